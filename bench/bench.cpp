@@ -0,0 +1,432 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Microbenchmarks of the CPU-bound parts of the connector, using synthetic
+ * inputs so that no server is needed. Usage:
+ *
+ *  akonadi_exchange_bench [--min-time ms] [name-prefix...]
+ *
+ * Each benchmark is repeated, doubling the number of iterations, until a run
+ * takes at least the minimum time. The result of that run is written to
+ * stdout as one line of JSON, for example:
+ *
+ *  {"name":"MapiId::toString","iterations":1048576,"nsPerOp":181.3}
+ */
+
+#include <KABC/Addressee>
+#include <KCalCore/Recurrence>
+#include <KComponentData>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTextCodec>
+#include <QTextStream>
+#include <string.h>
+
+#include "mapicontact.h"
+#include "mapiobjects.h"
+#include "mapirecurrence.h"
+
+/**
+ * Results are accumulated here, so that the compiler cannot discard the
+ * work being measured.
+ */
+static volatile unsigned sink;
+
+#define ID_COUNT 64
+
+static QString ids[ID_COUNT];
+
+static void idParse(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        MapiId id(ids[i % ID_COUNT]);
+
+        sink += (unsigned)id.second;
+    }
+}
+
+static void idFormat(unsigned iterations)
+{
+    static MapiId id(QString::fromAscii("1/1a2b3c4d5e6f0001/1a2b3c4d5e6f1234"));
+
+    for (unsigned i = 0; i < iterations; i++) {
+        sink += id.toString().size();
+    }
+}
+
+/**
+ * A property of each type commonly seen in a message.
+ */
+static SPropValue properties[4];
+static uint8_t entryId[70];
+
+static void propertiesInit()
+{
+    properties[0].ulPropTag = PidTagDisplayName;
+    properties[0].value.lpszW = "Fred Bloggs (Sales) <fred.bloggs@example.com>";
+    properties[1].ulPropTag = PidTagMessageFlags;
+    properties[1].value.l = MSGFLAG_READ | MSGFLAG_HASATTACH;
+    properties[2].ulPropTag = PidTagEntryId;
+    properties[2].value.bin.cb = sizeof(entryId);
+    properties[2].value.bin.lpb = entryId;
+    for (unsigned i = 0; i < sizeof(entryId); i++) {
+        entryId[i] = i * 7;
+    }
+    properties[3].ulPropTag = PidTagLastModificationTime;
+    properties[3].value.ft.dwLowDateTime = 0x7f39e000;
+    properties[3].value.ft.dwHighDateTime = 0x01ce3c3a;
+}
+
+static void propertyValue(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        MapiProperty property(properties[i % 4]);
+
+        sink += property.value().isValid();
+    }
+}
+
+/**
+ * The same properties, decoded as a decoder would, using the typed accessors.
+ */
+static void propertyTyped(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        MapiProperty property(properties[i % 4]);
+        unsigned size;
+
+        switch (i % 4) {
+        case 0:
+            sink += property.asString().size();
+            break;
+        case 1:
+            sink += (unsigned)property.asInteger();
+            break;
+        case 2:
+            sink += property.asBinary(size) ? size : 0;
+            break;
+        default:
+            sink += property.asDateTime().isValid();
+            break;
+        }
+    }
+}
+
+static void propertyToString(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        MapiProperty property(properties[i % 4]);
+
+        sink += property.toString().size();
+    }
+}
+
+static void extractSmtp(unsigned iterations)
+{
+    static QString source = QString::fromAscii("\"Bloggs, Fred\" <fred.bloggs@example.com>");
+
+    for (unsigned i = 0; i < iterations; i++) {
+        sink += mapiExtractEmail(source, "SMTP").size();
+    }
+}
+
+static void extractSmtpFallback(unsigned iterations)
+{
+    static QString source = QString::fromAscii("Fred Bloggs (Sales) <Sales Team> <fred.bloggs@example.com");
+
+    for (unsigned i = 0; i < iterations; i++) {
+        sink += mapiExtractEmail(source, "SMTP").size();
+    }
+}
+
+static void extractEx(unsigned iterations)
+{
+    static QString source = QString::fromAscii("/O=EXAMPLE/OU=EXCHANGE ADMINISTRATIVE GROUP (FYDIBOHF23SPDLT)/CN=RECIPIENTS/CN=fbloggs");
+
+    for (unsigned i = 0; i < iterations; i++) {
+        sink += mapiExtractEmail(source, "EX").size();
+    }
+}
+
+/**
+ * A recipient list as seen in a typical message, where the sender and the
+ * recipients are each seen several times from different properties.
+ */
+#define RECIPIENT_COUNT 50
+
+static QList<MapiRecipient> candidates;
+
+static void candidatesInit()
+{
+    for (unsigned i = 0; i < RECIPIENT_COUNT; i++) {
+        MapiRecipient candidate((MapiRecipient::Type)(i % 4));
+        unsigned person = i % (RECIPIENT_COUNT / 2);
+
+        // Alternate between name only, email only and both.
+        if (i % 3 != 1) {
+            candidate.name = QString::fromAscii("Person %1").arg(person);
+        }
+        if (i % 3 != 0) {
+            candidate.email = QString::fromAscii("person.%1@example.com").arg(person);
+        }
+        candidates.append(candidate);
+    }
+}
+
+static void addUniqueRecipient(unsigned iterations)
+{
+    static MapiId id(QString::fromAscii("1/1/1"));
+
+    for (unsigned i = 0; i < iterations; i++) {
+        MapiMessage message(0, "addUniqueRecipient", id);
+
+        for (int j = 0; j < candidates.size(); j++) {
+            MapiRecipient candidate(candidates.at(j));
+
+            message.addUniqueRecipient("bench", candidate);
+        }
+        sink += message.recipients().size();
+    }
+}
+
+/**
+ * A 4kB body, in each of the encodings we commonly see.
+ */
+static QByteArray bodyUtf16;
+static QByteArray bodyUtf8;
+static QByteArray bodyLatin1;
+
+static void bodiesInit()
+{
+    QString body;
+
+    while (body.size() < 4096) {
+        body += QString::fromUtf8("The quick brown fox jumps over the lazy dog. Zw\xc3\xb6lf Boxk\xc3\xa4mpfer jagen Viktor quer \xc3\xbc" "ber den Sylter Deich.\n");
+    }
+    body.truncate(4096);
+    bodyUtf16 = QByteArray((const char *)body.utf16(), body.size() * 2);
+    bodyUtf8 = body.toUtf8();
+    bodyLatin1 = body.toLatin1();
+}
+
+static void decode(unsigned iterations, unsigned codepage, const QByteArray &bytes)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        QTextCodec *codec = MapiMessage::codepageCodec(codepage);
+
+        sink += codec->toUnicode(bytes).size();
+    }
+}
+
+static void decodeUtf16(unsigned iterations)
+{
+    decode(iterations, 1200, bodyUtf16);
+}
+
+static void decodeUtf8(unsigned iterations)
+{
+    decode(iterations, 65001, bodyUtf8);
+}
+
+static void decodeWindows1252(unsigned iterations)
+{
+    decode(iterations, 1252, bodyLatin1);
+}
+
+/**
+ * A typical GAL entry.
+ */
+#define CONTACT_COUNT 16
+
+static SPropValue contact[CONTACT_COUNT];
+
+static void contactInit()
+{
+    static const struct {
+        int tag;
+        const char *value;
+    } strings[] = {
+        { PidTagDisplayName, "Bloggs, Fred" },
+        { PidTagEmailAddress, "/O=EXAMPLE/OU=EXCHANGE ADMINISTRATIVE GROUP (FYDIBOHF23SPDLT)/CN=RECIPIENTS/CN=fbloggs" },
+        { PidTagAddressType, "EX" },
+        { PidTagSmtpAddress, "fred.bloggs@example.com" },
+        { PidTagSurname, "Bloggs" },
+        { PidTagGivenName, "Fred" },
+        { PidTagTitle, "Sales Manager" },
+        { PidTagOfficeLocation, "Building 4" },
+        { PidTagStreetAddress, "1 High Street" },
+        { PidTagLocality, "Cambridge" },
+        { PidTagPostalCode, "CB1 1AA" },
+        { PidTagDepartmentName, "Sales" },
+        { PidTagBusinessTelephoneNumber, "+44 1223 000000" },
+        { PidTagMobileTelephoneNumber, "+44 7700 900000" },
+        { 0, 0 } };
+    unsigned i;
+
+    for (i = 0; strings[i].tag; i++) {
+        contact[i].ulPropTag = (MAPITAGS)strings[i].tag;
+        contact[i].value.lpszW = strings[i].value;
+    }
+    contact[i].ulPropTag = PidTagObjectType;
+    contact[i++].value.l = MAPI_MAILUSER;
+    contact[i].ulPropTag = PidTagDisplayType;
+    contact[i++].value.l = DT_MAILUSER;
+}
+
+static void contactPayload(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        KABC::Addressee addressee;
+        QString dn;
+
+        mapiContactPayload(contact, CONTACT_COUNT, addressee, &dn);
+        sink += dn.size() + addressee.phoneNumbers().size();
+    }
+}
+
+/**
+ * Recurrence patterns of the commonest kinds: weekly on several days,
+ * monthly on the Nth weekday, and yearly on a date.
+ */
+#define PATTERN_COUNT 3
+
+static RecurrencePattern patterns[PATTERN_COUNT];
+
+static void patternsInit()
+{
+    // Minutes since 1601 for 7th January 2013, and 31st December 2013.
+    static const uint32_t start = 216699840;
+    static const uint32_t end = 217215360;
+
+    memset(patterns, 0, sizeof(patterns));
+    patterns[0].RecurFrequency = RecurFrequency_Weekly;
+    patterns[0].PatternType = PatternType_Week;
+    patterns[0].Period = 1;
+    patterns[0].PatternTypeSpecific.WeekRecurrencePattern = M | W | F;
+    patterns[0].EndType = END_AFTER_N_OCCURRENCES;
+    patterns[0].OccurrenceCount = 10;
+
+    patterns[1].RecurFrequency = RecurFrequency_Monthly;
+    patterns[1].PatternType = PatternType_MonthNth;
+    patterns[1].Period = 1;
+    patterns[1].PatternTypeSpecific.MonthRecurrencePattern.WeekRecurrencePattern = Tu;
+    patterns[1].PatternTypeSpecific.MonthRecurrencePattern.N = 2;
+    patterns[1].EndType = END_AFTER_DATE;
+
+    patterns[2].RecurFrequency = RecurFrequency_Yearly;
+    patterns[2].PatternType = PatternType_Month;
+    patterns[2].Period = 1;
+    patterns[2].PatternTypeSpecific.Day = 7;
+    patterns[2].EndType = END_NEVER_END;
+
+    for (unsigned i = 0; i < PATTERN_COUNT; i++) {
+        patterns[i].FirstDOW = FirstDOW_Monday;
+        patterns[i].StartDate = start;
+        patterns[i].EndDate = end;
+    }
+}
+
+static void recurrence(unsigned iterations)
+{
+    for (unsigned i = 0; i < iterations; i++) {
+        KCalCore::Recurrence recurrence;
+
+        sink += mapiRecurrence(&patterns[i % PATTERN_COUNT], &recurrence).size();
+    }
+}
+
+typedef void (*BenchFunction)(unsigned iterations);
+
+static struct {
+    const char *name;
+    BenchFunction function;
+} benchmarks[] = {
+    { "MapiId::MapiId", idParse },
+    { "MapiId::toString", idFormat },
+    { "MapiProperty::value", propertyValue },
+    { "MapiProperty::as*", propertyTyped },
+    { "MapiProperty::toString", propertyToString },
+    { "mapiExtractEmail/SMTP", extractSmtp },
+    { "mapiExtractEmail/SMTP-fallback", extractSmtpFallback },
+    { "mapiExtractEmail/EX", extractEx },
+    { "MapiMessage::addUniqueRecipient/50", addUniqueRecipient },
+    { "MapiMessage::streamRead/UTF-16", decodeUtf16 },
+    { "MapiMessage::streamRead/UTF-8", decodeUtf8 },
+    { "MapiMessage::streamRead/Windows-1252", decodeWindows1252 },
+    { "mapiContactPayload", contactPayload },
+    { "mapiRecurrence", recurrence },
+    { 0, 0 } };
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    // The payload conversions use KDE's locale.
+    KComponentData component("akonadi_exchange_bench");
+    QStringList args = app.arguments();
+    QTextStream out(stdout);
+    qint64 minNsecs = 200 * 1000000LL;
+
+    args.removeFirst();
+    if ((args.size() >= 2) && (args.first() == QLatin1String("--min-time"))) {
+        args.removeFirst();
+        minNsecs = args.takeFirst().toLongLong() * 1000000LL;
+    }
+
+    for (unsigned i = 0; i < ID_COUNT; i++) {
+        ids[i] = QString::fromAscii("1/%1/%2").arg(0x1a2b3c4d5e6f0000ULL + i, 0, 16).arg(0x1a2b3c4d5e6f8000ULL + i * 37, 0, 16);
+    }
+    propertiesInit();
+    candidatesInit();
+    bodiesInit();
+    contactInit();
+    patternsInit();
+
+    for (unsigned i = 0; benchmarks[i].name; i++) {
+        QString name = QString::fromAscii(benchmarks[i].name);
+        bool selected = args.isEmpty();
+
+        foreach (const QString &prefix, args) {
+            selected |= name.startsWith(prefix);
+        }
+        if (!selected) {
+            continue;
+        }
+
+        // Warm up, then double the iterations until the run is long enough.
+        unsigned iterations = 1;
+        qint64 nsecs;
+        benchmarks[i].function(iterations);
+        forever {
+            QElapsedTimer timer;
+
+            timer.start();
+            benchmarks[i].function(iterations);
+            nsecs = timer.nsecsElapsed();
+            if ((nsecs >= minNsecs) || (iterations >= (1U << 30))) {
+                break;
+            }
+            iterations *= 2;
+        }
+        out << QString::fromAscii("{\"name\":\"%1\",\"iterations\":%2,\"nsPerOp\":%3}").
+            arg(name).arg(iterations).arg((double)nsecs / iterations, 0, 'f', 1) << endl;
+    }
+    return 0;
+}
@@ -38,95 +38,17 @@
 
 #include <libmapi/mapi_nameid.h>
 #include "mapiconnector2.h"
+#include "mapirecurrence.h"
+#include "mapischema.h"
 #include "profiledialog.h"
 
-/**
- * Set this to 1 to pull all the properties, e.g. to see what a server has
- * available.
- */
-#ifndef DEBUG_APPOINTMENT_PROPERTIES
-#define DEBUG_APPOINTMENT_PROPERTIES 0
-#endif
-
 using namespace Akonadi;
 
-static QString stringify(QBitArray &days)
-{
-    QString result;
-    if (days[0]) {
-        result.append(i18n("Mo"));
-    }
-    if (days[1]) {
-        result.append(i18n("Tu"));
-    }
-    if (days[2]) {
-        result.append(i18n("We"));
-    }
-    if (days[3]) {
-        result.append(i18n("Th"));
-    }
-    if (days[4]) {
-        result.append(i18n("Fr"));
-    }
-    if (days[5]) {
-        result.append(i18n("Sa"));
-    }
-    if (days[6]) {
-        result.append(i18n("Su"));
-    }
-    return result;
-}
-
 static QString stringify(KDateTime dateTime)
 {
     return KCalUtils::Stringify::formatDateTime(dateTime);
 }
 
-static QBitArray ex2kcalRecurrenceDays(uint32_t exchangeDays)
-{
-    QBitArray bitArray(7, false);
-
-    if (exchangeDays & Su) // Sunday
-        bitArray.setBit(6, true);
-    if (exchangeDays & M) // Monday
-        bitArray.setBit(0, true);
-    if (exchangeDays & Tu) // Tuesday
-        bitArray.setBit(1, true);
-    if (exchangeDays & W) // Wednesday
-        bitArray.setBit(2, true);
-    if (exchangeDays & Th) // Thursday
-        bitArray.setBit(3, true);
-    if (exchangeDays & F) // Friday
-        bitArray.setBit(4, true);
-    if (exchangeDays & Sa) // Saturday
-        bitArray.setBit(5, true);
-    return bitArray;
-}
-
-static uint32_t ex2kcalDayOfWeek(uint32_t exchangeDayOfWeek)
-{
-    uint32_t retVal = exchangeDayOfWeek;
-    if (retVal == FirstDOW_Sunday) {
-        // Exchange-Sunday(0) mapped to KCal-Sunday(7)
-        retVal = 7;
-    }
-    return retVal;
-}
-
-static uint32_t ex2kcalDaysFromMinutes(uint32_t exchangeMinutes)
-{
-    return exchangeMinutes / 60 / 24;
-}
-
-static KDateTime ex2kcalTimes(uint32_t exchangeMinutes)
-{
-    // exchange stores the recurrency times as minutes since 1.1.1601
-    QDateTime calc(QDate(1601, 1, 1));
-    int days = ex2kcalDaysFromMinutes(exchangeMinutes);
-    int secs = (exchangeMinutes - (days * 24 * 60)) * 60;
-    return KDateTime(calc.addDays(days).addSecs(secs));
-}
-
 /**
  * An Appointment, with attendee recipients.
  *
@@ -240,9 +162,10 @@ const QString ExCalResource::profile()
 void ExCalResource::retrieveCollections()
 {
     Collection::List collections;
+    Collection::List deletedCollections;
 
     setName(i18n("Exchange Calendar for %1", profile()));
-    fetchCollections(Calendar, collections);
+    fetchCollections(Calendar, collections, deletedCollections);
     if (collections.size()) {
         Collection root = collections.first();
         Akonadi::CachePolicy cachePolicy;
@@ -253,18 +176,22 @@ void ExCalResource::retrieveCollections()
         root.setCachePolicy(cachePolicy);
     }
 
-    // Notify Akonadi about the new collections.
-    collectionsRetrieved(collections);
+    // Notify Akonadi about the changed collections.
+    collectionsRetrievedIncremental(collections, deletedCollections);
 }
 
 void ExCalResource::retrieveItems(const Akonadi::Collection &collection)
 {
-    Item::List items;
-    Item::List deletedItems;
+    fetchItems(collection);
+}
 
-    fetchItems(collection, items, deletedItems);
-    kError() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
+void ExCalResource::itemsFetched(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+{
+    Q_UNUSED(collection);
+
+    MAPI_KDEBUG(Resource) << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
     itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
 }
 
 bool ExCalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByteArray> &parts)
@@ -278,10 +205,12 @@ bool ExCalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByte
         return true;
     }
 
-    MapiAppointment *message = fetchItem<MapiAppointment>(itemOrig);
-    if (!message) {
-        return false;
-    }
+    return fetchItemAsync<MapiAppointment>(itemOrig);
+}
+
+void ExCalResource::itemFetched(const Akonadi::Item &itemOrig, MapiMessage *mapiMessage)
+{
+    MapiAppointment *message = static_cast<MapiAppointment *>(mapiMessage);
 
     // Create a clone of the passed in Item and fill it with the payload.
     message->setUid(itemOrig.remoteId());
@@ -307,7 +236,6 @@ bool ExCalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByte
     if (m_exceptionItems.size()) {
         QMetaObject::invokeMethod(this, "deleteExceptionItems", Qt::QueuedConnection);
     }
-    return true;
 }
 
 /**
@@ -340,7 +268,7 @@ void ExCalResource::createExceptionItem(KJob *job)
     m_exceptionItems.removeFirst();
 
     // Save the new item in Akonadi.
-    kError() << __FUNCTION__ << "create" << item.remoteId() << "in" << item.parentCollection();
+    MAPI_KDEBUG(Resource) << __FUNCTION__ << "create" << item.remoteId() << "in" << item.parentCollection();
     Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, item.parentCollection());
     connect(createJob, SIGNAL(result(KJob *)), SLOT(createExceptionItemDone(KJob *)));
 }
@@ -408,7 +336,7 @@ void ExCalResource::itemChanged(const Akonadi::Item &item, const QSet<QByteArray
     return;
 
     // Get the payload for the item.
-    kWarning() << "fetch cached item: {" <<
+    MAPI_KDEBUG(Resource) << "fetch cached item: {" <<
         item.parentCollection().name() << "," << item.id() << "} = {" <<
         item.parentCollection().remoteId() << "," << item.remoteId() << "}";
     Akonadi::ItemFetchJob *job = new Akonadi::ItemFetchJob(item);
@@ -482,7 +410,7 @@ void ExCalResource::itemChangedContinue(KJob* job)
     message->ex2kcalRecurrency(event->recurrence());
 
     // Update exchange with the new message->
-    kWarning() << "updating item: {" <<
+    MAPI_KDEBUG(Resource) << "updating item: {" <<
         currentCollection().name() << "," << item.id() << "} = {" <<
         currentCollection().remoteId() << "," << item.remoteId() << "}";
     emit status(Running, i18n("Updating item: { %1, %2 }", currentCollection().name(), item.id()));
@@ -530,105 +458,8 @@ void MapiAppointment::ex2kcalRecurrency(AppointmentRecurrencePattern *pattern, K
         // No recurrency.
         return;
     }
-
-    RecurrencePattern *ex = &pattern->RecurrencePattern;
-    QString description;
-    //debug() << "Calendar:" << ex->CalendarType;
-    QBitArray days;
-    if (ex->RecurFrequency == RecurFrequency_Daily && ex->PatternType == PatternType_Day) {
-        kcal->setDaily(ex2kcalDaysFromMinutes(ex->Period));
-        description = i18n("Every %1 days,", ex2kcalDaysFromMinutes(ex->Period));
-    }
-    else if (ex->RecurFrequency == RecurFrequency_Daily && ex->PatternType == PatternType_Week) {
-        days = ex2kcalRecurrenceDays(M | Tu | W | Th | F);
-        kcal->setWeekly(ex2kcalDaysFromMinutes(ex->Period) / 7, days, ex2kcalDayOfWeek(ex->FirstDOW));
-        description = i18n("Every weekday,");
-    }
-    else if (ex->RecurFrequency == RecurFrequency_Weekly && ex->PatternType == PatternType_Week) {
-        days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.WeekRecurrencePattern);
-        kcal->setWeekly(ex->Period, days, ex2kcalDayOfWeek(ex->FirstDOW));
-        description = i18n("Every %1 weeks on %2,", ex->Period, stringify(days));
-    }
-    else if (ex->RecurFrequency == RecurFrequency_Monthly) {
-        kcal->setMonthly(ex->Period);
-        switch (ex->PatternType)
-        {
-        case PatternType_Month:
-        case PatternType_HjMonth:
-            kcal->addMonthlyDate(ex->PatternTypeSpecific.Day);
-            description = i18n("On the %1 day every %2 months,", ex->PatternTypeSpecific.Day,
-                       ex->Period);
-            break;
-        case PatternType_MonthNth:
-        case PatternType_HjMonthNth:
-            days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.MonthRecurrencePattern.WeekRecurrencePattern);
-            kcal->addMonthlyPos(ex->PatternTypeSpecific.MonthRecurrencePattern.N, days);
-            description = i18n("On %1 of the %2 week every %3 months,", stringify(days),
-                       ex->PatternTypeSpecific.MonthRecurrencePattern.N,
-                       ex->Period);
-            break;
-        case PatternType_MonthEnd:
-        case PatternType_HjMonthEnd:
-            kcal->addMonthlyDate(ex->PatternTypeSpecific.Day);
-            description = i18n("At the end (day %1) of every %2 month,", ex->PatternTypeSpecific.Day,
-                       ex->Period);
-            break;
-        default:
-            description = i18n("Unsupported monthly frequency with patterntype %1", ex->PatternType);
-            break;
-        }
-    }
-    else if (ex->RecurFrequency == RecurFrequency_Yearly) {
-        kcal->setYearly(1);
-        switch (ex->PatternType)
-        {
-        case PatternType_Month:
-        case PatternType_HjMonth:
-            kcal->addYearlyMonth(ex->Period);
-            kcal->addYearlyDate(ex->PatternTypeSpecific.Day);
-            description = i18n("Yearly, on the %1 day of the %2 month,", ex->PatternTypeSpecific.Day,
-                       ex->Period);
-            break;
-        case PatternType_MonthNth:
-        case PatternType_HjMonthNth:
-            days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.MonthRecurrencePattern.WeekRecurrencePattern);
-            kcal->addYearlyMonth(ex->Period);
-            kcal->addYearlyPos(ex->PatternTypeSpecific.MonthRecurrencePattern.N, days);
-            description = i18n("Yearly, the %1 day of the %2 month when it falls on %3,",
-                       ex->PatternTypeSpecific.MonthRecurrencePattern.N,
-                       ex->Period, stringify(days));
-            break;
-        default:
-            description = i18n("Unsupported yearly frequency with patterntype %1", ex->PatternType);
-            break;
-        };
-    } else {
-        description = i18n("Unsupported frequency %1 with patterntype %2 combination", ex->RecurFrequency,
-                   ex->PatternType);
-    }
-
-    kcal->setStartDateTime(ex2kcalTimes(ex->StartDate));
-    switch (ex->EndType) {
-    case END_AFTER_DATE:
-        kcal->setEndDateTime(ex2kcalTimes(ex->EndDate));
-        description += i18n(" from %1 to %2", stringify(kcal->startDateTime()),
-                    stringify(kcal->endDateTime()));
-        break;
-    case END_AFTER_N_OCCURRENCES:
-        kcal->setDuration(ex->OccurrenceCount);
-        description += i18n(" from %1 for %2 occurrences", stringify(kcal->startDateTime()),
-                    kcal->duration());
-        break;
-    case END_NEVER_END:
-    case NEVER_END:
-        description += i18n(" from %1, ending indefinitely", stringify(kcal->startDateTime()));
-        break;
-    default:
-        description += i18n(" from %1, unsupported endtype %2", stringify(kcal->startDateTime()),
-                    ex->EndType);
-        break;
-    }
-    debug() << description;
+    QString description = mapiRecurrence(&pattern->RecurrencePattern, kcal);
+    MAPI_DEBUG(Objects) << description;
 
     // We have dealt with the basic recurrence, now see what exceptions we have.
     for (int i = 0; i < pattern->ExceptionCount; i++) {
@@ -645,139 +476,285 @@ void MapiAppointment::ex2kcalRecurrency(AppointmentRecurrencePattern *pattern, K
     }
 }
 
-bool MapiAppointment::preparePayload()
+/**
+ * The state carried between the properties of an Appointment while they are
+ * decoded.
+ */
+class AppointmentDecoder
 {
-    // Start with a clean slate.
-    uint32_t sequence = 0;
-    enum FreeBusyStatus busyStatus = olFree;
+public:
+    AppointmentDecoder(MapiAppointment &appointment) :
+        appointment(appointment),
+        sequence(0),
+        busyStatus(olFree),
+        allDay(false),
+        state(0),
+        responseStatus(MapiAppointment::None),
+        textStream(false),
+        htmlStream(false),
+        recurrence(0),
+        recurrenceSize(0),
+        recurrenceType(0),
+        reminderSet(false),
+        reminderDelta(0)
+    {
+    }
+
+    MapiAppointment &appointment;
+    unsigned sequence;
+    unsigned busyStatus;
     QString location;
     QDateTime begin;
     QDateTime end;
-    bool allDay = false;
-    AppointmentStates state;
-    ResponseStatus responseStatus = None;
+    bool allDay;
+    unsigned state;
+    unsigned responseStatus;
     QString bodyText;
     QString bodyHtml;
-    struct TimeZoneStruct *timezone = 0;
-    AppointmentRecurrencePattern *pattern = 0;
-    enum RecurFrequency recurrenceType = (enum RecurFrequency)0;
+    bool textStream;
+    bool htmlStream;
+    const uint8_t *recurrence;
+    unsigned recurrenceSize;
+    unsigned recurrenceType;
     QString messageClass;
-    bool reminderSet = false;
+    bool reminderSet;
     QDateTime reminderTime;
-    uint32_t reminderDelta = 0;
+    unsigned reminderDelta;
     QString title;
     QDateTime modified;
     QDateTime created;
-
-    // Walk through the properties and extract the values of interest. The
-    // properties here should be aligned with the list pulled above.
-    bool embeddedInBody = false;
     QString header;
+};
+
+template <QString AppointmentDecoder::*field>
+static bool appointmentString(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asString();
+    return true;
+}
+
+template <unsigned AppointmentDecoder::*field>
+static bool appointmentUnsigned(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asInteger();
+    return true;
+}
 
-    for (unsigned i = 0; i < m_propertyCount; i++) {
-        MapiProperty property(m_properties[i]);
+template <bool AppointmentDecoder::*field>
+static bool appointmentBool(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asBool();
+    return true;
+}
 
+template <QDateTime AppointmentDecoder::*field>
+static bool appointmentDateTime(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asDateTime();
+    return true;
+}
+
+/**
+ * The pattern is parsed once decoding is done, since that needs a talloc
+ * context.
+ */
+static bool appointmentRecur(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    decoder.recurrence = property.asBinary(decoder.recurrenceSize);
+    return true;
+}
+
+/**
+ * Anything else is either an oversize value, which must be read from a
+ * stream, or ignored.
+ */
+static bool appointmentProperty(AppointmentDecoder &decoder, const MapiProperty &property)
+{
+    // Handle oversize objects.
+    if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
         switch (property.tag()) {
-        case PidLidAppointmentSequence:
-            sequence = property.value().toUInt();
-            break;
-        case PidLidBusyStatus:
-            busyStatus = (enum FreeBusyStatus)property.value().toUInt();
-            break;
-        case PidLidLocation:
-            location = property.value().toString();
-            break;
-        case PidLidAppointmentStartWhole:
-            begin = property.value().toDateTime();
-            break;
-        case PidLidAppointmentEndWhole:
-            end = property.value().toDateTime();
-            break;
-        case PidLidAppointmentSubType:
-            allDay = property.value().toUInt() != 0;
+        case PidTagBody_Error:
+            decoder.textStream = true;
             break;
-        case PidLidAppointmentStateFlags:
-            state = AppointmentStates(property.value().toUInt());
-            break;
-        case PidLidResponseStatus:
-            responseStatus = (ResponseStatus)property.value().toUInt();
-            break;
-        case PidTagBody:
-            bodyText = property.value().toString();
-            break;
-        case PidTagHtml:
-            bodyHtml = property.value().toString();
-            break;
-        case PidLidTimeZoneStruct:
-            timezone = get_TimeZoneStruct(ctx(), &m_properties[i].value.bin);
-            break;
-        case PidLidAppointmentRecur:
-            pattern = get_AppointmentRecurrencePattern(ctx(), &m_properties[i].value.bin);
-            break;
-        case PidLidRecurrenceType:
-            recurrenceType = (enum RecurFrequency)property.value().toInt();
-            break;
-        case PidTagMessageClass:
-            // Sanity check the message class.
-            messageClass = property.value().toString();
-            if (!messageClass.startsWith(QLatin1String("IPM.Appointment"))) {
-                if (!messageClass.startsWith(QLatin1String("IPM.Note"))) {
-                    error() << "retrieved item is not an appointment:" << messageClass;
-                    return false;
-                } else {
-                    embeddedInBody = true;
-                }
-            }
-            break;
-        case PidLidReminderSet:
-            reminderSet = property.value().toInt();
-            break;
-        case PidLidReminderSignalTime:
-            reminderTime = property.value().toDateTime();
-            break;
-        case PidLidReminderDelta:
-            reminderDelta = property.value().toInt();
-            break;
-        case PidTagConversationTopic:
-            title = property.value().toString();
-            break;
-        case PidTagLastModificationTime:
-            modified = property.value().toDateTime();
-            break;
-        case PidTagCreationTime:
-            created = property.value().toDateTime();
-            break;
-        case PidTagTransportMessageHeaders:
-            header = property.value().toString();
+        case PidTagHtml_Error:
+            decoder.htmlStream = true;
             break;
         default:
-            // Handle oversize objects.
-            if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
-                switch (property.tag()) {
-                case PidTagBody_Error:
-                    if (!streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, bodyText)) {
-                        return false;
-                    }
-                    break;
-                case PidTagHtml_Error:
-                    if (!streamRead(&m_object, PidTagHtml, CODEPAGE_UTF16, bodyHtml)) {
-                        return false;
-                    }
-                    break;
-                default:
-                    error() << "missing oversize support:" << tagName(property.tag());
-                    break;
-                }
-
-                // Carry on with next property...
-                break;
-            }
-#if (DEBUG_APPOINTMENT_PROPERTIES)
-            debug() << "ignoring appointment property:" << tagName(property.tag()) << property.value();
-#endif
+            kError() << "missing oversize support:" << decoder.appointment.tagName(property.tag());
             break;
         }
+        return true;
     }
+    MAPI_KTRACE(Objects) << "ignoring appointment property:" << decoder.appointment.tagName(property.tag()) << property.value();
+    return true;
+}
+
+/**
+ * The properties used to fetch an Appointment, based on [MS-OXOCAL], and how
+ * each is decoded.
+ */
+static const MapiSchema<AppointmentDecoder>::Entry appointmentEntries[] = {
+    // 2.2.1.1
+    { PidLidAppointmentSequence, appointmentUnsigned<&AppointmentDecoder::sequence> },
+    // 2.2.1.2
+    { PidLidBusyStatus, appointmentUnsigned<&AppointmentDecoder::busyStatus> },
+    // 2.2.1.3
+    //PidLidAppointmentAuxiliaryFlags,
+    // 2.2.1.4
+    { PidLidLocation, appointmentString<&AppointmentDecoder::location> },
+    // 2.2.1.5
+    { PidLidAppointmentStartWhole, appointmentDateTime<&AppointmentDecoder::begin> },
+    // 2.2.1.6
+    { PidLidAppointmentEndWhole, appointmentDateTime<&AppointmentDecoder::end> },
+    // 2.2.1.7
+    //PidLidAppointmentDuration,
+    // 2.2.1.8
+    //PidNameKeywords,
+    // 2.2.1.9
+    { PidLidAppointmentSubType, appointmentBool<&AppointmentDecoder::allDay> },
+    // 2.2.1.10
+    { PidLidAppointmentStateFlags, appointmentUnsigned<&AppointmentDecoder::state> },
+    // 2.2.1.11
+    { PidLidResponseStatus, appointmentUnsigned<&AppointmentDecoder::responseStatus> },
+    // 2.2.1.12
+    //PidLidRecurring,
+    // 2.2.1.13
+    //PidLidIsRecurring,
+    // 2.2.1.14
+    //PidLidClipStart,
+    // 2.2.1.15
+    //PidLidClipEnd,
+    // 2.2.1.16
+    //PidLidAllAttendeesString,
+    // 2.2.1.17
+    //PidLidToAttendeesString,
+    // 2.2.1.18
+    //PidLidCcAttendeesString,
+    // 2.2.1.19
+    //PidLidNonSendableTo,
+    // 2.2.1.20
+    //PidLidNonSendableCc,
+    // 2.2.1.21
+    //PidLidNonSendableBcc,
+    // 2.2.1.22
+    //PidLidNonSendToTrackStatus,
+    // 2.2.1.23
+    //PidLidNonSendCcTrackStatus,
+    // 2.2.1.24
+    //PidLidNonSendBccTrackStatus,
+    // 2.2.1.25
+    //PidLidAppointmentUnsendableRecipients,
+    // 2.2.1.26
+    //PidLidAppointmentNotAllowPropose,
+    // 2.2.1.27
+    //PidLidGlobalObjectId,
+    // 2.2.1.28
+    //PidLidCleanGlobalObjectId,
+    // 2.2.1.29
+    //PidTagOwnerAppointmentId,
+    // 2.2.1.30
+    //PidTagStartDate,
+    // 2.2.1.31
+    //PidTagEndDate,
+    // 2.2.1.32
+    //PidLidCommonStart,
+    // 2.2.1.33
+    //PidLidCommonEnd,
+    // 2.2.1.34
+    //PidLidOwnerCriticalChange,
+    // 2.2.1.35
+    //PidLidIsException,
+    // 2.2.1.36
+    //PidTagResponseRequested,
+    // 2.2.1.37
+    //PidTagReplyRequested,
+    // 2.2.1.38 Best Body Properties
+    { PidTagBody, appointmentString<&AppointmentDecoder::bodyText> },
+    { PidTagHtml, appointmentString<&AppointmentDecoder::bodyHtml> },
+    // 2.2.1.39
+    //PidLidTimeZoneStruct,
+    // 2.2.1.40
+    //PidLidTimeZoneDescription,
+    // 2.2.1.41
+    //PidLidAppointmentTimeZoneDefinitionRecur,
+    // 2.2.1.42
+    //PidLidAppointmentTimeZoneDefinitionStartDisplay,
+    // 2.2.1.43
+    //PidLidAppointmentTimeZoneDefinitionEndDisplay,
+    // 2.2.1.44
+    { PidLidAppointmentRecur, appointmentRecur },
+    // 2.2.1.45
+    { PidLidRecurrenceType, appointmentUnsigned<&AppointmentDecoder::recurrenceType> },
+    // 2.2.1.46
+    //PidLidRecurrencePattern,
+    // 2.2.1.47
+    //PidLidLinkedTaskItems,
+    // 2.2.1.48
+    //PidLidMeetingWorkspaceUrl,
+    // 2.2.1.49
+    //PidTagIconIndex Property
+    // 2.2.2.1
+    { PidTagMessageClass, appointmentString<&AppointmentDecoder::messageClass> },
+    // 2.2.3 Appointment-specific, nothing needed.
+    // TODO 2.2.4 through 2.2.9 Meeting-specific.
+    // TODO 2.2.10 Exception objects.
+    // 2.2.11 Calendar folder, nothing needed.
+    // TODO 2.2.12 Delegates.
+    // [MS-OXORMDR] section 2.2.1.1
+    { PidLidReminderSet, appointmentBool<&AppointmentDecoder::reminderSet> },
+    // [MS-OXORMDR] section 2.2.1.2
+    { PidLidReminderSignalTime, appointmentDateTime<&AppointmentDecoder::reminderTime> },
+    // [MS-OXORMDR] section 2.2.1.3
+    { PidLidReminderDelta, appointmentUnsigned<&AppointmentDecoder::reminderDelta> },
+    // Other
+    { PidTagConversationTopic, appointmentString<&AppointmentDecoder::title> },
+    { PidTagLastModificationTime, appointmentDateTime<&AppointmentDecoder::modified> },
+    { PidTagCreationTime, appointmentDateTime<&AppointmentDecoder::created> },
+    { PidTagTransportMessageHeaders, appointmentString<&AppointmentDecoder::header> },
+    { 0, 0 } };
+static MapiSchema<AppointmentDecoder> appointmentSchema(appointmentEntries, MapiMessage::tagList());
+
+bool MapiAppointment::preparePayload()
+{
+    MapiSpan span("preparePayload");
+
+    // Walk through the properties and extract the values of interest.
+    AppointmentDecoder decoder(*this);
+    if (!appointmentSchema.decode(m_properties, m_propertyCount, decoder, appointmentProperty)) {
+        return false;
+    }
+
+    // Sanity check the message class.
+    bool embeddedInBody = false;
+    if (!decoder.messageClass.startsWith(QLatin1String("IPM.Appointment"))) {
+        if (!decoder.messageClass.startsWith(QLatin1String("IPM.Note"))) {
+            error() << "retrieved item is not an appointment:" << decoder.messageClass;
+            return false;
+        } else {
+            embeddedInBody = true;
+        }
+    }
+    if (decoder.textStream && !streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, decoder.bodyText)) {
+        return false;
+    }
+    if (decoder.htmlStream && !streamRead(&m_object, PidTagHtml, CODEPAGE_UTF16, decoder.bodyHtml)) {
+        return false;
+    }
+
+    enum FreeBusyStatus busyStatus = (enum FreeBusyStatus)decoder.busyStatus;
+    AppointmentStates state = AppointmentStates(decoder.state);
+    ResponseStatus responseStatus = (ResponseStatus)decoder.responseStatus;
+    enum RecurFrequency recurrenceType = (enum RecurFrequency)decoder.recurrenceType;
+    AppointmentRecurrencePattern *pattern = 0;
+    if (decoder.recurrence) {
+        struct Binary_r bin;
+
+        bin.cb = decoder.recurrenceSize;
+        bin.lpb = (uint8_t *)decoder.recurrence;
+        pattern = get_AppointmentRecurrencePattern(ctx(), &bin);
+    }
+    QString &bodyText = decoder.bodyText;
+    QString &header = decoder.header;
 
     if (embeddedInBody) {
         // Exchange puts half the information in the headers:
@@ -847,10 +824,10 @@ DONE:
         setTransparency(Event::Opaque);
         break;
     }
-    setLocation(location);
-    setDtStart(KDateTime(begin));
-    setDtEnd(KDateTime(end));
-    setAllDay(allDay);
+    setLocation(decoder.location);
+    setDtStart(KDateTime(decoder.begin));
+    setDtEnd(KDateTime(decoder.end));
+    setAllDay(decoder.allDay);
     if (state.testFlag(Canceled)) {
         // Just mark this entry as cancelled.
         setStatus(StatusCanceled);
@@ -884,7 +861,7 @@ DONE:
         }
     }
     setDescription(bodyText);
-    setAltDescription(bodyHtml);
+    setAltDescription(decoder.bodyHtml);
     // TODO timezone
     if (recurrenceType != 0) {
         if (!pattern) {
@@ -897,19 +874,19 @@ DONE:
             ex2kcalRecurrency(pattern, recurrence());
         }
     }
-    if (reminderSet) {
+    if (decoder.reminderSet) {
         KCalCore::Alarm::Ptr alarm(new KCalCore::Alarm(dynamic_cast<KCalCore::Incidence*>(this)));
         // TODO Maybe we should check which one is set and then use either the time or the delte
         // KDateTime reminder(reminderTime);
         // reminder.setTimeSpec(KDateTime::Spec(KDateTime::UTC));
         // alarm->setTime(reminder);
-        alarm->setStartOffset(KCalCore::Duration(reminderDelta * -60));
+        alarm->setStartOffset(KCalCore::Duration(decoder.reminderDelta * -60));
         alarm->setEnabled(true);
         addAlarm(alarm);
     }
-    setSummary(title);
-    setLastModified(KDateTime(modified));
-    setCreated(KDateTime(created));
+    setSummary(decoder.title);
+    setLastModified(KDateTime(decoder.modified));
+    setCreated(KDateTime(decoder.created));
     foreach (MapiRecipient recipient, recipients()) {
         if (recipient.type() == MapiRecipient::ReplyTo) {
             KCalCore::Person::Ptr person(new KCalCore::Person(recipient.name, recipient.email));
@@ -924,140 +901,8 @@ DONE:
 
 bool MapiAppointment::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
 {
-    /**
-     * The list of tags used to fetch an Appointment, based on [MS-OXOCAL].
-     */
-    static unsigned ourTagList[] = {
-        // 2.2.1.1
-        PidLidAppointmentSequence,
-        // 2.2.1.2
-        PidLidBusyStatus,
-        // 2.2.1.3
-        //PidLidAppointmentAuxiliaryFlags,
-        // 2.2.1.4
-        PidLidLocation,
-        // 2.2.1.5
-        PidLidAppointmentStartWhole,
-        // 2.2.1.6
-        PidLidAppointmentEndWhole,
-        // 2.2.1.7
-        //PidLidAppointmentDuration,
-        // 2.2.1.8
-        //PidNameKeywords,
-        // 2.2.1.9
-        PidLidAppointmentSubType,
-        // 2.2.1.10
-        PidLidAppointmentStateFlags,
-        // 2.2.1.11
-        PidLidResponseStatus,
-        // 2.2.1.12
-        //PidLidRecurring,
-        // 2.2.1.13
-        //PidLidIsRecurring,
-        // 2.2.1.14
-        //PidLidClipStart,
-        // 2.2.1.15
-        //PidLidClipEnd,
-        // 2.2.1.16
-        //PidLidAllAttendeesString,
-        // 2.2.1.17
-        //PidLidToAttendeesString,
-        // 2.2.1.18
-        //PidLidCcAttendeesString,
-        // 2.2.1.19
-        //PidLidNonSendableTo,
-        // 2.2.1.20
-        //PidLidNonSendableCc,
-        // 2.2.1.21
-        //PidLidNonSendableBcc,
-        // 2.2.1.22
-        //PidLidNonSendToTrackStatus,
-        // 2.2.1.23
-        //PidLidNonSendCcTrackStatus,
-        // 2.2.1.24
-        //PidLidNonSendBccTrackStatus,
-        // 2.2.1.25
-        //PidLidAppointmentUnsendableRecipients,
-        // 2.2.1.26
-        //PidLidAppointmentNotAllowPropose,
-        // 2.2.1.27
-        //PidLidGlobalObjectId,
-        // 2.2.1.28
-        //PidLidCleanGlobalObjectId,
-        // 2.2.1.29
-        //PidTagOwnerAppointmentId,
-        // 2.2.1.30
-        //PidTagStartDate,
-        // 2.2.1.31
-        //PidTagEndDate,
-        // 2.2.1.32
-        //PidLidCommonStart,
-        // 2.2.1.33
-        //PidLidCommonEnd,
-        // 2.2.1.34
-        //PidLidOwnerCriticalChange,
-        // 2.2.1.35
-        //PidLidIsException,
-        // 2.2.1.36
-        //PidTagResponseRequested,
-        // 2.2.1.37
-        //PidTagReplyRequested,
-        // 2.2.1.38 Best Body Properties
-        PidTagBody,
-        PidTagHtml,
-        // 2.2.1.39
-        PidLidTimeZoneStruct,
-        // 2.2.1.40
-        //PidLidTimeZoneDescription,
-        // 2.2.1.41
-        //PidLidAppointmentTimeZoneDefinitionRecur,
-        // 2.2.1.42
-        //PidLidAppointmentTimeZoneDefinitionStartDisplay,
-        // 2.2.1.43
-        //PidLidAppointmentTimeZoneDefinitionEndDisplay,
-        // 2.2.1.44
-        PidLidAppointmentRecur,
-        // 2.2.1.45
-        PidLidRecurrenceType,
-        // 2.2.1.46
-        //PidLidRecurrencePattern,
-        // 2.2.1.47
-        //PidLidLinkedTaskItems,
-        // 2.2.1.48
-        //PidLidMeetingWorkspaceUrl,
-        // 2.2.1.49
-        //PidTagIconIndex Property
-        // 2.2.2.1
-        PidTagMessageClass,
-        // 2.2.3 Appointment-specific, nothing needed.
-        // TODO 2.2.4 through 2.2.9 Meeting-specific.
-        // TODO 2.2.10 Exception objects.
-        // 2.2.11 Calendar folder, nothing needed.
-        // TODO 2.2.12 Delegates.
-        // [MS-OXORMDR] section 2.2.1.1
-        PidLidReminderSet,
-        // [MS-OXORMDR] section 2.2.1.2
-        PidLidReminderSignalTime,
-        // [MS-OXORMDR] section 2.2.1.3
-        PidLidReminderDelta,
-        // Other
-        PidTagConversationTopic,
-        PidTagLastModificationTime,
-        PidTagCreationTime,
-        PidTagTransportMessageHeaders,
-        0 };
-    static SPropTagArray ourTags = {
-        (sizeof(ourTagList) / sizeof(ourTagList[0])) - 1,
-        (MAPITAGS *)ourTagList };
-
     if (!tagsAppended) {
-        for (unsigned i = 0; i < ourTags.cValues; i++) {
-            int newTag = ourTags.aulPropTag[i];
-
-            if (!tags.contains(newTag)) {
-                tags.append(newTag);
-            }
-        }
+        appointmentSchema.tagsAppend(tags);
     }
     if (!MapiMessage::propertiesPull(tags, tagsAppended, pullAll)) {
         return false;
@@ -1070,15 +915,9 @@ bool MapiAppointment::propertiesPull(QVector<int> &tags, const bool tagsAppended
 
 bool MapiAppointment::propertiesPull()
 {
-    static bool tagsAppended = false;
-    static QVector<int> tags;
+    QVector<int> tags(appointmentSchema.tagList());
 
-    if (!propertiesPull(tags, tagsAppended, (DEBUG_APPOINTMENT_PROPERTIES) != 0)) {
-        tagsAppended = true;
-        return false;
-    }
-    tagsAppended = true;
-    return true;
+    return propertiesPull(tags, true, MapiLog::enabled(MapiLog::Objects, MapiLog::Trace));
 }
 
 bool MapiAppointment::propertiesPush()
@@ -1143,26 +982,26 @@ bool MapiAppointment::propertiesPush()
         return false;
     }
 #if 0
-    debug() << "************  OpenFolder";
+    MAPI_DEBUG(Objects) << "************  OpenFolder";
     if (!OpenFolder(&m_store, folder.id(), folder.d())) {
         error() << "cannot open folder" << folderID
             << ", error:" << mapiError();
         return false;
         }
-    debug() << "************  SaveChangesMessage";
+    MAPI_DEBUG(Objects) << "************  SaveChangesMessage";
     if (!SaveChangesMessage(folder.d(), message.d(), KeepOpenReadWrite)) {
         error() << "cannot save message" << messageID << "in folder" << folderID
             << ", error:" << mapiError();
         return false;
     }
 #endif
-    debug() << "************  SubmitMessage";
+    MAPI_DEBUG(Objects) << "************  SubmitMessage";
     if (MAPI_E_SUCCESS != SubmitMessage(&m_object)) {
         error() << "cannot submit message, error:" << mapiError();
         return false;
     }
     struct mapi_SPropValue_array replyProperties;
-    debug() << "************  TransportSend";
+    MAPI_DEBUG(Objects) << "************  TransportSend";
     if (MAPI_E_SUCCESS != TransportSend(&m_object, &replyProperties)) {
         error() << "cannot send message, error:" << mapiError();
         return false;
@@ -1190,8 +1029,8 @@ bool MapiAppointmentException::preparePayload()
     // the exception information.
     enum FreeBusyStatus busyStatus = (m_parent.transparency() == Event::Transparent) ? olFree : olBusy;
     QString location = m_parent.location();
-    KDateTime begin = ex2kcalTimes(e->StartDateTime);
-    KDateTime end = ex2kcalTimes(e->EndDateTime);
+    KDateTime begin = mapiRecurrenceTime(e->StartDateTime);
+    KDateTime end = mapiRecurrenceTime(e->EndDateTime);
     bool allDay = m_parent.allDay();
     AppointmentStates state;
     bool reminderSet = m_parent.alarms().size() > 0;
@@ -1199,7 +1038,7 @@ bool MapiAppointmentException::preparePayload()
     QString title = m_parent.summary();
     uint32_t changeHighlight = 0;
     bool attachment = false;
-    KDateTime originalBegin = ex2kcalTimes(e->OriginalStartDate);
+    KDateTime originalBegin = mapiRecurrenceTime(e->OriginalStartDate);
     OverrideFlags overrideFlags = e->OverrideFlags;
 
     QString description;
@@ -1250,7 +1089,7 @@ bool MapiAppointmentException::preparePayload()
     }
     description += i18n("\n    ChangeHighlight %1, state %2, reminderDelta %3, reminderSet %4, busyStatus %5, attachment %6, allDay %7",
                 changeHighlight, state, reminderDelta, reminderSet, busyStatus, attachment, allDay);
-    debug() << description;
+    MAPI_DEBUG(Objects) << description;
 
     // Now set all the properties onto the item. Any items not specified by the
     // exception are just copied from the parent.
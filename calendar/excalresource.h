@@ -48,6 +48,8 @@ protected:
     virtual void itemAdded(const Akonadi::Item &item, const Akonadi::Collection &collection);
     virtual void itemChanged(const Akonadi::Item &item, const QSet<QByteArray> &parts);
     virtual void itemRemoved(const Akonadi::Item &item);
+    virtual void itemsFetched(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+    virtual void itemFetched(const Akonadi::Item &item, MapiMessage *message);
 
 private:
     void createKCalRecurrency(KCal::Recurrence* rec, const MapiRecurrencyPattern& pattern);
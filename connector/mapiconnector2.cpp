@@ -21,21 +21,26 @@
 #include "mapiconnector2.h"
 
 #include <QAbstractSocket>
+#include <QAtomicInt>
+#include <QDataStream>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QStringList>
 #include <QDir>
 #include <QMessageBox>
 #include <QRegExp>
+#include <QSet>
+#include <QUrl>
 #include <QVariant>
 #include <QSocketNotifier>
 #include <QTextCodec>
 #include <KDebug>
 #include <KLocale>
+#include <KSaveFile>
+#include <KStandardDirs>
 #include <kpimutils/email.h>
 
-#ifndef ENABLE_MAPI_DEBUG
-#define ENABLE_MAPI_DEBUG 1
-#endif
-
 #ifndef ENABLE_NOTIFICATIONS
 #define ENABLE_NOTIFICATIONS 0
 #endif
@@ -44,6 +49,17 @@
 #define ENABLE_PUBLIC_FOLDERS 0
 #endif
 
+/**
+ * The number of name resolutions each connection remembers, and for how
+ * many seconds.
+ */
+#ifndef RESOLVED_NAMES_MAX
+#define RESOLVED_NAMES_MAX 1000
+#endif
+#ifndef RESOLVED_NAMES_SECONDS
+#define RESOLVED_NAMES_SECONDS 3600
+#endif
+
 #define STR(def) \
 case def: return QString::fromLatin1(#def)
 
@@ -128,6 +144,20 @@ QString mapiError()
     }
 }
 
+bool mapiSessionLost()
+{
+    switch (GetLastError())
+    {
+    case MAPI_E_END_OF_SESSION:
+    case MAPI_E_NOT_INITIALIZED:
+    case MAPI_E_LOGON_FAILED:
+    case ecRpcFailed:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int profileSelectCallback(PropertyRowSet_r *rowset, const void* /*private_var*/)
 {
     qCritical() << "Found more than 1 matching users -> cancel";
@@ -137,64 +167,35 @@ static int profileSelectCallback(PropertyRowSet_r *rowset, const void* /*private
 }
 
 /**
- * An object which exists to enable MAPI debugging. This is intended to be
- * instantiated on the stack, as its destruction automatically resets the
- * debug settings.
+ * The contexts whose libmapi debugging follows the Wire logging category.
  */
-class MapiDebug
+static QMutex contextsLock;
+static QSet<mapi_context *> contexts;
+
+static void wireLevelSet(mapi_context *context, MapiLog::Level level)
 {
-public:
-    MapiDebug(MapiProfiles *context, bool enable) :
-        m_context(context->m_context),
-        m_enabled(enable)
-    {
-        if (m_enabled) {
-            if (MAPI_E_SUCCESS != SetMAPIDebugLevel(m_context, 9)) {
-                kError() << "cannot set debug level" << mapiError();
-            }
-            if (MAPI_E_SUCCESS != SetMAPIDumpData(m_context, true)) {
-                kError() << "cannot set dump data" << mapiError();
-            }
-        }
+    if (MAPI_E_SUCCESS != SetMAPIDebugLevel(context, (MapiLog::Error == level) ? 0 : 9)) {
+        kError() << "cannot set debug level" << mapiError();
     }
-
-    ~MapiDebug()
-    {
-        if (m_enabled) {
-            if (MAPI_E_SUCCESS != SetMAPIDebugLevel(m_context, 0)) {
-                kError() << "cannot reset debug level" << mapiError();
-            }
-            if (MAPI_E_SUCCESS != SetMAPIDumpData(m_context, false)) {
-                kError() << "cannot reset dump data" << mapiError();
-            }
-        }
+    if (MAPI_E_SUCCESS != SetMAPIDumpData(context, MapiLog::Trace == level)) {
+        kError() << "cannot set dump data" << mapiError();
     }
-private:
-    mapi_context *m_context;
-    bool m_enabled;
-};
+}
 
 MapiConnector2::MapiConnector2() :
     MapiProfiles(),
+    m_lease(0),
+    m_resolvedNames(RESOLVED_NAMES_MAX),
     m_session(0),
-    m_notifier(0)
+    m_store(0),
+    m_nspiStore(0),
+    m_namedProperties(0)
 {
-    m_store = allocate<mapi_object_t>();
-    m_nspiStore = allocate<mapi_object_t>();
-    mapi_object_init(m_store);
-    mapi_object_init(m_nspiStore);
 }
 
 MapiConnector2::~MapiConnector2()
 {
-    delete m_notifier;
-    // TODO The calls to tidy up m_nspiStore seem to break things.
-    if (m_session) {
-        //Logoff(m_nspiStore);
-        Logoff(m_store);
-    }
-    //mapi_object_release(m_nspiStore);
-    //mapi_object_release(m_store);
+    logout();
 }
 
 QDebug MapiConnector2::debug() const
@@ -241,7 +242,7 @@ QDebug MapiConnector2::error() const
 
 bool MapiConnector2::GALCount(unsigned *totalCount)
 {
-    if (MAPI_E_SUCCESS != GetGALTableCount(m_session, totalCount)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetGALTableCount, GetGALTableCount(m_session, totalCount))) {
         error() << "cannot get GAL count" << mapiError();
         return false;
     }
@@ -250,7 +251,7 @@ bool MapiConnector2::GALCount(unsigned *totalCount)
 
 bool MapiConnector2::GALRead(unsigned requestedCount, SPropTagArray *tags, SRowSet **results, unsigned *percentagePosition)
 {
-    if (MAPI_E_SUCCESS != GetGALTable(m_session, tags, (PropertyRowSet_r **)results, requestedCount, TABLE_CUR)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetGALTable, GetGALTable(m_session, tags, (PropertyRowSet_r **)results, requestedCount, TABLE_CUR))) {
         error() << "cannot read GAL entries" << mapiError();
         return false;
     }
@@ -284,7 +285,7 @@ bool MapiConnector2::GALSeek(const QString &displayName, unsigned *percentagePos
     key.ulPropTag = (MAPITAGS)PR_DISPLAY_NAME_UNICODE;
     key.dwAlignPad = 0;
     key.value.lpszW = string(displayName);
-    if (MAPI_E_SUCCESS != nspi_SeekEntries(nspi, ctx(), SortTypeDisplayName, (PropertyValue_r *)&key, tags, NULL, (PropertyRowSet_r **)(results ? results : &dummy))) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(SeekEntries, nspi_SeekEntries(nspi, ctx(), SortTypeDisplayName, (PropertyValue_r *)&key, tags, NULL, (PropertyRowSet_r **)(results ? results : &dummy)))) {
         error() << "cannot seek to GAL entry" << displayName << mapiError();
         return false;
     }
@@ -296,7 +297,7 @@ bool MapiConnector2::GALSeek(const QString &displayName, unsigned *percentagePos
     return true;
 }
 
-bool MapiConnector2::login(QString profile)
+bool MapiConnector2::login(QString profile, unsigned channel)
 {
     if (!init()) {
         return false;
@@ -316,79 +317,95 @@ bool MapiConnector2::login(QString profile)
         }
     }
 
-    // Log on
-    if (MAPI_E_SUCCESS != MapiLogonEx(m_context, &m_session, profile.toUtf8(), NULL)) {
-        error() << "cannot logon using profile" << profile << mapiError();
-        return false;
-    }
-    if (MAPI_E_SUCCESS != OpenMsgStore(m_session, m_store)) {
-        error() << "cannot open message store" << mapiError();
+    MapiSpan span("login", profile);
+    m_lease = MapiSession::acquire(profile, channel);
+    if (!m_lease) {
         return false;
     }
-#if (ENABLE_PUBLIC_FOLDERS)
-    if (MAPI_E_SUCCESS != OpenPublicFolder(m_session, m_nspiStore)) {
-        error() << "cannot open public folder" << mapiError();
-        return false;
+    m_session = m_lease->m_session;
+    m_store = m_lease->m_store;
+    m_nspiStore = m_lease->m_nspiStore;
+    m_namedProperties = m_lease->m_namedProperties;
+    return true;
+}
+
+void MapiConnector2::logout(bool lost)
+{
+    if (!m_lease) {
+        return;
+    }
+    MapiSession::release(m_lease, lost);
+    m_lease = 0;
+    m_resolvedNames.clear();
+    m_session = 0;
+    m_store = 0;
+    m_nspiStore = 0;
+    m_namedProperties = 0;
+}
+
+MapiNamedProperties *MapiConnector2::namedProperties(const MapiId &id) const
+{
+    // The public folders have ids of their own.
+    if (id.m_provider != MapiId::EMSDB) {
+        return 0;
     }
-#endif
-    MapiDebug debug(this, (0 != ENABLE_MAPI_DEBUG));
+    return m_namedProperties;
+}
 
-    // Get rid of any existing notifier and create a new one.
-    // TODO Wait for a version of libmapi that has asingle parameter here.
-#if (ENABLE_NOTIFICATIONS)
-#if 0
-    if (MAPI_E_SUCCESS != RegisterNotification(m_session)) {
-#else
-    if (MAPI_E_SUCCESS != RegisterNotification(m_session, 0)) {
-#endif
-        error() << "cannot register for notifications" << mapiError();
+bool MapiConnector2::ping()
+{
+    struct mapi_response *mapi_response;
+    NTSTATUS status;
+
+    if (!m_session) {
         return false;
     }
-    delete m_notifier;
-    m_notifier = new QSocketNotifier(m_session->notify_ctx->fd, QSocketNotifier::Read);
-    if (!m_notifier) {
-        error() << "cannot create notifier";
+
+    // Same dummy transaction as used to keep the notification pipe up.
+    status = emsmdb_transaction_null((struct emsmdb_context *)m_session->emsmdb->ctx, &mapi_response);
+    if (!NT_STATUS_IS_OK(status)) {
+        error() << "session not alive, nt status" << status;
         return false;
     }
-    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(notified(int)));
-#endif
     return true;
 }
 
-void MapiConnector2::notified(int fd)
+bool MapiConnector2::resolveNames(const char *names[], SPropTagArray *tags,
+                  SRowSet **results, PropertyTagArray_r **statuses)
 {
-    QAbstractSocket socket(QAbstractSocket::UdpSocket, this);
-    socket.setSocketDescriptor(fd);
-    struct mapi_response    *mapi_response;
-    NTSTATUS                status;
-    QByteArray data;
-    while (true) {
-        data = socket.readAll();
-        error() << "read from socket" << data.size();
-        if (!data.size()) {
-            break;
-        }
-        // Dummy transaction to keep the  pipe up.
-        status = emsmdb_transaction_null((struct emsmdb_context *)m_session->emsmdb->ctx,
-                                                                         &mapi_response);
-        if (!NT_STATUS_IS_OK(status)) {
-            error() << "bad nt status" << status;
-            break;
-        }
-        //retval = ProcessNotification(notify_ctx, mapi_response);
+    if (MAPI_E_SUCCESS != MAPI_TIMED(ResolveNames, ResolveNames(m_session, names, tags, (PropertyRowSet_r **)results, statuses, MAPI_UNICODE))) {
+        error() << "cannot resolve names" << mapiError();
+        return false;
     }
+    return true;
 }
 
-bool MapiConnector2::resolveNames(const char *names[], SPropTagArray *tags,
-                  SRowSet **results, PropertyTagArray_r **statuses)
+bool MapiConnector2::resolvedName(const QString &name, QString &resolvedName, QString &email) const
 {
-    if (MAPI_E_SUCCESS != ResolveNames(m_session, names, tags, (PropertyRowSet_r **)results, statuses, MAPI_UNICODE)) {
-        error() << "cannot resolve names" << mapiError();
+    ResolvedName *resolved = m_resolvedNames.object(name);
+
+    if (!resolved) {
         return false;
     }
+    if (resolved->added.secsTo(QDateTime::currentDateTime()) > RESOLVED_NAMES_SECONDS) {
+        m_resolvedNames.remove(name);
+        return false;
+    }
+    resolvedName = resolved->name;
+    email = resolved->email;
     return true;
 }
 
+void MapiConnector2::resolvedNameAdd(const QString &name, const QString &resolvedName, const QString &email)
+{
+    ResolvedName *resolved = new ResolvedName;
+
+    resolved->name = resolvedName;
+    resolved->email = email;
+    resolved->added = QDateTime::currentDateTime();
+    m_resolvedNames.insert(name, resolved);
+}
+
 /**
  * We store all objects in Akonadi using the densest string representation to hand:
  *
@@ -413,6 +430,13 @@ MapiId::MapiId(const MapiId &parent, const mapi_id_t &child)
     second = child;
 }
 
+MapiId::MapiId(const MapiId &ancestor, const mapi_id_t &parent, const mapi_id_t &child)
+{
+    m_provider = ancestor.m_provider;
+    first = parent;
+    second = child;
+}
+
 MapiId::MapiId(const QString &id)
 {
     m_provider = (Provider)id.at(0).digitValue();
@@ -434,6 +458,395 @@ bool MapiId::isValid() const
     return (m_provider == EMSDB) || (m_provider == NSPI);
 }
 
+/**
+ * The named property ids of each mailbox, keyed by profile and mailbox.
+ * These live as long as the process.
+ */
+static QMutex namedPropertiesLock;
+static QHash<QString, MapiNamedProperties *> namedProperties;
+
+/**
+ * The saved ids start with this, and a version number.
+ */
+static const char namedPropertiesMagic[] = "MAPINAME";
+#define NAMED_PROPERTIES_VERSION 1
+
+MapiNamedProperties::MapiNamedProperties(const QString &fileName) :
+    m_namesQueried(false),
+    m_fileName(fileName)
+{
+    load();
+}
+
+MapiNamedProperties *MapiNamedProperties::find(const QString &profile, const QString &mailbox)
+{
+    QMutexLocker locker(&namedPropertiesLock);
+    QString key = profile + QChar::fromAscii('/') + mailbox;
+    MapiNamedProperties *result = namedProperties.value(key);
+
+    if (!result) {
+        QString fileName;
+
+        if (!mailbox.isEmpty()) {
+            QString name = QString::fromAscii(QUrl::toPercentEncoding(profile)) + QChar::fromAscii('-') + mailbox;
+            fileName = KStandardDirs::locateLocal("cache", QString::fromAscii("akonadi_exchange/namedproperties-%1").arg(name));
+        }
+        result = new MapiNamedProperties(fileName);
+        namedProperties.insert(key, result);
+    }
+    return result;
+}
+
+bool MapiNamedProperties::map(const SPropTagArray &tags, SPropTagArray &mapped, QVector<int> &missing) const
+{
+    QMutexLocker locker(&m_lock);
+
+    for (unsigned i = 0; i < tags.cValues; i++) {
+        int tag = tags.aulPropTag[i];
+
+        if (tag & 0x80000000) {
+            QHash<int, int>::const_iterator j = m_ids.constFind(tag);
+
+            if (j == m_ids.constEnd()) {
+                missing.append(tag);
+            } else {
+                tag = j.value();
+            }
+        }
+        mapped.aulPropTag[i] = (MAPITAGS)tag;
+    }
+    return missing.isEmpty();
+}
+
+void MapiNamedProperties::insert(const QHash<int, int> &ids)
+{
+    QMutexLocker locker(&m_lock);
+
+    m_ids.unite(ids);
+    save();
+}
+
+void MapiNamedProperties::namesQuery(mapi_object_t *store)
+{
+    QMutexLocker locker(&m_lock);
+
+    if (m_namesQueried) {
+        return;
+    }
+    m_namesQueried = true;
+
+    uint16_t count;
+    uint16_t *ids;
+    MAPINAMEID *names;
+    if (MAPI_E_SUCCESS != MAPI_TIMED(QueryNamedProperties, QueryNamedProperties(store, 0, NULL, &count, &ids, &names))) {
+        kError() << "cannot enumerate named properties" << mapiError();
+        return;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        m_names.insert(ids[i], format(ids[i] << 16, names[i]));
+    }
+    MAPIFreeBuffer(ids);
+    MAPIFreeBuffer(names);
+    MAPI_KDEBUG(Connector) << "found" << count << "named property names";
+}
+
+bool MapiNamedProperties::name(int tag, QString &result) const
+{
+    QMutexLocker locker(&m_lock);
+    QHash<int, QString>::const_iterator i = m_names.constFind((unsigned)tag >> 16);
+
+    if (i == m_names.constEnd()) {
+        return false;
+    }
+    result = i.value();
+    return true;
+}
+
+void MapiNamedProperties::insertNames(const QHash<int, QString> &names)
+{
+    QMutexLocker locker(&m_lock);
+
+    m_names.unite(names);
+}
+
+QString MapiNamedProperties::format(int tag, const MAPINAMEID &name)
+{
+    if (MNID_STRING == name.ulKind) {
+        return QString::fromUtf8(name.kind.lpwstr.Name);
+    } else {
+        return QString::fromLatin1("Id0x%1:%2").arg((unsigned)tag, 0, 16).arg((unsigned)name.kind.lid, 0, 16);
+    }
+}
+
+void MapiNamedProperties::load()
+{
+    if (m_fileName.isEmpty()) {
+        return;
+    }
+
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QDataStream stream(&file);
+    QByteArray magic;
+    quint32 version;
+    QHash<qint32, qint32> ids;
+
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream >> magic >> version;
+    if ((magic != namedPropertiesMagic) || (version != NAMED_PROPERTIES_VERSION)) {
+        kError() << "ignoring named properties:" << m_fileName;
+        return;
+    }
+    stream >> ids;
+    if (stream.status() != QDataStream::Ok) {
+        kError() << "cannot read named properties:" << m_fileName;
+        return;
+    }
+    for (QHash<qint32, qint32>::const_iterator i = ids.constBegin(); i != ids.constEnd(); ++i) {
+        m_ids.insert(i.key(), i.value());
+    }
+    MAPI_KDEBUG(Connector) << "loaded" << m_ids.size() << "named properties from" << m_fileName;
+}
+
+/**
+ * The caller must hold the lock.
+ */
+void MapiNamedProperties::save() const
+{
+    if (m_fileName.isEmpty()) {
+        return;
+    }
+
+    KSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        kError() << "cannot save named properties:" << m_fileName << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    QHash<qint32, qint32> ids;
+
+    for (QHash<int, int>::const_iterator i = m_ids.constBegin(); i != m_ids.constEnd(); ++i) {
+        ids.insert(i.key(), i.value());
+    }
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream << QByteArray(namedPropertiesMagic) << (quint32)NAMED_PROPERTIES_VERSION << ids;
+    if (!file.finalize()) {
+        kError() << "cannot save named properties:" << m_fileName << file.errorString();
+    }
+}
+
+/**
+ * The pool of sessions, keyed by profile and channel.
+ */
+typedef QPair<QString, unsigned> SessionKey;
+static QMutex sessionPoolLock;
+static QHash<SessionKey, MapiSession *> sessionPool;
+
+MapiSession::MapiSession(const QString &profile, unsigned channel) :
+    QObject(),
+    MapiProfiles(),
+    m_profile(profile),
+    m_channel(channel),
+    m_leases(0),
+    m_session(0),
+    m_storeOpened(false),
+    m_namedProperties(0),
+    m_notifier(0)
+{
+    m_store = allocate<mapi_object_t>();
+    m_nspiStore = allocate<mapi_object_t>();
+    mapi_object_init(m_store);
+    mapi_object_init(m_nspiStore);
+}
+
+MapiSession::~MapiSession()
+{
+    logoff();
+    //mapi_object_release(m_nspiStore);
+    //mapi_object_release(m_store);
+}
+
+MapiSession *MapiSession::acquire(const QString &profile, unsigned channel)
+{
+    SessionKey key(profile, channel);
+    {
+        QMutexLocker locker(&sessionPoolLock);
+        MapiSession *session = sessionPool.value(key);
+
+        if (session) {
+            session->m_leases++;
+            return session;
+        }
+    }
+
+    // Login is a network round trip, so it is done without the lock, which
+    // would otherwise hold up logins on every other channel.
+    MapiSession *session = new MapiSession(profile, channel);
+    if (!session->login()) {
+        delete session;
+        return 0;
+    }
+
+    // If another thread logged in on the same channel meanwhile, use its
+    // session and drop ours.
+    MapiSession *existing;
+    {
+        QMutexLocker locker(&sessionPoolLock);
+        existing = sessionPool.value(key);
+        if (existing) {
+            existing->m_leases++;
+        } else {
+            sessionPool.insert(key, session);
+            session->m_leases++;
+        }
+    }
+    if (existing) {
+        delete session;
+        return existing;
+    }
+    return session;
+}
+
+void MapiSession::release(MapiSession *session, bool lost)
+{
+    QMutexLocker locker(&sessionPoolLock);
+    SessionKey key(session->m_profile, session->m_channel);
+
+    // A lost session is removed from the pool at once, but only if it has
+    // not already been replaced by another lease-holder.
+    if (lost && (sessionPool.value(key) == session)) {
+        sessionPool.remove(key);
+    }
+    if (--session->m_leases) {
+        return;
+    }
+    if (sessionPool.value(key) == session) {
+        sessionPool.remove(key);
+    }
+    delete session;
+}
+
+QDebug MapiSession::debug() const
+{
+    static QString prefix = QString::fromAscii("MapiSession: %1/%2:");
+    return TallocContext::debug(prefix.arg(m_profile).arg(m_channel));
+}
+
+QDebug MapiSession::error() const
+{
+    static QString prefix = QString::fromAscii("MapiSession: %1/%2:");
+    return TallocContext::error(prefix.arg(m_profile).arg(m_channel));
+}
+
+bool MapiSession::login()
+{
+    if (!init()) {
+        return false;
+    }
+
+    // Log on
+    if (MAPI_E_SUCCESS != MAPI_TIMED(Logon, MapiLogonEx(m_context, &m_session, m_profile.toUtf8(), NULL))) {
+        error() << "cannot logon" << mapiError();
+        m_session = 0;
+        return false;
+    }
+    if (MAPI_E_SUCCESS != OpenMsgStore(m_session, m_store)) {
+        error() << "cannot open message store" << mapiError();
+        logoff();
+        return false;
+    }
+    m_storeOpened = true;
+
+    // Named property ids are specific to the mailbox, which we identify by
+    // its record key. If that is not available, the ids are not saved.
+    QString mailbox;
+    SPropTagArray *tags = set_SPropTagArray(ctx(), 0x1, PidTagStoreRecordKey);
+    SPropValue *values;
+    uint32_t count;
+    if (tags && (MAPI_E_SUCCESS == MAPI_TIMED(GetProps, GetProps(m_store, MAPI_UNICODE, tags, &values, &count))) &&
+        count && (values[0].ulPropTag == PidTagStoreRecordKey)) {
+        mailbox = QString::fromAscii(QByteArray((char *)values[0].value.bin.lpb, values[0].value.bin.cb).toHex());
+    } else {
+        error() << "cannot identify mailbox, named properties will not be saved" << mapiError();
+    }
+    MAPIFreeBuffer(tags);
+    m_namedProperties = MapiNamedProperties::find(m_profile, mailbox);
+    m_namedProperties->namesQuery(m_store);
+#if (ENABLE_PUBLIC_FOLDERS)
+    if (MAPI_E_SUCCESS != OpenPublicFolder(m_session, m_nspiStore)) {
+        error() << "cannot open public folder" << mapiError();
+        logoff();
+        return false;
+    }
+#endif
+    // Get rid of any existing notifier and create a new one.
+    // TODO Wait for a version of libmapi that has asingle parameter here.
+#if (ENABLE_NOTIFICATIONS)
+#if 0
+    if (MAPI_E_SUCCESS != RegisterNotification(m_session)) {
+#else
+    if (MAPI_E_SUCCESS != RegisterNotification(m_session, 0)) {
+#endif
+        error() << "cannot register for notifications" << mapiError();
+        logoff();
+        return false;
+    }
+    delete m_notifier;
+    m_notifier = new QSocketNotifier(m_session->notify_ctx->fd, QSocketNotifier::Read);
+    if (!m_notifier) {
+        error() << "cannot create notifier";
+        logoff();
+        return false;
+    }
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(notified(int)));
+#endif
+    return true;
+}
+
+void MapiSession::logoff()
+{
+    delete m_notifier;
+    m_notifier = 0;
+
+    // Without an open store, there is nothing to log off from, and the
+    // session is freed along with our context.
+    // TODO The calls to tidy up m_nspiStore seem to break things.
+    if (m_storeOpened) {
+        //Logoff(m_nspiStore);
+        Logoff(m_store);
+        m_storeOpened = false;
+    }
+    m_session = 0;
+}
+
+void MapiSession::notified(int fd)
+{
+    QAbstractSocket socket(QAbstractSocket::UdpSocket, this);
+    socket.setSocketDescriptor(fd);
+    struct mapi_response    *mapi_response;
+    NTSTATUS                status;
+    QByteArray data;
+    while (true) {
+        data = socket.readAll();
+        MAPI_DEBUG(Connector) << "read from socket" << data.size();
+        if (!data.size()) {
+            break;
+        }
+        // Dummy transaction to keep the  pipe up.
+        status = emsmdb_transaction_null((struct emsmdb_context *)m_session->emsmdb->ctx,
+                                                                         &mapi_response);
+        if (!NT_STATUS_IS_OK(status)) {
+            error() << "bad nt status" << status;
+            break;
+        }
+        //retval = ProcessNotification(notify_ctx, mapi_response);
+    }
+}
+
 MapiProfiles::MapiProfiles() :
     TallocContext("MapiProfiles::MapiProfiles"),
     m_context(0),
@@ -444,6 +857,9 @@ MapiProfiles::MapiProfiles() :
 MapiProfiles::~MapiProfiles()
 {
     if (m_context) {
+        QMutexLocker locker(&contextsLock);
+
+        contexts.remove(m_context);
         MAPIUninitialize(m_context);
     }
 }
@@ -650,9 +1066,25 @@ bool MapiProfiles::init()
         return false;
     }
     m_initialised = true;
+
+    QMutexLocker locker(&contextsLock);
+    contexts.insert(m_context);
+    if (MapiLog::enabled(MapiLog::Wire, MapiLog::Debug)) {
+        wireLevelSet(m_context, MapiLog::level(MapiLog::Wire));
+    }
     return true;
 }
 
+void MapiProfiles::wireLevelApply()
+{
+    QMutexLocker locker(&contextsLock);
+    MapiLog::Level level = MapiLog::level(MapiLog::Wire);
+
+    foreach (mapi_context *context, contexts) {
+        wireLevelSet(context, level);
+    }
+}
+
 QStringList MapiProfiles::list()
 {
     if (!init()) {
@@ -674,7 +1106,7 @@ QStringList MapiProfiles::list()
 
         profiles.append(QString::fromLocal8Bit(name));
         if (dflt) {
-            debug() << "default profile:" << name;
+            MAPI_DEBUG(Connector) << "default profile:" << name;
         }
     }
     return profiles;
@@ -793,9 +1225,64 @@ bool MapiProfiles::updateInterim(const char *profile, const QString &username, c
     return true;
 }
 
-TallocContext::TallocContext(const char *name)
+/**
+ * The size of each arena's pool. Allocations which do not fit fall back to
+ * malloc().
+ */
+#ifndef TALLOC_ARENA_SIZE
+#define TALLOC_ARENA_SIZE (256 * 1024)
+#endif
+
+/**
+ * A pool is shared by the arena and each context allocated from it.
+ */
+struct TallocPool
+{
+    TALLOC_CTX *ctx;
+    QAtomicInt references;
+};
+
+static void poolRelease(TallocPool *pool)
+{
+    if (!pool->references.deref()) {
+        talloc_free(pool->ctx);
+        delete pool;
+    }
+}
+
+/**
+ * The innermost arena on each thread.
+ */
+static __thread TallocArena *currentArena = 0;
+
+TallocArena::TallocArena(const char *name) :
+    m_pool(new TallocPool),
+    m_previous(currentArena)
 {
-    m_ctx = talloc_named(NULL, 0, "%s", name);
+    m_pool->ctx = talloc_pool(NULL, TALLOC_ARENA_SIZE);
+    m_pool->references = 1;
+    if (m_pool->ctx) {
+        talloc_set_name_const(m_pool->ctx, name);
+    } else {
+        qCritical() << name << "talloc_pool failed";
+    }
+    currentArena = this;
+}
+
+TallocArena::~TallocArena()
+{
+    currentArena = m_previous;
+    poolRelease(m_pool);
+}
+
+TallocContext::TallocContext(const char *name) :
+    m_pool(0)
+{
+    if (currentArena && currentArena->m_pool->ctx) {
+        m_pool = currentArena->m_pool;
+        m_pool->references.ref();
+    }
+    m_ctx = talloc_named(m_pool ? m_pool->ctx : NULL, 0, "%s", name);
     if (!m_ctx) {
         qCritical() << name << "talloc_named failed";
     }
@@ -804,6 +1291,9 @@ TallocContext::TallocContext(const char *name)
 TallocContext::~TallocContext()
 {
     talloc_free(m_ctx);
+    if (m_pool) {
+        poolRelease(m_pool);
+    }
 }
 
 TALLOC_CTX *TallocContext::ctx()
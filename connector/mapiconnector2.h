@@ -22,11 +22,19 @@
 #define MAPICONNECTOR2_H
 
 #include <QBitArray>
+#include <QCache>
 #include <QDateTime>
 #include <QDebug>
+#include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QString>
+#include <QVector>
+
+#include "mapilog.h"
+#include "mapimetrics.h"
+#include "mapitrace.h"
 
 extern "C" {
 // libmapi is a C library and must therefore be included that way
@@ -39,6 +47,12 @@ extern "C" {
  */
 extern QString mapiError();
 
+/**
+ * Did the last error mean that the session with the server has been lost, so
+ * that a new login is required?
+ */
+extern bool mapiSessionLost();
+
 /**
  * Enumerate all starting points in the MAPI store.
  */
@@ -94,6 +108,11 @@ public:
      */
     MapiId(const MapiId &parent, const mapi_id_t &child);
 
+    /**
+     * For a descendant object, where we only have the id of its parent.
+     */
+    MapiId(const MapiId &ancestor, const mapi_id_t &parent, const mapi_id_t &child);
+
     /**
      * From an Akonadi id.
      */
@@ -118,9 +137,12 @@ private:
     friend class MapiConnector2;
 };
 
+struct TallocPool;
+
 /**
  * A class which wraps a talloc memory allocator such that objects of this type
- * automatically free the used memory on destruction.
+ * automatically free the used memory on destruction. Objects created while a
+ * @ref TallocArena is in scope on the same thread allocate from its pool.
  */
 class TallocContext
 {
@@ -151,6 +173,11 @@ public:
 protected:
     TALLOC_CTX *m_ctx;
 
+    /**
+     * The pool m_ctx was allocated from, if any.
+     */
+    TallocPool *m_pool;
+
     /**
      * Debug and error reporting. Each subclass should reimplement with 
      * logic that emits a prefix identifying the object involved. 
@@ -166,6 +193,33 @@ protected:
     QDebug error(const QString &caller) const;
 };
 
+/**
+ * A batch-scoped arena, for example:
+ *
+ *  TallocArena arena("MapiFetchItemsJob");
+ *
+ * While one exists, any @ref TallocContext created on the same thread takes
+ * its memory from a single talloc_pool, rather than making its own malloc()
+ * calls. The pool is freed once the arena has gone out of scope and the last
+ * object created in it has been destroyed. Objects may outlive the arena, but
+ * any one of them keeps the whole pool alive.
+ *
+ * Since talloc is not thread-safe, the objects created in one arena must only
+ * be used by one thread at a time. Do not create long-lived shared objects,
+ * such as sessions, in an arena.
+ */
+class TallocArena
+{
+public:
+    TallocArena(const char *name);
+    ~TallocArena();
+
+private:
+    friend class TallocContext;
+    TallocPool *m_pool;
+    TallocArena *m_previous;
+};
+
 template <class T>
 T *TallocContext::allocate()
 {
@@ -222,9 +276,13 @@ public:
      */
     bool remove(QString profile);
 
+    /**
+     * Make libmapi debugging follow the level of the Wire logging category.
+     */
+    static void wireLevelApply();
+
 protected:
     mapi_context *m_context;
-    friend class MapiDebug;
 
     /**
      * Must be called first!
@@ -244,7 +302,162 @@ private:
 };
 
 /**
- * The main class represents a connection to the MAPI server.
+ * The ids which a mailbox uses for named properties. These are assigned by
+ * the server the first time a name is used in the mailbox, and never change
+ * afterwards, so the mapping from libmapi's canonical tags (such as the
+ * PidLid* tags) to the ids is shared by every object in the process, and
+ * saved between runs. Only names which have not been seen before need a
+ * GetIDsFromNames round trip.
+ *
+ * The canonical tags come from libmapi's own table of names; if that changes
+ * on an upgrade, delete the saved file.
+ *
+ * The reverse mapping, from ids to names, is only used for diagnostics. It
+ * is enumerated in bulk when the mailbox is first logged into, and kept in
+ * memory.
+ */
+class MapiNamedProperties
+{
+public:
+    /**
+     * @param fileName  Where to persist the ids. If empty, the ids are
+     *                  only kept for the life of the object.
+     */
+    MapiNamedProperties(const QString &fileName = QString());
+
+    /**
+     * The shared instance for a mailbox.
+     *
+     * @param profile   Name in libmapi database.
+     * @param mailbox   An id for the mailbox, such as its GUID. If empty,
+     *                  the ids are not persisted.
+     */
+    static MapiNamedProperties *find(const QString &profile, const QString &mailbox);
+
+    /**
+     * Map any named tags to the ids used by the mailbox, leaving other tags
+     * as they are.
+     *
+     * @param tags      The tags to map.
+     * @param mapped    An array of the same size as tags, to be filled in.
+     * @param missing   Named tags which are not yet known are appended here.
+     * @return True if all the named tags were known.
+     */
+    bool map(const SPropTagArray &tags, SPropTagArray &mapped, QVector<int> &missing) const;
+
+    /**
+     * Add newly found ids, keyed by canonical tag, and save them.
+     */
+    void insert(const QHash<int, int> &ids);
+
+    /**
+     * Fetch the names of all the named properties in the mailbox, unless
+     * that has already been done.
+     */
+    void namesQuery(mapi_object_t *store);
+
+    /**
+     * The name of a named property.
+     *
+     * @param tag       The tag as seen in the mailbox.
+     * @param result    The name, or empty if the server does not know it.
+     * @return False if the id has not been looked up.
+     */
+    bool name(int tag, QString &result) const;
+
+    /**
+     * Add names, keyed by property id. An empty name records that the server
+     * does not know the id.
+     */
+    void insertNames(const QHash<int, QString> &names);
+
+    /**
+     * A readable form of a name returned by the server.
+     */
+    static QString format(int tag, const MAPINAMEID &name);
+
+private:
+    void load();
+    void save() const;
+
+    mutable QMutex m_lock;
+    QHash<int, int> m_ids;
+    QHash<int, QString> m_names;
+    bool m_namesQueried;
+    const QString m_fileName;
+};
+
+/**
+ * An authenticated session with the MAPI server. Sessions are kept by
+ * profile and channel, and every @ref MapiConnector2 in the process which
+ * logs in on the same channel leases the same session. Use @ref acquire()
+ * and @ref release() rather than creating these directly.
+ *
+ * Each agent is a process of its own, and normally has a single user per
+ * channel, so this saves no logins between the mail, calendar and contacts
+ * agents; that would need a daemon owning the sessions. What the leases do
+ * provide is one place to log in, log off and discard lost sessions.
+ */
+class MapiSession : public QObject, public MapiProfiles
+{
+    Q_OBJECT
+public:
+    /**
+     * Lease the session for the given profile, logging in if needed.
+     *
+     * @param profile   Name in libmapi database.
+     * @param channel   Selects one of several independent sessions for the
+     *                  same profile.
+     * @return          The session, or 0 if the login attempt failed.
+     */
+    static MapiSession *acquire(const QString &profile, unsigned channel);
+
+    /**
+     * Return a lease. The session is logged off when the last lease is
+     * returned.
+     *
+     * @param lost      The session is known to be dead. It is removed from
+     *                  the pool so that the next @ref acquire() logs in
+     *                  afresh, even while other leases are outstanding.
+     */
+    static void release(MapiSession *session, bool lost = false);
+
+private:
+    MapiSession(const QString &profile, unsigned channel);
+    virtual ~MapiSession();
+
+    /**
+     * Log in, leaving nothing half-open if any step fails.
+     */
+    bool login();
+
+    /**
+     * Undo whatever part of @ref login() succeeded.
+     */
+    void logoff();
+
+    QString m_profile;
+    unsigned m_channel;
+    unsigned m_leases;
+    mapi_session *m_session;
+    bool m_storeOpened;
+    mapi_object_t *m_store;
+    mapi_object_t *m_nspiStore;
+    MapiNamedProperties *m_namedProperties;
+    class QSocketNotifier *m_notifier;
+
+    virtual QDebug debug() const;
+    virtual QDebug error() const;
+
+    friend class MapiConnector2;
+
+private Q_SLOTS:
+    void notified(int fd);
+};
+
+/**
+ * The main class represents a connection to the MAPI server. The underlying
+ * session is leased from a per-profile pool of @ref MapiSession objects.
  */
 class MapiConnector2 : protected QObject, public MapiProfiles
 {
@@ -254,12 +467,32 @@ public:
     virtual ~MapiConnector2();
 
     /**
-     * Connect to the server.
+     * Connect to the server. If another connector in this process is already
+     * logged in using the same profile and channel, its session is shared.
      * 
      * @param profile   Name in libmapi database.
+     * @param channel   Connectors which need to run in parallel with each
+     *                  other must use different channels.
      * @return          True if the connection attempt succeeds.
      */
-    bool login(QString profile);
+    bool login(QString profile, unsigned channel = 0);
+
+    /**
+     * Disconnect from the server.
+     *
+     * @param lost      The session is known to be dead, and must not be
+     *                  reused by a subsequent @ref login() from any
+     *                  connector.
+     */
+    void logout(bool lost = false);
+
+    /**
+     * Check that the session is still alive using a lightweight round trip
+     * to the server.
+     *
+     * @return          True if the session is usable.
+     */
+    bool ping();
 
     /**
      * Factory for getting default folder ids. MAPI has two kinds of folder,
@@ -304,19 +537,51 @@ public:
     bool resolveNames(const char *names[], SPropTagArray *tags,
               SRowSet **results, PropertyTagArray_r **statuses);
 
+    /**
+     * Look up the outcome of an earlier @ref resolveNames(). Messages in the
+     * same folder tend to share correspondents, so remembering these saves
+     * most of the round trips needed to resolve recipients. Only the most
+     * recently used names are kept, and each only for a limited time, so
+     * that changes on the server are eventually seen.
+     *
+     * @param name          The name which was to be resolved.
+     * @param resolvedName  The name returned by the server.
+     * @param email         The email returned by the server. This is empty
+     *                      if the server could not resolve the name.
+     * @return              True if the name has been seen before.
+     */
+    bool resolvedName(const QString &name, QString &resolvedName, QString &email) const;
+
+    /**
+     * Remember the outcome of a @ref resolveNames().
+     */
+    void resolvedNameAdd(const QString &name, const QString &resolvedName, const QString &email);
+
+    /**
+     * The named property ids for the store holding the given object, or 0
+     * if they are not shared.
+     */
+    MapiNamedProperties *namedProperties(const MapiId &id) const;
+
 private:
     mapi_object_t openFolder(mapi_id_t folderID);
 
+    struct ResolvedName
+    {
+        QString name;
+        QString email;
+        QDateTime added;
+    };
+
+    MapiSession *m_lease;
+    mutable QCache<QString, ResolvedName> m_resolvedNames;
     mapi_session *m_session;
     mapi_object_t *m_store;
     mapi_object_t *m_nspiStore;
-    class QSocketNotifier *m_notifier;
+    MapiNamedProperties *m_namedProperties;
 
     virtual QDebug debug() const;
     virtual QDebug error() const;
-
-private Q_SLOTS:
-    void notified(int fd);
 };
 
 #endif // MAPICONNECTOR2_H
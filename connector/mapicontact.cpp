@@ -0,0 +1,393 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2011 Robert Gruber <rgruber@users.sourceforge.net>, Shaheed Haque
+ * <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapicontact.h"
+
+#include <KABC/Address>
+#include <KABC/Addressee>
+#include <KABC/PhoneNumber>
+#include <KABC/Picture>
+#include <KDebug>
+#include <KLocalizedString>
+#include <KUrl>
+#include <QImage>
+
+#include "mapischema.h"
+
+/**
+ * The state carried between the properties of a GAL entry or Contact while
+ * they are decoded.
+ */
+class ContactDecoder
+{
+public:
+    ContactDecoder(KABC::Addressee &addressee) :
+        addressee(addressee),
+        displayType(DT_MAILUSER),
+        objectType(MAPI_MAILUSER),
+        postal(KABC::Address::Postal),
+        work(KABC::Address::Work),
+        home(KABC::Address::Home),
+        other(KABC::Address::Pref)
+    {
+    }
+
+    KABC::Addressee &addressee;
+    unsigned displayType;
+    unsigned objectType;
+    QString email;
+    QString addressType;
+    QString officeLocation;
+    QString location;
+    KABC::Address postal;
+    KABC::Address work;
+    KABC::Address home;
+    KABC::Address other;
+};
+
+/**
+ * Setters shared by many properties.
+ */
+template <void (KABC::Addressee::*set)(const QString &)>
+static bool addresseeString(ContactDecoder &decoder, const MapiProperty &property)
+{
+    (decoder.addressee.*set)(property.asString());
+    return true;
+}
+
+template <KABC::Address ContactDecoder::*address, void (KABC::Address::*set)(const QString &)>
+static bool addressString(ContactDecoder &decoder, const MapiProperty &property)
+{
+    ((decoder.*address).*set)(property.asString());
+    return true;
+}
+
+template <QString ContactDecoder::*field>
+static bool decoderString(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asString();
+    return true;
+}
+
+template <unsigned ContactDecoder::*field>
+static bool decoderUnsigned(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asInteger();
+    return true;
+}
+
+/**
+ * The type is a sum of KABC::PhoneNumber::TypeFlag values, since the
+ * operator| defined for them cannot be used in a template argument.
+ */
+template <int type>
+static bool phoneNumber(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.addressee.insertPhoneNumber(KABC::PhoneNumber(property.asString(), KABC::PhoneNumber::Type(QFlag(type))));
+    return true;
+}
+
+static bool messageClass(ContactDecoder &decoder, const MapiProperty &property)
+{
+    Q_UNUSED(decoder)
+
+    // Sanity check the message class.
+    QString messageClass = property.asString();
+    if (!messageClass.startsWith(QLatin1String("IPM.Contact"))) {
+        kError() << "retrieved item is not a contact:" << messageClass;
+        return false;
+    }
+    return true;
+}
+
+static bool smtpAddress(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.addressee.setEmails(QStringList(mapiExtractEmail(property, "SMTP")));
+    return true;
+}
+
+static bool account(ContactDecoder &decoder, const MapiProperty &property)
+{
+    if (!decoder.addressee.emails().size()) {
+        decoder.addressee.insertEmail(mapiExtractEmail(property, "SMTP"));
+    }
+    return true;
+}
+
+static bool gender(ContactDecoder &decoder, const MapiProperty &property)
+{
+    switch (property.asString().toUInt()) {
+    case 1:
+        // Female.
+        decoder.addressee.setTitle(i18n("Ms."));
+        break;
+    case 2:
+        // Male.
+        decoder.addressee.setTitle(i18n("Mr."));
+        break;
+    }
+    return true;
+}
+
+static bool personalHomePage(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.addressee.setUrl(KUrl(property.asString()));
+    return true;
+}
+
+static bool businessHomePage(ContactDecoder &decoder, const MapiProperty &property)
+{
+    if (decoder.addressee.url().isEmpty()) {
+        decoder.addressee.setUrl(KUrl(property.asString()));
+    }
+    return true;
+}
+
+static bool birthday(ContactDecoder &decoder, const MapiProperty &property)
+{
+    decoder.addressee.setBirthday(property.asDateTime());
+    return true;
+}
+
+static bool thumbnailPhoto(ContactDecoder &decoder, const MapiProperty &property)
+{
+    unsigned size;
+    const uint8_t *data = property.asBinary(size);
+
+    decoder.addressee.setPhoto(KABC::Picture(QImage::fromData(data, size)));
+    return true;
+}
+
+/**
+ * Anything else is kept as a custom field.
+ */
+static bool unknownProperty(ContactDecoder &decoder, const MapiProperty &property)
+{
+    const char *str = get_proptag_name(property.tag());
+    QString tagName;
+
+    if (str) {
+        tagName = QString::fromAscii(str).mid(6);
+    } else {
+        tagName = QString::number(property.tag(), 0, 16);
+    }
+
+    if (PT_ERROR != (property.tag() & 0xFFFF)) {
+        decoder.addressee.insertCustom(i18n("Exchange"), tagName, property.toString());
+    }
+
+    // Handle oversize objects.
+    if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
+        switch (property.tag()) {
+        default:
+            kError() << "missing oversize support:" << tagName;
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * The properties used to fetch data from the GAL or for a Contact, and how
+ * each is decoded.
+ *
+ * This list is the superset of useful entries from [MS-NSPI] with the address
+ * book objects as specified below, thus ensuring the best possible unified
+ * experience. We want to decode all the properties in [MS-OXOABK] that we
+ * can, subject to the following:
+ *
+ * - Properties common to all objects (section 2.2.3), and which apply to both
+ *   Contacts from [MS-OXOAB] and the GAL from [MS-NSPI].
+ *
+ * - Properties which apply either to Mail Users (section 2.2.4) or
+ *   Distribution Lists (section 2.2.6) and which map to either
+ *   KABC::Addressee or KABC::DistributionList respectively.
+ *
+ * TODO For now, we don't do anything useful with distribtion lists.
+ */
+static const MapiSchema<ContactDecoder>::Entry contactEntries[] = {
+    { PidTagMessageClass, messageClass },
+    // 2.2.3.1
+    { PidTagDisplayName, addresseeString<&KABC::Addressee::setNameFromString> },
+    // 2.2.3.14 and related items.
+    { PidTagEmailAddress, decoderString<&ContactDecoder::email> },
+    { PidTagAddressType, decoderString<&ContactDecoder::addressType> },
+    { PidTagSmtpAddress, smtpAddress },
+    { PidTagAccount, account },
+
+    // 2.2.3.10
+    { PidTagObjectType, decoderUnsigned<&ContactDecoder::objectType> },
+    // 2.2.3.11
+    { PidTagDisplayType, decoderUnsigned<&ContactDecoder::displayType> },
+    // 2.2.4.1
+    { PidTagSurname, addresseeString<&KABC::Addressee::setFamilyName> },
+    // 2.2.4.2
+    { PidTagGivenName, addresseeString<&KABC::Addressee::setGivenName> },
+    // 2.2.4.3
+    { PidTagNickname, addresseeString<&KABC::Addressee::setNickName> },
+    // 2.2.4.4
+    { PidTagDisplayNamePrefix, addresseeString<&KABC::Addressee::setPrefix> },
+    // 2.2.4.6
+    { PidTagGeneration, addresseeString<&KABC::Addressee::setSuffix> },
+    // 2.2.4.7
+    { PidTagTitle, addresseeString<&KABC::Addressee::setRole> },
+    // 2.2.4.8 and related items.
+    { PidTagOfficeLocation, decoderString<&ContactDecoder::officeLocation> },
+    { PidTagStreetAddress, addressString<&ContactDecoder::work, &KABC::Address::setStreet> },
+    { PidTagPostOfficeBox, addressString<&ContactDecoder::work, &KABC::Address::setPostOfficeBox> },
+    { PidTagLocality, addressString<&ContactDecoder::work, &KABC::Address::setLocality> },
+    { PidTagStateOrProvince, addressString<&ContactDecoder::work, &KABC::Address::setRegion> },
+    { PidTagPostalCode, addressString<&ContactDecoder::work, &KABC::Address::setPostalCode> },
+    { PidTagCountry, addressString<&ContactDecoder::work, &KABC::Address::setCountry> },
+    { PidTagLocation, decoderString<&ContactDecoder::location> },
+
+    // 2.2.4.9
+    { PidTagDepartmentName, addresseeString<&KABC::Addressee::setDepartment> },
+    // 2.2.4.10
+    { PidTagCompanyName, addresseeString<&KABC::Addressee::setOrganization> },
+    // 2.2.4.18
+    { PidTagPostalAddress, addressString<&ContactDecoder::postal, &KABC::Address::setStreet> },
+
+    // 2.2.4.25 and related items.
+    { PidTagHomeAddressStreet, addressString<&ContactDecoder::home, &KABC::Address::setStreet> },
+    { PidTagHomeAddressPostOfficeBox, addressString<&ContactDecoder::home, &KABC::Address::setPostOfficeBox> },
+    { PidTagHomeAddressCity, addressString<&ContactDecoder::home, &KABC::Address::setLocality> },
+    { PidTagHomeAddressStateOrProvince, addressString<&ContactDecoder::home, &KABC::Address::setRegion> },
+    { PidTagHomeAddressPostalCode, addressString<&ContactDecoder::home, &KABC::Address::setPostalCode> },
+    { PidTagHomeAddressCountry, addressString<&ContactDecoder::home, &KABC::Address::setCountry> },
+
+    // 2.2.4.31 and related items.
+    { PidTagOtherAddressStreet, addressString<&ContactDecoder::other, &KABC::Address::setStreet> },
+    { PidTagOtherAddressPostOfficeBox, addressString<&ContactDecoder::other, &KABC::Address::setPostOfficeBox> },
+    { PidTagOtherAddressCity, addressString<&ContactDecoder::other, &KABC::Address::setLocality> },
+    { PidTagOtherAddressStateOrProvince, addressString<&ContactDecoder::other, &KABC::Address::setRegion> },
+    { PidTagOtherAddressPostalCode, addressString<&ContactDecoder::other, &KABC::Address::setPostalCode> },
+    { PidTagOtherAddressCountry, addressString<&ContactDecoder::other, &KABC::Address::setCountry> },
+
+    // 2.2.4.37 and related items.
+    { PidTagPrimaryTelephoneNumber, phoneNumber<KABC::PhoneNumber::Pref + KABC::PhoneNumber::Voice> },
+    { PidTagBusinessTelephoneNumber, phoneNumber<KABC::PhoneNumber::Work + KABC::PhoneNumber::Voice> },
+    { PidTagBusiness2TelephoneNumber, phoneNumber<KABC::PhoneNumber::Work + KABC::PhoneNumber::Voice> },
+    { PidTagBusiness2TelephoneNumbers, phoneNumber<KABC::PhoneNumber::Work + KABC::PhoneNumber::Voice> },
+    { PidTagHomeTelephoneNumber, phoneNumber<KABC::PhoneNumber::Home + KABC::PhoneNumber::Voice> },
+    { PidTagHome2TelephoneNumber, phoneNumber<KABC::PhoneNumber::Home + KABC::PhoneNumber::Voice> },
+    { PidTagHome2TelephoneNumbers, phoneNumber<KABC::PhoneNumber::Home + KABC::PhoneNumber::Voice> },
+    { PidTagMobileTelephoneNumber, phoneNumber<KABC::PhoneNumber::Cell + KABC::PhoneNumber::Voice> },
+    { PidTagRadioTelephoneNumber, phoneNumber<KABC::PhoneNumber::Cell + KABC::PhoneNumber::Voice> },
+    { PidTagCarTelephoneNumber, phoneNumber<KABC::PhoneNumber::Car + KABC::PhoneNumber::Voice> },
+    { PidTagPrimaryFaxNumber, phoneNumber<KABC::PhoneNumber::Pref + KABC::PhoneNumber::Fax> },
+    { PidTagBusinessFaxNumber, phoneNumber<KABC::PhoneNumber::Work + KABC::PhoneNumber::Fax> },
+    { PidTagHomeFaxNumber, phoneNumber<KABC::PhoneNumber::Home + KABC::PhoneNumber::Fax> },
+    { PidTagPagerTelephoneNumber, phoneNumber<KABC::PhoneNumber::Pager> },
+    { PidTagIsdnNumber, phoneNumber<KABC::PhoneNumber::Isdn> },
+
+    // 2.2.4.73
+    { PidTagGender, gender },
+    // 2.2.4.77 and related.
+    { PidTagPersonalHomePage, personalHomePage },
+    { PidTagBusinessHomePage, businessHomePage },
+    // 2.2.4.79
+    { PidTagBirthday, birthday },
+    // 2.2.4.82
+    { PidTagThumbnailPhoto, thumbnailPhoto },
+    // Only used to see when the entry changes, see ExGalResource.
+    { PidTagLastModificationTime, 0 },
+    { 0, 0 } };
+static MapiSchema<ContactDecoder> contactSchema(contactEntries);
+
+/**
+ * The same, plus the tags every MapiMessage needs, for contacts read as
+ * items rather than from the GAL.
+ */
+static MapiSchema<ContactDecoder> contactItemSchema(contactEntries, MapiMessage::tagList());
+
+SPropTagArray *mapiContactTags()
+{
+    return contactSchema.tags();
+}
+
+const QVector<int> &mapiContactItemTags()
+{
+    return contactItemSchema.tagList();
+}
+
+void mapiContactTagsAppend(QVector<int> &tags)
+{
+    contactSchema.tagsAppend(tags);
+}
+
+bool mapiContactPayload(SPropValue *properties, unsigned propertyCount, KABC::Addressee &addressee, QString *dn)
+{
+    MapiSpan span("preparePayload");
+    static QString separator = QString::fromAscii(", ");
+    ContactDecoder decoder(addressee);
+
+    if (!contactSchema.decode(properties, propertyCount, decoder, unknownProperty)) {
+        return false;
+    }
+    if (dn && (decoder.addressType == QLatin1String("EX"))) {
+        *dn = decoder.email;
+    }
+    if (decoder.displayType != DT_MAILUSER) {
+        //this->displayType = mapiDisplayType(displayType);
+    }
+    if (decoder.objectType != MAPI_MAILUSER) {
+        //this->objectType = mapiObjectType(objectType);
+        MAPI_KDEBUG(Objects) << "email" << decoder.email << decoder.objectType;
+    }
+
+    // Don't override an SMTP address.
+    if (!decoder.email.isEmpty()) {
+        if (!addressee.emails().size()) {
+            addressee.insertEmail(mapiExtractEmail(decoder.email, decoder.addressType.toAscii()));
+        }
+    }
+
+    // location
+    // officeLocation
+    // location, officeLocation
+    if (!decoder.location.isEmpty())
+    {
+        decoder.work.setExtended(decoder.location);
+    }
+    if (!decoder.officeLocation.isEmpty()) {
+        if (!decoder.location.isEmpty())
+        {
+            decoder.work.setExtended(decoder.location.append(separator).append(decoder.officeLocation));
+        } else {
+            decoder.work.setExtended(decoder.officeLocation);
+        }
+    }
+
+    // Any non-empty addresses?
+    if (!decoder.postal.formattedAddress().isEmpty()) {
+        addressee.insertAddress(decoder.postal);
+    }
+    if (!decoder.work.formattedAddress().isEmpty()) {
+        addressee.insertAddress(decoder.work);
+    }
+    if (!decoder.home.formattedAddress().isEmpty()) {
+        addressee.insertAddress(decoder.home);
+    }
+    if (!decoder.other.formattedAddress().isEmpty()) {
+        addressee.insertAddress(decoder.other);
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2011 Robert Gruber <rgruber@users.sourceforge.net>, Shaheed Haque
+ * <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPICONTACT_H
+#define MAPICONTACT_H
+
+#include <QVector>
+
+#include "mapiobjects.h"
+
+namespace KABC
+{
+class Addressee;
+}
+
+/**
+ * The tags to fetch for a GAL entry.
+ */
+extern SPropTagArray *mapiContactTags();
+
+/**
+ * The same, plus the tags every MapiMessage needs, for the
+ * MapiObject::propertiesPull() protocol of a Contact. The list is never
+ * modified, so copies can be used by any thread.
+ */
+extern const QVector<int> &mapiContactItemTags();
+
+/**
+ * Add the tags for a GAL entry to those already in a list.
+ */
+extern void mapiContactTagsAppend(QVector<int> &tags);
+
+/**
+ * Take a set of properties from a GAL entry or Contact, and attempt to apply
+ * them to the given addressee. This lives in the connector so that the
+ * benchmarks can use it too.
+ *
+ * @param dn    If given, set to the entry's distinguished name, if it has one.
+ * @return false on error.
+ */
+extern bool mapiContactPayload(SPropValue *properties, unsigned propertyCount, KABC::Addressee &addressee, QString *dn = 0);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapilog.h"
+
+#include <KDebug>
+
+#include "mapiconnector2.h"
+
+/**
+ * Set this to 1 to have libmapi dump every packet from startup, rather than
+ * only once the Wire category is turned up over D-Bus.
+ */
+#ifndef ENABLE_MAPI_DEBUG
+#define ENABLE_MAPI_DEBUG 0
+#endif
+
+static const char *categoryNames[] = {
+    "Connector",
+    "Objects",
+    "Resource",
+    "Wire" };
+
+static const char *levelNames[] = {
+    "Error",
+    "Debug",
+    "Trace" };
+
+#define LEVEL_COUNT (sizeof(levelNames) / sizeof(levelNames[0]))
+
+QAtomicInt MapiLog::s_levels[MapiLog::CategoryCount] = {
+    QAtomicInt(Error),
+    QAtomicInt(Error),
+    QAtomicInt(Error),
+    QAtomicInt(ENABLE_MAPI_DEBUG ? Trace : Error) };
+
+MapiLog::MapiLog(QObject *parent) :
+    QObject(parent)
+{
+}
+
+MapiLog::~MapiLog()
+{
+}
+
+MapiLog::Level MapiLog::level(Category category)
+{
+    return (Level)(int)s_levels[category];
+}
+
+void MapiLog::levelSet(Category category, Level level)
+{
+    s_levels[category] = level;
+    if (Wire == category) {
+        MapiProfiles::wireLevelApply();
+    }
+}
+
+QDebug MapiLog::debug(const char *function)
+{
+    return qDebug() << function;
+}
+
+QStringList MapiLog::levels() const
+{
+    QStringList result;
+
+    for (unsigned i = 0; i < CategoryCount; i++) {
+        result << QString::fromAscii("%1=%2").arg(QString::fromAscii(categoryNames[i])).
+            arg(QString::fromAscii(levelNames[level((Category)i)]));
+    }
+    return result;
+}
+
+bool MapiLog::setLevel(const QString &category, const QString &level)
+{
+    int newLevel = -1;
+
+    for (unsigned i = 0; i < LEVEL_COUNT; i++) {
+        if (0 == level.compare(QLatin1String(levelNames[i]), Qt::CaseInsensitive)) {
+            newLevel = i;
+            break;
+        }
+    }
+    if (newLevel < 0) {
+        return false;
+    }
+
+    bool all = (0 == category.compare(QLatin1String("All"), Qt::CaseInsensitive));
+    bool found = false;
+    for (unsigned i = 0; i < CategoryCount; i++) {
+        if (all || (0 == category.compare(QLatin1String(categoryNames[i]), Qt::CaseInsensitive))) {
+            levelSet((Category)i, (Level)newLevel);
+            found = true;
+        }
+    }
+    if (found) {
+        kDebug() << "logging" << category << "at" << level;
+    }
+    return found;
+}
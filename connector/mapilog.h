@@ -0,0 +1,132 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPILOG_H
+#define MAPILOG_H
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <QObject>
+#include <QStringList>
+
+/**
+ * Diagnostic logging, with a level for each category which can be changed
+ * at runtime over D-Bus, for example:
+ *
+ *  qdbus org.freedesktop.Akonadi.Resource.akonadi_exmail_resource_0 /Logging setLevel Objects Debug
+ *
+ * Errors are always logged. Debug and Trace output is written using the
+ * macros below, which do not evaluate their arguments at all unless the
+ * category is enabled at that level.
+ */
+class MapiLog : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Logging")
+public:
+    enum Category {
+        /**
+         * Profiles, sessions and connections.
+         */
+        Connector,
+
+        /**
+         * Folders, messages and their properties and recipients.
+         */
+        Objects,
+
+        /**
+         * Akonadi tasks.
+         */
+        Resource,
+
+        /**
+         * libmapi itself. At Debug, libmapi logs its RPCs; at Trace, it also
+         * dumps every NDR packet.
+         */
+        Wire,
+        CategoryCount
+    };
+
+    enum Level {
+        Error,
+        Debug,
+        Trace
+    };
+
+    MapiLog(QObject *parent = 0);
+    virtual ~MapiLog();
+
+    /**
+     * Is the category enabled at the level? This is cheap enough to be used
+     * on every hot path.
+     */
+    static inline bool enabled(Category category, Level level)
+    {
+        return (int)s_levels[category] >= (int)level;
+    }
+
+    static Level level(Category category);
+    static void levelSet(Category category, Level level);
+
+    /**
+     * A stream for output from outside a TallocContext subclass. Unlike
+     * kDebug(), this is not compiled out of release builds, so that output
+     * enabled at runtime is actually seen.
+     */
+    static QDebug debug(const char *function);
+
+public Q_SLOTS:
+    /**
+     * The categories and their current levels, as "Category=Level".
+     */
+    Q_SCRIPTABLE QStringList levels() const;
+
+    /**
+     * Change the level of a category, or of all categories if the name is
+     * "All".
+     *
+     * @return False if the category or level is not recognised.
+     */
+    Q_SCRIPTABLE bool setLevel(const QString &category, const QString &level);
+
+private:
+    static QAtomicInt s_levels[CategoryCount];
+};
+
+/**
+ * Debug and trace output from within a TallocContext subclass, using its
+ * debug() prefix.
+ */
+#define MAPI_DEBUG(category) \
+    if (!MapiLog::enabled(MapiLog::category, MapiLog::Debug)) {} else debug()
+
+#define MAPI_TRACE(category) \
+    if (!MapiLog::enabled(MapiLog::category, MapiLog::Trace)) {} else debug()
+
+/**
+ * Debug and trace output from anywhere else.
+ */
+#define MAPI_KDEBUG(category) \
+    if (!MapiLog::enabled(MapiLog::category, MapiLog::Debug)) {} else MapiLog::debug(Q_FUNC_INFO)
+
+#define MAPI_KTRACE(category) \
+    if (!MapiLog::enabled(MapiLog::category, MapiLog::Trace)) {} else MapiLog::debug(Q_FUNC_INFO)
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapimetrics.h"
+
+#include <QMutex>
+#include <string.h>
+
+static const char *operationNames[] = {
+    "Logon",
+    "OpenFolder",
+    "OpenMessage",
+    "GetHierarchyTable",
+    "GetContentsTable",
+    "SetColumns",
+    "QueryPosition",
+    "QueryRows",
+    "GetProps",
+    "GetPropsAll",
+    "GetIDsFromNames",
+    "GetNamesFromIDs",
+    "QueryNamedProperties",
+    "GetRecipientTable",
+    "OpenStream",
+    "ReadStream",
+    "FXGetBuffer",
+    "ResolveNames",
+    "GetGALTableCount",
+    "GetGALTable",
+    "SeekEntries" };
+
+/**
+ * The names of the gauges, as used in the summary. The metrics add a
+ * "mapi_" prefix.
+ */
+static const char *gaugeNames[] = {
+    "gal_batch_size" };
+
+/**
+ * The upper bounds of the latency buckets, in milliseconds. There is a final
+ * bucket for anything slower.
+ */
+static const unsigned bucketLimits[] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+
+#define BUCKET_COUNT (sizeof(bucketLimits) / sizeof(bucketLimits[0]) + 1)
+
+/**
+ * Taking a lock is cheap compared with a round trip to the server.
+ */
+static QMutex metricsLock;
+
+static struct {
+    quint64 count;
+    quint64 usecs;
+    quint64 maxUsecs;
+    quint64 buckets[BUCKET_COUNT];
+} operations[MapiMetrics::OperationCount];
+
+static quint64 streams;
+static quint64 streamBytes;
+
+static struct {
+    bool set;
+    quint64 value;
+} gauges[MapiMetrics::GaugeCount];
+
+MapiMetrics::MapiMetrics(QObject *parent) :
+    QObject(parent)
+{
+}
+
+MapiMetrics::~MapiMetrics()
+{
+}
+
+void MapiMetrics::record(Operation operation, quint64 usecs)
+{
+    unsigned bucket = 0;
+
+    while ((bucket < BUCKET_COUNT - 1) && (usecs > bucketLimits[bucket] * 1000)) {
+        bucket++;
+    }
+
+    QMutexLocker locker(&metricsLock);
+    operations[operation].count++;
+    operations[operation].usecs += usecs;
+    operations[operation].maxUsecs = qMax(operations[operation].maxUsecs, usecs);
+    operations[operation].buckets[bucket]++;
+}
+
+const char *MapiMetrics::name(Operation operation)
+{
+    return operationNames[operation];
+}
+
+void MapiMetrics::streamRead(quint64 bytes)
+{
+    QMutexLocker locker(&metricsLock);
+    streams++;
+    streamBytes += bytes;
+}
+
+void MapiMetrics::set(Gauge gauge, quint64 value)
+{
+    QMutexLocker locker(&metricsLock);
+    gauges[gauge].set = true;
+    gauges[gauge].value = value;
+}
+
+/**
+ * Estimate a percentile as the upper bound of the bucket containing it.
+ */
+static QString percentile(const quint64 *buckets, quint64 count, unsigned percent)
+{
+    quint64 target = (count * percent + 99) / 100;
+    quint64 seen = 0;
+
+    for (unsigned i = 0; i < BUCKET_COUNT - 1; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return QString::number(bucketLimits[i]);
+        }
+    }
+    return QString::fromAscii(">%1").arg(bucketLimits[BUCKET_COUNT - 2]);
+}
+
+QStringList MapiMetrics::summary() const
+{
+    static QString format = QString::fromAscii("%1: count %2 total %3 mean %4 p50 %5 p95 %6 max %7");
+    QMutexLocker locker(&metricsLock);
+    QStringList result;
+
+    for (unsigned i = 0; i < OperationCount; i++) {
+        if (!operations[i].count) {
+            continue;
+        }
+        result << format.arg(QString::fromAscii(operationNames[i])).
+            arg(operations[i].count).
+            arg(operations[i].usecs / 1000).
+            arg(operations[i].usecs / 1000.0 / operations[i].count, 0, 'f', 1).
+            arg(percentile(operations[i].buckets, operations[i].count, 50)).
+            arg(percentile(operations[i].buckets, operations[i].count, 95)).
+            arg(operations[i].maxUsecs / 1000.0, 0, 'f', 1);
+    }
+    result << QString::fromAscii("Streams: count %1 bytes %2").arg(streams).arg(streamBytes);
+    for (unsigned i = 0; i < GaugeCount; i++) {
+        if (gauges[i].set) {
+            result << QString::fromAscii("%1: %2").arg(QString::fromAscii(gaugeNames[i])).arg(gauges[i].value);
+        }
+    }
+    return result;
+}
+
+QString MapiMetrics::metrics() const
+{
+    QMutexLocker locker(&metricsLock);
+    QString result;
+
+    result += QString::fromAscii("# TYPE mapi_operation_seconds histogram\n");
+    for (unsigned i = 0; i < OperationCount; i++) {
+        QString name = QString::fromAscii(operationNames[i]);
+        quint64 cumulative = 0;
+
+        for (unsigned j = 0; j < BUCKET_COUNT - 1; j++) {
+            cumulative += operations[i].buckets[j];
+            result += QString::fromAscii("mapi_operation_seconds_bucket{operation=\"%1\",le=\"%2\"} %3\n").
+                arg(name).arg(bucketLimits[j] / 1000.0).arg(cumulative);
+        }
+        result += QString::fromAscii("mapi_operation_seconds_bucket{operation=\"%1\",le=\"+Inf\"} %2\n").
+            arg(name).arg(operations[i].count);
+        result += QString::fromAscii("mapi_operation_seconds_sum{operation=\"%1\"} %2\n").
+            arg(name).arg(operations[i].usecs / 1000000.0);
+        result += QString::fromAscii("mapi_operation_seconds_count{operation=\"%1\"} %2\n").
+            arg(name).arg(operations[i].count);
+    }
+    result += QString::fromAscii("# TYPE mapi_streams_total counter\n");
+    result += QString::fromAscii("mapi_streams_total %1\n").arg(streams);
+    result += QString::fromAscii("# TYPE mapi_stream_bytes_total counter\n");
+    result += QString::fromAscii("mapi_stream_bytes_total %1\n").arg(streamBytes);
+    for (unsigned i = 0; i < GaugeCount; i++) {
+        if (!gauges[i].set) {
+            continue;
+        }
+        QString name = QString::fromAscii(gaugeNames[i]);
+
+        result += QString::fromAscii("# TYPE mapi_%1 gauge\n").arg(name);
+        result += QString::fromAscii("mapi_%1 %2\n").arg(name).arg(gauges[i].value);
+    }
+    return result;
+}
+
+void MapiMetrics::reset()
+{
+    QMutexLocker locker(&metricsLock);
+    memset(operations, 0, sizeof(operations));
+    streams = 0;
+    streamBytes = 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPIMETRICS_H
+#define MAPIMETRICS_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QStringList>
+#include <errno.h>
+
+#include "mapitrace.h"
+
+/**
+ * Counters and latency histograms for the libmapi operations we issue, and
+ * the number of bytes read from streams. The registry is process-wide, and is
+ * exported on D-Bus as /Metrics, for example:
+ *
+ *  qdbus org.freedesktop.Akonadi.Resource.akonadi_exmail_resource_0 /Metrics summary
+ *
+ * The @ref metrics() form is meant for scraping by monitoring.
+ */
+class MapiMetrics : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Metrics")
+public:
+    enum Operation {
+        Logon,
+        OpenFolder,
+        OpenMessage,
+        GetHierarchyTable,
+        GetContentsTable,
+        SetColumns,
+        QueryPosition,
+        QueryRows,
+        GetProps,
+        GetPropsAll,
+        GetIDsFromNames,
+        GetNamesFromIDs,
+        QueryNamedProperties,
+        GetRecipientTable,
+        OpenStream,
+        ReadStream,
+        FXGetBuffer,
+        ResolveNames,
+        GetGALTableCount,
+        GetGALTable,
+        SeekEntries,
+        OperationCount
+    };
+
+    /**
+     * Values which are set, rather than accumulated.
+     */
+    enum Gauge {
+        GALBatchSize,
+        GaugeCount
+    };
+
+    MapiMetrics(QObject *parent = 0);
+    virtual ~MapiMetrics();
+
+    /**
+     * Account for an operation which took the given time.
+     */
+    static void record(Operation operation, quint64 usecs);
+
+    /**
+     * Account for a stream which has been read.
+     */
+    static void streamRead(quint64 bytes);
+
+    /**
+     * Set the current value of a gauge.
+     */
+    static void set(Gauge gauge, quint64 value);
+
+    /**
+     * The name of an operation, as used in the reports and traces.
+     */
+    static const char *name(Operation operation);
+
+public Q_SLOTS:
+    /**
+     * One line per operation: count, total, mean, 50th and 95th percentiles
+     * and maximum, in milliseconds. Then the streams, and any gauges which
+     * have been set.
+     */
+    Q_SCRIPTABLE QStringList summary() const;
+
+    /**
+     * Everything, in the Prometheus text format.
+     */
+    Q_SCRIPTABLE QString metrics() const;
+
+    /**
+     * Start counting afresh.
+     */
+    Q_SCRIPTABLE void reset();
+};
+
+/**
+ * Times an operation, from construction to destruction. When tracing, the
+ * operation is also recorded as a span.
+ *
+ * libmapi reports errors through errno, which is read after the timer is
+ * destroyed, so the destructor leaves it as it was.
+ */
+class MapiTimer
+{
+public:
+    MapiTimer(MapiMetrics::Operation operation) :
+        m_operation(operation)
+    {
+        m_timer.start();
+    }
+
+    ~MapiTimer()
+    {
+        int savedErrno = errno;
+        quint64 usecs = m_timer.nsecsElapsed() / 1000;
+
+        MapiMetrics::record(m_operation, usecs);
+        if (MapiTrace::enabled()) {
+            MapiTrace::complete(MapiMetrics::name(m_operation), MapiTrace::now() - usecs);
+        }
+        errno = savedErrno;
+    }
+
+private:
+    MapiMetrics::Operation m_operation;
+    QElapsedTimer m_timer;
+};
+
+/**
+ * Time a libmapi call in the middle of an expression, for example:
+ *
+ *  if (MAPI_E_SUCCESS != MAPI_TIMED(OpenFolder, OpenFolder(store, id, &folder))) {
+ *
+ * The timer is a temporary, so it lasts until the end of the full expression.
+ */
+#define MAPI_TIMED(operation, call) \
+    (MapiTimer(MapiMetrics::operation), (call))
+
+#endif
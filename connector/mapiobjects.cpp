@@ -19,7 +19,9 @@
  */
 
 #include <QAbstractSocket>
+#include <QDataStream>
 #include <QDebug>
+#include <QHash>
 #include <QStringList>
 #include <QDir>
 #include <QMessageBox>
@@ -29,6 +31,7 @@
 #include <QTextCodec>
 #include <KLocale>
 #include <kpimutils/email.h>
+#include <string.h>
 #include "mapiobjects.h"
 
 #define CASE_PREFER_A_OVER_B(a, b, lvalue, rvalue) \
@@ -42,22 +45,32 @@ case a: \
 
 #define UNDOCUMENTED_PR_EMAIL_UNICODE 0x6001001f
 
-/**
- * Set this to 1 to pull all the properties, e.g. to see what a server has
- * available.
- */
-#ifndef DEBUG_MESSAGE_PROPERTIES
-#define DEBUG_MESSAGE_PROPERTIES 0
-#endif
-
-#ifndef DEBUG_RECIPIENTS
-#define DEBUG_RECIPIENTS 0
-#endif
-
 #ifndef DEBUG_NOTIFICATIONS
 #define DEBUG_NOTIFICATIONS 0
 #endif
 
+/**
+ * Markers and meta-properties found in an ICS FastTransfer stream, as per
+ * [MS-OXCFXICS]. The meta-properties are matched on their property id only.
+ */
+#define FX_START_RECIP              0x40030003
+#define FX_END_TO_RECIP             0x40040003
+#define FX_NEW_ATTACH               0x40000003
+#define FX_END_ATTACH               0x400E0003
+#define FX_START_EMBED              0x40010003
+#define FX_END_EMBED                0x40020003
+#define FX_INCR_SYNC_CHG            0x40120003
+#define FX_INCR_SYNC_DEL            0x40130003
+#define FX_INCR_SYNC_END            0x40140003
+#define FX_INCR_SYNC_MESSAGE        0x40150003
+#define FX_INCR_SYNC_STATE_BEGIN    0x403A0003
+#define FX_INCR_SYNC_STATE_END      0x403B0003
+#define FX_META_IDSET_GIVEN         0x4017
+#define FX_META_IDSET_DELETED       0x67E5
+#define FX_META_CNSET_SEEN          0x6796
+#define FX_META_CNSET_SEEN_FAI      0x67DA
+#define FX_META_CNSET_READ          0x67D2
+
 /**
  * Try to extract an email address from a string.
  */
@@ -103,7 +116,7 @@ extern QString mapiExtractEmail(const QString &source, const QByteArray &type, b
 
 QString mapiExtractEmail(const class MapiProperty &source, const QByteArray &type, bool emptyDefault)
 {
-    return mapiExtractEmail(source.value().toString(), type, emptyDefault);
+    return mapiExtractEmail(source.asString(), type, emptyDefault);
 }
 
 static QDateTime convertSysTime(const FILETIME& filetime)
@@ -147,6 +160,294 @@ unsigned isGoodEmailAddress(QString &email)
     }
 }
 
+/**
+ * Convert a GLOBCNT from an IDSET back into a folder or message id. We ask for
+ * no foreign identifiers, so everything belongs to the mailbox whose REPLID is
+ * always 1. The GLOBCNT is big-endian, and occupies the top 6 bytes of the
+ * little-endian id.
+ */
+static mapi_id_t globcntToId(uint64_t globcnt)
+{
+    mapi_id_t id = 0x0001;
+
+    for (unsigned i = 0; i < 6; i++) {
+        id |= ((globcnt >> (8 * (5 - i))) & 0xFF) << (16 + 8 * i);
+    }
+    return id;
+}
+
+/**
+ * Drive an Incremental Change Synchronization download, and decode the
+ * resulting FastTransfer stream into:
+ *
+ *  - The properties seen for each changed object.
+ *
+ *  - The ids of deleted objects.
+ *
+ *  - The new state, serialised such that it can be saved by the caller, and
+ *    uploaded again at the start of the next download.
+ *
+ *  - Whether the previous state was applied. If not, everything was
+ *    downloaded, and there are no deletions.
+ */
+class MapiSynchronizer : protected TallocContext
+{
+public:
+    MapiSynchronizer(const MapiId &id) :
+        TallocContext("MapiSynchronizer::MapiSynchronizer"),
+        incremental(false),
+        m_id(id),
+        m_section(None),
+        m_depth(0)
+    {
+    }
+
+    bool download(mapi_object_t *folder, enum SynchronizationType type, uint16_t flags, SPropTagArray *tags, QByteArray &state);
+
+    QList<QHash<int, QVariant> > changes;
+    QList<mapi_id_t> deleted;
+    bool incremental;
+
+private:
+    const MapiId m_id;
+    enum {
+        None,
+        Change,
+        Deletions,
+        State
+    } m_section;
+    unsigned m_depth;
+    QMap<quint32, QByteArray> m_state;
+
+    bool upload(mapi_object_t *context, const QByteArray &state, bool &applied);
+    void idsetDecode(const QByteArray &idset);
+
+    static enum MAPISTATUS marker(uint32_t marker, void *priv);
+    static enum MAPISTATUS property(struct SPropValue value, void *priv);
+
+    virtual QDebug debug() const;
+    virtual QDebug error() const;
+};
+
+QDebug MapiSynchronizer::debug() const
+{
+    static QString prefix = QString::fromAscii("MapiSynchronizer: %1:");
+    return TallocContext::debug(prefix.arg(m_id.toString()));
+}
+
+QDebug MapiSynchronizer::error() const
+{
+    static QString prefix = QString::fromAscii("MapiSynchronizer: %1:");
+    return TallocContext::error(prefix.arg(m_id.toString()));
+}
+
+bool MapiSynchronizer::download(mapi_object_t *folder, enum SynchronizationType type, uint16_t flags, SPropTagArray *tags, QByteArray &state)
+{
+    mapi_object_t context;
+    DATA_BLOB restriction;
+
+    restriction.data = 0;
+    restriction.length = 0;
+    mapi_object_init(&context);
+    if (MAPI_E_SUCCESS != ICSSyncConfigure(folder, type, FastTransfer_Unicode, flags, restriction, SynchronizationExtraFlag_Eid, tags, &context)) {
+        error() << "cannot configure synchronization" << mapiError();
+        mapi_object_release(&context);
+        return false;
+    }
+    if (!upload(&context, state, incremental)) {
+        mapi_object_release(&context);
+        return false;
+    }
+
+    struct fx_parser_context *parser = fxparser_init(ctx(), this);
+    if (!parser) {
+        error() << "cannot create stream parser" << mapiError();
+        mapi_object_release(&context);
+        return false;
+    }
+    fxparser_set_marker_callback(parser, marker);
+    fxparser_set_property_callback(parser, property);
+
+    // Pull the stream one buffer at a time, and decode it as we go.
+    enum TransferStatus status;
+    do {
+        uint16_t progress;
+        uint16_t total;
+        DATA_BLOB buffer;
+
+        if (MAPI_E_SUCCESS != MAPI_TIMED(FXGetBuffer, FXGetBuffer(&context, 0, &status, &progress, &total, &buffer))) {
+            error() << "cannot get synchronization buffer" << mapiError();
+            mapi_object_release(&context);
+            return false;
+        }
+        if (MAPI_E_SUCCESS != fxparser_parse(parser, &buffer)) {
+            error() << "cannot parse synchronization buffer" << mapiError();
+            mapi_object_release(&context);
+            return false;
+        }
+    } while ((TransferStatus_Partial == status) || (TransferStatus_NoRoom == status));
+    mapi_object_release(&context);
+    if (TransferStatus_Done != status) {
+        error() << "synchronization failed, status:" << status;
+        return false;
+    }
+
+    // Return the new state.
+    state.clear();
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    stream << m_state;
+    return true;
+}
+
+void MapiSynchronizer::idsetDecode(const QByteArray &idset)
+{
+    DATA_BLOB blob;
+
+    blob.data = (uint8_t *)idset.data();
+    blob.length = idset.size();
+    for (struct idset *set = IDSET_parse(ctx(), blob, false); set; set = set->next) {
+        for (struct globset_range *range = set->ranges; range; range = range->next) {
+            for (uint64_t globcnt = range->low; globcnt <= range->high; globcnt++) {
+                deleted.append(globcntToId(globcnt));
+            }
+        }
+    }
+}
+
+enum MAPISTATUS MapiSynchronizer::marker(uint32_t marker, void *priv)
+{
+    MapiSynchronizer *synchronizer = static_cast<MapiSynchronizer *>(priv);
+
+    switch (marker) {
+    case FX_INCR_SYNC_CHG:
+        synchronizer->changes.append(QHash<int, QVariant>());
+        synchronizer->m_section = Change;
+        synchronizer->m_depth = 0;
+        break;
+    case FX_INCR_SYNC_DEL:
+        synchronizer->m_section = Deletions;
+        break;
+    case FX_INCR_SYNC_STATE_BEGIN:
+        synchronizer->m_section = State;
+        break;
+    case FX_INCR_SYNC_STATE_END:
+    case FX_INCR_SYNC_END:
+        synchronizer->m_section = None;
+        break;
+    case FX_START_RECIP:
+    case FX_NEW_ATTACH:
+    case FX_START_EMBED:
+        // Ignore the properties of anything nested inside a change.
+        synchronizer->m_depth++;
+        break;
+    case FX_END_TO_RECIP:
+    case FX_END_ATTACH:
+    case FX_END_EMBED:
+        synchronizer->m_depth--;
+        break;
+    default:
+        // FX_INCR_SYNC_MESSAGE separates the header of a message change from
+        // its body, but we treat both alike.
+        break;
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS MapiSynchronizer::property(struct SPropValue value, void *priv)
+{
+    MapiSynchronizer *synchronizer = static_cast<MapiSynchronizer *>(priv);
+    unsigned id = (value.ulPropTag >> 16) & 0xFFFF;
+    QByteArray bytes;
+
+    // Only the deletions and state are made of binary properties.
+    if ((synchronizer->m_section == Deletions) || (synchronizer->m_section == State)) {
+        if ((value.ulPropTag & 0xFFFF) != PT_BINARY) {
+            if (MapiLog::enabled(MapiLog::Objects, MapiLog::Trace)) {
+                synchronizer->debug() << "ignoring non-binary property:" << QString::number(value.ulPropTag, 16);
+            }
+            return MAPI_E_SUCCESS;
+        }
+        bytes = QByteArray((char *)value.value.bin.lpb, value.value.bin.cb);
+    }
+
+    switch (synchronizer->m_section) {
+    case Change:
+        if (!synchronizer->m_depth) {
+            synchronizer->changes.last().insert(value.ulPropTag, MapiProperty(value).value());
+        }
+        break;
+    case Deletions:
+        if (FX_META_IDSET_DELETED == id) {
+            synchronizer->idsetDecode(bytes);
+        }
+        break;
+    case State:
+        // The state is saved using the tags needed to upload it again.
+        switch (id) {
+        case FX_META_IDSET_GIVEN:
+            synchronizer->m_state.insert(PidTagIdsetGiven, bytes);
+            break;
+        case FX_META_CNSET_SEEN:
+            synchronizer->m_state.insert(PidTagCnsetSeen, bytes);
+            break;
+        case FX_META_CNSET_SEEN_FAI:
+            synchronizer->m_state.insert(PidTagCnsetSeenFAI, bytes);
+            break;
+        case FX_META_CNSET_READ:
+            synchronizer->m_state.insert(PidTagCnsetRead, bytes);
+            break;
+        default:
+            if (MapiLog::enabled(MapiLog::Objects, MapiLog::Trace)) {
+                synchronizer->debug() << "ignoring state property:" << QString::number(value.ulPropTag, 16);
+            }
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+    return MAPI_E_SUCCESS;
+}
+
+bool MapiSynchronizer::upload(mapi_object_t *context, const QByteArray &state, bool &applied)
+{
+    applied = false;
+    if (state.isEmpty()) {
+        // Nothing to upload, start from scratch.
+        return true;
+    }
+
+    QMap<quint32, QByteArray> properties;
+    QDataStream stream(state);
+    stream >> properties;
+    if (QDataStream::Ok != stream.status()) {
+        error() << "ignoring corrupt synchronization state";
+        return true;
+    }
+
+    QMap<quint32, QByteArray>::const_iterator i;
+    for (i = properties.constBegin(); i != properties.constEnd(); ++i) {
+        DATA_BLOB blob;
+
+        blob.data = (uint8_t *)i.value().data();
+        blob.length = i.value().size();
+        if (MAPI_E_SUCCESS != ICSSyncUploadStateBegin(context, (enum StateProperty)i.key(), blob.length)) {
+            error() << "cannot begin state upload" << mapiError();
+            return false;
+        }
+        if (MAPI_E_SUCCESS != ICSSyncUploadStateContinue(context, blob)) {
+            error() << "cannot continue state upload" << mapiError();
+            return false;
+        }
+        if (MAPI_E_SUCCESS != ICSSyncUploadStateEnd(context)) {
+            error() << "cannot end state upload" << mapiError();
+            return false;
+        }
+    }
+    applied = true;
+    return true;
+}
+
 MapiFolder::MapiFolder(MapiConnector2 *connection, const char *tallocName, const MapiId &id) :
     MapiObject(connection, tallocName, id)
 {
@@ -174,8 +475,10 @@ QDebug MapiFolder::error() const
 
 bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filter)
 {
+    MapiSpan span("childrenPull");
+
     // Retrieve folder's folder table
-    if (MAPI_E_SUCCESS != GetHierarchyTable(&m_object, &m_contents, 0, NULL)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetHierarchyTable, GetHierarchyTable(&m_object, &m_contents, 0, NULL))) {
         error() << "cannot get hierarchy table" << mapiError();
         return false;
     }
@@ -186,7 +489,7 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
         error() << "cannot set hierarchy table tags" << mapiError();
         return false;
     }
-    if (MAPI_E_SUCCESS != SetColumns(&m_contents, tags)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(SetColumns, SetColumns(&m_contents, tags))) {
         error() << "cannot set hierarchy table columns" << mapiError();
         MAPIFreeBuffer(tags);
         return false;
@@ -195,14 +498,14 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
 
     // Get current cursor position.
     uint32_t cursor;
-    if (MAPI_E_SUCCESS != QueryPosition(&m_contents, NULL, &cursor)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(QueryPosition, QueryPosition(&m_contents, NULL, &cursor))) {
         error() << "cannot query position" << mapiError();
         return false;
     }
 
     // Iterate through sets of rows.
     SRowSet rowset;
-    while ((QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset) == MAPI_E_SUCCESS) && rowset.cRows) {
+    while ((MAPI_TIMED(QueryRows, QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset)) == MAPI_E_SUCCESS) && rowset.cRows) {
         for (unsigned i = 0; i < rowset.cRows; i++) {
             SRow &row = rowset.aRow[i];
             mapi_id_t fid = 0;
@@ -216,13 +519,13 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
                 // with those set above.
                 switch (property.tag()) {
                 case PidTagFolderId:
-                    fid = property.value().toULongLong(); 
+                    fid = property.asInteger(); 
                     break;
                 case PidTagDisplayName:
-                    name = property.value().toString(); 
+                    name = property.asString(); 
                     break;
                 case PidTagContainerClass:
-                    folderClass = property.value().toString(); 
+                    folderClass = property.asString(); 
                     break;
                 default:
                     //debug() << "ignoring folder property:" << tagName(property.tag()) << property.value();
@@ -230,7 +533,7 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
                 }
             }
             if (!filter.isEmpty() && !folderClass.isEmpty() && !folderClass.startsWith(filter)) {
-                debug() << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
+                MAPI_DEBUG(Objects) << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
                 continue;
             }
 
@@ -244,10 +547,147 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
     return true;
 }
 
+bool MapiFolder::descendantsPull(QList<MapiFolder *> &descendants, const QString &filter)
+{
+    MapiSpan span("descendantsPull");
+
+    // Retrieve folder's folder table, including all descendants.
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetHierarchyTable, GetHierarchyTable(&m_object, &m_contents, TableFlags_Depth | TableFlags_NoNotifications, NULL))) {
+        error() << "cannot get deep hierarchy table" << mapiError();
+        return false;
+    }
+
+    // Create the MAPI table view
+    SPropTagArray* tags = set_SPropTagArray(ctx(), 0x4, PidTagFolderId, PidTagParentFolderId, PidTagDisplayName, PidTagContainerClass);
+    if (!tags) {
+        error() << "cannot set hierarchy table tags" << mapiError();
+        return false;
+    }
+    if (MAPI_E_SUCCESS != MAPI_TIMED(SetColumns, SetColumns(&m_contents, tags))) {
+        error() << "cannot set hierarchy table columns" << mapiError();
+        MAPIFreeBuffer(tags);
+        return false;
+    }
+    MAPIFreeBuffer(tags);
+
+    // Get current cursor position.
+    uint32_t cursor;
+    if (MAPI_E_SUCCESS != MAPI_TIMED(QueryPosition, QueryPosition(&m_contents, NULL, &cursor))) {
+        error() << "cannot query position" << mapiError();
+        return false;
+    }
+
+    // Iterate through sets of rows, remembering which folders match the
+    // filter. Whether a folder is wanted also depends on its ancestors, which
+    // may not have been seen yet, so we sort that out afterwards.
+    QHash<mapi_id_t, MapiFolder *> candidates;
+    SRowSet rowset;
+    while ((MAPI_TIMED(QueryRows, QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset)) == MAPI_E_SUCCESS) && rowset.cRows) {
+        for (unsigned i = 0; i < rowset.cRows; i++) {
+            SRow &row = rowset.aRow[i];
+            mapi_id_t fid = 0;
+            mapi_id_t parentFid = 0;
+            QString name;
+            QString folderClass;
+
+            for (unsigned j = 0; j < row.cValues; j++) {
+                MapiProperty property(row.lpProps[j]); 
+
+                // Note that the set of properties fetched here must be aligned
+                // with those set above.
+                switch (property.tag()) {
+                case PidTagFolderId:
+                    fid = property.asInteger(); 
+                    break;
+                case PidTagParentFolderId:
+                    parentFid = property.asInteger(); 
+                    break;
+                case PidTagDisplayName:
+                    name = property.asString(); 
+                    break;
+                case PidTagContainerClass:
+                    folderClass = property.asString(); 
+                    break;
+                default:
+                    break;
+                }
+            }
+            if (!filter.isEmpty() && !folderClass.isEmpty() && !folderClass.startsWith(filter)) {
+                MAPI_DEBUG(Objects) << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
+                continue;
+            }
+
+            MapiId folderId(m_id, parentFid, fid);
+            MapiFolder *data = new MapiFolder(m_connection, "MapiFolder::descendantsPull", folderId);
+            data->name = name;
+            candidates.insert(fid, data);
+        }
+    }
+
+    // Keep only those folders whose ancestors were all wanted too.
+    foreach (MapiFolder *data, candidates) {
+        mapi_id_t ancestor = data->id().first;
+
+        while ((ancestor != m_id.second) && candidates.contains(ancestor)) {
+            ancestor = candidates.value(ancestor)->id().first;
+        }
+        if (ancestor == m_id.second) {
+            descendants.append(data);
+        } else {
+            delete data;
+        }
+    }
+    return true;
+}
+
+bool MapiFolder::childrenPull(QByteArray &syncState, QList<MapiFolder *> &changed, QList<MapiId> &deleted, bool &incremental, const QString &filter)
+{
+    MapiSpan span("childrenPull");
+
+    // For hierarchy synchronization, the tags are those to be excluded, and
+    // we want all the properties which describe a folder.
+    SPropTagArray* tags = set_SPropTagArray(ctx(), 0x0);
+    if (!tags) {
+        error() << "cannot set synchronization tags" << mapiError();
+        return false;
+    }
+
+    MapiSynchronizer synchronizer(m_id);
+    uint16_t flags = SynchronizationFlag_Unicode | SynchronizationFlag_NoForeignIdentifiers;
+    if (!synchronizer.download(&m_object, SynchronizationType_Hierarchy, flags, tags, syncState)) {
+        MAPIFreeBuffer(tags);
+        return false;
+    }
+    MAPIFreeBuffer(tags);
+    incremental = synchronizer.incremental;
+
+    foreach (const QHash<int, QVariant> &change, synchronizer.changes) {
+        QString name = change.value(PidTagDisplayName).toString();
+        QString folderClass = change.value(PidTagContainerClass).toString();
+
+        if (!filter.isEmpty() && !folderClass.isEmpty() && !folderClass.startsWith(filter)) {
+            MAPI_DEBUG(Objects) << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
+            continue;
+        }
+
+        // Add the entry to the output list!
+        MapiId folderId(m_id, change.value(PidTagParentFolderId).toULongLong(), change.value(PidTagFolderId).toULongLong());
+        MapiFolder *data = new MapiFolder(m_connection, "MapiFolder::childrenPull", folderId);
+        data->name = name;
+        changed.append(data);
+    }
+    foreach (mapi_id_t id, synchronizer.deleted) {
+        deleted.append(MapiId(m_id, id));
+    }
+    return true;
+}
+
 bool MapiFolder::childrenPull(QList<MapiItem *> &children)
 {
+    MapiSpan span("childrenPull");
+
     // Retrieve folder's content table
-    if (MAPI_E_SUCCESS != GetContentsTable(&m_object, &m_contents, TableFlags_UseUnicode, NULL)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetContentsTable, GetContentsTable(&m_object, &m_contents, TableFlags_UseUnicode, NULL))) {
         error() << "cannot get content table" << mapiError();
         return false;
     }
@@ -258,7 +698,7 @@ bool MapiFolder::childrenPull(QList<MapiItem *> &children)
         error() << "cannot set content table tags" << mapiError();
         return false;
     }
-    if (MAPI_E_SUCCESS != SetColumns(&m_contents, tags)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(SetColumns, SetColumns(&m_contents, tags))) {
         error() << "cannot set content table columns" << mapiError();
         MAPIFreeBuffer(tags);
         return false;
@@ -267,14 +707,14 @@ bool MapiFolder::childrenPull(QList<MapiItem *> &children)
 
     // Get current cursor position.
     uint32_t cursor;
-    if (MAPI_E_SUCCESS != QueryPosition(&m_contents, NULL, &cursor)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(QueryPosition, QueryPosition(&m_contents, NULL, &cursor))) {
         error() << "cannot query position" << mapiError();
         return false;
     }
 
     // Iterate through sets of rows.
     SRowSet rowset;
-    while ((QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset) == MAPI_E_SUCCESS) && rowset.cRows) {
+    while ((MAPI_TIMED(QueryRows, QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset)) == MAPI_E_SUCCESS) && rowset.cRows) {
         for (unsigned i = 0; i < rowset.cRows; i++) {
             SRow &row = rowset.aRow[i];
             mapi_id_t id = 0;
@@ -288,13 +728,13 @@ bool MapiFolder::childrenPull(QList<MapiItem *> &children)
                 // with those set above.
                 switch (property.tag()) {
                 case PidTagMid:
-                    id = property.value().toULongLong(); 
+                    id = property.asInteger(); 
                     break;
                 case PidTagConversationTopic:
-                    name = property.value().toString(); 
+                    name = property.asString(); 
                     break;
                 case PidTagLastModificationTime:
-                    modified = property.value().toDateTime(); 
+                    modified = property.asDateTime(); 
                     break;
                 default:
                     //debug() << "ignoring item property:" << tagName(property.tag()) << property.value();
@@ -313,9 +753,46 @@ bool MapiFolder::childrenPull(QList<MapiItem *> &children)
     return true;
 }
 
+bool MapiFolder::childrenPull(QByteArray &syncState, QList<MapiItem *> &changed, QList<MapiId> &deleted, bool &incremental)
+{
+    MapiSpan span("childrenPull");
+
+    // Only ask for the properties we need to describe an item. This also
+    // keeps recipients and attachments out of the stream.
+    SPropTagArray* tags = set_SPropTagArray(ctx(), 0x3, PidTagMid, PidTagConversationTopic, PidTagLastModificationTime);
+    if (!tags) {
+        error() << "cannot set synchronization tags" << mapiError();
+        return false;
+    }
+
+    MapiSynchronizer synchronizer(m_id);
+    uint16_t flags = SynchronizationFlag_Unicode | SynchronizationFlag_Normal |
+                     SynchronizationFlag_OnlySpecifiedProperties | SynchronizationFlag_NoForeignIdentifiers;
+    if (!synchronizer.download(&m_object, SynchronizationType_Contents, flags, tags, syncState)) {
+        MAPIFreeBuffer(tags);
+        return false;
+    }
+    MAPIFreeBuffer(tags);
+    incremental = synchronizer.incremental;
+
+    foreach (const QHash<int, QVariant> &change, synchronizer.changes) {
+        QString name = change.value(PidTagConversationTopic).toString();
+        QDateTime modified = change.value(PidTagLastModificationTime).toDateTime();
+
+        // Add the entry to the output list!
+        MapiId itemId(m_id, change.value(PidTagMid).toULongLong());
+        MapiItem *data = new MapiItem(itemId, name, modified);
+        changed.append(data);
+    }
+    foreach (mapi_id_t id, synchronizer.deleted) {
+        deleted.append(MapiId(m_id, id));
+    }
+    return true;
+}
+
 bool MapiFolder::open()
 {
-    if (MAPI_E_SUCCESS != OpenFolder(m_connection->store(m_id), m_id.second, &m_object)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(OpenFolder, OpenFolder(m_connection->store(m_id), m_id.second, &m_object))) {
         error() << "cannot open folder" << m_id << mapiError();
         return false;
     }
@@ -351,11 +828,7 @@ MapiMessage::MapiMessage(MapiConnector2 *connection, const char *tallocName, con
 
 void MapiMessage::addUniqueRecipient(const char *source, MapiRecipient &candidate)
 {
-#if DEBUG_RECIPIENTS
-    debug() << "candidate address:" << source << candidate.toString();
-#else
-    Q_UNUSED(source)
-#endif
+    MAPI_TRACE(Objects) << "candidate address:" << source << candidate.toString();
     if (candidate.name.isEmpty() && candidate.email.isEmpty()) {
         // Discard garbage.
         return;
@@ -411,9 +884,7 @@ void MapiMessage::addUniqueRecipient(const char *source, MapiRecipient &candidat
     }
 
     // Add the entry if it did not match.
-#if DEBUG_RECIPIENTS
-    debug() << "add new address:" << source << candidate.toString();
-#endif
+    MAPI_TRACE(Objects) << "add new address:" << source << candidate.toString();
     m_recipients.append(candidate);
 }
 
@@ -431,39 +902,64 @@ QDebug MapiMessage::error() const
 
 bool MapiMessage::open()
 {
-    if (MAPI_E_SUCCESS != OpenMessage(m_connection->store(m_id), m_id.first, m_id.second, &m_object, 0x0)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(OpenMessage, OpenMessage(m_connection->store(m_id), m_id.first, m_id.second, &m_object, 0x0))) {
         error() << "cannot open message, error:" << mapiError();
         return false;
     }
     return true;
 }
 
+/**
+ * The properties needed to collect recipients.
+ */
+static int messageTagList[] = {
+    PidTagDisplayTo,
+    PidTagDisplayCc,
+    PidTagDisplayBcc,
+    PidTagSenderEmailAddress,
+    PidTagSenderSmtpAddress,
+    PidTagSenderName,
+    PidTagOriginalSenderEmailAddress,
+    PidTagOriginalSenderName,
+    PidTagSentRepresentingEmailAddress,
+    PidTagSentRepresentingName,
+    PidTagOriginalSentRepresentingEmailAddress,
+    PidTagOriginalSentRepresentingName,
+    0 };
+static SPropTagArray messageTags = {
+    (sizeof(messageTagList) / sizeof(messageTagList[0])) - 1,
+    (MAPITAGS *)messageTagList };
+
+static QVector<int> messageTagVectorInit()
+{
+    QVector<int> tags;
+
+    for (unsigned i = 0; i < messageTags.cValues; i++) {
+        tags.append(messageTags.aulPropTag[i]);
+    }
+    return tags;
+}
+
+/**
+ * The same, for propertiesPull(). Built during static initialisation, before
+ * any worker thread can pull properties, and never modified afterwards.
+ */
+static const QVector<int> messageTagVector = messageTagVectorInit();
+
+const int *MapiMessage::tagList()
+{
+    return messageTagList;
+}
+
 /**
  * We collect recipients as well as properties.
  */
 bool MapiMessage::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
 {
-    static unsigned ourTagList[] = {
-        PidTagDisplayTo,
-        PidTagDisplayCc,
-        PidTagDisplayBcc,
-        PidTagSenderEmailAddress,
-        PidTagSenderSmtpAddress,
-        PidTagSenderName,
-        PidTagOriginalSenderEmailAddress,
-        PidTagOriginalSenderName,
-        PidTagSentRepresentingEmailAddress,
-        PidTagSentRepresentingName,
-        PidTagOriginalSentRepresentingEmailAddress,
-        PidTagOriginalSentRepresentingName,
-        0 };
-    static SPropTagArray ourTags = {
-        (sizeof(ourTagList) / sizeof(ourTagList[0])) - 1,
-        (MAPITAGS *)ourTagList };
 
     if (!tagsAppended) {
-        for (unsigned i = 0; i < ourTags.cValues; i++) {
-            int newTag = ourTags.aulPropTag[i];
+        for (unsigned i = 0; i < messageTags.cValues; i++) {
+            int newTag = messageTags.aulPropTag[i];
             
             if (!tags.contains(newTag)) {
                 tags.append(newTag);
@@ -481,15 +977,9 @@ bool MapiMessage::propertiesPull(QVector<int> &tags, const bool tagsAppended, bo
 
 bool MapiMessage::propertiesPull()
 {
-    static bool tagsAppended = false;
-    static QVector<int> tags;
+    QVector<int> tags(messageTagVector);
 
-    if (!propertiesPull(tags, tagsAppended, (DEBUG_MESSAGE_PROPERTIES) != 0)) {
-        tagsAppended = true;
-        return false;
-    }
-    tagsAppended = true;
-    return true;
+    return propertiesPull(tags, true, MapiLog::enabled(MapiLog::Objects, MapiLog::Trace));
 }
 
 void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiRecipient &result)
@@ -504,7 +994,7 @@ void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiReci
         case PidTagDisplayName_string8:
         case PidTagDisplayName:
         case PidTagRecipientDisplayName:
-            result.name = property.value().toString();
+            result.name = property.asString();
             tmp = mapiExtractEmail(property, "SMTP", true);
             if (isGoodEmailAddress(result.email) < isGoodEmailAddress(tmp)) {
                 result.email = tmp;
@@ -514,30 +1004,30 @@ void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiReci
             result.email = mapiExtractEmail(property, "SMTP");
             break;
         case UNDOCUMENTED_PR_EMAIL_UNICODE:
-            debug() << "UNDOCUMENTED_PR_EMAIL_UNICODE" << property.value().toString();
+            MAPI_TRACE(Objects) << "UNDOCUMENTED_PR_EMAIL_UNICODE" << property.asString();
             tmp = mapiExtractEmail(property, "SMTP");
             if (isGoodEmailAddress(result.email) < isGoodEmailAddress(tmp)) {
                 result.email = tmp;
             }
             break;
         case PidTagRecipientTrackStatus:
-            result.trackStatus = property.value().toInt();
+            result.trackStatus = property.asInteger();
             break;
         case PidTagRecipientFlags:
-            result.flags = property.value().toInt();
+            result.flags = property.asInteger();
             break;
         case PidTagRecipientType:
             // Mask off bits we don't want.
-            result.setType((MapiRecipient::Type)(property.value().toUInt() & 0x3));
+            result.setType((MapiRecipient::Type)(property.asInteger() & 0x3));
             break;
         case PidTagRecipientOrder:
-            result.order = property.value().toInt();
+            result.order = property.asInteger();
             break;
         case PidTagDisplayType:
-            result.setDisplayType((MapiRecipient::DisplayType)property.value().toUInt());
+            result.setDisplayType((MapiRecipient::DisplayType)property.asInteger());
             break;
         case PidTagObjectType:
-            result.setObjectType((MapiRecipient::ObjectType)property.value().toUInt());
+            result.setObjectType((MapiRecipient::ObjectType)property.asInteger());
             break;
         default:
             // Handle oversize objects.
@@ -551,11 +1041,7 @@ void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiReci
                 // Carry on with next property...
                 break;
             }
-#if (DEBUG_MESSAGE_PROPERTIES)
-            debug() << "ignoring " << phase << " property:" << tagName(property.tag()) << property.value();
-#else
-            Q_UNUSED(phase);
-#endif
+            MAPI_TRACE(Objects) << "ignoring " << phase << " property:" << tagName(property.tag()) << property.value();
             break;
         }
     }
@@ -601,7 +1087,7 @@ bool MapiMessage::recipientsPull()
         error() << "cannot read recipient table" << mapiError();
         return false;
     }
-    debug() << "number of recipients:" << recCount;
+    MAPI_DEBUG(Objects) << "number of recipients:" << recCount;
     for (int i = 0; i < recCount; i++) {
         struct RecipientRow &recipient = &recipientTable[i].RecipientRow;
         Recipient result;
@@ -645,7 +1131,7 @@ bool MapiMessage::recipientsPull()
 
     // Step 1. Add all the recipients from the actual table.
     SRowSet rowset;
-    if (MAPI_E_SUCCESS != GetRecipientTable(&m_object, &rowset, &tableTags)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetRecipientTable, GetRecipientTable(&m_object, &rowset, &tableTags))) {
         error() << "cannot get recipient table:" << mapiError();
         return false;
     }
@@ -677,7 +1163,7 @@ bool MapiMessage::recipientsPull()
 
         switch (property.tag()) {
         case PidTagDisplayTo:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
+            foreach (QString name, property.asString().split(QChar::fromAscii(';'))) {
                 MapiRecipient result(MapiRecipient::To);
 
                 result.name = name.trimmed();
@@ -686,7 +1172,7 @@ bool MapiMessage::recipientsPull()
             }
             break;
         case PidTagDisplayCc:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
+            foreach (QString name, property.asString().split(QChar::fromAscii(';'))) {
                 MapiRecipient result(MapiRecipient::CC);
 
                 result.name = name.trimmed();
@@ -695,7 +1181,7 @@ bool MapiMessage::recipientsPull()
             }
             break;
         case PidTagDisplayBcc:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
+            foreach (QString name, property.asString().split(QChar::fromAscii(';'))) {
                 MapiRecipient result(MapiRecipient::BCC);
 
                 result.name = name.trimmed();
@@ -710,25 +1196,25 @@ bool MapiMessage::recipientsPull()
             sender.email = mapiExtractEmail(property, "SMTP");
             break;
         case PidTagSenderName:
-            sender.name = property.value().toString();
+            sender.name = property.asString();
             break;
         case PidTagOriginalSenderEmailAddress:
             originalSender.email = mapiExtractEmail(property, "SMTP");
             break;
         case PidTagOriginalSenderName:
-            originalSender.name = property.value().toString();
+            originalSender.name = property.asString();
             break;
         case PidTagSentRepresentingEmailAddress:
             sentRepresenting.email = mapiExtractEmail(property, "SMTP");
             break;
         case PidTagSentRepresentingName:
-            sentRepresenting.name = property.value().toString();
+            sentRepresenting.name = property.asString();
             break;
         case PidTagOriginalSentRepresentingEmailAddress:
             originalSentRepresenting.email = mapiExtractEmail(property, "SMTP");
             break;
         case PidTagOriginalSentRepresentingName:
-            originalSentRepresenting.name = property.value().toString();
+            originalSentRepresenting.name = property.asString();
             break;
         }
     }
@@ -769,24 +1255,58 @@ bool MapiMessage::recipientsPull()
             needingResolution << i;
         }
     }
-#if DEBUG_RECIPIENTS
-    debug() << "recipients needing primary resolution:" << needingResolution.size() << "from a total:" << m_recipients.size();
-#endif
+    MAPI_DEBUG(Objects) << "recipients needing primary resolution:" << needingResolution.size() << "from a total:" << m_recipients.size();
 
     // Short-circuit exit.
     if (!needingResolution.size()) {
         return true;
     }
 
-    // Primary resolution is to ask Exchange to resolve the names.
+    // Primary resolution is to ask Exchange to resolve the names. Messages
+    // in the same folder tend to share correspondents, so first use what
+    // was learnt from earlier messages, and only ask about the rest.
+    QList<int> unknown;
+    for (int i = 0; i < needingResolution.size(); i++) {
+        MapiRecipient &to = m_recipients[needingResolution.at(i)];
+        QString name;
+        QString email;
+
+        if (!m_connection->resolvedName(to.name, name, email)) {
+            unknown << needingResolution.at(i);
+            continue;
+        }
+        if (email.isEmpty()) {
+            // We already know Exchange cannot resolve this one.
+            continue;
+        }
+        if (!name.isEmpty()) {
+            to.name = name;
+        }
+        if (isGoodEmailAddress(to.email) < isGoodEmailAddress(email)) {
+            to.email = email;
+        }
+        needingResolution.removeAt(i);
+        i--;
+    }
+    MAPI_DEBUG(Objects) << "recipients needing a server round trip:" << unknown.size();
+    if (unknown.size()) {
+        if (!recipientsResolve(unknown, needingResolution)) {
+            return false;
+        }
+    }
+    return recipientsDeduplicate(needingResolution);
+}
+
+bool MapiMessage::recipientsResolve(const QList<int> &unknown, QList<int> &needingResolution)
+{
     struct PropertyTagArray_r *statuses = NULL;
     SRowSet *results = NULL;
 
     // Fill an array with the names we need to resolve. We will do a Unicode
     // lookup, so use UTF8.
-    const char *names[needingResolution.size() + 1];
+    const char *names[unknown.size() + 1];
     unsigned j = 0;
-    foreach (int i, needingResolution) {
+    foreach (int i, unknown) {
         MapiRecipient &recipient = m_recipients[i];
 
         names[j] = string(recipient.name);
@@ -815,18 +1335,20 @@ bool MapiMessage::recipientsPull()
     if (!m_connection->resolveNames(names, &recipientTags, &results, &statuses)) {
         return false;
     }
-    if (results) {
+    if (statuses) {
         // Walk the returned results. Every request has a status, but
         // only resolved items also have a row of results.
         //
         // As we do the walk, we trim the needingResolution array so
         // that when we are done with this loop, it only contains
-        // entries which need more work.
-        for (unsigned i = 0, unresolveds = 0; i < statuses->cValues; i++) {
-            MapiRecipient &to = m_recipients[needingResolution.at(unresolveds)];
-
-            if (MAPI_RESOLVED == statuses->aulPropTag[i]) {
-                struct SRow &recipient = results->aRow[i - unresolveds];
+        // entries which need more work. Either way, remember the outcome
+        // for subsequent messages.
+        for (unsigned i = 0, resolveds = 0; i < statuses->cValues; i++) {
+            MapiRecipient &to = m_recipients[unknown.at(i)];
+            QString name = to.name;
+
+            if (results && (MAPI_RESOLVED == statuses->aulPropTag[i])) {
+                struct SRow &recipient = results->aRow[resolveds++];
                 MapiRecipient result(MapiRecipient::To);
 
                 recipientPopulate("resolution", recipient, result);
@@ -837,17 +1359,21 @@ bool MapiMessage::recipientsPull()
                 if (isGoodEmailAddress(to.email) < isGoodEmailAddress(result.email)) {
                     to.email = result.email;
                 }
-                needingResolution.removeAt(unresolveds);
+                needingResolution.removeOne(unknown.at(i));
+                m_connection->resolvedNameAdd(name, result.name, result.email);
             } else {
-                unresolveds++;
+                m_connection->resolvedNameAdd(name, QString(), QString());
             }
         }
     }
     MAPIFreeBuffer(results);
     MAPIFreeBuffer(statuses);
-#if DEBUG_RECIPIENTS
-    debug() << "recipients needing secondary resolution:" << needingResolution.size();
-#endif
+    return true;
+}
+
+bool MapiMessage::recipientsDeduplicate(QList<int> &needingResolution)
+{
+    MAPI_DEBUG(Objects) << "recipients needing secondary resolution:" << needingResolution.size();
 
     // Secondary resolution is to remove entries which have the the same 
     // email. But we must take care since we'll still have unresolved 
@@ -885,9 +1411,7 @@ bool MapiMessage::recipientsPull()
             }
         }
     }
-#if DEBUG_RECIPIENTS
-    debug() << "recipients needing tertiary resolution:" << needingResolution.size();
-#endif
+    MAPI_DEBUG(Objects) << "recipients needing tertiary resolution:" << needingResolution.size();
 
     // Tertiary resolution.
     //
@@ -913,13 +1437,9 @@ bool MapiMessage::recipientsPull()
     m_recipients.clear();
     foreach (MapiRecipient recipient, uniqueResolvedRecipients) {
         m_recipients.append(recipient);
-#if DEBUG_RECIPIENTS
-        debug() << "recipient name:" << recipient.toString();
-#endif
+        MAPI_TRACE(Objects) << "recipient name:" << recipient.toString();
     }
-#if DEBUG_RECIPIENTS
-    debug() << "recipients after resolution:" << m_recipients.size();
-#endif
+    MAPI_DEBUG(Objects) << "recipients after resolution:" << m_recipients.size();
     return true;
 }
 
@@ -930,13 +1450,14 @@ const QList<MapiRecipient> &MapiMessage::recipients()
 
 bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
 {
+    MapiSpan span("streamRead");
     mapi_object_t stream;
     unsigned dataSize;
     unsigned offset;
     uint16_t readSize;
 
     mapi_object_init(&stream);
-    if (MAPI_E_SUCCESS != OpenStream(parent, (MAPITAGS)tag, OpenStream_ReadOnly, &stream)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(OpenStream, OpenStream(parent, (MAPITAGS)tag, OpenStream_ReadOnly, &stream))) {
         error() << "cannot open stream:" << tagName(tag) << mapiError();
         mapi_object_release(&stream);
         return false;
@@ -949,7 +1470,7 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
     bytes.reserve(dataSize);
     offset = 0;
     do {
-        if (MAPI_E_SUCCESS != ReadStream(&stream, (uchar *)bytes.data() + offset, 0x1000, &readSize)) {
+        if (MAPI_E_SUCCESS != MAPI_TIMED(ReadStream, ReadStream(&stream, (uchar *)bytes.data() + offset, 0x1000, &readSize))) {
             error() << "cannot read stream:" << tagName(tag) << mapiError();
             mapi_object_release(&stream);
             return false;
@@ -958,6 +1479,7 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
     } while (readSize && (offset < dataSize));
     bytes.resize(dataSize);
     mapi_object_release(&stream);
+    MapiMetrics::streamRead(dataSize);
     return true;
 }
 
@@ -966,7 +1488,7 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
  */
 const unsigned MapiMessage::CODEPAGE_UTF16 = 1200;
 
-bool MapiMessage::streamRead(mapi_object_t *parent, int tag, unsigned codepage, QString &string)
+QTextCodec *MapiMessage::codepageCodec(unsigned codepage)
 {
     // Map QTextCodec names to Microsoft Code Pages
     typedef struct
@@ -1039,20 +1561,29 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, unsigned codepage,
         //{,		"WINSAMI2" },
         { 0, 0 }
     };
-    QByteArray bytes;
     codepage2codec *entry = &map[0];
 
     while (entry->codepage && entry->codepage != codepage) {
         entry++;
     }
     if (!entry->codec) {
+        return 0;
+    }
+    return QTextCodec::codecForName(entry->codec);
+}
+
+bool MapiMessage::streamRead(mapi_object_t *parent, int tag, unsigned codepage, QString &string)
+{
+    QTextCodec *codec = codepageCodec(codepage);
+    QByteArray bytes;
+
+    if (!codec) {
         error() << "codec name not found for codepage:" << codepage;
         return false;
     }
     if (!streamRead(parent, tag, bytes)) {
         return false;
     }
-    QTextCodec *codec = QTextCodec::codecForName(entry->codec);
     string = codec->toUnicode(bytes);
     return true;
 }
@@ -1063,8 +1594,8 @@ MapiObject::MapiObject(MapiConnector2 *connection, const char *tallocName, const
     m_id(id),
     m_properties(0),
     m_propertyCount(0),
-    m_cachedNames(0),
-    m_cachedNamedTags(0),
+    m_index(0),
+    m_indexMask(0),
     m_listenerId(0)
 {
     mapi_object_init(&m_object);
@@ -1077,6 +1608,12 @@ MapiObject::~MapiObject()
     mapi_object_release(&m_object);
 }
 
+void MapiObject::close()
+{
+    mapi_object_release(&m_object);
+    mapi_object_init(&m_object);
+}
+
 mapi_object_t *MapiObject::d() const
 {
     return &m_object;
@@ -1095,13 +1632,82 @@ bool MapiObject::propertiesPush()
     }
     m_properties = 0;
     m_propertyCount = 0;
+    m_indexMask = 0;
     return true;
 }
 
-bool MapiObject::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
+bool MapiObject::namedPropertiesMap(SPropTagArray &mapped)
 {
-    bool usingNamedProperties = false;
+    MapiNamedProperties local;
+    MapiNamedProperties *ids = m_connection ? m_connection->namedProperties(m_id) : 0;
+    QVector<int> missing;
+
+    if (!ids) {
+        ids = &local;
+    }
+    if (ids->map(m_cachedTags, mapped, missing)) {
+        return true;
+    }
+
+    // Ask the server about the names we have not seen before. Any which
+    // libmapi does not know the name of are left as they are.
+    SPropTagArray unknown;
+    unknown.cValues = missing.size();
+    unknown.aulPropTag = (MAPITAGS *)array<int>(missing.size() + 1);
+    if (!unknown.aulPropTag) {
+        error() << "cannot allocate named tags:" << missing.size() << mapiError();
+        return false;
+    }
+    QHash<int, int> found;
+    for (int i = 0; i < missing.size(); i++) {
+        unknown.aulPropTag[i] = (MAPITAGS)missing[i];
+        found.insert(missing[i], missing[i]);
+    }
+    unknown.aulPropTag[missing.size()] = (MAPITAGS)0;
+
+    mapi_nameid *names = mapi_nameid_new(ctx());
+    if (!names) {
+        error() << "Cannot create named property context" << mapiError();
+        return false;
+    }
+    MAPISTATUS status = mapi_nameid_lookup_SPropTagArray(names, &unknown);
+    if ((MAPI_E_NOT_FOUND != status) && (MAPI_E_SUCCESS != status)) {
+        error() << "Cannot find named properties" << mapiError();
+        talloc_free(names);
+        return false;
+    }
+    if (names->count) {
+        SPropTagArray *namedTags;
 
+        if (MAPI_E_SUCCESS != MAPI_TIMED(GetIDsFromNames, GetIDsFromNames(&m_object, names->count, names->nameid, 0, &namedTags))) {
+            error() << "Cannot find named property ids" << mapiError();
+            talloc_free(names);
+            return false;
+        }
+        for (unsigned i = 0; (i < names->count) && (i < namedTags->cValues); i++) {
+            unsigned namedTag = namedTags->aulPropTag[i];
+
+            // Without MAPI_CREATE, a name the mailbox has not used yet has
+            // no id. Leave it unmapped, so that it is asked about again.
+            if (!(namedTag >> 16) || ((namedTag & 0xFFFF) == PT_ERROR)) {
+                found.remove(names->entries[i].proptag);
+                continue;
+            }
+            found.insert(names->entries[i].proptag, (namedTag & 0xFFFF0000) | names->entries[i].propType);
+        }
+        MAPIFreeBuffer(namedTags);
+    }
+    talloc_free(names);
+    MAPI_DEBUG(Objects) << "found" << found.size() << "named property ids";
+    ids->insert(found);
+
+    missing.clear();
+    ids->map(m_cachedTags, mapped, missing);
+    return true;
+}
+
+bool MapiObject::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
+{
     // If the user tells us the tags he has given us have not previously been
     // seen, or the cache is empty, fill it.
     if (!tagsAppended || !m_cachedTags.aulPropTag) {
@@ -1117,77 +1723,50 @@ bool MapiObject::propertiesPull(QVector<int> &tags, const bool tagsAppended, boo
         unsigned i = 0;
         foreach (int tag, tags) {
             m_cachedTags.aulPropTag[i++] = (MAPITAGS)tag;
-            usingNamedProperties |= ((tag & 0x80000000) != 0);
         }
         m_cachedTags.aulPropTag[i] = (MAPITAGS)0;
-
-        // Now create the named property translation, if needed.
-        if (usingNamedProperties) {
-            m_cachedNames = mapi_nameid_new(ctx());
-            if (!m_cachedNames) {
-                error() << "Cannot create named property context" << mapiError();
-                return false;
-            }
-            m_cachedNamedTags = talloc_zero(ctx(), struct SPropTagArray);
-            if (!m_cachedNamedTags) {
-                error() << "Cannot create named property array" << mapiError();
-                return false;
-            }
-            MAPISTATUS status = mapi_nameid_lookup_SPropTagArray(m_cachedNames, &m_cachedTags);
-            if ((MAPI_E_NOT_FOUND != status) && (MAPI_E_SUCCESS != status)) {
-                error() << "Cannot find named properties" << mapiError();
-                return false;
-            }
-            if (MAPI_E_SUCCESS != mapi_nameid_GetIDsFromNames(m_cachedNames, &m_object, m_cachedNamedTags)) {
-                error() << "Cannot find named property ids" << mapiError();
-                return false;
-            }
-        } else {
-            m_cachedNames = 0;
-        }
     }
 
     m_properties = 0;
     m_propertyCount = 0;
+    m_indexMask = 0;
     if (pullAll) {
         return MapiObject::propertiesPull();
     }
 
+    bool usingNamedProperties = false;
+    for (unsigned i = 0; i < m_cachedTags.cValues; i++) {
+        usingNamedProperties |= ((m_cachedTags.aulPropTag[i] & 0x80000000) != 0);
+    }
+
     // Map the tags before the call, and unmap them afterwards.
+    SPropTagArray *requested = &m_cachedTags;
+    SPropTagArray mapped;
     if (usingNamedProperties) {
-        if (MAPI_E_SUCCESS != mapi_nameid_map_SPropTagArray(m_cachedNames, &m_cachedTags, m_cachedNamedTags)) {
-            error() << "Cannot map named properties" << mapiError();
+        mapped.cValues = m_cachedTags.cValues;
+        mapped.aulPropTag = (MAPITAGS *)array<int>(m_cachedTags.cValues + 1);
+        if (!mapped.aulPropTag) {
+            error() << "cannot allocate tags:" << m_cachedTags.cValues << mapiError();
+            return false;
+        }
+        mapped.aulPropTag[m_cachedTags.cValues] = (MAPITAGS)0;
+        if (!namedPropertiesMap(mapped)) {
             return false;
         }
+        requested = &mapped;
     }
-    if (MAPI_E_SUCCESS != GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, &m_cachedTags, &m_properties, &m_propertyCount)) {
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetProps, GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, requested, &m_properties, &m_propertyCount))) {
         error() << "cannot pull properties:" << mapiError();
-        if (usingNamedProperties) {
-            if (MAPI_E_SUCCESS != mapi_nameid_unmap_SPropTagArray(m_cachedNames, &m_cachedTags)) {
-                error() << "Cannot unmap named properties" << mapiError();
-                return false;
-            }
-        }
         return false;
     }
     if (usingNamedProperties) {
-        if (MAPI_E_SUCCESS != mapi_nameid_unmap_SPropTagArray(m_cachedNames, &m_cachedTags)) {
-            error() << "Cannot unmap named properties" << mapiError();
-            return false;
-        }
-
-        // When we unmap the property tags in the value array, preserve the type
-        // portion since that's how we get to know about errors.
-        QVector<int> types(m_propertyCount);
-        for (unsigned i = 0; i < m_propertyCount; i++) {
-            types[i] = m_properties[i].ulPropTag & 0xFFFF;
-        }
-        if (MAPI_E_SUCCESS != mapi_nameid_unmap_SPropValue(m_cachedNames, m_properties, m_propertyCount)) {
-            error() << "Cannot unmap named values" << mapiError();
-            return false;
-        }
-        for (unsigned i = 0; i < m_propertyCount; i++) {
-            m_properties[i].ulPropTag = (MAPITAGS)(m_properties[i].ulPropTag & (0xFFFF0000 | types[i]));
+        // The values come back in the order the tags were given. When we
+        // unmap the tags, preserve the type portion since that's how we get
+        // to know about errors.
+        for (unsigned i = 0; (i < m_propertyCount) && (i < m_cachedTags.cValues); i++) {
+            if (m_cachedTags.aulPropTag[i] & 0x80000000) {
+                m_properties[i].ulPropTag = (MAPITAGS)((m_cachedTags.aulPropTag[i] & 0xFFFF0000) | (m_properties[i].ulPropTag & 0xFFFF));
+            }
         }
     }
     return true;
@@ -1199,7 +1778,8 @@ bool MapiObject::propertiesPull()
 
     m_properties = 0;
     m_propertyCount = 0;
-    if (MAPI_E_SUCCESS != GetPropsAll(&m_object, MAPI_UNICODE, &mapiProperties)) {
+    m_indexMask = 0;
+    if (MAPI_E_SUCCESS != MAPI_TIMED(GetPropsAll, GetPropsAll(&m_object, MAPI_UNICODE, &mapiProperties))) {
         error() << "cannot pull all properties:" << mapiError();
         return false;
     }
@@ -1230,16 +1810,73 @@ QVariant MapiObject::propertyAt(unsigned i) const
     return MapiProperty(m_properties[i]).value();
 }
 
+MapiProperty MapiObject::propertyRef(unsigned i) const
+{
+    return MapiProperty(m_properties[i]);
+}
+
 unsigned MapiObject::propertyCount() const
 {
     return m_propertyCount;
 }
 
-unsigned MapiObject::propertyFind(int tag) const
+/**
+ * Objects with fewer properties than this are just scanned.
+ */
+#define PROPERTY_INDEX_MINIMUM 8
+
+static inline unsigned propertyHash(int tag, unsigned mask)
+{
+    uint32_t hash = (uint32_t)tag * 0x9E3779B1U;
+
+    return (hash ^ (hash >> 16)) & mask;
+}
+
+bool MapiObject::propertiesIndex() const
 {
+    unsigned size = 16;
+
+    // Keep the table no more than half full.
+    while (size < m_propertyCount * 2) {
+        size *= 2;
+    }
+    m_index = talloc_realloc(m_ctx, m_index, uint32_t, size);
+    if (!m_index) {
+        m_indexMask = 0;
+        return false;
+    }
+    memset(m_index, 0, size * sizeof(m_index[0]));
+    m_indexMask = size - 1;
     for (unsigned i = 0; i < m_propertyCount; i++) {
-        if (m_properties[i].ulPropTag == tag) {
-            return i;
+        unsigned slot = propertyHash(m_properties[i].ulPropTag, m_indexMask);
+
+        while (m_index[slot]) {
+            // Where a tag is repeated, the first one wins.
+            if (m_properties[m_index[slot] - 1].ulPropTag == m_properties[i].ulPropTag) {
+                break;
+            }
+            slot = (slot + 1) & m_indexMask;
+        }
+        if (!m_index[slot]) {
+            m_index[slot] = i + 1;
+        }
+    }
+    return true;
+}
+
+unsigned MapiObject::propertyFind(int tag) const
+{
+    if ((m_propertyCount < PROPERTY_INDEX_MINIMUM) || (!m_indexMask && !propertiesIndex())) {
+        for (unsigned i = 0; i < m_propertyCount; i++) {
+            if (m_properties[i].ulPropTag == tag) {
+                return i;
+            }
+        }
+        return UINT_MAX;
+    }
+    for (unsigned slot = propertyHash(tag, m_indexMask); m_index[slot]; slot = (slot + 1) & m_indexMask) {
+        if (m_properties[m_index[slot] - 1].ulPropTag == tag) {
+            return m_index[slot] - 1;
         }
     }
     return UINT_MAX;
@@ -1258,23 +1895,41 @@ bool MapiObject::propertyWrite(int tag, void *data, bool idempotent)
     // If the assignment is idempotent, if an instance of the 
     // property exists, it will be overwritten.
     if (idempotent) {
-        for (unsigned i = 0; i < m_propertyCount; i++) {
-            if (m_properties[i].ulPropTag == tag) {
-                bool ok = set_SPropValue_proptag(&m_properties[i], (MAPITAGS)tag, data);
-                if (!ok) {
-                    error() << "cannot overwrite tag:" << tagName(tag) << "value:" << data;
-                }
-                return ok;
+        unsigned i = propertyFind(tag);
+
+        if (i != UINT_MAX) {
+            bool ok = set_SPropValue_proptag(&m_properties[i], (MAPITAGS)tag, data);
+            if (!ok) {
+                error() << "cannot overwrite tag:" << tagName(tag) << "value:" << data;
             }
+            return ok;
         }
     }
 
     // Add a new entry to the array.
     m_properties = add_SPropValue(ctx(), m_properties, &m_propertyCount, (MAPITAGS)tag, data);
     if (!m_properties) {
+        m_propertyCount = 0;
+        m_indexMask = 0;
         error() << "cannot write tag:" << tagName(tag) << "value:" << data;
         return false;
     }
+
+    // Keep the index up to date, or rebuild it when it gets too full.
+    if (m_indexMask) {
+        if (m_propertyCount * 2 > m_indexMask + 1) {
+            m_indexMask = 0;
+        } else {
+            unsigned slot = propertyHash(tag, m_indexMask);
+
+            while (m_index[slot] && (m_properties[m_index[slot] - 1].ulPropTag != tag)) {
+                slot = (slot + 1) & m_indexMask;
+            }
+            if (!m_index[slot]) {
+                m_index[slot] = m_propertyCount;
+            }
+        }
+    }
     return true;
 }
 
@@ -1347,37 +2002,41 @@ QString MapiObject::tagName(int tag) const
 
     if (str) {
         return QString::fromLatin1(str);
-    } else {
-        struct MAPINAMEID *names;
+    }
+
+    // Try the names we already know, or a lookup, which is remembered for
+    // next time whether or not it succeeds.
+    MapiNamedProperties local;
+    MapiNamedProperties *names = m_connection ? m_connection->namedProperties(m_id) : 0;
+    QString result;
+
+    if (!names) {
+        names = &local;
+    }
+    if (!names->name(tag, result)) {
+        struct MAPINAMEID *found;
         uint16_t count;
         int safeTag = (tag & 0xFFFF0000) | PT_NULL;
 
-        /*
-            * Try a lookup.
-            */
-        if (MAPI_E_SUCCESS != GetNamesFromIDs(&m_object, (MAPITAGS)safeTag, &count, &names)) {
-            return QString::fromLatin1("Pid0x%1").arg(tag, 0, 16);
-        } else {
-            QByteArray strs;
+        if (MAPI_E_SUCCESS == MAPI_TIMED(GetNamesFromIDs, GetNamesFromIDs(&m_object, (MAPITAGS)safeTag, &count, &found))) {
+            // Oh dear, a lookup can return multiple names...
+            QStringList strs;
 
-            /*
-                * Oh dear, a lookup can return multiple 
-                * names...
-                */
             for (unsigned i = 0; i < count; i++) {
-                if (i) {
-                    strs.append(',');
-                }
-                if (MNID_STRING == names[i].ulKind) {
-                    strs.append(&names[i].kind.lpwstr.Name[0], names[i].kind.lpwstr.NameSize);
-                } else {
-                    strs.append(QString::fromLatin1("Id0x%1:%2").arg((unsigned)tag, 0, 16).
-                            arg((unsigned)names[i].kind.lid, 0, 16).toLatin1());
-                }
+                strs << MapiNamedProperties::format(safeTag, found[i]);
             }
-            return QString::fromLatin1(strs);
+            result = strs.join(QString::fromAscii(","));
+            MAPIFreeBuffer(found);
         }
+
+        QHash<int, QString> entry;
+        entry.insert((unsigned)tag >> 16, result);
+        names->insertNames(entry);
+    }
+    if (result.isEmpty()) {
+        return QString::fromLatin1("Pid0x%1").arg(tag, 0, 16);
     }
+    return result;
 }
 
 MapiProperty::MapiProperty(SPropValue &property) :
@@ -1431,10 +2090,81 @@ QString MapiProperty::toString() const
     }
 }
 
+QString MapiProperty::asString() const
+{
+    switch (m_property.ulPropTag & 0xFFFF) {
+    case PT_UNICODE:
+        return QString::fromUtf8(m_property.value.lpszW);
+    case PT_STRING8:
+        return QString::fromLocal8Bit(m_property.value.lpszA);
+    default:
+        return value().toString();
+    }
+}
+
+qint64 MapiProperty::asInteger() const
+{
+    switch (m_property.ulPropTag & 0xFFFF) {
+    case PT_SHORT:
+        return m_property.value.i;
+    case PT_LONG:
+        return m_property.value.l;
+    case PT_BOOLEAN:
+        return m_property.value.b;
+    case PT_I8:
+        return m_property.value.d;
+    case PT_ERROR:
+        return (unsigned)m_property.value.err;
+    default:
+        return value().toLongLong();
+    }
+}
+
+bool MapiProperty::asBool() const
+{
+    return asInteger() != 0;
+}
+
+QDateTime MapiProperty::asDateTime() const
+{
+    if ((m_property.ulPropTag & 0xFFFF) == PT_SYSTIME) {
+        return convertSysTime(m_property.value.ft);
+    }
+    return value().toDateTime();
+}
+
+const char *MapiProperty::asUtf8() const
+{
+    if ((m_property.ulPropTag & 0xFFFF) != PT_UNICODE) {
+        return 0;
+    }
+    return m_property.value.lpszW;
+}
+
+const FILETIME *MapiProperty::asFileTime() const
+{
+    if ((m_property.ulPropTag & 0xFFFF) != PT_SYSTIME) {
+        return 0;
+    }
+    return &m_property.value.ft;
+}
+
+const uint8_t *MapiProperty::asBinary(unsigned &size) const
+{
+    switch (m_property.ulPropTag & 0xFFFF) {
+    case PT_BINARY:
+    case PT_SVREID:
+        size = m_property.value.bin.cb;
+        return m_property.value.bin.lpb;
+    default:
+        size = 0;
+        return 0;
+    }
+}
+
 /**
  * Get the value of the property in a nice typesafe wrapper.
  */
-inline
 QVariant MapiProperty::value() const
 {
     switch (m_property.ulPropTag & 0xFFFF) {
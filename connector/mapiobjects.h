@@ -30,6 +30,8 @@
 
 #include "mapiconnector2.h"
 
+class QTextCodec;
+
 extern "C" {
 // libmapi is a C library and must therefore be included that way
 // otherwise we'll get linker errors due to C++ name mangling
@@ -66,6 +68,25 @@ public:
      */
     QVariant value() const;
 
+    /**
+     * Typed accessors, for decoders which know what they want. These avoid
+     * the round trip through a QVariant, falling back to it only when the
+     * property is not of the expected type.
+     */
+    QString asString() const;
+    qint64 asInteger() const;
+    bool asBool() const;
+    QDateTime asDateTime() const;
+
+    /**
+     * Views onto the property's own data, which are only valid as long as
+     * the property itself. Each returns 0 if the property is not of the
+     * expected type.
+     */
+    const char *asUtf8() const;
+    const FILETIME *asFileTime() const;
+    const uint8_t *asBinary(unsigned &size) const;
+
     /**
      * Get the string equivalent of a property, e.g. for display purposes.
      * We take care to hex-ify GUIDs and other byte arrays, and lists of
@@ -226,6 +247,13 @@ public:
 
     virtual bool open() = 0;
 
+    /**
+     * Release the server side of the object, keeping whatever has been
+     * pulled. Once closed, the object no longer touches its session, and
+     * so may be handed to, and deleted on, another thread.
+     */
+    virtual void close();
+
     /**
      * Add a property with the given int.
      */
@@ -252,7 +280,9 @@ public:
     unsigned propertyCount() const;
 
     /**
-     * Find a property by tag.
+     * Find a property by tag. Apart from small objects, this uses an index
+     * which is built on first use after a pull, and kept up to date as
+     * properties are written.
      * 
      * @return The index, or UINT_MAX if not found.
      */
@@ -268,6 +298,12 @@ public:
      */
     QVariant propertyAt(unsigned i) const;
 
+    /**
+     * Fetch a property by index, for use with its typed accessors. The index
+     * must be valid.
+     */
+    MapiProperty propertyRef(unsigned i) const;
+
     /**
      * Fetch a tag by index.
      */
@@ -281,9 +317,9 @@ public:
     QString propertyString(unsigned i) const;
 
     /**
-     * Find the name for a tag. If it not a well known one, try a lookup.
-     * Technically, this should only be needed if bit 31 is set, but
-     * still...
+     * Find the name for a tag. If it not a well known one, try the names
+     * known for the mailbox, and then a lookup. Technically, this should only
+     * be needed if bit 31 is set, but still...
      */
     QString tagName(int tag) const;
 
@@ -325,9 +361,26 @@ private:
      */
     bool propertyWrite(int tag, void *data, bool idempotent = true);
 
+    /**
+     * Map the named tags in @ref m_cachedTags to the ids used by the
+     * mailbox, asking the server about any which have not been seen before.
+     */
+    bool namedPropertiesMap(SPropTagArray &mapped);
+
+    /**
+     * (Re)build the index of @ref m_properties.
+     */
+    bool propertiesIndex() const;
+
     SPropTagArray m_cachedTags;
-    mapi_nameid *m_cachedNames;
-    SPropTagArray *m_cachedNamedTags;
+
+    /**
+     * An open-addressed hash table of positions in @ref m_properties, plus
+     * one so that zero marks an empty slot. A mask of zero means the index
+     * needs to be built.
+     */
+    mutable uint32_t *m_index;
+    mutable unsigned m_indexMask;
 
     // Get notifications from Exchange.
     friend class MapiConnector2;
@@ -393,6 +446,46 @@ public:
      */
     bool childrenPull(QList<MapiFolder *> &children, const QString &filter = QString());
 
+    /**
+     * Fetch all descendants which are folders, using a single hierarchy table
+     * with depth traversal rather than one table per folder.
+     * 
+     * @param descendants   The descendants will be added to this list, in no
+     *                  particular order. The id of each identifies its
+     *                  immediate parent. The caller is responsible for
+     *                  freeing entries on the list.
+     * @param filter    Only return items whose PR_CONTAINER_CLASS starts with
+     *                  this value, and whose parent is also returned, or the
+     *                  empty string to get all of them.
+     */
+    bool descendantsPull(QList<MapiFolder *> &descendants, const QString &filter = QString());
+
+    /**
+     * Fetch descendants which are folders using Incremental Change
+     * Synchronization (ICS), so that only those which were created, renamed,
+     * moved or deleted since a previous call are returned. Parents are
+     * returned before their children.
+     *
+     * @param syncState The state returned by a previous call, or an empty
+     *                  array to get all the descendants. On success, this is
+     *                  updated with the new state which should be saved for
+     *                  use next time.
+     * @param changed   The created or changed descendants will be added to
+     *                  this list. The id of each identifies its immediate
+     *                  parent. The caller is responsible for freeing entries
+     *                  on the list.
+     * @param deleted   The deleted descendants will be added to this list.
+     *                  Their parent is not known.
+     * @param incremental   Set if the previous state was applied, so that only
+     *                  the changes were returned. If it was not, all the
+     *                  descendants were returned, and the caller must work
+     *                  out the deletions for itself.
+     * @param filter    Only return changed items whose PR_CONTAINER_CLASS
+     *                  starts with this value, or the empty string to get all
+     *                  of them.
+     */
+    bool childrenPull(QByteArray &syncState, QList<MapiFolder *> &changed, QList<MapiId> &deleted, bool &incremental, const QString &filter = QString());
+
     /**
      * Fetch children which are not folders.
      * 
@@ -402,6 +495,26 @@ public:
      */
     bool childrenPull(QList<MapiItem *> &children);
 
+    /**
+     * Fetch children which are not folders using Incremental Change
+     * Synchronization (ICS), so that only those which were created, changed
+     * or deleted since a previous call are returned.
+     *
+     * @param syncState The state returned by a previous call, or an empty
+     *                  array to get all the children. On success, this is
+     *                  updated with the new state which should be saved for
+     *                  use next time.
+     * @param changed   The created or changed children will be added to this
+     *                  list. The caller is responsible for freeing entries on
+     *                  the list.
+     * @param deleted   The deleted children will be added to this list.
+     * @param incremental   Set if the previous state was applied, so that only
+     *                  the changes were returned. If it was not, all the
+     *                  children were returned, and the caller must work out
+     *                  the deletions for itself.
+     */
+    bool childrenPull(QByteArray &syncState, QList<MapiItem *> &changed, QList<MapiId> &deleted, bool &incremental);
+
 protected:
     mapi_object_t m_contents;
 
@@ -442,6 +555,19 @@ public:
      */
     void addUniqueRecipient(const char *source, MapiRecipient &candidate);
 
+    /**
+     * Find the codec for a Microsoft code page.
+     *
+     * @return 0 if the code page is not supported.
+     */
+    static QTextCodec *codepageCodec(unsigned codepage);
+
+    /**
+     * The tags a message fetches for itself, terminated by a zero tag, for
+     * subclasses to append to their own @ref MapiSchema.
+     */
+    static const int *tagList();
+
 protected:
     QList<MapiRecipient> m_recipients;
 
@@ -481,6 +607,17 @@ private:
      */
     bool recipientsPull();
 
+    /**
+     * Ask the server to resolve the recipients with the given indices.
+     * Those which are resolved are removed from needingResolution.
+     */
+    bool recipientsResolve(const QList<int> &unknown, QList<int> &needingResolution);
+
+    /**
+     * Remove duplicates, and make do with whatever is left unresolved.
+     */
+    bool recipientsDeduplicate(QList<int> &needingResolution);
+
     /**
      * Flesh out a recipient.
      */
@@ -0,0 +1,202 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2011 Robert Gruber <rgruber@users.sourceforge.net>
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapirecurrence.h"
+
+#include <KCalCore/Recurrence>
+#include <KLocalizedString>
+#include <kcalutils/stringify.h>
+
+static QString stringify(QBitArray &days)
+{
+    QString result;
+    if (days[0]) {
+        result.append(i18n("Mo"));
+    }
+    if (days[1]) {
+        result.append(i18n("Tu"));
+    }
+    if (days[2]) {
+        result.append(i18n("We"));
+    }
+    if (days[3]) {
+        result.append(i18n("Th"));
+    }
+    if (days[4]) {
+        result.append(i18n("Fr"));
+    }
+    if (days[5]) {
+        result.append(i18n("Sa"));
+    }
+    if (days[6]) {
+        result.append(i18n("Su"));
+    }
+    return result;
+}
+
+static QString stringify(KDateTime dateTime)
+{
+    return KCalUtils::Stringify::formatDateTime(dateTime);
+}
+
+static QBitArray ex2kcalRecurrenceDays(uint32_t exchangeDays)
+{
+    QBitArray bitArray(7, false);
+
+    if (exchangeDays & Su) // Sunday
+        bitArray.setBit(6, true);
+    if (exchangeDays & M) // Monday
+        bitArray.setBit(0, true);
+    if (exchangeDays & Tu) // Tuesday
+        bitArray.setBit(1, true);
+    if (exchangeDays & W) // Wednesday
+        bitArray.setBit(2, true);
+    if (exchangeDays & Th) // Thursday
+        bitArray.setBit(3, true);
+    if (exchangeDays & F) // Friday
+        bitArray.setBit(4, true);
+    if (exchangeDays & Sa) // Saturday
+        bitArray.setBit(5, true);
+    return bitArray;
+}
+
+static uint32_t ex2kcalDayOfWeek(uint32_t exchangeDayOfWeek)
+{
+    uint32_t retVal = exchangeDayOfWeek;
+    if (retVal == FirstDOW_Sunday) {
+        // Exchange-Sunday(0) mapped to KCal-Sunday(7)
+        retVal = 7;
+    }
+    return retVal;
+}
+
+static uint32_t ex2kcalDaysFromMinutes(uint32_t exchangeMinutes)
+{
+    return exchangeMinutes / 60 / 24;
+}
+
+KDateTime mapiRecurrenceTime(uint32_t exchangeMinutes)
+{
+    // exchange stores the recurrency times as minutes since 1.1.1601
+    QDateTime calc(QDate(1601, 1, 1));
+    int days = ex2kcalDaysFromMinutes(exchangeMinutes);
+    int secs = (exchangeMinutes - (days * 24 * 60)) * 60;
+    return KDateTime(calc.addDays(days).addSecs(secs));
+}
+
+QString mapiRecurrence(RecurrencePattern *ex, KCalCore::Recurrence *kcal)
+{
+    QString description;
+    //debug() << "Calendar:" << ex->CalendarType;
+    QBitArray days;
+    if (ex->RecurFrequency == RecurFrequency_Daily && ex->PatternType == PatternType_Day) {
+        kcal->setDaily(ex2kcalDaysFromMinutes(ex->Period));
+        description = i18n("Every %1 days,", ex2kcalDaysFromMinutes(ex->Period));
+    }
+    else if (ex->RecurFrequency == RecurFrequency_Daily && ex->PatternType == PatternType_Week) {
+        days = ex2kcalRecurrenceDays(M | Tu | W | Th | F);
+        kcal->setWeekly(ex2kcalDaysFromMinutes(ex->Period) / 7, days, ex2kcalDayOfWeek(ex->FirstDOW));
+        description = i18n("Every weekday,");
+    }
+    else if (ex->RecurFrequency == RecurFrequency_Weekly && ex->PatternType == PatternType_Week) {
+        days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.WeekRecurrencePattern);
+        kcal->setWeekly(ex->Period, days, ex2kcalDayOfWeek(ex->FirstDOW));
+        description = i18n("Every %1 weeks on %2,", ex->Period, stringify(days));
+    }
+    else if (ex->RecurFrequency == RecurFrequency_Monthly) {
+        kcal->setMonthly(ex->Period);
+        switch (ex->PatternType)
+        {
+        case PatternType_Month:
+        case PatternType_HjMonth:
+            kcal->addMonthlyDate(ex->PatternTypeSpecific.Day);
+            description = i18n("On the %1 day every %2 months,", ex->PatternTypeSpecific.Day,
+                       ex->Period);
+            break;
+        case PatternType_MonthNth:
+        case PatternType_HjMonthNth:
+            days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.MonthRecurrencePattern.WeekRecurrencePattern);
+            kcal->addMonthlyPos(ex->PatternTypeSpecific.MonthRecurrencePattern.N, days);
+            description = i18n("On %1 of the %2 week every %3 months,", stringify(days),
+                       ex->PatternTypeSpecific.MonthRecurrencePattern.N,
+                       ex->Period);
+            break;
+        case PatternType_MonthEnd:
+        case PatternType_HjMonthEnd:
+            kcal->addMonthlyDate(ex->PatternTypeSpecific.Day);
+            description = i18n("At the end (day %1) of every %2 month,", ex->PatternTypeSpecific.Day,
+                       ex->Period);
+            break;
+        default:
+            description = i18n("Unsupported monthly frequency with patterntype %1", ex->PatternType);
+            break;
+        }
+    }
+    else if (ex->RecurFrequency == RecurFrequency_Yearly) {
+        kcal->setYearly(1);
+        switch (ex->PatternType)
+        {
+        case PatternType_Month:
+        case PatternType_HjMonth:
+            kcal->addYearlyMonth(ex->Period);
+            kcal->addYearlyDate(ex->PatternTypeSpecific.Day);
+            description = i18n("Yearly, on the %1 day of the %2 month,", ex->PatternTypeSpecific.Day,
+                       ex->Period);
+            break;
+        case PatternType_MonthNth:
+        case PatternType_HjMonthNth:
+            days = ex2kcalRecurrenceDays(ex->PatternTypeSpecific.MonthRecurrencePattern.WeekRecurrencePattern);
+            kcal->addYearlyMonth(ex->Period);
+            kcal->addYearlyPos(ex->PatternTypeSpecific.MonthRecurrencePattern.N, days);
+            description = i18n("Yearly, the %1 day of the %2 month when it falls on %3,",
+                       ex->PatternTypeSpecific.MonthRecurrencePattern.N,
+                       ex->Period, stringify(days));
+            break;
+        default:
+            description = i18n("Unsupported yearly frequency with patterntype %1", ex->PatternType);
+            break;
+        };
+    } else {
+        description = i18n("Unsupported frequency %1 with patterntype %2 combination", ex->RecurFrequency,
+                   ex->PatternType);
+    }
+
+    kcal->setStartDateTime(mapiRecurrenceTime(ex->StartDate));
+    switch (ex->EndType) {
+    case END_AFTER_DATE:
+        kcal->setEndDateTime(mapiRecurrenceTime(ex->EndDate));
+        description += i18n(" from %1 to %2", stringify(kcal->startDateTime()),
+                    stringify(kcal->endDateTime()));
+        break;
+    case END_AFTER_N_OCCURRENCES:
+        kcal->setDuration(ex->OccurrenceCount);
+        description += i18n(" from %1 for %2 occurrences", stringify(kcal->startDateTime()),
+                    kcal->duration());
+        break;
+    case END_NEVER_END:
+    case NEVER_END:
+        description += i18n(" from %1, ending indefinitely", stringify(kcal->startDateTime()));
+        break;
+    default:
+        description += i18n(" from %1, unsupported endtype %2", stringify(kcal->startDateTime()),
+                    ex->EndType);
+        break;
+    }
+    return description;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2011 Robert Gruber <rgruber@users.sourceforge.net>
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPIRECURRENCE_H
+#define MAPIRECURRENCE_H
+
+#include <KDateTime>
+
+#include "mapiobjects.h"
+
+namespace KCalCore
+{
+class Recurrence;
+}
+
+/**
+ * Convert an Exchange time, in minutes since 1601, to a KDateTime.
+ */
+extern KDateTime mapiRecurrenceTime(uint32_t exchangeMinutes);
+
+/**
+ * Convert an Exchange recurrence pattern into the given recurrence, which
+ * should be clear. Any exceptions are left to the caller. This lives in the
+ * connector so that the benchmarks can use it too.
+ *
+ * @return A description of the recurrence, for debugging.
+ */
+extern QString mapiRecurrence(RecurrencePattern *ex, KCalCore::Recurrence *kcal);
+
+#endif
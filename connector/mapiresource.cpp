@@ -19,6 +19,9 @@
 
 #include "mapiresource.h"
 
+#include <QHash>
+#include <QMutex>
+#include <QSet>
 #include <QtDBus/QDBusConnection>
 
 #include <KConfigGroup>
@@ -27,6 +30,10 @@
 #include <KStandardDirs>
 
 #include <Akonadi/AgentManager>
+#include <Akonadi/AttributeFactory>
+#include <Akonadi/CollectionFetchJob>
+#include <Akonadi/CollectionFetchScope>
+#include <Akonadi/CollectionModifyJob>
 #include <Akonadi/ItemFetchJob>
 #include <Akonadi/ItemFetchScope>
 #include <akonadi/kmime/messageparts.h>
@@ -34,6 +41,30 @@
 
 #include "mapiconnector2.h"
 
+/**
+ * Set this to 0 to always walk the whole of a folder rather than use
+ * Incremental Change Synchronization.
+ */
+#ifndef ENABLE_ICS
+#define ENABLE_ICS 1
+#endif
+
+/**
+ * A session which has been idle for longer than this many seconds is checked
+ * before being reused.
+ */
+#ifndef SESSION_IDLE_SECONDS
+#define SESSION_IDLE_SECONDS 60
+#endif
+
+/**
+ * Each prefetch session hands its items to Akonadi in chunks of this many,
+ * freeing the messages as it goes.
+ */
+#ifndef MAPI_PREFETCH_CHUNK
+#define MAPI_PREFETCH_CHUNK 50
+#endif
+
 using namespace Akonadi;
 
 MapiResource::MapiResource(const QString &id, const QString &desktopName, const char *folderFilter, const char *messageType, const QString &itemMimeType) :
@@ -42,28 +73,69 @@ MapiResource::MapiResource(const QString &id, const QString &desktopName, const
     m_mapiMessageType(QString::fromAscii(messageType)),
     m_itemMimeType(itemMimeType),
     m_connection(new MapiConnector2()),
-    m_connected(false)
+    m_connected(false),
+    m_worker(new MapiWorker(this)),
+    m_job(0),
+    m_prefetch(0),
+    m_logoffPending(false),
+    m_logoffLost(false)
 {
     if (name() == identifier()) {
         setName(desktopName);
     }
 
     setHierarchicalRemoteIdentifiersEnabled(true);
+    AttributeFactory::registerAttribute<SyncStateAttribute>();
+    AttributeFactory::registerAttribute<HierarchyStateAttribute>();
     //setCollectionStreamingEnabled(true);
-    //setItemStreamingEnabled(true);
+    setItemStreamingEnabled(true);
+    connect(this, SIGNAL(abortRequested()), SLOT(abortTask()));
+    connect(this, SIGNAL(error(QString)), SLOT(syncStateDiscard()));
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Logging"), new MapiLog(this),
+                                                 QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Metrics"), new MapiMetrics(this),
+                                                 QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Trace"), new MapiTrace(identifier(), this),
+                                                 QDBusConnection::ExportScriptableSlots);
+    m_worker->setObjectName(QLatin1String("worker"));
+    m_worker->start();
 }
 
 MapiResource::~MapiResource()
 {
+    delete m_worker;
+    qDeleteAll(m_prefetchWorkers);
+    qDeleteAll(m_prefetchConnections);
+
+    // With the workers gone, nothing else is using the session.
+    m_job = 0;
+    delete m_prefetch;
+    m_prefetch = 0;
     logoff();
     delete m_connection;
 }
 
+void MapiResource::abortTask()
+{
+    // The task is cancelled when the jobs finish.
+    if (m_job) {
+        m_worker->abort();
+    }
+    if (m_prefetch) {
+        foreach (MapiWorker *worker, m_prefetchWorkers) {
+            worker->abort();
+        }
+    }
+}
+
 void MapiResource::doSetOnline(bool online)
 {
     if (online) {
         logon();
     } else {
+        // Going offline stops whatever is running; the logout follows once
+        // it has.
+        abortTask();
         logoff();
     }
 }
@@ -71,6 +143,12 @@ void MapiResource::doSetOnline(bool online)
 void MapiResource::error(const QString &message)
 {
     kError() << message;
+
+    // If the session itself has failed, the next task must login afresh.
+    if (mapiSessionLost()) {
+        logoff(true);
+    }
+    m_syncStates.remove(currentCollection().id());
     emit status(Broken, message);
     cancelTask(message);
 }
@@ -101,7 +179,8 @@ void MapiResource::error(const MapiMessage &msg, const QString &body)
 
 void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections)
 {
-    kDebug() << "fetch all collections";
+    MapiSpan span("fetchCollections", name());
+    MAPI_KDEBUG(Resource) << "fetch all collections";
 
     if (!logon()) {
         // Come back later.
@@ -124,13 +203,254 @@ void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Colle
     root.setParentCollection(Collection::root());
     root.setContentMimeTypes(contentTypes);
     collections.append(root);
-    fetchCollections(root.name(), rootId, root, collections);
+
+    MapiFolder rootMapiFolder(m_connection, __FUNCTION__, rootId);
+    if (!rootMapiFolder.open()) {
+        error(rootMapiFolder, i18n("Cannot open folder list: %1", mapiError()));
+        return;
+    }
+
+    // Fetch the whole tree in one go, and rebuild it here.
+    QList<MapiFolder *> list;
+    emit status(Running, i18n("Fetching folder list: %1", root.name()));
+    if (!rootMapiFolder.descendantsPull(list, m_mapiFolderFilter)) {
+        // Not all stores support depth traversal, so fall back to recursion.
+        kDebug() << "cannot fetch folder tree:" << root.name() << mapiError();
+        qDeleteAll(list);
+        fetchCollections(root.name(), rootId, root, collections);
+        emit status(Running, i18n("Fetched collections: %1", collections.size()));
+        return;
+    }
+
+    QMultiHash<mapi_id_t, MapiFolder *> children;
+    foreach (MapiFolder *data, list) {
+        children.insert(data->id().first, data);
+    }
+
+    // Walk the tree from the top, so that parents come before children.
+    QList<Collection> parents;
+    parents.append(root);
+    while (!parents.isEmpty()) {
+        Collection parent = parents.takeFirst();
+
+        foreach (MapiFolder *data, children.values(MapiId(parent.remoteId()).second)) {
+            Collection child;
+
+            child.setName(data->name);
+            child.setRemoteId(data->id().toString());
+            child.setParentCollection(parent);
+            child.setContentMimeTypes(contentTypes);
+            collections.append(child);
+            parents.append(child);
+        }
+    }
+    qDeleteAll(list);
     emit status(Running, i18n("Fetched collections: %1", collections.size()));
 }
 
+/**
+ * With hierarchical remote ids, Akonadi needs the chain of remote ids from a
+ * collection all the way up to the root. Since our remote ids also identify
+ * the parent, the chain can be rebuilt from the collections we already know.
+ */
+static Collection remoteIdChain(const MapiId &rootId, const QHash<mapi_id_t, Collection> &known, mapi_id_t fid)
+{
+    Collection collection;
+
+    if ((fid == rootId.second) || !known.contains(fid)) {
+        collection.setRemoteId(rootId.toString());
+        collection.setParentCollection(Collection::root());
+        return collection;
+    }
+    collection.setRemoteId(known.value(fid).remoteId());
+    collection.setParentCollection(remoteIdChain(rootId, known, MapiId(collection.remoteId()).first));
+    return collection;
+}
+
+/**
+ * When a folder moves, its old collection is deleted, and with it all the
+ * collections below it. ICS does not report the descendants since they have
+ * not changed, so report them again under the moved folder.
+ */
+static void reparentDescendants(mapi_id_t fid, const QMultiHash<mapi_id_t, Collection> &knownChildren, const QSet<mapi_id_t> &deleted,
+                                const QStringList &contentTypes, QHash<mapi_id_t, Collection> &seen, Collection::List &collections)
+{
+    foreach (const Collection &known, knownChildren.values(fid)) {
+        mapi_id_t childFid = MapiId(known.remoteId()).second;
+
+        if (deleted.contains(childFid)) {
+            continue;
+        }
+        if (!seen.contains(childFid)) {
+            Collection child;
+            child.setName(known.name());
+            child.setRemoteId(known.remoteId());
+            child.setParentCollection(seen.value(fid));
+            child.setContentMimeTypes(contentTypes);
+            collections.append(child);
+            seen.insert(childFid, child);
+        }
+        reparentDescendants(childFid, knownChildren, deleted, contentTypes, seen, collections);
+    }
+}
+
+void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections, Akonadi::Collection::List &deletedCollections)
+{
+    MapiSpan span("fetchCollections", name());
+    MAPI_KDEBUG(Resource) << "fetch changed collections";
+
+    if (!logon()) {
+        // Come back later.
+        deferTask();
+        return;
+    }
+
+    MapiId rootId(m_connection, rootFolder);
+    if (!rootId.isValid())
+    {
+        error(i18n("Cannot find folder root: %1, %2", rootId.toString(), mapiError()));
+        return;
+    }
+
+    // Find the collections we already have, and the saved state. This only
+    // involves Akonadi, which is a lot cheaper than asking Exchange.
+    QHash<mapi_id_t, Collection> known;
+    QByteArray syncState;
+    {
+        CollectionFetchJob *fetch = new CollectionFetchJob(Collection::root(), CollectionFetchJob::Recursive);
+        fetch->fetchScope().setResource(identifier());
+        if (!fetch->exec()) {
+            error(i18n("Unable to list collections: %1", fetch->errorString()));
+            return;
+        }
+        foreach (const Collection &collection, fetch->collections()) {
+            if (collection.remoteId().isEmpty()) {
+                continue;
+            }
+            MapiId id(collection.remoteId());
+            if (!id.isValid()) {
+                continue;
+            }
+            known.insert(id.second, collection);
+            if ((id == rootId) && collection.hasAttribute<HierarchyStateAttribute>()) {
+                syncState = collection.attribute<HierarchyStateAttribute>()->state();
+            }
+        }
+    }
+    bool incremental = false;
+
+    MapiFolder rootMapiFolder(m_connection, __FUNCTION__, rootId);
+    if (!rootMapiFolder.open()) {
+        error(rootMapiFolder, i18n("Cannot open folder list: %1", mapiError()));
+        return;
+    }
+
+    QList<MapiFolder *> list;
+    QList<MapiId> deletedIds;
+    emit status(Running, i18n("Fetching folder changes: %1", name()));
+    if (!rootMapiFolder.childrenPull(syncState, list, deletedIds, incremental, m_mapiFolderFilter)) {
+        // Not all stores support ICS. Fall back to fetching everything, and
+        // working out the deletions for ourselves.
+        kDebug() << "cannot synchronize folders:" << name() << mapiError();
+        qDeleteAll(list);
+        fetchCollections(rootFolder, collections);
+        QSet<QString> remoteIds;
+        foreach (const Collection &collection, collections) {
+            remoteIds << collection.remoteId();
+        }
+        foreach (const Collection &collection, known) {
+            if (!remoteIds.contains(collection.remoteId())) {
+                deletedCollections << collection;
+            }
+        }
+        return;
+    }
+
+    // The root is always returned, to save the new state.
+    Collection root;
+    QStringList contentTypes;
+    contentTypes << m_itemMimeType << Akonadi::Collection::mimeType();
+    root.setName(name());
+    root.setRemoteId(rootId.toString());
+    root.setParentCollection(Collection::root());
+    root.setContentMimeTypes(contentTypes);
+    root.addAttribute(new HierarchyStateAttribute(syncState));
+    collections.append(root);
+
+    // Parents come before their children, so we can always find the parent
+    // either in what we have seen so far, or in what we knew already.
+    QHash<mapi_id_t, Collection> seen;
+    QList<mapi_id_t> moved;
+    seen.insert(rootId.second, root);
+    foreach (MapiFolder *data, list) {
+        mapi_id_t fid = data->id().second;
+        mapi_id_t parentFid = data->id().first;
+        Collection parent;
+
+        if (seen.contains(parentFid)) {
+            parent = seen.value(parentFid);
+        } else if (known.contains(parentFid)) {
+            parent = remoteIdChain(rootId, known, parentFid);
+        } else {
+            // The parent did not match the filter, so neither does this.
+            delete data;
+            continue;
+        }
+
+        // A move changes the remote id, so the old collection must go.
+        if (known.contains(fid) && (known.value(fid).remoteId() != data->id().toString())) {
+            deletedCollections << known.value(fid);
+            moved << fid;
+        }
+
+        Collection child;
+        child.setName(data->name);
+        child.setRemoteId(data->id().toString());
+        child.setParentCollection(parent);
+        child.setContentMimeTypes(contentTypes);
+        collections.append(child);
+        seen.insert(fid, child);
+        delete data;
+    }
+
+    if (!moved.isEmpty()) {
+        QMultiHash<mapi_id_t, Collection> knownChildren;
+        QSet<mapi_id_t> deleted;
+
+        foreach (const Collection &collection, known) {
+            knownChildren.insert(MapiId(collection.remoteId()).first, collection);
+        }
+        foreach (const MapiId &id, deletedIds) {
+            deleted << id.second;
+        }
+        foreach (mapi_id_t fid, moved) {
+            reparentDescendants(fid, knownChildren, deleted, contentTypes, seen, collections);
+        }
+    }
+
+    if (incremental) {
+        foreach (const MapiId &id, deletedIds) {
+            if (known.contains(id.second)) {
+                deletedCollections << known.value(id.second);
+            }
+        }
+    } else {
+        // We got everything, so anything else we knew about has gone.
+        foreach (const Collection &collection, known) {
+            MapiId id(collection.remoteId());
+
+            if (!seen.contains(id.second)) {
+                deletedCollections << collection;
+            }
+        }
+    }
+    emit status(Running, i18n("Fetched collection changes: %1", collections.size()));
+}
+
 void MapiResource::fetchCollections(const QString &path, const MapiId &parentId, const Collection &parent, Akonadi::Collection::List &collections)
 {
-    kDebug() << "fetch collections in:" << path << "under parent folder:" << parentId.toString();
+    MapiSpan span("fetchCollections", path);
+    MAPI_KDEBUG(Resource) << "fetch collections in:" << path << "under parent folder:" << parentId.toString();
 
     MapiFolder parentFolder(m_connection, __FUNCTION__, parentId);
     if (!parentFolder.open()) {
@@ -168,9 +488,69 @@ void MapiResource::fetchCollections(const QString &path, const MapiId &parentId,
 #endif
 }
 
-void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+/**
+ * Pull the contents of a folder on the worker thread. Where we can, we only
+ * get what changed since the last time.
+ */
+class MapiFetchItemsJob : public MapiJob
 {
-    kDebug() << "fetch items from collection:" << collection.name();
+public:
+    MapiFetchItemsJob(MapiConnector2 *connection, const Collection &collection, const QByteArray &syncState) :
+        MapiJob(),
+        m_collection(collection),
+        m_syncState(syncState),
+        m_incremental(false),
+        m_synchronized(false),
+        m_connection(connection)
+    {
+    }
+
+    virtual ~MapiFetchItemsJob()
+    {
+        qDeleteAll(m_list);
+    }
+
+    const Collection m_collection;
+    QByteArray m_syncState;
+    bool m_incremental;
+    bool m_synchronized;
+    QList<MapiItem *> m_list;
+    QList<MapiId> m_deletedIds;
+
+protected:
+    virtual bool run()
+    {
+        MapiSpan span("MapiFetchItemsJob", m_collection.name());
+        TallocArena arena("MapiFetchItemsJob");
+        MapiId parentId(m_collection.remoteId());
+        MapiFolder parentFolder(m_connection, "MapiFetchItemsJob::run", parentId);
+        if (!parentFolder.open()) {
+            return false;
+        }
+#if (ENABLE_ICS)
+        m_synchronized = parentFolder.childrenPull(m_syncState, m_list, m_deletedIds, m_incremental);
+        if (!m_synchronized) {
+            // Not all stores support ICS. Fall back to walking the whole folder.
+            kDebug() << "cannot synchronize collection:" << m_collection.name() << mapiError();
+            qDeleteAll(m_list);
+            m_list.clear();
+            m_deletedIds.clear();
+            m_incremental = false;
+        }
+#endif
+        if (!m_synchronized && !parentFolder.childrenPull(m_list)) {
+            return false;
+        }
+        return true;
+    }
+
+private:
+    MapiConnector2 *m_connection;
+};
+
+void MapiResource::fetchItems(const Akonadi::Collection &collection)
+{
+    MAPI_KDEBUG(Resource) << "fetch items from collection:" << collection.name();
 
     if (!logon()) {
         // Come back later.
@@ -178,12 +558,34 @@ void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List
         return;
     }
 
-    // Find all item that are already in this collection in Akonadi.
-    QSet<MapiId> knownRemoteIds;
-    QMap<MapiId, Item> knownItems;
-    {
+    QByteArray syncState;
+#if (ENABLE_ICS)
+    if (collection.hasAttribute<SyncStateAttribute>()) {
+        syncState = collection.attribute<SyncStateAttribute>()->state();
+    }
+#endif
+    emit status(Running, i18n("Fetching collection: %1", collection.name()));
+    MapiFetchItemsJob *job = new MapiFetchItemsJob(m_connection, collection, syncState);
+    MapiTrace::asyncBegin("fetchItems", job, collection.name());
+    startJob(job, SLOT(fetchItemsDone(MapiJob *)));
+}
+
+void MapiResource::fetchItemsDone(MapiJob *mapiJob)
+{
+    MapiFetchItemsJob *job = static_cast<MapiFetchItemsJob *>(mapiJob);
+    const Collection &collection = job->m_collection;
+
+    if (!jobDone(job, ki18n("Unable to fetch collection: %1, %2").subs(collection.name()))) {
+        MapiTrace::asyncEnd("fetchItems", job);
+        return;
+    }
+    MAPI_KDEBUG(Resource) << "fetched:" << job->m_list.size() << "items from collection:" << collection.name();
+
+    if (!job->m_incremental) {
+        // Find all item that are already in this collection in Akonadi, and
+        // compare them with the complete list we got.
         emit status(Running, i18n("Fetching %1 from cache", collection.name()));
-        ItemFetchJob *fetch = new ItemFetchJob( collection );
+        ItemFetchJob *fetch = new ItemFetchJob(collection);
 
         Akonadi::ItemFetchScope scope;
         // we are only interested in the items from the cache
@@ -191,39 +593,63 @@ void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List
         // we don't need the payload (we are mainly interested in the remoteID and the modification time)
         scope.fetchFullPayload(false);
         fetch->setFetchScope(scope);
-        if (!fetch->exec()) {
-            error(collection, i18n("Unable to list collection: %1, %2", fetch->errorString(), mapiError()));
-            return;
-        }
-        Item::List existingItems = fetch->items();
-        foreach (Item item, existingItems) {
-            // store all the items that we already know
-            MapiId id(item.remoteId());
-            knownRemoteIds.insert(id);
-            knownItems.insert(id, item);
-        }
+        connect(fetch, SIGNAL(result(KJob *)), SLOT(fetchItemsCacheDone(KJob *)));
+        MapiTrace::asyncBegin("ItemFetchJob", job);
+        return;
     }
-    kError() << "knownRemoteIds:" << knownRemoteIds.size();
 
-    MapiId parentId(collection.remoteId());
-    MapiFolder parentFolder(m_connection, __FUNCTION__, parentId);
-    if (!parentFolder.open()) {
-        error(collection, i18n("Unable to open collection: %1", mapiError()));
-        return;
+    // The server has already worked out what changed, so there is no
+    // need to look in the cache. Use the modification time as the
+    // revision to force akonadi to call retrieveItem() for changed items.
+    Item::List items;
+    Item::List deletedItems;
+    foreach (MapiItem *data, job->m_list) {
+        Item item(m_itemMimeType);
+        item.setParentCollection(collection);
+        item.setRemoteId(data->id().toString());
+        item.setRemoteRevision(QString::number(data->modified().toTime_t()));
+        items << item;
     }
+    foreach (const MapiId &remoteId, job->m_deletedIds) {
+        Item item(m_itemMimeType);
+        item.setParentCollection(collection);
+        item.setRemoteId(remoteId.toString());
+        deletedItems << item;
+    }
+    fetchItemsComplete(job, items, deletedItems);
+}
 
-    // Get the folder content for the collection.
-    QList<MapiItem *> list;
-    emit status(Running, i18n("Fetching collection: %1", collection.name()));
-    if (!parentFolder.childrenPull(list)) {
-        error(collection, i18n("Unable to fetch collection: %1", mapiError()));
+void MapiResource::fetchItemsCacheDone(KJob *fetchJob)
+{
+    MapiFetchItemsJob *job = static_cast<MapiFetchItemsJob *>(m_job);
+    const Collection &collection = job->m_collection;
+
+    MapiTrace::asyncEnd("ItemFetchJob", job);
+    if (fetchJob->error()) {
+        MapiTrace::asyncEnd("fetchItems", job);
+        m_job = 0;
+        job->deleteLater();
+        error(collection, i18n("Unable to list collection: %1", fetchJob->errorString()));
         return;
     }
-    kError() << "fetched:" << list.size() << "items from collection:" << collection.name();
 
+    qint64 diffStart = MapiTrace::now();
+    QSet<MapiId> knownRemoteIds;
+    QMap<MapiId, Item> knownItems;
+    Item::List existingItems = static_cast<ItemFetchJob *>(fetchJob)->items();
+    foreach (Item item, existingItems) {
+        // store all the items that we already know
+        MapiId id(item.remoteId());
+        knownRemoteIds.insert(id);
+        knownItems.insert(id, item);
+    }
+    MAPI_KDEBUG(Resource) << "knownRemoteIds:" << knownRemoteIds.size();
+
+    Item::List items;
+    Item::List deletedItems;
     QSet<MapiId> checkedRemoteIds;
     // run though all the found data...
-    foreach (MapiItem *data, list) {
+    foreach (MapiItem *data, job->m_list) {
         MapiId remoteId(data->id());
         checkedRemoteIds << remoteId; // store for later use
 
@@ -241,7 +667,7 @@ void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List
 // 				kDebug() << "Item("<<existingItem.id()<<":"<<data.id<<":"<<existingItem.revision()<<") is already known [Cache-ModTime:"<<existingItem.modificationTime()
 // 						<<" Server-ModTime:"<<data.modified<<"] Flags:"<<existingItem.flags()<<"Attrib:"<<existingItem.attributes();
             if (existingItem.modificationTime() < data->modified()) {
-                kDebug() << existingItem.id()<<"=> this item has changed";
+                MAPI_KDEBUG(Resource) << existingItem.id()<<"=> this item has changed";
 
                 // force akonadi to call retrieveItem() for this item in order to get updated data
                 int revision = existingItem.remoteRevision().toInt();
@@ -250,11 +676,6 @@ void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List
                 items << existingItem;
             }
         }
-        delete data;
-        // TODO just for debugging...
-        if (items.size() > 3) {
-            //break;
-        }
     }
 
     // now check if some of the items need to be removed
@@ -263,20 +684,391 @@ void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List
     foreach (const MapiId &remoteId, knownRemoteIds) {
         deletedItems << knownItems.value(remoteId);
     }
+    if (MapiTrace::enabled()) {
+        MapiTrace::complete("diff", diffStart, collection.name());
+    }
+    fetchItemsComplete(job, items, deletedItems);
+}
 
-    foreach(Item item, items) {
-        kDebug() << "[Item-Dump] ID:"<<item.id()<<"RemoteId:"<<item.remoteId()<<"Revision:"<<item.revision()<<"ModTime:"<<item.modificationTime();
+void MapiResource::fetchItemsComplete(MapiFetchItemsJob *job, Item::List &items, Item::List &deletedItems)
+{
+    // Save the new state for next time, but only once akonadi has stored the
+    // items; until then, the previous state is kept so that the changes are
+    // fetched again if anything goes wrong.
+    if (job->m_synchronized) {
+        Collection update(job->m_collection);
+        update.addAttribute(new SyncStateAttribute(job->m_syncState));
+        m_syncStates.insert(update.id(), update);
+        scheduleCustomTask(this, "syncStateSave", update.id());
     }
 
-    // We fetched a load of stuff. This seems like a good place to force 
-    // any subsequent activity to re-attempt the login.
-    logoff();
+    if (MapiLog::enabled(MapiLog::Resource, MapiLog::Trace)) {
+        foreach(Item item, items) {
+            kDebug() << "[Item-Dump] ID:"<<item.id()<<"RemoteId:"<<item.remoteId()<<"Revision:"<<item.revision()<<"ModTime:"<<item.modificationTime();
+        }
+    }
+    MapiTrace::asyncEnd("fetchItems", job);
+    m_job = 0;
+    job->deleteLater();
+    if (prefetchSessions() && items.size()) {
+        prefetchItems(job->m_collection, items, deletedItems);
+        return;
+    }
+    itemsFetched(job->m_collection, items, deletedItems);
+}
+
+/**
+ * The state of a prefetch, shared by the prefetch jobs.
+ */
+class MapiPrefetch
+{
+public:
+    MapiPrefetch(const Collection &collection, const Item::List &items, const Item::List &deletedItems) :
+        m_collection(collection),
+        m_items(items),
+        m_deletedItems(deletedItems),
+        m_messages(new MapiMessage *[items.size()]),
+        m_outstanding(0),
+        m_aborted(false),
+        m_next(0)
+    {
+        for (int i = 0; i < m_items.size(); i++) {
+            m_messages[i] = 0;
+        }
+    }
+
+    ~MapiPrefetch()
+    {
+        for (int i = 0; i < m_items.size(); i++) {
+            delete m_messages[i];
+        }
+        delete [] m_messages;
+    }
+
+    /**
+     * Claim the next item to be fetched. Whichever session is free takes
+     * the next item, so that all sessions stay busy until the end.
+     */
+    bool take(int &i)
+    {
+        QMutexLocker locker(&m_lock);
+
+        if (m_next >= m_items.size()) {
+            return false;
+        }
+        i = m_next++;
+        return true;
+    }
+
+    /**
+     * Hand a chunk of claimed items, fetched or not, to the main thread.
+     */
+    void ready(const QList<int> &chunk)
+    {
+        QMutexLocker locker(&m_lock);
+
+        m_ready << chunk;
+    }
+
+    /**
+     * Collect the items handed over so far. Once all the jobs are done,
+     * also collect any items which were never claimed.
+     */
+    QList<int> takeReady(bool all)
+    {
+        QMutexLocker locker(&m_lock);
+        QList<int> chunk = m_ready;
+
+        m_ready.clear();
+        while (all && (m_next < m_items.size())) {
+            chunk << m_next++;
+        }
+        return chunk;
+    }
+
+    const Collection m_collection;
+    Item::List m_items;
+    Item::List m_deletedItems;
+
+    /**
+     * The fetched messages, indexed like m_items. Each entry is written by
+     * whichever job claimed it, and read by the main thread once the item
+     * has been handed over.
+     */
+    MapiMessage **m_messages;
+
+    /**
+     * These are only used on the main thread.
+     */
+    unsigned m_outstanding;
+    bool m_aborted;
+
+private:
+    QMutex m_lock;
+    int m_next;
+    QList<int> m_ready;
+};
+
+/**
+ * Fetch items on behalf of a prefetch, using one of the prefetch sessions.
+ */
+class MapiPrefetchJob : public MapiJob
+{
+public:
+    MapiPrefetchJob(MapiResource *resource, MapiConnector2 *connection, const QString &profile, unsigned channel, MapiPrefetch *prefetch) :
+        MapiJob(),
+        m_connection(connection),
+        m_resource(resource),
+        m_profile(profile),
+        m_channel(channel),
+        m_prefetch(prefetch)
+    {
+    }
+
+    MapiConnector2 *m_connection;
+
+protected:
+    virtual bool run()
+    {
+        if (!m_connection->login(m_profile, m_channel)) {
+            return false;
+        }
+
+        bool sessionLost = false;
+        while (!sessionLost && !isAborted()) {
+            QList<int> chunk;
+
+            sessionLost = !fetchChunk(chunk);
+            if (chunk.isEmpty()) {
+                break;
+            }
+            m_prefetch->ready(chunk);
+            QMetaObject::invokeMethod(m_resource, "prefetchItemsReady", Qt::QueuedConnection);
+        }
+        return !sessionLost;
+    }
+
+private:
+    /**
+     * Fetch the next chunk of items as one batch. Any which cannot be
+     * fetched are left for Akonadi to fetch on demand.
+     *
+     * @return False if the session was lost.
+     */
+    bool fetchChunk(QList<int> &chunk)
+    {
+        QList<MapiId> ids;
+        int i;
+        while ((chunk.size() < MAPI_PREFETCH_CHUNK) && m_prefetch->take(i)) {
+            chunk.append(i);
+            ids.append(MapiId(m_prefetch->m_items.at(i).remoteId()));
+        }
+
+        QList<MapiMessage *> messages;
+        bool succeeded = m_resource->fetchMessages(m_connection, ids, messages);
+        for (i = 0; i < messages.size(); i++) {
+            m_prefetch->m_messages[chunk.at(i)] = messages.at(i);
+        }
+        return succeeded;
+    }
+
+    MapiResource *m_resource;
+    const QString m_profile;
+    const unsigned m_channel;
+    MapiPrefetch *m_prefetch;
+};
+
+void MapiResource::prefetchItems(const Akonadi::Collection &collection, const Item::List &items, const Item::List &deletedItems)
+{
+    unsigned sessions = prefetchSessions();
+
+    // Each session has its own worker.
+    while ((unsigned)m_prefetchWorkers.size() < sessions) {
+        MapiWorker *worker = new MapiWorker(this);
+        worker->setObjectName(QString::fromAscii("prefetch %1").arg(m_prefetchWorkers.size() + 1));
+        worker->start();
+        m_prefetchWorkers.append(worker);
+        m_prefetchConnections.append(new MapiConnector2());
+    }
+
+    MAPI_KDEBUG(Resource) << "prefetch" << items.size() << "items using" << sessions << "sessions";
+    emit status(Running, i18n("Fetching %1 items from collection: %2", items.size(), collection.name()));
+    m_prefetch = new MapiPrefetch(collection, items, deletedItems);
+    MapiTrace::asyncBegin("prefetch", m_prefetch, collection.name());
+    for (unsigned i = 0; i < sessions; i++) {
+        // Channel 0 is the session used by everything else.
+        MapiPrefetchJob *job = new MapiPrefetchJob(this, m_prefetchConnections.at(i), profile(), i + 1, m_prefetch);
+        connect(job, SIGNAL(finished(MapiJob *)), SLOT(prefetchItemsDone(MapiJob *)));
+        connect(job, SIGNAL(finished(MapiJob *)), SLOT(logoffDeferred()));
+        m_prefetch->m_outstanding++;
+        m_prefetchWorkers.at(i)->post(job);
+    }
+}
+
+void MapiResource::prefetchItemsDone(MapiJob *mapiJob)
+{
+    MapiPrefetchJob *job = static_cast<MapiPrefetchJob *>(mapiJob);
+
+    if (job->aborted()) {
+        m_prefetch->m_aborted = true;
+    } else if (!job->succeeded()) {
+        // Any items left over are fetched by the other sessions, or on demand.
+        kError() << "prefetch session failed:" << job->errorText();
+        if (job->sessionLost()) {
+            job->m_connection->logout(true);
+        }
+    }
+    job->deleteLater();
+    if (--m_prefetch->m_outstanding) {
+        return;
+    }
+
+    MapiPrefetch *prefetch = m_prefetch;
+    m_prefetch = 0;
+    MapiTrace::asyncEnd("prefetch", prefetch);
+    if (prefetch->m_aborted) {
+        MAPI_KDEBUG(Resource) << "task aborted";
+        m_syncStates.remove(prefetch->m_collection.id());
+        cancelTask(i18n("Aborted"));
+        delete prefetch;
+        return;
+    }
+
+    // Whatever is left, including any items the sessions did not get to,
+    // goes with the deletions.
+    Item::List items = prefetchItemsTake(prefetch, true);
+    itemsFetched(prefetch->m_collection, items, prefetch->m_deletedItems);
+    delete prefetch;
+}
+
+void MapiResource::prefetchItemsReady()
+{
+    if (!m_prefetch || m_prefetch->m_aborted) {
+        return;
+    }
+
+    Item::List items = prefetchItemsTake(m_prefetch, false);
+    if (items.size()) {
+        MAPI_KDEBUG(Resource) << "prefetched items:" << items.size();
+        itemsRetrievedIncremental(items, Item::List());
+    }
+}
+
+bool MapiResource::fetchMessages(MapiConnector2 *connection, const QList<MapiId> &ids, QList<MapiMessage *> &messages)
+{
+    // The messages come from an arena of their own, which this thread is
+    // done with before they are handed over.
+    TallocArena arena("fetchMessages");
+    bool succeeded = true;
+    foreach (MapiId id, ids) {
+        MapiMessage *message = 0;
+
+        if (succeeded) {
+            MapiSpan span("fetchMessage", id.toString());
+            message = createMessage(connection, id);
+            if (!message->open() || !message->propertiesPull()) {
+                delete message;
+                message = 0;
+                succeeded = !mapiSessionLost();
+            } else {
+                // Only the pulled properties go to the main thread.
+                message->close();
+            }
+        }
+        messages.append(message);
+    }
+    return succeeded;
+}
+
+Item::List MapiResource::prefetchItemsTake(MapiPrefetch *prefetch, bool all)
+{
+    Item::List items;
+
+    foreach (int i, prefetch->takeReady(all)) {
+        items << prefetch->m_items.at(i);
+        if (prefetch->m_messages[i]) {
+            itemPayload(items.last(), prefetch->m_messages[i]);
+            prefetch->m_messages[i] = 0;
+        }
+    }
+    return items;
+}
+
+unsigned MapiResource::prefetchSessions()
+{
+    return 0;
+}
+
+MapiMessage *MapiResource::createMessage(MapiConnector2 *connection, MapiId &id)
+{
+    Q_UNUSED(connection);
+    Q_UNUSED(id);
+
+    return 0;
+}
+
+void MapiResource::itemPayload(Akonadi::Item &item, MapiMessage *message)
+{
+    Q_UNUSED(item);
+
+    delete message;
+}
+
+void MapiResource::fetchItemDone(MapiJob *mapiJob)
+{
+    MapiFetchItemJob *job = static_cast<MapiFetchItemJob *>(mapiJob);
+    const Item &item = job->item();
+
+    if (!jobDone(job, ki18n("Unable to fetch item: %1/%2, %3").subs(currentCollection().name()).subs(item.id()))) {
+        MapiTrace::asyncEnd("retrieveItem", job);
+        return;
+    }
+    MAPI_KDEBUG(Resource) << "fetched item:" << item.remoteId();
+    m_job = 0;
+    job->deleteLater();
+    itemFetched(item, job->takeMessage());
+    MapiTrace::asyncEnd("retrieveItem", job);
+}
+
+void MapiResource::itemsFetched(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+{
+    Q_UNUSED(collection);
+
+    itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
+}
+
+bool MapiResource::jobDone(MapiJob *job, const KLocalizedString &failure)
+{
+    if (job->succeeded()) {
+        return true;
+    }
+    m_job = 0;
+    job->deleteLater();
+    if (job->aborted()) {
+        MAPI_KDEBUG(Resource) << "task aborted";
+        cancelTask(i18n("Aborted"));
+        return false;
+    }
+    if (job->sessionLost()) {
+        logoff(true);
+    }
+    error(failure.subs(job->errorText()).toString());
+    return false;
 }
 
 bool MapiResource::logon(void)
 {
     const QString &profileName = profile();
 
+    // If the session has been idle for a while, make sure it is still alive
+    // before relying on it.
+    if (m_connected && (m_lastUsed.secsTo(QDateTime::currentDateTime()) > SESSION_IDLE_SECONDS)) {
+        if (!m_connection->ping()) {
+            MAPI_KDEBUG(Resource) << "session lost, logging in again as" << profileName;
+            logoff(true);
+        }
+    }
     if (!m_connected) {
         // logon to exchange (if needed)
         emit status(Running, i18n("Logging in as %1").arg(profileName));
@@ -285,14 +1077,58 @@ bool MapiResource::logon(void)
     if (!m_connected) {
         emit status(Broken, i18n("Unable to login as %1, %2", profileName, mapiError()));
     }
+    m_lastUsed = QDateTime::currentDateTime();
     return m_connected;
 }
 
-void MapiResource::logoff(void)
+void MapiResource::startJob(MapiJob *job, const char *slot)
 {
-    // There is no logoff operation. We just want to make sure we retry the
-    // logon next time.
+    m_job = job;
+    connect(job, SIGNAL(finished(MapiJob *)), slot);
+    connect(job, SIGNAL(finished(MapiJob *)), SLOT(logoffDeferred()));
+    m_worker->post(job);
+}
+
+void MapiResource::logoff(bool lost)
+{
+    // The session must outlive any job still using it.
+    if (m_job || m_prefetch) {
+        MAPI_KDEBUG(Resource) << "logout deferred until the jobs are done";
+        m_logoffPending = true;
+        m_logoffLost = m_logoffLost || lost;
+        return;
+    }
+    m_connection->logout(lost || m_logoffLost);
     m_connected = false;
+    m_logoffPending = false;
+    m_logoffLost = false;
+}
+
+void MapiResource::syncStateSave(const QVariant &collectionId)
+{
+    Collection::Id id = collectionId.toLongLong();
+
+    if (m_syncStates.contains(id)) {
+        CollectionModifyJob *modify = new CollectionModifyJob(m_syncStates.take(id));
+        if (!modify->exec()) {
+            kError() << "unable to save synchronization state:" << modify->errorString();
+        }
+    }
+    taskDone();
+}
+
+void MapiResource::syncStateDiscard()
+{
+    // The items were not all stored, so the next fetch must start again from
+    // the previous state.
+    m_syncStates.remove(currentCollection().id());
+}
+
+void MapiResource::logoffDeferred()
+{
+    if (m_logoffPending) {
+        logoff(m_logoffLost);
+    }
 }
 
 #include "mapiresource.moc"
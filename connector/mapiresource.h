@@ -20,15 +20,158 @@
 #ifndef MAPIRESOURCE_H
 #define MAPIRESOURCE_H
 
+#include <QHash>
+
 #include <KLocalizedString>
+#include <akonadi/attribute.h>
 #include <akonadi/resourcebase.h>
 
 #include "mapiobjects.h"
+#include "mapiworker.h"
 
+class KJob;
 class MapiConnector2;
+class MapiFetchItemsJob;
+class MapiPrefetch;
 class MapiFolder;
 class MapiMessage;
 
+/**
+ * We track the contents of a collection using the Incremental Change
+ * Synchronization state returned by @ref MapiFolder::childrenPull(). The state
+ * is opaque to us. An empty state means the next fetch must start from
+ * scratch.
+ */
+class SyncStateAttribute :
+    public Akonadi::Attribute
+{
+public:
+#define SYNC_STATE "SyncState"
+
+    SyncStateAttribute()
+    {
+    }
+
+    SyncStateAttribute(const QByteArray &state) :
+        m_state(state)
+    {
+    }
+
+    void setState(const QByteArray &state)
+    {
+        m_state = state;
+    }
+
+    QByteArray state() const
+    {
+        return m_state;
+    }
+
+    virtual QByteArray type() const
+    {
+        return SYNC_STATE;
+    }
+
+    virtual Attribute *clone() const
+    {
+        return new SyncStateAttribute(m_state);
+    }
+
+    virtual QByteArray serialized() const
+    {
+        return m_state.toBase64();
+    }
+
+    virtual void deserialize(const QByteArray &data)
+    {
+        m_state = QByteArray::fromBase64(data);
+    }
+
+private:
+    QByteArray m_state;
+};
+
+/**
+ * Similarly, we track the folder hierarchy under a root collection using the
+ * Incremental Change Synchronization state saved on the root collection.
+ */
+class HierarchyStateAttribute :
+    public SyncStateAttribute
+{
+public:
+#define HIERARCHY_STATE "HierarchyState"
+
+    HierarchyStateAttribute()
+    {
+    }
+
+    HierarchyStateAttribute(const QByteArray &state) :
+        SyncStateAttribute(state)
+    {
+    }
+
+    virtual QByteArray type() const
+    {
+        return HIERARCHY_STATE;
+    }
+
+    virtual Attribute *clone() const
+    {
+        return new HierarchyStateAttribute(state());
+    }
+};
+
+/**
+ * Fetch the properties of an item on the worker thread.
+ */
+class MapiFetchItemJob :
+    public MapiJob
+{
+public:
+    MapiFetchItemJob(const Akonadi::Item &item, MapiMessage *message) :
+        m_item(item),
+        m_message(message)
+    {
+    }
+
+    virtual ~MapiFetchItemJob()
+    {
+        delete m_message;
+    }
+
+    const Akonadi::Item &item() const
+    {
+        return m_item;
+    }
+
+    /**
+     * Take ownership of the fetched message.
+     */
+    MapiMessage *takeMessage()
+    {
+        MapiMessage *message = m_message;
+        m_message = 0;
+        return message;
+    }
+
+protected:
+    virtual bool run()
+    {
+        MapiSpan span("MapiFetchItemJob", m_item.remoteId());
+        if (!m_message->open() || !m_message->propertiesPull()) {
+            return false;
+        }
+
+        // Only the pulled properties go to the main thread.
+        m_message->close();
+        return true;
+    }
+
+private:
+    const Akonadi::Item m_item;
+    MapiMessage *m_message;
+};
+
 /**
  * The purpose of this class is to actas a base for individual resources which
  * implement MAPI services. It hides the networking/logon and other details
@@ -57,8 +200,8 @@ protected:
     virtual const QString profile() = 0;
 
     /**
-     * Recursively find all folders starting at the given root which match
-     * the given filter.
+     * Find all folders starting at the given root which match the given
+     * filter.
      * 
      * @param rootFolder 	Identifies where to start the search.
      * @param collections	List to which any matches are to be appended.
@@ -66,13 +209,39 @@ protected:
     void fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections);
 
     /**
-     * Find all the items in the given collection.
+     * Find the folders starting at the given root which match the given
+     * filter, and which have been added, renamed, moved or deleted since the
+     * last call. The root collection, which carries a
+     * @ref HierarchyStateAttribute, is always returned first.
+     * 
+     * @param rootFolder 	Identifies where to start the search.
+     * @param collections	List to which any changes are to be appended.
+     * @param deletedCollections	List to which any deletions are to be
+     *                  appended.
+     */
+    void fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections, Akonadi::Collection::List &deletedCollections);
+
+    /**
+     * Start finding all the items in the given collection. Where the
+     * collection has a @ref SyncStateAttribute, only the items which have
+     * changed since the last fetch are found. The MAPI work is done on the
+     * worker thread, and the results are delivered to @ref itemsFetched().
      * 
      * @param collection	The collection to fetch.
+     */
+    void fetchItems(const Akonadi::Collection &collection);
+
+    /**
+     * Completion handler for @ref fetchItems(). The default implementation
+     * hands the results to Akonadi. Items are delivered in streaming mode,
+     * and any prefetched items may already have been delivered, so
+     * implementations must finish with itemsRetrievalDone().
+     * 
+     * @param collection	The collection fetched.
      * @param items		Fetched items.
      * @param deletedItems	Items which have been deleted on the backend.
      */
-    void fetchItems(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+    virtual void itemsFetched(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
 
     /**
      * Get the message corresponding to the item.
@@ -80,6 +249,61 @@ protected:
     template <class Message>
     Message *fetchItem(const Akonadi::Item &item);
 
+    /**
+     * Start getting the message corresponding to the item. The MAPI work is
+     * done on the worker thread, and the result is delivered to
+     * @ref itemFetched().
+     *
+     * @return False if the fetch could not be started.
+     */
+    template <class Message>
+    bool fetchItemAsync(const Akonadi::Item &item);
+
+    /**
+     * Completion handler for @ref fetchItemAsync().
+     *
+     * @param item		The item being fetched.
+     * @param message	The message, of the type given to
+     *                  @ref fetchItemAsync(). The callee takes ownership.
+     */
+    virtual void itemFetched(const Akonadi::Item &item, MapiMessage *message) = 0;
+
+    /**
+     * How many extra sessions should @ref fetchItems() use to fetch the
+     * contents of new and changed items in parallel? The default of 0
+     * leaves Akonadi to call retrieveItem() on demand. A resource which
+     * returns non-zero must also implement @ref createMessage() and
+     * @ref itemPayload().
+     */
+    virtual unsigned prefetchSessions();
+
+    /**
+     * Create a message of the type used by this resource. This is called on
+     * the prefetch threads.
+     */
+    virtual MapiMessage *createMessage(MapiConnector2 *connection, MapiId &id);
+
+    /**
+     * Fill in the payload of an item from its message. The callee takes
+     * ownership of the message.
+     */
+    virtual void itemPayload(Akonadi::Item &item, MapiMessage *message);
+
+    /**
+     * Fetch the payloads of a batch of messages, as built by
+     * @ref createMessage(), using the given session on the calling thread.
+     * libmapi sends each OpenMessage and GetProps in a round trip of its
+     * own, so the batches are pipelined by running one per prefetch
+     * session, see @ref prefetchItems().
+     *
+     * @param messages  The messages, returned together and indexed like
+     *                  the ids. An entry is null if that message could not
+     *                  be fetched. The caller takes ownership.
+     * @return False if the session was lost, in which case the messages
+     *                  after the failure are null.
+     */
+    bool fetchMessages(MapiConnector2 *connection, const QList<MapiId> &ids, QList<MapiMessage *> &messages);
+
 protected:
     /*
     virtual void aboutToQuit();
@@ -91,10 +315,29 @@ protected:
 
     /**
      * Recurse through a hierarchy of Exchange folders which match the
-     * given filter.
+     * given filter. This is only used for stores which cannot return the
+     * whole hierarchy in one table.
      */
     void fetchCollections(const QString &path, const MapiId &parentId, const Akonadi::Collection &parent, Akonadi::Collection::List &collections);
 
+    /**
+     * Run a job on the worker thread on behalf of the current task. Only
+     * one job is outstanding at a time, since ResourceBase does not start
+     * another task until this one is done.
+     *
+     * @param slot	Completion handler, which should call @ref jobDone().
+     */
+    void startJob(MapiJob *job, const char *slot);
+
+    /**
+     * Common completion handling for @ref startJob(). If the job failed, it
+     * is deleted, and the task is cancelled or the error reported.
+     *
+     * @param failure	Error message, to which the MAPI error is added.
+     * @return True if the job succeeded.
+     */
+    bool jobDone(MapiJob *job, const KLocalizedString &failure);
+
     /**
      * Consistent error handling for task-based routines.
      */
@@ -108,20 +351,105 @@ protected:
     QString m_itemMimeType;
     MapiConnector2 *m_connection;
     bool m_connected;
+    QDateTime m_lastUsed;
+    MapiWorker *m_worker;
+    MapiJob *m_job;
+    QList<MapiWorker *> m_prefetchWorkers;
+    QList<MapiConnector2 *> m_prefetchConnections;
+    MapiPrefetch *m_prefetch;
+    bool m_logoffPending;
+    bool m_logoffLost;
+    QHash<Akonadi::Collection::Id, Akonadi::Collection> m_syncStates;
 
 protected:
     /**
-     * Logon to Exchange. A successful login is cached and subsequent calls
-     * short-circuited.
+     * Logon to Exchange. A successful login is cached and reused across
+     * tasks. If it has been idle for a while, it is checked first, and only
+     * if it has been lost is a new login attempted.
      *
      * @return True if the login attempt succeeded.
      */
     bool logon(void);
 
     /**
-     * Logout from Exchange.
+     * Logout from Exchange. This is done automatically when a task fails
+     * because the session was lost. While a job is still using the session,
+     * the logout is deferred until the jobs are done.
+     *
+     * @param lost  The session is dead, and must not be reused.
+     */
+    void logoff(bool lost = false);
+
+private:
+    /**
+     * Queue the new synchronization state to be saved, and hand the results
+     * to @ref itemsFetched().
+     */
+    void fetchItemsComplete(MapiFetchItemsJob *job, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+
+    /**
+     * Fetch the contents of the given items in parallel.
+     *
+     * Next state: @ref prefetchItemsDone().
      */
-    void logoff(void);
+    void prefetchItems(const Akonadi::Collection &collection, const Akonadi::Item::List &items, const Akonadi::Item::List &deletedItems);
+
+    /**
+     * Collect the items the prefetch sessions have handed over, with their
+     * payloads, freeing the messages.
+     *
+     * @param all   Also collect the items no session got to.
+     */
+    Akonadi::Item::List prefetchItemsTake(MapiPrefetch *prefetch, bool all);
+
+    friend class MapiPrefetchJob;
+
+private Q_SLOTS:
+    /**
+     * Stop the current task at the next opportunity.
+     */
+    void abortTask();
+
+    /**
+     * Completion handlers for @ref fetchItems().
+     */
+    void fetchItemsDone(MapiJob *job);
+    void fetchItemsCacheDone(KJob *job);
+
+    /**
+     * Completion handler for @ref fetchItemAsync().
+     */
+    void fetchItemDone(MapiJob *job);
+
+    /**
+     * Deliver each chunk of items as the sessions used by
+     * @ref prefetchItems() finish with it.
+     */
+    void prefetchItemsReady();
+
+    /**
+     * Completion handler for each session used by @ref prefetchItems().
+     */
+    void prefetchItemsDone(MapiJob *job);
+
+    /**
+     * Save the synchronization state of a collection once its items have
+     * been stored. This runs as a task of its own, queued behind the item
+     * retrieval.
+     */
+    void syncStateSave(const QVariant &collectionId);
+
+    /**
+     * Forget the synchronization state of the current collection, because
+     * akonadi failed to store its items.
+     */
+    void syncStateDiscard();
+
+    /**
+     * Run after each job's own completion handler, to carry out any logout
+     * deferred by @ref logoff().
+     */
+    void logoffDeferred();
 };
 
 /**
@@ -137,11 +465,17 @@ Message *MapiResource::fetchItem(const Akonadi::Item &itemOrig)
         return 0;
     }
 
+    MapiSpan span("retrieveItem", itemOrig.remoteId());
+    TallocArena arena("retrieveItem");
     MapiId remoteId(itemOrig.remoteId());
     Message *message = new Message(m_connection, __FUNCTION__, remoteId);
     if (!message->open()) {
         emit status(Broken, i18n("Unable to open item: %1/%2, %3", currentCollection().name(),
                                  itemOrig.id(), mapiError()));
+        if (mapiSessionLost()) {
+            logoff(true);
+        }
+        delete message;
         return 0;
     }
 
@@ -150,6 +484,9 @@ Message *MapiResource::fetchItem(const Akonadi::Item &itemOrig)
     if (!message->propertiesPull()) {
         emit status(Broken, i18n("Unable to fetch item: %1/%2, %3", currentCollection().name(),
                                  itemOrig.id(), mapiError()));
+        if (mapiSessionLost()) {
+            logoff(true);
+        }
         delete message;
         return 0;
     }
@@ -157,4 +494,29 @@ Message *MapiResource::fetchItem(const Akonadi::Item &itemOrig)
     return message;
 }
 
+template <class Message>
+bool MapiResource::fetchItemAsync(const Akonadi::Item &itemOrig)
+{
+    kDebug() << "fetch item:" << currentCollection().name() << itemOrig.id() <<
+            ", " << itemOrig.remoteId();
+
+    if (!logon()) {
+        return false;
+    }
+
+    // The message is handed over to the worker, which is then the only
+    // thread to use it until the job is done.
+    Message *message;
+    {
+        TallocArena arena("retrieveItem");
+        MapiId remoteId(itemOrig.remoteId());
+        message = new Message(m_connection, __FUNCTION__, remoteId);
+    }
+    emit status(Running, i18n("Fetching item: %1/%2", currentCollection().name(), itemOrig.id()));
+    MapiFetchItemJob *job = new MapiFetchItemJob(itemOrig, message);
+    MapiTrace::asyncBegin("retrieveItem", job, itemOrig.remoteId());
+    startJob(job, SLOT(fetchItemDone(MapiJob *)));
+    return true;
+}
+
 #endif
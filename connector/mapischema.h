@@ -0,0 +1,159 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPISCHEMA_H
+#define MAPISCHEMA_H
+
+#include <QHash>
+#include <QVector>
+
+#include "mapiobjects.h"
+
+/**
+ * A table-driven decoder for the properties of one type of item. A single
+ * static table of tags and setters gives both the tags to fetch and how to
+ * decode each one, so the two cannot drift apart. For example:
+ *
+ *  static const MapiSchema<Decoder>::Entry entries[] = {
+ *      { PidTagDisplayName, displayName },
+ *      ...
+ *      { 0, 0 } };
+ *  static MapiSchema<Decoder> schema(entries);
+ *
+ *  connection->GALRead(..., schema.tags(), ...);
+ *  schema.decode(properties, count, decoder, unknownProperty);
+ *
+ * Properties normally come back in the order they were asked for, so the
+ * setter for a property is usually found by position. A hash of the tags
+ * covers the cases where they are not, such as when other tags were asked
+ * for as well, or the server returned an error in place of a value.
+ *
+ * For a MapiObject subclass, the tags fetched and decoded by its base class
+ * can be appended to the schema's own, so that @ref tags() is the whole
+ * list, in the order fetched, and the fallback is not called for them.
+ */
+template <class State>
+class MapiSchema
+{
+public:
+    /**
+     * @return False to abandon decoding.
+     */
+    typedef bool (*Setter)(State &state, const MapiProperty &property);
+
+    /**
+     * A null setter means the property is fetched, but not decoded.
+     */
+    struct Entry
+    {
+        int tag;
+        Setter setter;
+    };
+
+    /**
+     * @param entries   The table, terminated by a zero tag.
+     * @param baseTags  Tags to fetch after those in the table, terminated by
+     *                  a zero tag, which are decoded elsewhere.
+     */
+    MapiSchema(const Entry *entries, const int *baseTags = 0) :
+        m_entries(entries),
+        m_count(0)
+    {
+        while (m_entries[m_count].tag) {
+            m_tagList.append(m_entries[m_count].tag);
+            m_setters.insert(m_entries[m_count].tag, m_entries[m_count].setter);
+            m_count++;
+        }
+        for (unsigned i = 0; baseTags && baseTags[i]; i++) {
+            if (!m_setters.contains(baseTags[i])) {
+                m_tagList.append(baseTags[i]);
+                m_setters.insert(baseTags[i], 0);
+            }
+        }
+        m_tagArray = m_tagList;
+        m_tagArray.append(0);
+        m_tags.cValues = m_tagList.size();
+        m_tags.aulPropTag = (MAPITAGS *)m_tagArray.data();
+    }
+
+    /**
+     * The tags to fetch.
+     */
+    SPropTagArray *tags()
+    {
+        return &m_tags;
+    }
+
+    /**
+     * The tags to fetch, as a complete list for the
+     * MapiObject::propertiesPull() protocol. The list is never modified
+     * after construction, so copies can be used by any thread.
+     */
+    const QVector<int> &tagList() const
+    {
+        return m_tagList;
+    }
+
+    /**
+     * Add the tags to fetch to those already in a list, for the
+     * MapiObject::propertiesPull() protocol.
+     */
+    void tagsAppend(QVector<int> &tags) const
+    {
+        foreach (int tag, m_tagList) {
+            if (!tags.contains(tag)) {
+                tags.append(tag);
+            }
+        }
+    }
+
+    /**
+     * Decode a set of properties.
+     *
+     * @param fallback  Called for any property not in the table, if given.
+     * @return False if any setter fails.
+     */
+    bool decode(SPropValue *properties, unsigned count, State &state, Setter fallback = 0) const
+    {
+        for (unsigned i = 0; i < count; i++) {
+            MapiProperty property(properties[i]);
+            Setter setter;
+
+            if ((i < m_count) && (m_entries[i].tag == property.tag())) {
+                setter = m_entries[i].setter;
+            } else {
+                setter = m_setters.value(property.tag(), fallback);
+            }
+            if (setter && !setter(state, property)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    const Entry *m_entries;
+    unsigned m_count;
+    QVector<int> m_tagList;
+    QVector<int> m_tagArray;
+    QHash<int, Setter> m_setters;
+    SPropTagArray m_tags;
+};
+
+#endif
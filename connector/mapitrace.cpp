@@ -0,0 +1,248 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapitrace.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+
+#include <KDebug>
+
+QAtomicInt MapiTrace::s_enabled(0);
+
+/**
+ * Everything below is guarded by the lock. Writing an event is cheap
+ * compared with the MAPI calls and Akonadi jobs being traced.
+ */
+static QMutex traceLock;
+static QFile *traceFile = 0;
+static bool traceFirst;
+static QElapsedTimer traceClock;
+
+/**
+ * Trace viewers are happier with small thread ids, so we number the threads
+ * in the order they are first seen.
+ */
+static QHash<Qt::HANDLE, int> traceThreads;
+
+static QByteArray quote(const QString &string)
+{
+    QByteArray result;
+    QByteArray utf8 = string.toUtf8();
+
+    result.reserve(utf8.size() + 2);
+    result += '"';
+    for (int i = 0; i < utf8.size(); i++) {
+        char c = utf8.at(i);
+
+        switch (c) {
+        case '"':
+        case '\\':
+            result += '\\';
+            result += c;
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                result += QString::fromAscii("\\u%1").arg((int)c, 4, 16, QChar::fromAscii('0')).toAscii();
+            } else {
+                result += c;
+            }
+            break;
+        }
+    }
+    result += '"';
+    return result;
+}
+
+/**
+ * Write one event. The caller must hold the lock.
+ */
+static void write(const QByteArray &event)
+{
+    if (!traceFirst) {
+        traceFile->write(",\n");
+    }
+    traceFirst = false;
+    traceFile->write(event);
+}
+
+/**
+ * The id of the current thread, announcing its name the first time it is
+ * seen. The caller must hold the lock.
+ */
+static int threadId()
+{
+    Qt::HANDLE handle = QThread::currentThreadId();
+    QHash<Qt::HANDLE, int>::const_iterator i = traceThreads.constFind(handle);
+
+    if (i != traceThreads.constEnd()) {
+        return i.value();
+    }
+
+    int id = traceThreads.size() + 1;
+    QThread *thread = QThread::currentThread();
+    QString name = thread ? thread->objectName() : QString();
+
+    traceThreads.insert(handle, id);
+    if (name.isEmpty()) {
+        if (QCoreApplication::instance() && (thread == QCoreApplication::instance()->thread())) {
+            name = QString::fromAscii("main");
+        } else {
+            name = QString::fromAscii("thread %1").arg(id);
+        }
+    }
+    write(QString::fromAscii("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%1,\"tid\":%2,\"args\":{\"name\":%3}}").
+        arg(QCoreApplication::applicationPid()).arg(id).arg(QString::fromUtf8(quote(name))).toUtf8());
+    return id;
+}
+
+static QByteArray args(const QString &detail)
+{
+    if (detail.isEmpty()) {
+        return QByteArray();
+    }
+    return ",\"args\":{\"detail\":" + quote(detail) + '}';
+}
+
+MapiTrace::MapiTrace(const QString &resource, QObject *parent) :
+    QObject(parent)
+{
+    QByteArray dir = qgetenv("MAPI_TRACE_DIR");
+
+    if (!dir.isEmpty() && !enabled()) {
+        start(QDir(QString::fromLocal8Bit(dir)).filePath(resource + QString::fromAscii(".json")));
+    }
+}
+
+MapiTrace::~MapiTrace()
+{
+    stop();
+}
+
+qint64 MapiTrace::now()
+{
+    return traceClock.nsecsElapsed() / 1000;
+}
+
+void MapiTrace::complete(const char *name, qint64 start, const QString &detail)
+{
+    QMutexLocker locker(&traceLock);
+
+    if (!traceFile) {
+        return;
+    }
+
+    qint64 end = now();
+    QByteArray event = "{\"name\":\"" + QByteArray(name) +
+        "\",\"ph\":\"X\",\"ts\":" + QByteArray::number(start) +
+        ",\"dur\":" + QByteArray::number(end - start) +
+        ",\"pid\":" + QByteArray::number(QCoreApplication::applicationPid()) +
+        ",\"tid\":" + QByteArray::number(threadId()) + args(detail) + '}';
+    write(event);
+}
+
+void MapiTrace::asyncBegin(const char *name, const void *id, const QString &detail)
+{
+    QMutexLocker locker(&traceLock);
+
+    if (!traceFile) {
+        return;
+    }
+
+    QByteArray event = "{\"name\":\"" + QByteArray(name) +
+        "\",\"cat\":\"sync\",\"ph\":\"b\",\"id\":\"" + QByteArray::number((qulonglong)(quintptr)id, 16) +
+        "\",\"ts\":" + QByteArray::number(now()) +
+        ",\"pid\":" + QByteArray::number(QCoreApplication::applicationPid()) +
+        ",\"tid\":" + QByteArray::number(threadId()) + args(detail) + '}';
+    write(event);
+}
+
+void MapiTrace::asyncEnd(const char *name, const void *id)
+{
+    QMutexLocker locker(&traceLock);
+
+    if (!traceFile) {
+        return;
+    }
+
+    QByteArray event = "{\"name\":\"" + QByteArray(name) +
+        "\",\"cat\":\"sync\",\"ph\":\"e\",\"id\":\"" + QByteArray::number((qulonglong)(quintptr)id, 16) +
+        "\",\"ts\":" + QByteArray::number(now()) +
+        ",\"pid\":" + QByteArray::number(QCoreApplication::applicationPid()) +
+        ",\"tid\":" + QByteArray::number(threadId()) + '}';
+    write(event);
+}
+
+bool MapiTrace::start(const QString &fileName)
+{
+    stop();
+
+    QFile *file = new QFile(fileName);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        kError() << "cannot create trace:" << fileName << file->errorString();
+        delete file;
+        return false;
+    }
+    file->write("[\n");
+
+    QMutexLocker locker(&traceLock);
+    traceFile = file;
+    traceFirst = true;
+    traceThreads.clear();
+    traceClock.start();
+    s_enabled = 1;
+    kDebug() << "tracing to" << fileName;
+    return true;
+}
+
+QString MapiTrace::stop()
+{
+    QMutexLocker locker(&traceLock);
+
+    if (!traceFile) {
+        return QString();
+    }
+    s_enabled = 0;
+
+    QString fileName = traceFile->fileName();
+    traceFile->write("\n]\n");
+    traceFile->close();
+    delete traceFile;
+    traceFile = 0;
+    kDebug() << "trace written to" << fileName;
+    return fileName;
+}
+
+QString MapiTrace::fileName() const
+{
+    QMutexLocker locker(&traceLock);
+
+    return traceFile ? traceFile->fileName() : QString();
+}
@@ -0,0 +1,143 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPITRACE_H
+#define MAPITRACE_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QString>
+
+/**
+ * Span tracing of the sync pipelines, written as a Chrome trace-event JSON
+ * file which can be opened in Perfetto or chrome://tracing. Tracing is
+ * started either by setting $MAPI_TRACE_DIR before the resource starts, in
+ * which case the trace is written to <dir>/<resource>.json, or over D-Bus,
+ * for example:
+ *
+ *  qdbus org.freedesktop.Akonadi.Resource.akonadi_exmail_resource_0 /Trace start /tmp/exmail.json
+ *  qdbus org.freedesktop.Akonadi.Resource.akonadi_exmail_resource_0 /Trace stop
+ *
+ * Work done within one function on one thread is traced using a
+ * @ref MapiSpan. Work which is carried across the event loop, such as an
+ * Akonadi job, is traced using @ref asyncBegin() and @ref asyncEnd(); spans
+ * with the same id nest on their own track.
+ */
+class MapiTrace : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Trace")
+public:
+    /**
+     * @param resource  The name of the trace file to use when tracing is
+     *                  enabled by $MAPI_TRACE_DIR.
+     */
+    MapiTrace(const QString &resource, QObject *parent = 0);
+    virtual ~MapiTrace();
+
+    /**
+     * Is a trace being written? This is cheap enough to be used on every
+     * hot path.
+     */
+    static inline bool enabled()
+    {
+        return (int)s_enabled != 0;
+    }
+
+    /**
+     * The current time on the trace clock, in microseconds.
+     */
+    static qint64 now();
+
+    /**
+     * Record a span on the current thread which started at the given time,
+     * and ends now.
+     */
+    static void complete(const char *name, qint64 start, const QString &detail = QString());
+
+    /**
+     * Record the start and end of a span which is carried across the event
+     * loop. The id is typically the address of the object which carries the
+     * state, and must be the same for both calls.
+     */
+    static void asyncBegin(const char *name, const void *id, const QString &detail = QString());
+    static void asyncEnd(const char *name, const void *id);
+
+public Q_SLOTS:
+    /**
+     * Start writing a trace to the given file. Any trace already being
+     * written is finished first.
+     *
+     * @return False if the file cannot be created.
+     */
+    Q_SCRIPTABLE bool start(const QString &fileName);
+
+    /**
+     * Finish the trace.
+     *
+     * @return The name of the file written, if any.
+     */
+    Q_SCRIPTABLE QString stop();
+
+    /**
+     * The name of the file being written, if any.
+     */
+    Q_SCRIPTABLE QString fileName() const;
+
+private:
+    static QAtomicInt s_enabled;
+};
+
+/**
+ * A span covering the lifetime of the object, for example:
+ *
+ *  MapiSpan span("fetchCollections", name());
+ *
+ * When tracing is disabled, this costs one test.
+ */
+class MapiSpan
+{
+public:
+    MapiSpan(const char *name) :
+        m_name(name),
+        m_start(MapiTrace::enabled() ? MapiTrace::now() : -1)
+    {
+    }
+
+    MapiSpan(const char *name, const QString &detail) :
+        m_name(name),
+        m_detail(detail),
+        m_start(MapiTrace::enabled() ? MapiTrace::now() : -1)
+    {
+    }
+
+    ~MapiSpan()
+    {
+        if (m_start >= 0) {
+            MapiTrace::complete(m_name, m_start, m_detail);
+        }
+    }
+
+private:
+    const char *m_name;
+    const QString m_detail;
+    const qint64 m_start;
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapiworker.h"
+
+#include "mapiconnector2.h"
+
+MapiJob::MapiJob() :
+    QObject(),
+    m_aborted(0),
+    m_succeeded(false),
+    m_sessionLost(false)
+{
+}
+
+MapiJob::~MapiJob()
+{
+}
+
+bool MapiJob::aborted() const
+{
+    return isAborted();
+}
+
+QString MapiJob::errorText() const
+{
+    return m_errorText;
+}
+
+void MapiJob::execute()
+{
+    if (isAborted()) {
+        return;
+    }
+    m_succeeded = run();
+    if (!m_succeeded) {
+        m_errorText = mapiError();
+        m_sessionLost = mapiSessionLost();
+    }
+}
+
+bool MapiJob::isAborted() const
+{
+    return (int)m_aborted != 0;
+}
+
+bool MapiJob::sessionLost() const
+{
+    return m_sessionLost;
+}
+
+bool MapiJob::succeeded() const
+{
+    return m_succeeded && !isAborted();
+}
+
+MapiWorker::MapiWorker(QObject *parent) :
+    QThread(parent),
+    m_current(0),
+    m_stopping(false)
+{
+    // Needed to deliver MapiJob::finished() across threads.
+    qRegisterMetaType<MapiJob *>("MapiJob*");
+}
+
+MapiWorker::~MapiWorker()
+{
+    {
+        QMutexLocker locker(&m_lock);
+        m_stopping = true;
+        if (m_current) {
+            m_current->m_aborted = 1;
+        }
+        m_wakeup.wakeAll();
+    }
+    wait();
+    qDeleteAll(m_jobs);
+}
+
+void MapiWorker::abort()
+{
+    QMutexLocker locker(&m_lock);
+
+    if (m_current) {
+        m_current->m_aborted = 1;
+    }
+    foreach (MapiJob *job, m_jobs) {
+        job->m_aborted = 1;
+    }
+}
+
+void MapiWorker::post(MapiJob *job)
+{
+    QMutexLocker locker(&m_lock);
+
+    m_jobs.enqueue(job);
+    m_wakeup.wakeOne();
+}
+
+void MapiWorker::run()
+{
+    forever {
+        MapiJob *job;
+        {
+            QMutexLocker locker(&m_lock);
+            while (!m_stopping && m_jobs.isEmpty()) {
+                m_wakeup.wait(&m_lock);
+            }
+            if (m_stopping) {
+                return;
+            }
+            job = m_jobs.dequeue();
+            m_current = job;
+        }
+        job->execute();
+
+        // Forget the job before announcing it: the receiver may delete it
+        // at any time after that.
+        {
+            QMutexLocker locker(&m_lock);
+            m_current = 0;
+        }
+        emit job->finished(job);
+    }
+}
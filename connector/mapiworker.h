@@ -0,0 +1,132 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPIWORKER_H
+#define MAPIWORKER_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+/**
+ * A unit of MAPI work to be run by a @ref MapiWorker. Subclasses implement
+ * @ref run(), which is called on the worker thread and so must not touch
+ * Akonadi or any other state owned by the main thread. When it returns,
+ * @ref finished() is emitted; receivers in the main thread get it through
+ * their event loop, and should deleteLater() the job.
+ */
+class MapiJob : public QObject
+{
+    Q_OBJECT
+public:
+    MapiJob();
+    virtual ~MapiJob();
+
+    /**
+     * Did the job complete successfully?
+     */
+    bool succeeded() const;
+
+    /**
+     * Was the job aborted before it could complete?
+     */
+    bool aborted() const;
+
+    /**
+     * The MAPI error for a failed job. The error state of libmapi is per
+     * thread, so it is captured on the worker thread.
+     */
+    QString errorText() const;
+
+    /**
+     * Did a failed job find that the session had been lost?
+     */
+    bool sessionLost() const;
+
+Q_SIGNALS:
+    void finished(MapiJob *job);
+
+protected:
+    /**
+     * Do the work. Called on the worker thread.
+     *
+     * @return True on success.
+     */
+    virtual bool run() = 0;
+
+    /**
+     * Long running jobs should check this between MAPI calls, and give up
+     * if it is set.
+     */
+    bool isAborted() const;
+
+private:
+    friend class MapiWorker;
+
+    void execute();
+
+    QAtomicInt m_aborted;
+    bool m_succeeded;
+    bool m_sessionLost;
+    QString m_errorText;
+};
+
+/**
+ * A dedicated thread for running MAPI jobs, one at a time, in the order
+ * they were posted. Since libmapi is not thread-safe, all jobs sharing a
+ * session should be posted to the same worker, and the posting thread
+ * must not use the session until the job has finished.
+ */
+class MapiWorker : public QThread
+{
+    Q_OBJECT
+public:
+    MapiWorker(QObject *parent = 0);
+
+    /**
+     * Stop the thread. Jobs which have not been started are discarded.
+     */
+    virtual ~MapiWorker();
+
+    /**
+     * Queue a job to be run.
+     */
+    void post(MapiJob *job);
+
+    /**
+     * Abort the running job, if any, and all queued jobs. Each job still
+     * emits @ref MapiJob::finished(), with @ref MapiJob::aborted() set.
+     */
+    void abort();
+
+protected:
+    virtual void run();
+
+private:
+    QMutex m_lock;
+    QWaitCondition m_wakeup;
+    QQueue<MapiJob *> m_jobs;
+    MapiJob *m_current;
+    bool m_stopping;
+};
+
+#endif
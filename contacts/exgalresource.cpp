@@ -27,29 +27,28 @@
 #include <akonadi/cachepolicy.h>
 #include <akonadi/collectionattributessynchronizationjob.h>
 #include <akonadi/item.h>
-#include <akonadi/itemcreatejob.h>
 #include <akonadi/itemdeletejob.h>
+#include <akonadi/itemcreatejob.h>
+#include <akonadi/itemfetchjob.h>
+#include <akonadi/itemfetchscope.h>
 #include <akonadi/itemmodifyjob.h>
+#include <akonadi/transactionsequence.h>
 #include <KLocalizedString>
-#include <KABC/Address>
 #include <KABC/Addressee>
-#include <KABC/PhoneNumber>
-#include <KABC/Picture>
 #include <KDateTime>
+#include <KSaveFile>
+#include <KStandardDirs>
 #include <KWindowSystem>
 #include <QtDBus/QDBusConnection>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
 
 #include "mapiconnector2.h"
+#include "mapicontact.h"
 #include "profiledialog.h"
 
-/**
- * Set this to 1 to pull all the properties, e.g. to see what a server has
- * available.
- */
-#ifndef DEBUG_CONTACT_PROPERTIES
-#define DEBUG_CONTACT_PROPERTIES 1
-#endif
-
 #ifndef ENABLE_GAL
 #define ENABLE_GAL 1
 #endif
@@ -60,6 +59,71 @@
 
 #define MEASURE_PERFORMANCE 1
 
+/**
+ * The number of GAL rows fetched in a batch is adjusted to make each read
+ * take about GAL_BATCH_MSECS, within the given bounds. The initial value
+ * gives about 4 seconds in Exchange, and about 4 seconds in Akonadi, on my
+ * laptop. Since the batches waiting to be written are held in memory, the
+ * size is also limited to about GAL_BATCH_BYTES of properties.
+ */
+#ifndef GAL_BATCH_SIZE
+#define GAL_BATCH_SIZE 500
+#endif
+
+#ifndef GAL_BATCH_MIN
+#define GAL_BATCH_MIN 50
+#endif
+
+#ifndef GAL_BATCH_MAX
+#define GAL_BATCH_MAX 5000
+#endif
+
+#ifndef GAL_BATCH_MSECS
+#define GAL_BATCH_MSECS 4000
+#endif
+
+#ifndef GAL_BATCH_BYTES
+#define GAL_BATCH_BYTES (8 * 1024 * 1024)
+#endif
+
+/**
+ * When the GAL is refreshed, only the entries which have changed are
+ * fetched in full, see MapiGAL::readChanges(). But since the columns used
+ * to spot changes might not change for every edit, the whole GAL is
+ * fetched again after this many days.
+ */
+#ifndef GAL_FULL_REFRESH_DAYS
+#define GAL_FULL_REFRESH_DAYS 7
+#endif
+
+/**
+ * The saved digests start with this, and a version number.
+ */
+static const char galDigestsMagic[] = "MAPIGALD";
+#define GAL_DIGESTS_VERSION 1
+
+/**
+ * The version of the GAL items in Akonadi, kept in the FetchStatusAttribute.
+ * Version 1 items have the entry's DN as their remoteId; older ones had the
+ * display name, and are removed before the GAL is fetched again.
+ */
+#define GAL_ITEMS_VERSION 1
+
+/**
+ * The GAL is read using a session of its own, so that reading it on the
+ * GAL worker does not get in the way of anything using the main session
+ * (channel 0), or the prefetch sessions (channels 1 upwards).
+ */
+#define GAL_CHANNEL 1000
+
+/**
+ * How many batches may be read from Exchange ahead of the one being written
+ * to Akonadi.
+ */
+#ifndef GAL_PIPELINE_DEPTH
+#define GAL_PIPELINE_DEPTH 2
+#endif
+
 using namespace Akonadi;
 
 /**
@@ -93,6 +157,9 @@ private:
  * 	- As fetching proceeds, we store the last fetched item's displayName.
  * 	On resume, this can be used to seek to the right place in the GAL to
  * 	resume fetching.
+ *
+ * 	- The version of the GAL items, see @ref GAL_ITEMS_VERSION. Older
+ * 	attributes have none, and are read as version 0.
  */
 class FetchStatusAttribute :
     public Akonadi::Attribute
@@ -100,13 +167,15 @@ class FetchStatusAttribute :
 public:
 #define FETCH_STATUS "FetchStatus"
 
-    FetchStatusAttribute()
+    FetchStatusAttribute() :
+        m_version(0)
     {
     }
 
-    FetchStatusAttribute(const KDateTime &dateTime, const QString &displayName) :
+    FetchStatusAttribute(const KDateTime &dateTime, const QString &displayName, unsigned version) :
         m_dateTime(dateTime),
-        m_displayName(displayName)
+        m_displayName(displayName),
+        m_version(version)
     {
     }
 
@@ -130,6 +199,16 @@ public:
         return m_displayName;
     }
 
+    void setVersion(unsigned version)
+    {
+        m_version = version;
+    }
+
+    unsigned version() const
+    {
+        return m_version;
+    }
+
     virtual QByteArray type() const
     {
         return FETCH_STATUS;
@@ -137,13 +216,17 @@ public:
 
     virtual Attribute *clone() const
     {
-        return new FetchStatusAttribute(m_dateTime, m_displayName);
+        return new FetchStatusAttribute(m_dateTime, m_displayName, m_version);
     }
 
+    /**
+     * The version goes before the displayName, which may itself contain the
+     * separator.
+     */
     virtual QByteArray serialized() const
     {
         static QString separator = QString::fromAscii("|");
-        QString tmp = m_dateTime.toString().append(separator).append(m_displayName);
+        QString tmp = m_dateTime.toString().append(separator).append(QString::number(m_version)).append(separator).append(m_displayName);
 
         return tmp.toUtf8();
     }
@@ -151,415 +234,41 @@ public:
     virtual void deserialize(const QByteArray &data)
     {
         int i = data.indexOf("|");
+        int j = data.indexOf("|", i + 1);
+        bool ok = false;
 
         m_dateTime = KDateTime::fromString(QString::fromUtf8(data.left(i)));
-        m_displayName = QString::fromUtf8(data.mid(i + 1));
+        if (j > i) {
+            m_version = data.mid(i + 1, j - i - 1).toUInt(&ok);
+        }
+        if (ok) {
+            m_displayName = QString::fromUtf8(data.mid(j + 1));
+        } else {
+            // An attribute from before there were versions.
+            m_version = 0;
+            m_displayName = QString::fromUtf8(data.mid(i + 1));
+        }
     }
 
 private:
     KDateTime m_dateTime;
     QString m_displayName;
+    unsigned m_version;
 };
 
 /**
- * The list of tags used to fetch data from the GAL or for a Contact. This list
- * must be kept synchronised with the body of @ref preparePayload.
- *
- * This list is the superset of useful entries from [MS-NSPI] with the address
- * book objects as specified in that function, thus ensuring the best possible
- * unified experience.
+ * The columns which show when a GAL entry has changed. These are cheap to
+ * fetch compared with the whole entry, and are all in mapiContactTags() too.
  */
-static int contactTagList[] = {
-    PidTagMessageClass,
-    PidTagDisplayName,
+static int changeTagList[] = {
     PidTagEmailAddress,
     PidTagAddressType,
-    PidTagSmtpAddress,
-    PidTagAccount,
-
-    PidTagObjectType,
-    PidTagDisplayType,
-    PidTagSurname,
-    PidTagGivenName,
-    PidTagNickname,
-    PidTagDisplayNamePrefix,
-    PidTagGeneration,
-    PidTagTitle,
-    PidTagOfficeLocation,
-    PidTagStreetAddress,
-    PidTagPostOfficeBox,
-    PidTagLocality,
-    PidTagStateOrProvince,
-    PidTagPostalCode,
-    PidTagCountry,
-    PidTagLocation,
-
-    PidTagDepartmentName,
-    PidTagCompanyName,
-    PidTagPostalAddress,
-
-    PidTagHomeAddressStreet,
-    PidTagHomeAddressPostOfficeBox,
-    PidTagHomeAddressCity,
-    PidTagHomeAddressStateOrProvince,
-    PidTagHomeAddressPostalCode,
-    PidTagHomeAddressCountry,
-
-    PidTagOtherAddressStreet,
-    PidTagOtherAddressPostOfficeBox,
-    PidTagOtherAddressCity,
-    PidTagOtherAddressStateOrProvince,
-    PidTagOtherAddressPostalCode,
-    PidTagOtherAddressCountry,
-
-    PidTagPrimaryTelephoneNumber,
-    PidTagBusinessTelephoneNumber,
-    PidTagBusiness2TelephoneNumber,
-    PidTagBusiness2TelephoneNumbers,
-    PidTagHomeTelephoneNumber,
-    PidTagHome2TelephoneNumber,
-    PidTagHome2TelephoneNumbers,
-    PidTagMobileTelephoneNumber,
-    PidTagRadioTelephoneNumber,
-    PidTagCarTelephoneNumber,
-    PidTagPrimaryFaxNumber,
-    PidTagBusinessFaxNumber,
-    PidTagHomeFaxNumber,
-    PidTagPagerTelephoneNumber,
-    PidTagIsdnNumber,
-
-    PidTagGender,
-    PidTagPersonalHomePage,
-    PidTagBusinessHomePage,
-    PidTagBirthday,
-    PidTagThumbnailPhoto,
+    PidTagDisplayName,
+    PidTagLastModificationTime,
     0 };
-static SPropTagArray contactTags = {
-    (sizeof(contactTagList) / sizeof(contactTagList[0])) - 1,
-    (MAPITAGS *)contactTagList };
-
-/**
- * Take a set of properties, and attempt to apply them to the given addressee.
- * 
- * The switch statement at the heart of this routine must be kept synchronised
- * with @ref contactTagList.
- *
- * @return false on error.
- */
-static bool preparePayload(SPropValue *properties, unsigned propertyCount, KABC::Addressee &addressee)
-{
-    static QString separator = QString::fromAscii(", ");
-    unsigned displayType = DT_MAILUSER;
-    unsigned objectType = MAPI_MAILUSER;
-    QString messageClass;
-    QString email;
-    QString addressType;
-    QString officeLocation;
-    QString location;
-    KABC::Address postal(KABC::Address::Postal);
-    KABC::Address work(KABC::Address::Work);
-    KABC::Address home(KABC::Address::Home);
-    KABC::Address other(KABC::Address::Pref);
-
-    // Walk through the properties and extract the values of interest. The
-    // properties here should be aligned with the list pulled above.
-    //
-    // We want to decode all the properties in [MS-OXOABK] that we can,
-    // subject to the following:
-    //
-    // - Properties common to all objects (section 2.2.3), and which
-    //   apply to both Contacts from [MS-OXOAB] and the GAL from [MS-NSPI].
-    //
-    // - Properties which apply either to Mail Users (section 2.2.4) or 
-    //   Distribution Lists (section 2.2.6) and which map to either 
-    //   KABC::Addressee or KABC::DistributionList respectively.
-    //
-    // TODO For now, we don't do anything useful with distribtion lists.
-    for (unsigned i = 0; i < propertyCount; i++) {
-        MapiProperty property(properties[i]);
-
-        switch (property.tag()) {
-        case PidTagMessageClass:
-            // Sanity check the message class.
-            messageClass = property.value().toString();
-            if (!messageClass.startsWith(QLatin1String("IPM.Contact"))) {
-                kError() << "retrieved item is not a contact:" << messageClass;
-                return false;
-            }
-            break;
-        // 2.2.3.1
-        case PidTagDisplayName:
-            addressee.setNameFromString(property.value().toString());
-            break;
-        // 2.2.3.14 and related items.
-        case PidTagEmailAddress:
-            email = property.value().toString();
-            break;
-        case PidTagAddressType:
-            addressType = property.value().toString();
-            break;
-        case PidTagSmtpAddress:
-            addressee.setEmails(QStringList(mapiExtractEmail(property, "SMTP")));
-            break;
-        case PidTagAccount:
-            if (!addressee.emails().size()) {
-                addressee.insertEmail(mapiExtractEmail(property, "SMTP"));
-            }
-            break;
-
-        // 2.2.3.10
-        case PidTagObjectType:
-            objectType = property.value().toUInt();
-            break;
-        // 2.2.3.11
-        case PidTagDisplayType:
-            displayType = property.value().toUInt();
-            break;
-        // 2.2.4.1
-        case PidTagSurname:
-            addressee.setFamilyName(property.value().toString());
-            break;
-        // 2.2.4.2
-        case PidTagGivenName:
-            addressee.setGivenName(property.value().toString());
-            break;
-        // 2.2.4.3
-        case PidTagNickname:
-            addressee.setNickName(property.value().toString());
-            break;
-        // 2.2.4.4
-        case PidTagDisplayNamePrefix:
-            addressee.setPrefix(property.value().toString());
-            break;
-        // 2.2.4.6
-        case PidTagGeneration:
-            addressee.setSuffix(property.value().toString());
-            break;
-        // 2.2.4.7
-        case PidTagTitle:
-            addressee.setRole(property.value().toString());
-            break;
-        // 2.2.4.8 and related items.
-        case PidTagOfficeLocation:
-            officeLocation = property.value().toString();
-            break;
-        case PidTagStreetAddress:
-            work.setStreet(property.value().toString());
-            break;
-        case PidTagPostOfficeBox:
-            work.setPostOfficeBox(property.value().toString());
-            break;
-        case PidTagLocality:
-            work.setLocality(property.value().toString());
-            break;
-        case PidTagStateOrProvince:
-            work.setRegion(property.value().toString());
-            break;
-        case PidTagPostalCode:
-            work.setPostalCode(property.value().toString());
-            break;
-        case PidTagCountry:
-            work.setCountry(property.value().toString());
-            break;
-        case PidTagLocation:
-            location = property.value().toString();
-            break;
-
-        // 2.2.4.9
-        case PidTagDepartmentName:
-            addressee.setDepartment(property.value().toString());
-            break;
-        // 2.2.4.10
-        case PidTagCompanyName:
-            addressee.setOrganization(property.value().toString());
-            break;
-        // 2.2.4.18
-        case PidTagPostalAddress:
-            postal.setStreet(property.value().toString());
-            break;
-
-        // 2.2.4.25 and related items.
-        case PidTagHomeAddressStreet:
-            home.setStreet(property.value().toString());
-            break;
-        case PidTagHomeAddressPostOfficeBox:
-            home.setPostOfficeBox(property.value().toString());
-            break;
-        case PidTagHomeAddressCity:
-            home.setLocality(property.value().toString());
-            break;
-        case PidTagHomeAddressStateOrProvince:
-            home.setRegion(property.value().toString());
-            break;
-        case PidTagHomeAddressPostalCode:
-            home.setPostalCode(property.value().toString());
-            break;
-        case PidTagHomeAddressCountry:
-            home.setCountry(property.value().toString());
-            break;
-
-        // 2.2.4.31 and related items.
-        case PidTagOtherAddressStreet:
-            other.setStreet(property.value().toString());
-            break;
-        case PidTagOtherAddressPostOfficeBox:
-            other.setPostOfficeBox(property.value().toString());
-            break;
-        case PidTagOtherAddressCity:
-            other.setLocality(property.value().toString());
-            break;
-        case PidTagOtherAddressStateOrProvince:
-            other.setRegion(property.value().toString());
-            break;
-        case PidTagOtherAddressPostalCode:
-            other.setPostalCode(property.value().toString());
-            break;
-        case PidTagOtherAddressCountry:
-            other.setCountry(property.value().toString());
-            break;
-
-        // 2.2.4.37 and related items.
-        case PidTagPrimaryTelephoneNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Pref | KABC::PhoneNumber::Voice));
-            break;
-        case PidTagBusinessTelephoneNumber:
-        case PidTagBusiness2TelephoneNumber:
-        case PidTagBusiness2TelephoneNumbers:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Work | KABC::PhoneNumber::Voice));
-            break;
-        case PidTagHomeTelephoneNumber:
-        case PidTagHome2TelephoneNumber:
-        case PidTagHome2TelephoneNumbers:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Home | KABC::PhoneNumber::Voice));
-            break;
-        case PidTagMobileTelephoneNumber:
-        case PidTagRadioTelephoneNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Cell | KABC::PhoneNumber::Voice));
-            break;
-        case PidTagCarTelephoneNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Car | KABC::PhoneNumber::Voice));
-            break;
-        case PidTagPrimaryFaxNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Pref | KABC::PhoneNumber::Fax));
-            break;
-        case PidTagBusinessFaxNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Work | KABC::PhoneNumber::Fax));
-            break;
-        case PidTagHomeFaxNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Home | KABC::PhoneNumber::Fax));
-            break;
-        case PidTagPagerTelephoneNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Pager));
-            break;
-        case PidTagIsdnNumber:
-            addressee.insertPhoneNumber(KABC::PhoneNumber(property.value().toString(), KABC::PhoneNumber::Isdn));
-            break;
-
-        // 2.2.4.73
-        case PidTagGender:
-            switch (property.value().toString().toUInt()) {
-            case 1:
-                // Female.
-                addressee.setTitle(i18n("Ms."));
-                break;
-            case 2:
-                // Male.
-                addressee.setTitle(i18n("Mr."));
-                break;
-            }
-            break;
-        // 2.2.4.77 and related.
-        case PidTagPersonalHomePage:
-            addressee.setUrl(KUrl(property.value().toString()));
-            break;
-        case PidTagBusinessHomePage:
-            if (addressee.url().isEmpty()) {
-                addressee.setUrl(KUrl(property.value().toString()));
-            }
-            break;
-
-        // 2.2.4.79
-        case PidTagBirthday:
-            addressee.setBirthday(property.value().toDateTime());
-            break;
-        // 2.2.4.82
-        case PidTagThumbnailPhoto:
-            addressee.setPhoto(KABC::Picture(QImage::fromData(property.value().toByteArray())));
-            break;
-        default:
-            const char *str = get_proptag_name(property.tag());
-            QString tagName;
-
-            if (str) {
-                tagName = QString::fromAscii(str).mid(6);
-            } else {
-                tagName = QString::number(property.tag(), 0, 16);
-            }
-
-            if (PT_ERROR != (property.tag() & 0xFFFF)) {
-                addressee.insertCustom(i18n("Exchange"), tagName, property.toString());
-            }
-
-            // Handle oversize objects.
-            if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
-                switch (property.tag()) {
-                default:
-                    kError() << "missing oversize support:" << tagName;
-                    break;
-                }
-
-                // Carry on with next property...
-                break;
-            }
-            break;
-        }
-    }
-    if (displayType != DT_MAILUSER) {
-        //this->displayType = mapiDisplayType(displayType);
-    }
-    if (objectType != MAPI_MAILUSER) {
-        //this->objectType = mapiObjectType(objectType);
-        kError() << "email" << email << objectType;
-    }
-
-    // Don't override an SMTP address.
-    if (!email.isEmpty()) {
-        if (!addressee.emails().size()) {
-            addressee.insertEmail(mapiExtractEmail(email, addressType.toAscii()));
-        }
-    }
-
-    // location
-    // officeLocation
-    // location, officeLocation
-    if (!location.isEmpty())
-    {
-        work.setExtended(location);
-    }
-    if (!officeLocation.isEmpty()) {
-        if (!location.isEmpty())
-        {
-            work.setExtended(location.append(separator).append(officeLocation));
-        } else {
-            work.setExtended(officeLocation);
-        }
-    }
-
-    // Any non-empty addresses?
-    if (!postal.formattedAddress().isEmpty()) {
-        addressee.insertAddress(postal);
-    }
-    if (!work.formattedAddress().isEmpty()) {
-        addressee.insertAddress(work);
-    }
-    if (!home.formattedAddress().isEmpty()) {
-        addressee.insertAddress(home);
-    }
-    if (!other.formattedAddress().isEmpty()) {
-        addressee.insertAddress(other);
-    }
-    return true;
-}
+static SPropTagArray changeTags = {
+    (sizeof(changeTagList) / sizeof(changeTagList[0])) - 1,
+    (MAPITAGS *)changeTagList };
 
 /**
  * The Global Address List. Exactly one of these is associated with an instance
@@ -571,7 +280,8 @@ public:
     MapiGAL(MapiConnector2 *connection, QStringList itemMimeType) :
         m_galId(QString::fromAscii("2/gal/gal")),
         m_connection(connection),
-        m_fetchStatus(0)
+        m_fetchStatus(0),
+        m_mimeType(itemMimeType.first())
     {
         setName(i18n("Global Address List"));
         setRemoteId(m_galId.toString());
@@ -619,41 +329,250 @@ public:
     /**
      * Fetch upto the requested number of entries from the GAL. The start
      * point is where we previously left off.
+     *
+     * This is called on the worker thread, so it leaves the parent of the
+     * items to be set by the caller.
+     *
+     * @param bytes     If given, set to the size of the properties read.
      */
-    bool read(unsigned entries, Item::List &contacts, unsigned *percentagePosition = 0)
+    bool read(unsigned entries, GalBatch &batch, unsigned *percentagePosition = 0, unsigned *bytes = 0)
     {
         struct SRowSet *results = NULL;
+        unsigned size = 0;
 
-        if (!m_connection->GALRead(entries, &contactTags, &results, percentagePosition)) {
+        if (!m_connection->GALRead(entries, mapiContactTags(), &results, percentagePosition)) {
             return false;
         }
+        if (bytes) {
+            *bytes = 0;
+        }
         if (!results) {
             // All done!
             return true;
         }
 
         // For each row, construct an Addressee, and add the item to the list.
+        batch.rows = results->cRows;
         for (unsigned i = 0; i < results->cRows; i++) {
             struct SRow &contact = results->aRow[i];
-            KABC::Addressee addressee;
-
-            if (!preparePayload(contact.lpProps, contact.cValues, addressee)) {
-                kError() << "Skipped malformed GAL entry";
+            QString key;
+            QByteArray digest;
+            QString name;
+            Item item;
+
+            changeDigest(contact.lpProps, contact.cValues, key, digest, name, size);
+            if (!name.isEmpty()) {
+                batch.last = name;
+            }
+            if (!entry(contact, item, size)) {
                 continue;
             }
+            batch.digests.insert(key, digest);
+            batch.items << item;
+        }
+        MAPIFreeBuffer(results);
+        if (bytes) {
+            *bytes = size;
+        }
+        return true;
+    }
 
-            Item item(contentMimeTypes()[0]);
-            item.setParentCollection(*this);
-            item.setRemoteId(addressee.name());
-            item.setRemoteRevision(QString::number(1));
-            item.setPayload<KABC::Addressee>(addressee);
+    /**
+     * Like @ref read(), but only the columns needed to see which entries
+     * have changed are fetched. The entries whose digests are not in the
+     * known set are then fetched in full by resolving them.
+     *
+     * This is called on the worker thread.
+     */
+    bool readChanges(unsigned entries, const QHash<QString, QByteArray> &known, GalBatch &batch, unsigned *percentagePosition = 0, unsigned *bytes = 0)
+    {
+        struct SRowSet *results = NULL;
+        unsigned size = 0;
+        QList<QByteArray> names;
+
+        if (!m_connection->GALRead(entries, &changeTags, &results, percentagePosition)) {
+            return false;
+        }
+        if (bytes) {
+            *bytes = 0;
+        }
+        if (!results) {
+            // All done!
+            return true;
+        }
+        batch.rows = results->cRows;
+        for (unsigned i = 0; i < results->cRows; i++) {
+            struct SRow &contact = results->aRow[i];
+            QString key;
+            QByteArray digest;
+            QString name;
+
+            changeDigest(contact.lpProps, contact.cValues, key, digest, name, size);
+            if (!name.isEmpty()) {
+                batch.last = name;
+            }
+            batch.digests.insert(key, digest);
+            if (known.value(key) != digest) {
+                names << key.toUtf8();
+            }
+        }
+        MAPIFreeBuffer(results);
+        if (bytes) {
+            *bytes = size;
+        }
+        if (names.isEmpty()) {
+            return true;
+        }
 
-            contacts << item;
+        // Server round trip here! The DN of an entry resolves to just that
+        // entry.
+        struct PropertyTagArray_r *statuses = NULL;
+        const char *array[names.size() + 1];
+        for (int i = 0; i < names.size(); i++) {
+            array[i] = names.at(i).constData();
+        }
+        array[names.size()] = 0;
+        if (!m_connection->resolveNames(array, mapiContactTags(), &results, &statuses)) {
+            return false;
+        }
+        if (statuses) {
+            // Every request has a status, but only resolved items also have
+            // a row of results.
+            for (unsigned i = 0, resolveds = 0; i < statuses->cValues; i++) {
+                Item item;
+
+                if (results && (MAPI_RESOLVED == statuses->aulPropTag[i]) &&
+                    entry(results->aRow[resolveds++], item, size)) {
+                    batch.items << item;
+                } else {
+                    // Try again next time.
+                    MAPI_KDEBUG(Resource) << "cannot resolve changed GAL entry" << names.at(i);
+                    batch.digests.remove(QString::fromUtf8(names.at(i)));
+                }
+            }
         }
         MAPIFreeBuffer(results);
+        MAPIFreeBuffer(statuses);
+        if (bytes) {
+            *bytes = size;
+        }
         return true;
     }
 
+    /**
+     * Construct an item for a row of the GAL. The item is keyed by the
+     * entry's DN, which unlike its name is unique, and the revision is a
+     * hash of its content so that we can tell whether it has changed.
+     *
+     * @param bytes     Incremented by the size of the properties.
+     */
+    bool entry(struct SRow &contact, Item &item, unsigned &bytes)
+    {
+        KABC::Addressee addressee;
+        QString dn;
+
+        if (!mapiContactPayload(contact.lpProps, contact.cValues, addressee, &dn)) {
+            kError() << "Skipped malformed GAL entry";
+            return false;
+        }
+        if (dn.isEmpty()) {
+            dn = addressee.name();
+        }
+
+        item = Item(m_mimeType);
+        item.setRemoteId(dn);
+        item.setRemoteRevision(contentHash(contact.lpProps, contact.cValues, bytes));
+        item.setPayload<KABC::Addressee>(addressee);
+        return true;
+    }
+
+    /**
+     * A hash of the raw properties of an entry.
+     *
+     * @param bytes     Incremented by the size of the properties hashed.
+     */
+    static QString contentHash(SPropValue *properties, unsigned propertyCount, unsigned &bytes)
+    {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+
+        for (unsigned i = 0; i < propertyCount; i++) {
+            bytes += hashProperty(hash, MapiProperty(properties[i]));
+        }
+        return QString::fromAscii(hash.result().toHex());
+    }
+
+    /**
+     * A digest of the columns of an entry which show when it changes, and
+     * the key of the entry in the digests: its DN if it has one, or its
+     * name. Both of these are the same whether the entry was read with
+     * @ref changeTags or in full.
+     *
+     * @param displayName   Set to the entry's name.
+     * @param bytes         Incremented by the size of the properties hashed.
+     */
+    static void changeDigest(SPropValue *properties, unsigned propertyCount, QString &key, QByteArray &digest, QString &displayName, unsigned &bytes)
+    {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        QString email;
+        QString addressType;
+
+        displayName.clear();
+        for (unsigned i = 0; changeTagList[i]; i++) {
+            for (unsigned j = 0; j < propertyCount; j++) {
+                MapiProperty property(properties[j]);
+
+                // Compare ids, in case the server returned an error instead.
+                if ((property.tag() >> 16) != (changeTagList[i] >> 16)) {
+                    continue;
+                }
+                bytes += hashProperty(hash, property);
+                switch (changeTagList[i]) {
+                case PidTagEmailAddress:
+                    email = property.asString();
+                    break;
+                case PidTagAddressType:
+                    addressType = property.asString();
+                    break;
+                case PidTagDisplayName:
+                    displayName = property.asString();
+                    break;
+                default:
+                    break;
+                }
+                break;
+            }
+        }
+        key = ((addressType == QLatin1String("EX")) && !email.isEmpty()) ? email : displayName;
+        digest = hash.result();
+    }
+
+    /**
+     * Add a property to a hash.
+     *
+     * @return The size of the property.
+     */
+    static unsigned hashProperty(QCryptographicHash &hash, const MapiProperty &property)
+    {
+        int tag = property.tag();
+        const char *utf8 = property.asUtf8();
+        unsigned size;
+        const uint8_t *data = property.asBinary(size);
+
+        hash.addData((const char *)&tag, sizeof(tag));
+        if (utf8) {
+            size = strlen(utf8);
+            hash.addData(utf8, size);
+        } else if (data) {
+            hash.addData((const char *)data, size);
+        } else {
+            QByteArray value = property.toString().toUtf8();
+
+            size = value.size();
+            hash.addData(value);
+        }
+        return sizeof(tag) + size;
+    }
+
     bool seek(const QString &displayName, unsigned *percentagePosition = 0)
     {
         if (!m_connection->GALSeek(displayName, percentagePosition)) {
@@ -687,6 +606,17 @@ public:
         return true;
     }
 
+    /**
+     * Mark the items as being of the given version, and start again from
+     * the beginning.
+     */
+    bool upgrade(unsigned version)
+    {
+        m_fetchStatus->setDateTime(KDateTime());
+        m_fetchStatus->setVersion(version);
+        return rewind();
+    }
+
     bool close()
     {
         // Set the modified attribute to have an end time.
@@ -704,11 +634,73 @@ private:
     const MapiId m_galId;
     MapiConnector2 *m_connection;
     FetchStatusAttribute *m_fetchStatus;
+    const QString m_mimeType;
+};
+
+/**
+ * Read one batch of the GAL on the GAL worker.
+ */
+class MapiGALReadJob : public MapiJob
+{
+public:
+    /**
+     * @param known     If given, only fetch the entries whose digests are
+     *                  not in this set, see @ref MapiGAL::readChanges().
+     *                  It is read on the worker thread, so it must not
+     *                  change until the job has finished.
+     */
+    MapiGALReadJob(MapiGAL *gal, unsigned entries, const QHash<QString, QByteArray> *known = 0) :
+        MapiJob(),
+        m_entries(entries),
+        m_percentagePosition(0),
+        m_bytes(0),
+        m_msecs(0),
+        m_gal(gal),
+        m_known(known)
+    {
+    }
+
+    const unsigned m_entries;
+    GalBatch m_batch;
+    unsigned m_percentagePosition;
+    unsigned m_bytes;
+    qint64 m_msecs;
+
+protected:
+    virtual bool run()
+    {
+        MapiSpan span("MapiGALReadJob", QString::number(m_entries));
+        QElapsedTimer timer;
+        bool result;
+
+        timer.start();
+        if (m_known) {
+            result = m_gal->readChanges(m_entries, *m_known, m_batch, &m_percentagePosition, &m_bytes);
+        } else {
+            result = m_gal->read(m_entries, m_batch, &m_percentagePosition, &m_bytes);
+        }
+        m_msecs = timer.elapsed();
+        return result;
+    }
+
+private:
+    MapiGAL *m_gal;
+    const QHash<QString, QByteArray> *m_known;
 };
 
 ExGalResource::ExGalResource(const QString &id) : 
     MapiResource(id, i18n("Exchange Address Lists"), IPF_CONTACT, "IPM.Contact", QString::fromAscii("text/directory")),
-    m_gal(new MapiGAL(m_connection, QStringList(m_itemMimeType))),
+    m_galConnection(new MapiConnector2()),
+    m_galWorker(new MapiWorker(this)),
+    m_gal(new MapiGAL(m_galConnection, QStringList(m_itemMimeType))),
+    m_galRead(0),
+    m_galWriting(false),
+    m_galReadAll(false),
+    m_galFailed(false),
+    m_galBatchSize(GAL_BATCH_SIZE),
+    m_galDelta(false),
+    m_galRewound(false),
+    m_galDigestsLoaded(false),
     m_msExchangeFetch(0),
     m_msAkonadiWrite(0),
     m_msAkonadiWriteStatus(0)
@@ -718,11 +710,16 @@ ExGalResource::ExGalResource(const QString &id) :
                              Settings::self(), 
                              QDBusConnection::ExportAdaptors);
     AttributeFactory::registerAttribute<FetchStatusAttribute>();
+    m_galWorker->setObjectName(QString::fromAscii("gal"));
+    m_galWorker->start();
 }
 
 ExGalResource::~ExGalResource()
 {
+    // The worker may still be reading the GAL, so stop it first.
+    delete m_galWorker;
     delete m_gal;
+    delete m_galConnection;
 }
 
 const QString ExGalResource::profile()
@@ -750,7 +747,7 @@ void ExGalResource::retrieveCollections()
     // until a restart.
     setName(i18n("Exchange Address Lists for %1", profile()));
     MapiId rootId(QString::fromAscii("0/gal/galRoot"));
-    kError() << "default folder:" << rootId.toString();
+    MAPI_KDEBUG(Resource) << "default folder:" << rootId.toString();
     Collection root;
     QStringList contentTypes;
     contentTypes << m_itemMimeType << Akonadi::Collection::mimeType();
@@ -791,21 +788,29 @@ void ExGalResource::retrieveCollections()
 
 void ExGalResource::retrieveItems(const Akonadi::Collection &collection)
 {
-    Item::List items;
-    Item::List deletedItems;
-
-    kError() << __FUNCTION__ << collection.name();
+    MAPI_KDEBUG(Resource) << __FUNCTION__ << collection.name();
     MapiId id(collection.remoteId());
     if (!id.isValid()) {
         // This is the case for the 0/gal/galRoot See above.
-        kDebug() << "No items to fetch for" << id.toString();
+        MAPI_KDEBUG(Resource) << "No items to fetch for" << id.toString();
         cancelTask();
         return;
     }
     if (id == m_gal->id()) {
 #if (ENABLE_GAL)
+        if (m_galRead || m_galWriting) {
+            // The worker may be reading the GAL, so leave it be.
+            MAPI_KDEBUG(Resource) << "Already fetching GAL";
+            cancelTask();
+            return;
+        }
+
         // Assume the GAL is going to take a while to fetch.
         setAutomaticProgressReporting(false);
+        if (!galLogon()) {
+            cancelTask();
+            return;
+        }
 
         // Now that the collection has come back to us from the backend,
         // it isValid(). Make m_gal valid too...
@@ -815,10 +820,10 @@ void ExGalResource::retrieveItems(const Akonadi::Collection &collection)
         // displayName to start from.
         QString savedDisplayName = fetchStatus->displayName();
         if (savedDisplayName.isEmpty()) {
-            kDebug() << "Start fetching GAL";
+            MAPI_KDEBUG(Resource) << "Start fetching GAL";
             emit status(Running, i18n("Start fetching GAL"));
         } else {
-            kDebug() << "Fetching GAL from item" << savedDisplayName;
+            MAPI_KDEBUG(Resource) << "Fetching GAL from item" << savedDisplayName;
             emit status(Running, i18n("Fetching GAL from item: %1", savedDisplayName));
 
             // Seek to the row at or after the point we remembered.
@@ -834,38 +839,48 @@ void ExGalResource::retrieveItems(const Akonadi::Collection &collection)
 #endif
         cancelTask();
     } else {
-        // This request is NOT for the GAL. We don't bother with 
-        // streaming mode.
+        // This request is NOT for the GAL. The items are streamed to us in
+        // chunks if prefetching, and finished in itemsFetched().
         setAutomaticProgressReporting(true);
-        fetchItems(collection, items, deletedItems);
-        kError() <<"calling retrieved"<<items.size() << deletedItems.size();
-        itemsRetrievedIncremental(items, deletedItems);
-        itemsRetrievalDone();
-        kDebug() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
+        fetchItems(collection);
     }
 }
 
+void ExGalResource::itemsFetched(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+{
+    Q_UNUSED(collection);
+
+    MAPI_KDEBUG(Resource) << "calling retrieved"<<items.size() << deletedItems.size();
+    itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
+    MAPI_KDEBUG(Resource) << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
+}
+
 /**
- * Streamed fetch of the GAL from Exchange, one batch at a time.
- * 
- * Next state: If we have read the entire GAL, @ref updateAkonadiBatchStatus for the 
- * last time, otherwise @ref createAkonadiItem().
+ * Streamed fetch of the GAL from Exchange, one batch at a time. This is a
+ * pipeline: while one batch is being written to Akonadi, the next ones are
+ * read from Exchange on the GAL worker, upto @ref GAL_PIPELINE_DEPTH
+ * batches ahead. Only batches which have been written are checkpointed in
+ * the @ref FetchStatusAttribute.
+ *
+ * Next state: @ref readExchangeBatchDone(), or if the GAL was fetched
+ * recently enough, nothing.
  */
 void ExGalResource::fetchExchangeBatch()
 {
-    // The size of a batch is arbitrary. On my laptop, the number here gives
-    // about 4 seconds in Exchange, and about 4 seconds in Akonadi.
-    unsigned requestedCount = 500;
-    unsigned percentagePosition;
-
-    if (!logon()) {
-        error(i18n("Login failed: %1", mapiError()));
+    if (m_galRead || m_galWriting) {
         return;
     }
+    if (!galLogon()) {
+        return;
+    }
+    digestsLoad();
 
-    // Actually do the fetching.
-    m_galItems.clear();
     const FetchStatusAttribute *fetchStatus = m_gal->offset();
+    if (fetchStatus->version() < GAL_ITEMS_VERSION) {
+        purgeAkonadiItems();
+        return;
+    }
     KDateTime savedDateTime = fetchStatus->dateTime();
     if (savedDateTime.isValid()) {
         // If the saved fetch time is over a day ago, refetch it.
@@ -875,92 +890,375 @@ void ExGalResource::fetchExchangeBatch()
                 error(i18n("Cannot rewind GAL: %1", mapiError()));
                 return;
             }
-            fetchStatus = m_gal->offset();
+
+            // Unless it is time for a full refresh, just fetch the changes.
+            m_galDelta = !m_galDigests.isEmpty() && m_galRefreshed.isValid() &&
+                (m_galRefreshed.daysTo(QDateTime::currentDateTimeUtc()) < GAL_FULL_REFRESH_DAYS);
+            if (!m_galDelta) {
+                m_galDigests.clear();
+            }
+            m_galSavedDigests.clear();
+            MAPI_KDEBUG(Resource) << "Refreshing GAL" << (m_galDelta ? "changes" : "entries") <<
+                "last full refresh" << m_galRefreshed;
         } else {
-            kDebug() << "Finished fetching GAL" << savedDateTime;
+            MAPI_KDEBUG(Resource) << "Finished fetching GAL" << savedDateTime;
             emit status(Running, i18n("Finished fetching GAL: %1", savedDateTime.toString()));
             emit percent(100);
             return;
         }
     }
 
-#if MEASURE_PERFORMANCE
-    m_msExchangeFetch = 0;
-    m_msAkonadiWrite = 0;
-    m_msAkonadiWriteStatus = 0;
-    m_msExchangeFetch -= QDateTime::currentMSecsSinceEpoch();
-#endif
-    if (!m_gal->read(requestedCount, m_galItems, &percentagePosition)) {
-        error(i18n("Cannot fetch GAL: %1", mapiError()));
+    // A pass which resumes part way through may have missed the digests of
+    // the entries before that point.
+    m_galRewound = fetchStatus->displayName().isEmpty();
+    m_galBatches.clear();
+    m_galReadAll = false;
+    m_galFailed = false;
+    readExchangeBatch();
+}
+
+/**
+ * Before version 1, GAL items were keyed by display name, so that people
+ * who share a name shared an item, and none of them would be found by DN.
+ * Remove all such items before fetching the GAL again.
+ *
+ * Next state: @ref purgeAkonadiItemsFetched().
+ */
+void ExGalResource::purgeAkonadiItems()
+{
+    MAPI_KDEBUG(Resource) << "Removing GAL items of version" << m_gal->offset()->version();
+    emit status(Running, i18n("Removing old GAL items"));
+    m_galWriting = true;
+    Akonadi::ItemFetchJob *fetch = new Akonadi::ItemFetchJob(*m_gal, this);
+    fetch->fetchScope().setCacheOnly(true);
+    fetch->fetchScope().fetchFullPayload(false);
+    connect(fetch, SIGNAL(result(KJob *)), SLOT(purgeAkonadiItemsFetched(KJob *)));
+}
+
+/**
+ * Delete the items which are not keyed by DN (a DN always starts with /).
+ *
+ * Next state: @ref purgeAkonadiItemsDone().
+ */
+void ExGalResource::purgeAkonadiItemsFetched(KJob *job)
+{
+    Akonadi::Item::List stale;
+
+    if (job->error()) {
+        // A fetch which finds nothing reports it as an error.
+        static QString noItems = QString::fromAscii("Unknown error. (No items found)");
+        if (job->errorString() != noItems) {
+            kError() << __FUNCTION__ << job->errorString();
+            error(i18n("Cannot remove old GAL items: %1", job->errorString()));
+            m_galWriting = false;
+            return;
+        }
+    } else {
+        foreach (const Akonadi::Item &item, static_cast<Akonadi::ItemFetchJob *>(job)->items()) {
+            if (!item.remoteId().startsWith(QLatin1Char('/'))) {
+                stale.append(item);
+            }
+        }
+    }
+    MAPI_KDEBUG(Resource) << "Removing" << stale.size() << "old GAL items";
+    if (stale.isEmpty()) {
+        purgeAkonadiItemsDone(0);
+        return;
+    }
+    Akonadi::ItemDeleteJob *remove = new Akonadi::ItemDeleteJob(stale, this);
+    connect(remove, SIGNAL(result(KJob *)), SLOT(purgeAkonadiItemsDone(KJob *)));
+}
+
+/**
+ * Once the old items are gone, fetch the whole GAL again. The new version
+ * is saved with the status of the first batch written.
+ *
+ * Next state: @ref fetchExchangeBatch().
+ */
+void ExGalResource::purgeAkonadiItemsDone(KJob *job)
+{
+    m_galWriting = false;
+    if (job && job->error()) {
+        // Try again next time.
+        kError() << __FUNCTION__ << job->errorString();
+        error(i18n("Cannot remove old GAL items: %1", job->errorString()));
+        return;
+    }
+    if (!m_gal->upgrade(GAL_ITEMS_VERSION)) {
+        error(i18n("Cannot rewind GAL: %1", mapiError()));
+        return;
+    }
+    m_galDigests.clear();
+    m_galSavedDigests.clear();
+    m_galRefreshed = QDateTime();
+    QMetaObject::invokeMethod(this, "fetchExchangeBatch", Qt::QueuedConnection);
+}
+
+/**
+ * Log in to the GAL's own session. It is only used here while no read job
+ * is running, and by the read jobs on the GAL worker.
+ */
+bool ExGalResource::galLogon()
+{
+    if (!m_galConnection->login(profile(), GAL_CHANNEL)) {
+        error(i18n("Login failed: %1", mapiError()));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Start reading the next batch of the GAL on the GAL worker. In a delta
+ * pass, the job looks up m_galDigests as it reads, so that is left alone
+ * until the pass is over, see @ref updateAkonadiBatchStatus().
+ *
+ * Next state: @ref readExchangeBatchDone().
+ */
+void ExGalResource::readExchangeBatch()
+{
+    m_galRead = new MapiGALReadJob(m_gal, m_galBatchSize, m_galDelta ? &m_galDigests : 0);
+    MapiTrace::asyncBegin("GAL fetch", m_galRead);
+    connect(m_galRead, SIGNAL(finished(MapiJob *)), SLOT(readExchangeBatchDone(MapiJob *)));
+    m_galWorker->post(m_galRead);
+}
+
+/**
+ * Queue a batch read from Exchange, and keep both sides of the pipeline
+ * busy.
+ *
+ * Next state: @ref readExchangeBatch() if there is room in the queue, and
+ * @ref writeAkonadiBatch() if nothing is being written.
+ */
+void ExGalResource::readExchangeBatchDone(MapiJob *mapiJob)
+{
+    MapiGALReadJob *job = static_cast<MapiGALReadJob *>(mapiJob);
+
+    MapiTrace::asyncEnd("GAL fetch", job);
+    m_galRead = 0;
+    job->deleteLater();
+    if (m_galFailed) {
+        // The pipeline has been abandoned.
         return;
     }
-    emit percent(percentagePosition);
+    if (!job->succeeded()) {
+        // Stop reading, but let the batches we already have be written.
+        if (job->sessionLost()) {
+            m_galConnection->logout(true);
+        }
+
+        // Perhaps the server timed out. Try a smaller batch next time.
+        adjustBatchSize(job->m_entries, 0, 0);
+        m_galFailed = true;
+        error(i18n("Cannot fetch GAL: %1", job->errorText()));
+    } else if (!job->m_batch.rows) {
+        // All read!
+        m_galReadAll = true;
+    } else {
+        emit percent(job->m_percentagePosition);
+        adjustBatchSize(job->m_batch.rows, job->m_bytes, qMax(job->m_msecs, (qint64)1));
 #if MEASURE_PERFORMANCE
-    m_msExchangeFetch += QDateTime::currentMSecsSinceEpoch();
+        m_msExchangeFetch = job->m_msecs;
 #endif
-    logoff();
+        for (int i = 0; i < job->m_batch.items.size(); i++) {
+            job->m_batch.items[i].setParentCollection(*m_gal);
+        }
+        m_galBatches.enqueue(job->m_batch);
+        if (m_galBatches.size() < GAL_PIPELINE_DEPTH) {
+            readExchangeBatch();
+        }
+    }
+    if (!m_galWriting) {
+        writeAkonadiBatch();
+    }
+}
+
+/**
+ * Pick the size of the next batch from the last one. The rate at which
+ * rows came back gives the size which would take GAL_BATCH_MSECS, but to
+ * smooth out the noise, the size is only allowed to halve or double at
+ * each step.
+ *
+ * @param rows      The number of rows read.
+ * @param bytes     Their size.
+ * @param msecs     How long the read took, or zero if it failed.
+ */
+void ExGalResource::adjustBatchSize(unsigned rows, unsigned bytes, qint64 msecs)
+{
+    unsigned size;
+
+    if (!msecs) {
+        size = qMin(rows, m_galBatchSize) / 2;
+    } else {
+        size = (unsigned)qMin((qint64)GAL_BATCH_MAX, rows * (qint64)GAL_BATCH_MSECS / msecs);
+        if (bytes) {
+            size = qMin(size, (unsigned)(rows * (qint64)GAL_BATCH_BYTES / bytes));
+        }
+        size = qBound(m_galBatchSize / 2, size, m_galBatchSize * 2);
+    }
+    size = qBound((unsigned)GAL_BATCH_MIN, size, (unsigned)GAL_BATCH_MAX);
+    if (size != m_galBatchSize) {
+        MAPI_KDEBUG(Resource) << "GAL batch of" << rows << "rows," << bytes << "bytes took" << msecs <<
+            "ms, next batch size:" << size;
+    }
+    m_galBatchSize = size;
+    MapiMetrics::set(MapiMetrics::GALBatchSize, m_galBatchSize);
+}
+
+/**
+ * Start writing the oldest batch we have read to Akonadi. Once everything
+ * has been read and written, the GAL is marked as complete.
+ *
+ * Next state: @ref writeAkonadiItems(), or @ref updateAkonadiBatchStatus()
+ * for the last time.
+ */
+void ExGalResource::writeAkonadiBatch()
+{
+    m_galWriting = false;
+    if (m_galBatches.isEmpty()) {
+        if (!m_galReadAll || m_galFailed) {
+            // Wait for the next batch to be read, or give up.
+            return;
+        }
 
-    if (!m_galItems.size()) {
         // All done!
+        m_galWriting = true;
+        m_galBatch = GalBatch();
+        MapiTrace::asyncBegin("GAL batch", this);
         emit status(Running, i18n("Finished fetching GAL"));
         emit percent(100);
-        updateAkonadiBatchStatus();
+        updateAkonadiBatchStatus(QString(), true);
         return;
     }
+    m_galWriting = true;
+    m_galBatch = m_galBatches.dequeue();
+
+    // Now that there is room in the queue, keep Exchange busy.
+    if (!m_galRead && !m_galReadAll && !m_galFailed) {
+        readExchangeBatch();
+    }
 
     // Push the batch into Akonadi.
-    QString lastDisplayName = m_galItems.last().payload<KABC::Addressee>().name();
-    emit status(Running, i18n("Saving GAL through to item: %1", lastDisplayName));
+    emit status(Running, i18n("Saving GAL through to item: %1", m_galBatch.last));
 #if MEASURE_PERFORMANCE
+    m_msAkonadiWrite = 0;
+    m_msAkonadiWriteStatus = 0;
     m_msAkonadiWrite -= QDateTime::currentMSecsSinceEpoch();
 #endif
-    Akonadi::ItemDeleteJob *job = new Akonadi::ItemDeleteJob(m_galItems);
-    connect(job, SIGNAL(result(KJob *)), SLOT(createAkonadiItem(KJob *)));
+    MapiTrace::asyncBegin("GAL batch", this);
+    if (m_galBatch.items.isEmpty()) {
+        // Nothing in this batch has changed.
+        updateAkonadiBatchStatus(m_galBatch.last);
+        return;
+    }
+    //
+    // Start by finding which of the items we already have.
+    MapiTrace::asyncBegin("GAL write", this, QString::number(m_galBatch.items.size()));
+    Akonadi::ItemFetchJob *fetch = new Akonadi::ItemFetchJob(m_galBatch.items, this);
+    fetch->setCollection(*m_gal);
+    fetch->fetchScope().setCacheOnly(true);
+    fetch->fetchScope().fetchFullPayload(false);
+    connect(fetch, SIGNAL(result(KJob *)), SLOT(writeAkonadiItems(KJob *)));
 }
 
 /**
- * Initiate the creation of a single GAL item if we didn't find an existing item
- * or else modify the existing one.
- * 
- * Next state: @ref createAkonadiItemDone().
+ * Write a batch of GAL items as one transaction, creating the new ones and
+ * modifying those whose content has changed. Failures of individual items
+ * are reported, but do not prevent the rest of the batch from being
+ * committed.
+ *
+ * Next state: @ref createAkonadiItemsDone(), or if nothing has changed,
+ * @ref updateAkonadiBatchStatus().
  */
-void ExGalResource::createAkonadiItem(KJob *job)
+void ExGalResource::writeAkonadiItems(KJob *job)
 {
+    QHash<QString, Akonadi::Item> existing;
+
     if (job->error()) {
-        // Modify normal error reporting, since a delete can give us the
-        // error "Unknown error. (No items found)".
+        // A fetch which finds nothing reports it as an error.
         static QString noItems = QString::fromAscii("Unknown error. (No items found)");
         if (job->errorString() != noItems) {
             kError() << __FUNCTION__ << job->errorString();
         }
+    } else {
+        foreach (const Akonadi::Item &item, static_cast<Akonadi::ItemFetchJob *>(job)->items()) {
+            existing.insert(item.remoteId(), item);
+        }
     }
-    Akonadi::Item item = m_galItems.first();
-    m_galItems.removeFirst();
 
-    // Save the new item in Akonadi.
-    Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, *m_gal);
-    connect(createJob, SIGNAL(result(KJob *)), SLOT(createAkonadiItemDone(KJob *)));
+    Akonadi::TransactionSequence *transaction = 0;
+    unsigned created = 0;
+    unsigned modified = 0;
+    foreach (const Akonadi::Item &item, m_galBatch.items) {
+        QHash<QString, Akonadi::Item>::const_iterator i = existing.constFind(item.remoteId());
+        KJob *writeJob;
+
+        if (i == existing.constEnd()) {
+            if (!transaction) {
+                transaction = new Akonadi::TransactionSequence(this);
+            }
+            writeJob = new Akonadi::ItemCreateJob(item, *m_gal, transaction);
+            created++;
+        } else if (i.value().remoteRevision() != item.remoteRevision()) {
+            Akonadi::Item update(i.value());
+
+            update.setPayload<KABC::Addressee>(item.payload<KABC::Addressee>());
+            update.setRemoteRevision(item.remoteRevision());
+            if (!transaction) {
+                transaction = new Akonadi::TransactionSequence(this);
+            }
+            Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(update, transaction);
+            modifyJob->disableRevisionCheck();
+            writeJob = modifyJob;
+            modified++;
+        } else {
+            continue;
+        }
+        transaction->setIgnoreJobFailure(writeJob);
+        connect(writeJob, SIGNAL(result(KJob *)), SLOT(createAkonadiItemDone(KJob *)));
+    }
+    MAPI_KDEBUG(Resource) << "GAL batch:" << m_galBatch.rows << "read:" << m_galBatch.items.size() << "created:" << created << "modified:" << modified;
+    if (!transaction) {
+        // Nothing has changed.
+        MapiTrace::asyncEnd("GAL write", this);
+        updateAkonadiBatchStatus(m_galBatch.last);
+        return;
+    }
+    connect(transaction, SIGNAL(result(KJob *)), SLOT(createAkonadiItemsDone(KJob *)));
 }
- 
+
 /**
- * Complete the creation of a single GAL item.
- * 
- * Next state: If there are more items in the batch, create the next item
- * @ref fetchAkonadiItem(), otherwise @ref updateAkonadiBatchStatus for the current batch.
+ * Complete the creation or modification of a single GAL item.
  */
 void ExGalResource::createAkonadiItemDone(KJob *job)
 {
     if (job->error()) {
         kError() << __FUNCTION__ << job->errorString();
     }
-    if (m_galItems.size()) {
-        // Go back and create the next item.
-        createAkonadiItem(job);
-    } else {
-        Akonadi::ItemCreateJob *createJob = qobject_cast<Akonadi::ItemCreateJob *>(job);
-        // Update the status of the current batch.
-        updateAkonadiBatchStatus(createJob->item().payload<KABC::Addressee>().name());
+}
+
+/**
+ * Complete the transaction which wrote a batch of GAL items.
+ *
+ * Next state: @ref updateAkonadiBatchStatus for the current batch.
+ */
+void ExGalResource::createAkonadiItemsDone(KJob *job)
+{
+    MapiTrace::asyncEnd("GAL write", this);
+    if (job->error()) {
+        // The batch was rolled back. Leave the status alone, so that the
+        // next sync starts again from the last batch which was saved, and
+        // abandon any batches read since.
+        kError() << __FUNCTION__ << job->errorString();
+        error(i18n("Cannot save GAL: %1", job->errorString()));
+        MapiTrace::asyncEnd("GAL batch", this);
+        m_galFailed = true;
+        m_galBatches.clear();
+        m_galWriting = false;
+        return;
     }
+
+    // Update the status of the current batch.
+    updateAkonadiBatchStatus(m_galBatch.last);
 }
 
 /**
@@ -968,23 +1266,43 @@ void ExGalResource::createAkonadiItemDone(KJob *job)
  * of the fetch status of the GAL, see @ref FetchStatusAttribute.
  * 
  * @param lastAddressee		If not empty, the displayName of the last
- * 				item written. If empty, we will write a final
- * 				timestamp instead.
+ * 				item written, from which to resume. If empty,
+ * 				the previous checkpoint is kept.
+ * @param complete		The whole GAL has been written, so we will
+ * 				write a final timestamp instead.
  * 
  * Next state: @ref updateAkonadiBatchStatusDone().
  */
-void ExGalResource::updateAkonadiBatchStatus(QString lastAddressee)
+void ExGalResource::updateAkonadiBatchStatus(QString lastAddressee, bool complete)
 {
 #if MEASURE_PERFORMANCE
     m_msAkonadiWrite += QDateTime::currentMSecsSinceEpoch();
     m_msAkonadiWriteStatus -= QDateTime::currentMSecsSinceEpoch();
 #endif
-    if (lastAddressee.isEmpty()) {
+    MapiTrace::asyncBegin("GAL status", this);
+    if (complete) {
         // All done.
         m_gal->close();
+        if (!m_galDelta && m_galRewound) {
+            m_galRefreshed = QDateTime::currentDateTimeUtc();
+        }
+
+        // Nothing is reading the digests now.
+        for (QHash<QString, QByteArray>::const_iterator i = m_galSavedDigests.constBegin(); i != m_galSavedDigests.constEnd(); ++i) {
+            m_galDigests.insert(i.key(), i.value());
+        }
+        m_galSavedDigests.clear();
+        digestsSave();
     } else {
-        emit status(Running, i18n("Saved GAL through to item: %1", lastAddressee));
-        m_gal->sync(lastAddressee);
+        if (!lastAddressee.isEmpty()) {
+            emit status(Running, i18n("Saved GAL through to item: %1", lastAddressee));
+            m_gal->sync(lastAddressee);
+        }
+
+        // Now that the batch is saved, remember what it contained.
+        for (QHash<QString, QByteArray>::const_iterator i = m_galBatch.digests.constBegin(); i != m_galBatch.digests.constEnd(); ++i) {
+            m_galSavedDigests.insert(i.key(), i.value());
+        }
     }
 
     // Push the "fetched" state out to Akonadi.
@@ -996,7 +1314,8 @@ void ExGalResource::updateAkonadiBatchStatus(QString lastAddressee)
 /**
  * Complete the update of the fetch status of the GAL.
  * 
- * Next state: Go get the next batch, @ref fetchExchangeBatch().
+ * Next state: Write the next batch, @ref writeAkonadiBatch(), or once
+ * the GAL is complete, @ref fetchExchangeBatch().
  */
 void ExGalResource::updateAkonadiBatchStatusDone(KJob *job)
 {
@@ -1005,13 +1324,83 @@ void ExGalResource::updateAkonadiBatchStatusDone(KJob *job)
     }
 #if MEASURE_PERFORMANCE
     m_msAkonadiWriteStatus += QDateTime::currentMSecsSinceEpoch();
-    kDebug() << "Exchange fetch ms:" << m_msExchangeFetch <<
+    MAPI_KDEBUG(Resource) << "Exchange fetch ms:" << m_msExchangeFetch <<
         "Akonadi write ms:" << m_msAkonadiWrite <<
         "Akonadi status write ms:" << m_msAkonadiWriteStatus;
 #endif
+    MapiTrace::asyncEnd("GAL status", this);
+    MapiTrace::asyncEnd("GAL batch", this);
 
-    // Go get the next batch.
-    QMetaObject::invokeMethod(this, "fetchExchangeBatch", Qt::QueuedConnection);
+    if (!m_galBatch.rows) {
+        // The GAL is complete.
+        m_galWriting = false;
+        QMetaObject::invokeMethod(this, "fetchExchangeBatch", Qt::QueuedConnection);
+        return;
+    }
+
+    // Go write the next batch.
+    writeAkonadiBatch();
+}
+
+/**
+ * The digests of the GAL entries, see MapiGAL::changeDigest(), are kept in
+ * the cache between runs.
+ */
+QString ExGalResource::digestsFileName() const
+{
+    return KStandardDirs::locateLocal("cache", QString::fromAscii("akonadi_exchange/galdigests-%1").arg(identifier()));
+}
+
+void ExGalResource::digestsLoad()
+{
+    if (m_galDigestsLoaded) {
+        return;
+    }
+    m_galDigestsLoaded = true;
+
+    QString fileName = digestsFileName();
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QDataStream stream(&file);
+    QByteArray magic;
+    quint32 version;
+    QDateTime refreshed;
+    QHash<QString, QByteArray> digests;
+
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream >> magic >> version;
+    if ((magic != galDigestsMagic) || (version != GAL_DIGESTS_VERSION)) {
+        kError() << "ignoring GAL digests:" << fileName;
+        return;
+    }
+    stream >> refreshed >> digests;
+    if (stream.status() != QDataStream::Ok) {
+        kError() << "cannot read GAL digests:" << fileName;
+        return;
+    }
+    m_galRefreshed = refreshed;
+    m_galDigests = digests;
+    MAPI_KDEBUG(Resource) << "loaded" << m_galDigests.size() << "GAL digests from" << fileName;
+}
+
+void ExGalResource::digestsSave() const
+{
+    QString fileName = digestsFileName();
+    KSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        kError() << "cannot save GAL digests:" << fileName << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream << QByteArray(galDigestsMagic) << (quint32)GAL_DIGESTS_VERSION << m_galRefreshed << m_galDigests;
+    if (!file.finalize()) {
+        kError() << "cannot save GAL digests:" << fileName << file.errorString();
+    }
 }
 
 /**
@@ -1021,20 +1410,36 @@ bool ExGalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByte
 {
     Q_UNUSED(parts);
 
-    kError() << "GAL retrieveItem";
-    MapiContact *message = fetchItem<MapiContact>(itemOrig);
-    if (!message) {
-        return false;
-    }
+    MAPI_KDEBUG(Resource) << "GAL retrieveItem";
+    return fetchItemAsync<MapiContact>(itemOrig);
+}
 
+void ExGalResource::itemFetched(const Akonadi::Item &itemOrig, MapiMessage *message)
+{
     // Create a clone of the passed in Item and fill it with the payload.
     Akonadi::Item item(itemOrig);
-    item.setPayload<KABC::Addressee>(*message);
+    itemPayload(item, message);
 
     // Notify Akonadi about the new data.
     itemRetrieved(item);
+}
+
+unsigned ExGalResource::prefetchSessions()
+{
+    return Settings::self()->prefetchSessions();
+}
+
+MapiMessage *ExGalResource::createMessage(MapiConnector2 *connection, MapiId &id)
+{
+    return new MapiContact(connection, "ExGalResource::createMessage", id);
+}
+
+void ExGalResource::itemPayload(Akonadi::Item &item, MapiMessage *mapiMessage)
+{
+    MapiContact *message = static_cast<MapiContact *>(mapiMessage);
+
+    item.setPayload<KABC::Addressee>(*message);
     delete message;
-    return true;
 }
 
 void ExGalResource::aboutToQuit()
@@ -1117,18 +1522,12 @@ QDebug MapiContact::error() const
 bool MapiContact::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
 {
     if (!tagsAppended) {
-        for (unsigned i = 0; i < contactTags.cValues; i++) {
-            int newTag = contactTags.aulPropTag[i];
-            
-            if (!tags.contains(newTag)) {
-                tags.append(newTag);
-            }
-        }
+        mapiContactTagsAppend(tags);
     }
     if (!MapiMessage::propertiesPull(tags, tagsAppended, pullAll)) {
         return false;
     }
-    if (!preparePayload(m_properties, m_propertyCount, *this)) {
+    if (!mapiContactPayload(m_properties, m_propertyCount, *this)) {
         return false;
     }
     return true;
@@ -1136,15 +1535,9 @@ bool MapiContact::propertiesPull(QVector<int> &tags, const bool tagsAppended, bo
 
 bool MapiContact::propertiesPull()
 {
-    static bool tagsAppended = false;
-    static QVector<int> tags;
+    QVector<int> tags(mapiContactItemTags());
 
-    if (!propertiesPull(tags, tagsAppended, (DEBUG_CONTACT_PROPERTIES) != 0)) {
-        tagsAppended = true;
-        return false;
-    }
-    tagsAppended = true;
-    return true;
+    return propertiesPull(tags, true, MapiLog::enabled(MapiLog::Objects, MapiLog::Trace));
 }
 
 AKONADI_RESOURCE_MAIN(ExGalResource)
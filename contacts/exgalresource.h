@@ -21,6 +21,10 @@
 #ifndef EXGALRESOURCE_H
 #define EXGALRESOURCE_H
 
+#include <QDateTime>
+#include <QHash>
+#include <QQueue>
+
 #include "mapiresource.h"
 
 namespace Akonadi
@@ -28,6 +32,40 @@ namespace Akonadi
     class Collection;
 }
 class KJob;
+class MapiGALReadJob;
+
+/**
+ * A batch of GAL entries read from Exchange.
+ */
+struct GalBatch
+{
+    GalBatch() :
+        rows(0)
+    {
+    }
+
+    /**
+     * The entries read in full.
+     */
+    Akonadi::Item::List items;
+
+    /**
+     * The number of rows read, which includes any unchanged entries which
+     * were not read in full.
+     */
+    unsigned rows;
+
+    /**
+     * The name of the last row which has one, which is where to resume
+     * from. Empty if no row in the batch has a name.
+     */
+    QString last;
+
+    /**
+     * The digests of the rows read.
+     */
+    QHash<QString, QByteArray> digests;
+};
 class MapiConnector2;
 
 /**
@@ -58,22 +96,70 @@ protected:
     virtual void itemAdded(const Akonadi::Item &item, const Akonadi::Collection &collection);
     virtual void itemChanged(const Akonadi::Item &item, const QSet<QByteArray> &parts);
     virtual void itemRemoved(const Akonadi::Item &item);
+    virtual void itemsFetched(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+    virtual void itemFetched(const Akonadi::Item &item, MapiMessage *message);
+    virtual unsigned prefetchSessions();
+    virtual MapiMessage *createMessage(MapiConnector2 *connection, MapiId &id);
+    virtual void itemPayload(Akonadi::Item &item, MapiMessage *message);
 
 private:
+    /**
+     * The GAL is read on a worker and session of its own.
+     */
+    MapiConnector2 *m_galConnection;
+    MapiWorker *m_galWorker;
+
     /**
      * A copy of the collection used for the GAL.
      */
     class MapiGAL *m_gal;
-    Akonadi::Item::List m_galItems;
+
+    /**
+     * The batch being written to Akonadi, and those read from Exchange
+     * which are waiting to be written.
+     */
+    GalBatch m_galBatch;
+    QQueue<GalBatch> m_galBatches;
+    MapiGALReadJob *m_galRead;
+    bool m_galWriting;
+    bool m_galReadAll;
+    bool m_galFailed;
+    unsigned m_galBatchSize;
+
+    /**
+     * Are we only fetching the entries which have changed? The digests of
+     * the entries are saved as of the last completed fetch, as is the time
+     * of the last full fetch, which only counts if it started from the
+     * beginning of the GAL. The digests of the batches saved during a fetch
+     * are kept apart until it completes.
+     */
+    bool m_galDelta;
+    bool m_galRewound;
+    bool m_galDigestsLoaded;
+    QHash<QString, QByteArray> m_galDigests;
+    QHash<QString, QByteArray> m_galSavedDigests;
+    QDateTime m_galRefreshed;
     qint64 m_msExchangeFetch;
     qint64 m_msAkonadiWrite;
     qint64 m_msAkonadiWriteStatus;
-    void updateAkonadiBatchStatus(QString lastAddressee = QString());
+    bool galLogon();
+    void purgeAkonadiItems();
+    void readExchangeBatch();
+    void adjustBatchSize(unsigned rows, unsigned bytes, qint64 msecs);
+    void writeAkonadiBatch();
+    void updateAkonadiBatchStatus(QString lastAddressee, bool complete = false);
+    QString digestsFileName() const;
+    void digestsLoad();
+    void digestsSave() const;
 
 private Q_SLOTS:
     void fetchExchangeBatch();
-    void createAkonadiItem(KJob *job);
+    void purgeAkonadiItemsFetched(KJob *job);
+    void purgeAkonadiItemsDone(KJob *job);
+    void readExchangeBatchDone(MapiJob *job);
+    void writeAkonadiItems(KJob *job);
     void createAkonadiItemDone(KJob *job);
+    void createAkonadiItemsDone(KJob *job);
     void updateAkonadiBatchStatusDone(KJob *job);
 };
 
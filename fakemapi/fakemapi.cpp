@@ -0,0 +1,801 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Replacements for the libmapi calls which talk to the server. Preloading
+ * this library ahead of libmapi makes the connector (and anything built on
+ * it) talk to a @ref FakeMapiStore instead:
+ *
+ *  LD_PRELOAD=libfakemapi.so akonadi_exmail_resource ...
+ *
+ * Everything else, including the profile database and the helpers for
+ * handling properties and named properties, is still provided by libmapi.
+ * Only reading is supported; calls which would create or send items are not
+ * replaced, and ICS is reported as unsupported, so that callers fall back to
+ * walking tables.
+ */
+
+#include "fakemapistore.h"
+
+#include <QSet>
+#include <QVector>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Our state for a mapi_object_t, hung off its private_data.
+ */
+class FakeMapiHandle
+{
+public:
+    enum Type {
+        Store,
+        Folder,
+        Message,
+        Attachment,
+        Table,
+        Stream
+    };
+
+    FakeMapiHandle(Type type, mapi_id_t id = 0) :
+        type(type),
+        id(id),
+        position(0),
+        ctx(talloc_named_const(NULL, 0, "FakeMapiHandle"))
+    {
+    }
+
+    ~FakeMapiHandle()
+    {
+        talloc_free(ctx);
+    }
+
+    Type type;
+
+    /**
+     * The folder or message id.
+     */
+    mapi_id_t id;
+
+    /**
+     * A snapshot of a message or attachment.
+     */
+    FakeMapiProperties properties;
+    QList<FakeMapiProperties> recipients;
+    QList<FakeMapiProperties> attachments;
+
+    /**
+     * A table's rows and columns, or a stream's data. The position is the
+     * cursor for either.
+     */
+    QList<FakeMapiProperties> rows;
+    QVector<uint32_t> columns;
+    QByteArray data;
+    unsigned position;
+
+    /**
+     * Results handed back to the caller live as long as the handle.
+     */
+    TALLOC_CTX *ctx;
+};
+
+static QMutex handlesLock;
+static QSet<FakeMapiHandle *> handles;
+static QAtomicInt handleCount(0);
+
+static enum MAPISTATUS failed(enum MAPISTATUS code)
+{
+    errno = code;
+    return code;
+}
+
+static FakeMapiHandle *handle(mapi_object_t *obj)
+{
+    QMutexLocker locker(&handlesLock);
+    FakeMapiHandle *h = (FakeMapiHandle *)obj->private_data;
+
+    if (!h || !handles.contains(h)) {
+        return 0;
+    }
+    return h;
+}
+
+static FakeMapiHandle *handle(mapi_object_t *obj, FakeMapiHandle::Type type)
+{
+    FakeMapiHandle *h = handle(obj);
+
+    if (!h || (h->type != type)) {
+        return 0;
+    }
+    return h;
+}
+
+/**
+ * Make the object refer to the handle. Any previous handle is discarded.
+ */
+static void attach(mapi_object_t *obj, FakeMapiHandle *h, struct mapi_session *session)
+{
+    FakeMapiHandle *old = handle(obj);
+
+    QMutexLocker locker(&handlesLock);
+    if (old) {
+        handles.remove(old);
+        delete old;
+    }
+    handles.insert(h);
+    obj->store = (h->type == FakeMapiHandle::Store);
+    obj->id = h->id;
+    obj->handle = handleCount.fetchAndAddRelaxed(1);
+    obj->logon_id = 0;
+    obj->session = session;
+    obj->private_data = h;
+}
+
+static void detach(mapi_object_t *obj)
+{
+    FakeMapiHandle *h = handle(obj);
+
+    if (h) {
+        QMutexLocker locker(&handlesLock);
+        handles.remove(h);
+        delete h;
+    }
+    mapi_object_init(obj);
+}
+
+/**
+ * The current properties of a folder, message or attachment.
+ */
+static bool properties(FakeMapiHandle *h, FakeMapiProperties &result)
+{
+    switch (h->type) {
+    case FakeMapiHandle::Folder:
+    {
+        FakeMapiNode node(FakeMapiNode::Folder, 0, 0);
+
+        if (!FakeMapiStore::self()->node(h->id, FakeMapiNode::Folder, node)) {
+            return false;
+        }
+        result = node.properties;
+        return true;
+    }
+    case FakeMapiHandle::Message:
+    case FakeMapiHandle::Attachment:
+        result = h->properties;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void rowFill(TALLOC_CTX *ctx, const FakeMapiProperties &properties, const uint32_t *tags, unsigned tagCount, struct SRow &row)
+{
+    row.ulAdrEntryPad = 0;
+    row.cValues = tagCount;
+    row.lpProps = talloc_array(ctx, struct SPropValue, tagCount);
+    for (unsigned i = 0; i < tagCount; i++) {
+        FakeMapiStore::toSPropValue(ctx, properties, tags[i], row.lpProps[i]);
+    }
+}
+
+/**
+ * Common code for GAL rows.
+ */
+static struct SRowSet *galRows(TALLOC_CTX *ctx, unsigned first, unsigned count, struct SPropTagArray *tags)
+{
+    FakeMapiStore *store = FakeMapiStore::self();
+    struct SRowSet *rows = talloc_zero(ctx, struct SRowSet);
+
+    rows->cRows = count;
+    rows->aRow = talloc_array(rows, struct SRow, count);
+    for (unsigned i = 0; i < count; i++) {
+        rowFill(rows, store->galAt(first + i), (uint32_t *)tags->aulPropTag, tags->cValues, rows->aRow[i]);
+    }
+    return rows;
+}
+
+static void galPosition(struct nspi_context *nspi, unsigned position)
+{
+    unsigned total = FakeMapiStore::self()->galCount();
+
+    nspi->pStat->NumPos = position;
+    nspi->pStat->CurrentRec = (position < total) ? (NSPI_MID)(position + 0x100) : (NSPI_MID)MID_END_OF_TABLE;
+    nspi->pStat->TotalRecs = total ? total : 1;
+}
+
+extern "C" {
+
+enum MAPISTATUS mapi_object_init(mapi_object_t *obj)
+{
+    obj->store = false;
+    obj->id = 0;
+    obj->handle = INVALID_HANDLE_VALUE;
+    obj->logon_id = 0;
+    obj->session = NULL;
+    obj->private_data = NULL;
+    return MAPI_E_SUCCESS;
+}
+
+void mapi_object_release(mapi_object_t *obj)
+{
+    if (!handle(obj)) {
+        return;
+    }
+
+    // This is a Release ROP.
+    FakeMapiStore::self()->rpc("Release");
+    detach(obj);
+}
+
+enum MAPISTATUS MapiLogonEx(struct mapi_context *mapi_ctx, struct mapi_session **session, const char *profname, const char *password)
+{
+    Q_UNUSED(mapi_ctx)
+    Q_UNUSED(profname)
+    Q_UNUSED(password)
+    FakeMapiStore *store = FakeMapiStore::self();
+
+    // Binding to both the EMSMDB and NSPI providers costs a few round trips.
+    store->rpc(__FUNCTION__, 3);
+    struct mapi_session *s = talloc_zero(NULL, struct mapi_session);
+    s->emsmdb = talloc_zero(s, struct mapi_provider);
+    s->emsmdb->ctx = talloc_named_const(s->emsmdb, 0, "emsmdb_context");
+    s->nspi = talloc_zero(s, struct mapi_provider);
+
+    struct nspi_context *nspi = talloc_zero(s->nspi, struct nspi_context);
+    nspi->pStat = talloc_zero(nspi, struct STAT);
+    nspi->pStat->CurrentRec = (NSPI_MID)MID_BEGINNING_OF_TABLE;
+    nspi->pStat->TotalRecs = store->galCount() ? store->galCount() : 1;
+    s->nspi->ctx = nspi;
+    *session = s;
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS Logoff(mapi_object_t *obj_store)
+{
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (obj_store->session) {
+        talloc_free(obj_store->session);
+    }
+    detach(obj_store);
+    return MAPI_E_SUCCESS;
+}
+
+NTSTATUS emsmdb_transaction_null(struct emsmdb_context *emsmdb_ctx, struct mapi_response **res)
+{
+    Q_UNUSED(emsmdb_ctx)
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    *res = NULL;
+    return NT_STATUS_OK;
+}
+
+enum MAPISTATUS OpenMsgStore(struct mapi_session *session, mapi_object_t *obj_store)
+{
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    attach(obj_store, new FakeMapiHandle(FakeMapiHandle::Store), session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS OpenPublicFolder(struct mapi_session *session, mapi_object_t *obj_store)
+{
+    Q_UNUSED(session)
+    Q_UNUSED(obj_store)
+    return failed(MAPI_E_NO_SUPPORT);
+}
+
+enum MAPISTATUS GetDefaultFolder(mapi_object_t *obj_store, uint64_t *folder, const uint32_t id)
+{
+    // The ids are returned by the logon, so there is no round trip here.
+    if (!handle(obj_store, FakeMapiHandle::Store)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    *folder = FakeMapiStore::self()->defaultFolder(id);
+    if (!*folder) {
+        return failed(MAPI_E_NOT_FOUND);
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetDefaultPublicFolder(mapi_object_t *obj_store, uint64_t *folder, const uint32_t id)
+{
+    Q_UNUSED(obj_store)
+    Q_UNUSED(folder)
+    Q_UNUSED(id)
+    return failed(MAPI_E_NO_SUPPORT);
+}
+
+enum MAPISTATUS OpenFolder(mapi_object_t *obj_store, mapi_id_t id_folder, mapi_object_t *obj_folder)
+{
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiNode node(FakeMapiNode::Folder, 0, 0);
+
+    store->rpc(__FUNCTION__);
+    if (!handle(obj_store, FakeMapiHandle::Store)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    if (!store->node(id_folder, FakeMapiNode::Folder, node)) {
+        return failed(MAPI_E_NOT_FOUND);
+    }
+    attach(obj_folder, new FakeMapiHandle(FakeMapiHandle::Folder, id_folder), obj_store->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetHierarchyTable(mapi_object_t *obj_container, mapi_object_t *obj_table, uint8_t TableFlags, uint32_t *RowCount)
+{
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiHandle *folder = handle(obj_container, FakeMapiHandle::Folder);
+
+    store->rpc(__FUNCTION__);
+    if (!folder) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    FakeMapiHandle *table = new FakeMapiHandle(FakeMapiHandle::Table, folder->id);
+    table->rows = store->folders(folder->id, (TableFlags & TableFlags_Depth) != 0);
+    if (RowCount) {
+        *RowCount = table->rows.size();
+    }
+    attach(obj_table, table, obj_container->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetContentsTable(mapi_object_t *obj_container, mapi_object_t *obj_table, uint8_t TableFlags, uint32_t *RowCount)
+{
+    Q_UNUSED(TableFlags)
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiHandle *folder = handle(obj_container, FakeMapiHandle::Folder);
+
+    store->rpc(__FUNCTION__);
+    if (!folder) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    FakeMapiHandle *table = new FakeMapiHandle(FakeMapiHandle::Table, folder->id);
+    table->rows = store->messages(folder->id);
+    if (RowCount) {
+        *RowCount = table->rows.size();
+    }
+    attach(obj_table, table, obj_container->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetAttachmentTable(mapi_object_t *obj_message, mapi_object_t *obj_table)
+{
+    FakeMapiHandle *message = handle(obj_message, FakeMapiHandle::Message);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!message) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    FakeMapiHandle *table = new FakeMapiHandle(FakeMapiHandle::Table, message->id);
+    table->rows = message->attachments;
+    attach(obj_table, table, obj_message->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS SetColumns(mapi_object_t *obj_table, struct SPropTagArray *properties)
+{
+    FakeMapiHandle *table = handle(obj_table, FakeMapiHandle::Table);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!table || !properties) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    table->columns.resize(properties->cValues);
+    for (unsigned i = 0; i < properties->cValues; i++) {
+        table->columns[i] = properties->aulPropTag[i];
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS QueryPosition(mapi_object_t *obj_table, uint32_t *Numerator, uint32_t *Denominator)
+{
+    FakeMapiHandle *table = handle(obj_table, FakeMapiHandle::Table);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!table) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    if (Numerator) {
+        *Numerator = table->position;
+    }
+    if (Denominator) {
+        *Denominator = table->rows.size();
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS QueryRows(mapi_object_t *obj_table, uint16_t row_count, enum QueryRowsFlags flags, struct SRowSet *rowSet)
+{
+    FakeMapiHandle *table = handle(obj_table, FakeMapiHandle::Table);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!table || !rowSet) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    unsigned count = qMin((unsigned)row_count, table->rows.size() - table->position);
+    rowSet->cRows = count;
+    rowSet->aRow = count ? talloc_array(table->ctx, struct SRow, count) : NULL;
+    for (unsigned i = 0; i < count; i++) {
+        rowFill(table->ctx, table->rows.at(table->position + i), table->columns.constData(), table->columns.size(), rowSet->aRow[i]);
+    }
+    if (!(flags & TBL_NOADVANCE)) {
+        table->position += count;
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS OpenMessage(mapi_object_t *obj_store, mapi_id_t id_folder, mapi_id_t id_message, mapi_object_t *obj_message, uint8_t ulFlags)
+{
+    Q_UNUSED(ulFlags)
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiNode node(FakeMapiNode::Message, 0, 0);
+
+    store->rpc(__FUNCTION__);
+    if (!handle(obj_store, FakeMapiHandle::Store)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    if (!store->node(id_message, FakeMapiNode::Message, node) || (node.parentId != id_folder)) {
+        return failed(MAPI_E_NOT_FOUND);
+    }
+
+    // As with a real server, the recipients come back with the message.
+    FakeMapiHandle *message = new FakeMapiHandle(FakeMapiHandle::Message, id_message);
+    message->properties = node.properties;
+    message->recipients = node.recipients;
+    message->attachments = node.attachments;
+    attach(obj_message, message, obj_store->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetRecipientTable(mapi_object_t *obj_message, struct SRowSet *SRowSet, struct SPropTagArray *SPropTagArray)
+{
+    static const uint32_t tags[] = {
+        PidTagDisplayName,
+        PidTagRecipientDisplayName,
+        PidTagSmtpAddress,
+        PidTagRecipientType,
+        PidTagRecipientOrder,
+        PidTagObjectType,
+        PidTagDisplayType };
+    static const unsigned tagCount = sizeof(tags) / sizeof(tags[0]);
+    FakeMapiHandle *message = handle(obj_message, FakeMapiHandle::Message);
+
+    // The recipients were returned by OpenMessage, so there is no round trip.
+    if (!message) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    SPropTagArray->cValues = tagCount;
+    SPropTagArray->aulPropTag = (enum MAPITAGS *)talloc_memdup(message->ctx, tags, sizeof(tags));
+    SRowSet->cRows = message->recipients.size();
+    SRowSet->aRow = talloc_array(message->ctx, struct SRow, SRowSet->cRows);
+    for (unsigned i = 0; i < SRowSet->cRows; i++) {
+        rowFill(message->ctx, message->recipients.at(i), tags, tagCount, SRowSet->aRow[i]);
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS OpenAttach(mapi_object_t *obj_message, uint32_t num_attach, mapi_object_t *obj_attach)
+{
+    FakeMapiHandle *message = handle(obj_message, FakeMapiHandle::Message);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!message) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    foreach (const FakeMapiProperties &properties, message->attachments) {
+        if (properties.value(PidTagAttachNumber >> 16).toUInt() == num_attach) {
+            FakeMapiHandle *attachment = new FakeMapiHandle(FakeMapiHandle::Attachment, message->id);
+
+            attachment->properties = properties;
+            attach(obj_attach, attachment, obj_message->session);
+            return MAPI_E_SUCCESS;
+        }
+    }
+    return failed(MAPI_E_NOT_FOUND);
+}
+
+enum MAPISTATUS GetProps(mapi_object_t *obj, uint32_t flags, struct SPropTagArray *SPropTagArray, struct SPropValue **lpProps, uint32_t *PropCount)
+{
+    Q_UNUSED(flags)
+    FakeMapiHandle *h = handle(obj);
+    FakeMapiProperties current;
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!h || !properties(h, current)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+
+    // Missing values come back as errors, as with a real server.
+    *PropCount = SPropTagArray->cValues;
+    *lpProps = talloc_array(h->ctx, struct SPropValue, SPropTagArray->cValues);
+    for (unsigned i = 0; i < SPropTagArray->cValues; i++) {
+        FakeMapiStore::toSPropValue(h->ctx, current, SPropTagArray->aulPropTag[i], (*lpProps)[i]);
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetPropsAll(mapi_object_t *obj, uint32_t flags, struct mapi_SPropValue_array *properties)
+{
+    Q_UNUSED(flags)
+    FakeMapiHandle *h = handle(obj);
+    FakeMapiProperties current;
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!h || !::properties(h, current)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    properties->cValues = 0;
+    properties->lpProps = talloc_array(h->ctx, struct mapi_SPropValue, current.size());
+    foreach (unsigned id, current.keys()) {
+        struct SPropValue value;
+
+        // Leave out anything which would need a stream.
+        if (FakeMapiStore::toSPropValue(h->ctx, current, id << 16, value)) {
+            cast_mapi_SPropValue(h->ctx, &properties->lpProps[properties->cValues++], &value);
+        }
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS SetProps(mapi_object_t *obj, uint32_t flags, struct SPropValue *lpProps, unsigned long PropCount)
+{
+    Q_UNUSED(flags)
+    FakeMapiHandle *h = handle(obj);
+    FakeMapiProperties changes;
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!h || ((h->type != FakeMapiHandle::Folder) && (h->type != FakeMapiHandle::Message))) {
+        return failed(MAPI_E_NO_SUPPORT);
+    }
+    for (unsigned long i = 0; i < PropCount; i++) {
+        QVariant value = FakeMapiStore::fromSPropValue(lpProps[i]);
+
+        if (value.isValid()) {
+            changes.insert(lpProps[i].ulPropTag >> 16, value);
+        }
+    }
+    if (!FakeMapiStore::self()->propertiesSet(h->id, changes)) {
+        return failed(MAPI_E_NOT_FOUND);
+    }
+    if (h->type == FakeMapiHandle::Message) {
+        for (FakeMapiProperties::const_iterator i = changes.constBegin(); i != changes.constEnd(); ++i) {
+            h->properties.insert(i.key(), i.value());
+        }
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS OpenStream(mapi_object_t *obj_related, enum MAPITAGS PropertyTag, enum OpenStream_OpenModeFlags OpenModeFlag, mapi_object_t *obj_stream)
+{
+    Q_UNUSED(OpenModeFlag)
+    FakeMapiHandle *h = handle(obj_related);
+    FakeMapiProperties current;
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!h || !properties(h, current)) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    QVariant value = current.value(PropertyTag >> 16);
+    if (!value.isValid()) {
+        return failed(MAPI_E_NOT_FOUND);
+    }
+    FakeMapiHandle *stream = new FakeMapiHandle(FakeMapiHandle::Stream, h->id);
+    stream->data = FakeMapiStore::toStream(value);
+    attach(obj_stream, stream, obj_related->session);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetStreamSize(mapi_object_t *obj_stream, uint32_t *StreamSize)
+{
+    FakeMapiHandle *stream = handle(obj_stream, FakeMapiHandle::Stream);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!stream) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    *StreamSize = stream->data.size();
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS ReadStream(mapi_object_t *obj_stream, unsigned char *buf_data, uint16_t ByteCount, uint16_t *ByteRead)
+{
+    FakeMapiHandle *stream = handle(obj_stream, FakeMapiHandle::Stream);
+
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    if (!stream) {
+        return failed(MAPI_E_INVALID_PARAMETER);
+    }
+    unsigned count = qMin((unsigned)ByteCount, stream->data.size() - stream->position);
+    memcpy(buf_data, stream->data.constData() + stream->position, count);
+    stream->position += count;
+    *ByteRead = count;
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetIDsFromNames(mapi_object_t *obj, uint16_t count, struct MAPINAMEID *nameid, uint32_t ulFlags, struct SPropTagArray **proptags)
+{
+    Q_UNUSED(ulFlags)
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiHandle *h = handle(obj);
+
+    store->rpc(__FUNCTION__);
+    *proptags = talloc_zero(h ? h->ctx : NULL, struct SPropTagArray);
+    (*proptags)->cValues = count;
+    (*proptags)->aulPropTag = (enum MAPITAGS *)talloc_array(*proptags, uint32_t, count + 1);
+    for (unsigned i = 0; i < count; i++) {
+        (*proptags)->aulPropTag[i] = (enum MAPITAGS)(store->namedPropertyId(nameid[i]) << 16);
+    }
+    (*proptags)->aulPropTag[count] = (enum MAPITAGS)0;
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetNamesFromIDs(mapi_object_t *obj, enum MAPITAGS ulPropTag, uint16_t *count, struct MAPINAMEID **nameid)
+{
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiHandle *h = handle(obj);
+
+    store->rpc(__FUNCTION__);
+    *nameid = talloc_zero(h ? h->ctx : NULL, struct MAPINAMEID);
+    if (!store->namedProperty(*nameid, ulPropTag >> 16, **nameid)) {
+        talloc_free(*nameid);
+        *nameid = NULL;
+        return failed(MAPI_E_NOT_FOUND);
+    }
+    *count = 1;
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS QueryNamedProperties(mapi_object_t *obj, uint8_t queryFlags, struct GUID *guid, uint16_t *count, uint16_t **propID, struct MAPINAMEID **nameid)
+{
+    Q_UNUSED(queryFlags)
+    Q_UNUSED(guid)
+    FakeMapiStore *store = FakeMapiStore::self();
+    FakeMapiHandle *h = handle(obj);
+    QList<uint16_t> ids = store->namedPropertyIds();
+
+    store->rpc(__FUNCTION__);
+    *count = ids.size();
+    *propID = talloc_array(h ? h->ctx : NULL, uint16_t, ids.size() + 1);
+    *nameid = talloc_array(h ? h->ctx : NULL, struct MAPINAMEID, ids.size() + 1);
+    for (int i = 0; i < ids.size(); i++) {
+        (*propID)[i] = ids.at(i);
+        store->namedProperty(*nameid, ids.at(i), (*nameid)[i]);
+    }
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS Subscribe(mapi_object_t *obj, uint32_t *connection, uint16_t NotificationFlags, bool WholeStore, mapi_notify_callback_t notify_callback, void *private_data)
+{
+    Q_UNUSED(obj)
+    Q_UNUSED(NotificationFlags)
+    Q_UNUSED(WholeStore)
+    Q_UNUSED(notify_callback)
+    Q_UNUSED(private_data)
+
+    // Nothing ever changes behind the client's back, so there is nothing to
+    // notify.
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    *connection = handleCount.fetchAndAddRelaxed(1);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS ICSSyncConfigure(mapi_object_t *obj, enum SynchronizationType sync_type, uint8_t send_options, uint16_t sync_flags, DATA_BLOB restriction, uint32_t sync_extraflags, const struct SPropTagArray *property_tags, mapi_object_t *obj_sync_context)
+{
+    Q_UNUSED(obj)
+    Q_UNUSED(sync_type)
+    Q_UNUSED(send_options)
+    Q_UNUSED(sync_flags)
+    Q_UNUSED(restriction)
+    Q_UNUSED(sync_extraflags)
+    Q_UNUSED(property_tags)
+    Q_UNUSED(obj_sync_context)
+
+    // Not all stores support ICS.
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    return failed(MAPI_E_NO_SUPPORT);
+}
+
+enum MAPISTATUS ResolveNames(struct mapi_session *session, const char **usernames, struct SPropTagArray *props, struct PropertyRowSet_r **rowset, struct PropertyTagArray_r **flaglist, uint32_t flags)
+{
+    Q_UNUSED(session)
+    Q_UNUSED(flags)
+    FakeMapiStore *store = FakeMapiStore::self();
+    unsigned count = 0;
+
+    store->rpc(__FUNCTION__);
+    while (usernames[count]) {
+        count++;
+    }
+
+    // The statuses and rows are freed by the caller.
+    struct PropertyTagArray_r *statuses = talloc_zero(NULL, struct PropertyTagArray_r);
+    statuses->cValues = count;
+    statuses->aulPropTag = talloc_array(statuses, uint32_t, count + 1);
+    struct SRowSet *rows = talloc_zero(NULL, struct SRowSet);
+    rows->aRow = talloc_array(rows, struct SRow, count);
+    for (unsigned i = 0; i < count; i++) {
+        FakeMapiProperties entry;
+
+        if (!store->resolve(QString::fromUtf8(usernames[i]), entry)) {
+            statuses->aulPropTag[i] = MAPI_UNRESOLVED;
+            continue;
+        }
+        statuses->aulPropTag[i] = MAPI_RESOLVED;
+        rowFill(rows, entry, (uint32_t *)props->aulPropTag, props->cValues, rows->aRow[rows->cRows++]);
+    }
+    if (!rows->cRows) {
+        talloc_free(rows);
+        rows = NULL;
+    }
+    *rowset = (struct PropertyRowSet_r *)rows;
+    *flaglist = statuses;
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetGALTableCount(struct mapi_session *session, uint32_t *totalRecs)
+{
+    Q_UNUSED(session)
+    FakeMapiStore::self()->rpc(__FUNCTION__);
+    *totalRecs = FakeMapiStore::self()->galCount();
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS GetGALTable(struct mapi_session *session, struct SPropTagArray *SPropTagArray, struct PropertyRowSet_r **RowSet, uint32_t count, uint8_t ulFlags)
+{
+    FakeMapiStore *store = FakeMapiStore::self();
+    struct nspi_context *nspi = (struct nspi_context *)session->nspi->ctx;
+    unsigned position = nspi->pStat->NumPos;
+
+    store->rpc(__FUNCTION__);
+    if ((ulFlags == TABLE_START) || (nspi->pStat->CurrentRec == (NSPI_MID)MID_BEGINNING_OF_TABLE)) {
+        position = 0;
+    }
+    if (position >= store->galCount()) {
+        // All done.
+        galPosition(nspi, position);
+        *RowSet = NULL;
+        return MAPI_E_SUCCESS;
+    }
+    count = qMin(count, store->galCount() - position);
+    *RowSet = (struct PropertyRowSet_r *)galRows(NULL, position, count, SPropTagArray);
+    galPosition(nspi, position + count);
+    return MAPI_E_SUCCESS;
+}
+
+enum MAPISTATUS nspi_SeekEntries(struct nspi_context *nspi_ctx, TALLOC_CTX *mem_ctx, enum TableSortOrders SortType, struct PropertyValue_r *pTarget, struct SPropTagArray *pPropTags, struct PropertyTagArray_r *pMIds, struct PropertyRowSet_r **pRows)
+{
+    Q_UNUSED(SortType)
+    Q_UNUSED(pMIds)
+    FakeMapiStore *store = FakeMapiStore::self();
+
+    store->rpc(__FUNCTION__);
+
+    // The target is always a display name.
+    struct SPropValue *target = (struct SPropValue *)pTarget;
+    unsigned position = store->galSeek(QString::fromUtf8(target->value.lpszW));
+    galPosition(nspi_ctx, position);
+    if (pRows) {
+        if (pPropTags && (position < store->galCount())) {
+            *pRows = (struct PropertyRowSet_r *)galRows(mem_ctx, position, 1, pPropTags);
+        } else {
+            *pRows = NULL;
+        }
+    }
+    return MAPI_E_SUCCESS;
+}
+
+}
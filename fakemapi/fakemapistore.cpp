@@ -0,0 +1,932 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fakemapistore.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QSettings>
+#include <QStringList>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Values bigger than this must be read using a stream.
+ */
+#define STREAM_THRESHOLD 0x4000
+
+/**
+ * The first id handed out for a named property.
+ */
+#define NAMED_PROPERTY_BASE 0x8000
+
+/**
+ * A trace starts with this, followed by the version and the compressed
+ * contents.
+ */
+#define TRACE_MAGIC "FAKEMAPI"
+#define TRACE_VERSION 1
+
+static inline unsigned propertyId(uint32_t tag)
+{
+    return tag >> 16;
+}
+
+/**
+ * GAL entries are sorted by display name, but people can share a name, so
+ * the DN tells them apart.
+ */
+static QString galKey(const FakeMapiProperties &entry)
+{
+    return entry.value(propertyId(PidTagDisplayName)).toString().toLower() + QChar(0) +
+        entry.value(propertyId(PidTagEmailAddress)).toString().toLower();
+}
+
+static inline void propertySet(FakeMapiProperties &properties, uint32_t tag, const QVariant &value)
+{
+    properties.insert(propertyId(tag), value);
+}
+
+static unsigned setting(const QSettings *settings, const char *key, unsigned defaultValue)
+{
+    if (!settings) {
+        return defaultValue;
+    }
+    return settings->value(QString::fromAscii("Store/%1").arg(QString::fromAscii(key)), defaultValue).toUInt();
+}
+
+static const char *givenNames[] = {
+    "Alice", "Bob", "Carol", "Dave", "Eve", "Frank", "Grace", "Heidi",
+    "Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy", "Rupert", "Sybil" };
+
+static const char *surnames[] = {
+    "Adams", "Baker", "Clark", "Davis", "Evans", "Fisher", "Green", "Harris",
+    "Irwin", "Jones", "King", "Lewis", "Moore", "Nolan", "Owen", "Parker" };
+
+#define NAME_COUNT (sizeof(givenNames) / sizeof(givenNames[0]))
+
+FakeMapiNode::FakeMapiNode(Kind kind, mapi_id_t id, mapi_id_t parentId) :
+    kind(kind),
+    id(id),
+    parentId(parentId)
+{
+}
+
+FakeMapiStore *FakeMapiStore::self()
+{
+    // GCC makes the initialisation of a local static thread-safe.
+    static FakeMapiStore store;
+    return &store;
+}
+
+FakeMapiStore::FakeMapiStore() :
+    m_nextId(0x10001),
+    m_nextNamedId(NAMED_PROPERTY_BASE),
+    m_latency(0)
+{
+    QByteArray record = qgetenv("FAKEMAPI_RECORD");
+    QByteArray replay = qgetenv("FAKEMAPI_REPLAY");
+
+    if (!record.isEmpty()) {
+        // Start empty, to be filled in from a real server.
+        m_recordFile = QString::fromLocal8Bit(record);
+        qDebug() << "FakeMapiStore: recording to" << m_recordFile;
+    } else if (!replay.isEmpty()) {
+        load(QString::fromLocal8Bit(replay));
+    } else {
+        generate();
+    }
+
+    // An explicit latency overrides any recorded timings, so that a trace can
+    // be replayed flat out to measure just the CPU cost on the client.
+    QByteArray latency = qgetenv("FAKEMAPI_LATENCY");
+    if (!latency.isEmpty()) {
+        m_latency = latency.toUInt();
+        m_recordedTimings.clear();
+    }
+    qDebug() << "FakeMapiStore:" << m_nodes.size() << "folders and messages," << m_gal.size() << "GAL entries, latency" << m_latency << "ms";
+}
+
+FakeMapiStore::~FakeMapiStore()
+{
+    quint64 calls = 0;
+    quint64 usecs = 0;
+
+    for (Timings::const_iterator i = m_timings.constBegin(); i != m_timings.constEnd(); ++i) {
+        qDebug() << "FakeMapiStore:" << i.key().constData() << i.value().first << "calls," << i.value().second / 1000 << "ms";
+        calls += i.value().first;
+        usecs += i.value().second;
+    }
+    qDebug() << "FakeMapiStore:" << calls << "RPCs," << usecs / 1000 << "ms";
+    if (!m_recordFile.isEmpty()) {
+        save(m_recordFile);
+    }
+    qDeleteAll(m_nodes);
+}
+
+void FakeMapiStore::generate()
+{
+    QByteArray file = qgetenv("FAKEMAPI_STORE");
+    QSettings *settings = 0;
+    if (!file.isEmpty()) {
+        settings = new QSettings(QString::fromLocal8Bit(file), QSettings::IniFormat);
+    }
+    m_folders = setting(settings, "Folders", 2);
+    m_depth = setting(settings, "Depth", 1);
+    m_messages = setting(settings, "Messages", 50);
+    m_recipients = setting(settings, "Recipients", 3);
+    m_attachments = setting(settings, "Attachments", 0);
+    m_attachmentSize = setting(settings, "AttachmentSize", 4096);
+    m_bodySize = setting(settings, "BodySize", 2048);
+    m_latency = setting(settings, "Latency", 0);
+    unsigned galEntries = setting(settings, "GalEntries", 1000);
+    delete settings;
+
+    // The GAL comes first, since messages are addressed to its entries.
+    for (unsigned i = 0; i < galEntries; i++) {
+        QString given = QString::fromAscii(givenNames[i % NAME_COUNT]);
+        QString surname = QString::fromAscii(surnames[(i / NAME_COUNT) % NAME_COUNT]);
+        QString suffix;
+        if (i >= NAME_COUNT * NAME_COUNT) {
+            suffix = QString::number(i / (NAME_COUNT * NAME_COUNT));
+        }
+        QString displayName = QString::fromAscii("%1 %2%3").arg(given).arg(surname).arg(suffix);
+        QString account = QString::fromAscii("user%1").arg(i);
+        QString smtp = QString::fromAscii("%1.%2%3@example.com").arg(given.toLower()).arg(surname.toLower()).arg(suffix);
+        FakeMapiProperties entry;
+
+        propertySet(entry, PidTagDisplayName, displayName);
+        propertySet(entry, PidTagGivenName, given);
+        propertySet(entry, PidTagSurname, surname);
+        propertySet(entry, PidTagAccount, account);
+        propertySet(entry, PidTagSmtpAddress, smtp);
+        propertySet(entry, PidTagAddressType, QString::fromAscii("EX"));
+        propertySet(entry, PidTagEmailAddress, QString::fromAscii("/o=Example/ou=Exchange/cn=Recipients/cn=%1").arg(account));
+        propertySet(entry, PidTagObjectType, (uint)MAPI_MAILUSER);
+        propertySet(entry, PidTagDisplayType, (uint)DT_MAILUSER);
+        propertySet(entry, PidTagTitle, QString::fromAscii("Engineer"));
+        propertySet(entry, PidTagDepartmentName, QString::fromAscii("Department %1").arg(i % 10));
+        propertySet(entry, PidTagCompanyName, QString::fromAscii("Example Ltd"));
+        propertySet(entry, PidTagOfficeLocation, QString::fromAscii("Building %1").arg(i % 4));
+        propertySet(entry, PidTagBusinessTelephoneNumber, QString::fromAscii("+1 555 %1").arg(i, 4, 10, QLatin1Char('0')));
+        m_galSorted.insert(galKey(entry), entry);
+    }
+    galIndex();
+
+    // Now the folders.
+    mapi_id_t root = folderAdd(0, QString::fromAscii("Root"), QString());
+    mapi_id_t top = folderAdd(root, QString::fromAscii("Top of Information Store"), QString());
+    m_defaultFolders.insert(olFolderMailboxRoot, root);
+    m_defaultFolders.insert(olFolderTopInformationStore, top);
+
+    static const struct {
+        uint32_t type;
+        const char *name;
+        const char *folderClass;
+    } defaults[] = {
+        { olFolderInbox, "Inbox", "IPF.Note" },
+        { olFolderOutbox, "Outbox", "IPF.Note" },
+        { olFolderSentMail, "Sent Items", "IPF.Note" },
+        { olFolderDeletedItems, "Deleted Items", "IPF.Note" },
+        { olFolderCalendar, "Calendar", "IPF.Appointment" },
+        { olFolderContacts, "Contacts", "IPF.Contact" },
+        { olFolderTasks, "Tasks", "IPF.Task" },
+        { 0, 0, 0 } };
+    for (unsigned i = 0; defaults[i].name; i++) {
+        QString folderClass = QString::fromAscii(defaults[i].folderClass);
+        mapi_id_t id = folderAdd(top, QString::fromAscii(defaults[i].name), folderClass);
+
+        m_defaultFolders.insert(defaults[i].type, id);
+        subfoldersAdd(id, folderClass, m_depth);
+    }
+}
+
+void FakeMapiStore::galIndex()
+{
+    m_gal = m_galSorted.values();
+    m_galIndex.clear();
+    for (int i = 0; i < m_gal.size(); i++) {
+        const FakeMapiProperties &entry = m_gal.at(i);
+
+        m_galIndex.insert(entry.value(propertyId(PidTagDisplayName)).toString().toLower(), i);
+        m_galIndex.insert(entry.value(propertyId(PidTagSmtpAddress)).toString().toLower(), i);
+        m_galIndex.insert(entry.value(propertyId(PidTagAccount)).toString().toLower(), i);
+        // Exchange resolves an entry's DN to the entry.
+        m_galIndex.insert(entry.value(propertyId(PidTagEmailAddress)).toString().toLower(), i);
+    }
+}
+
+mapi_id_t FakeMapiStore::folderAdd(mapi_id_t parentId, const QString &name, const QString &folderClass)
+{
+    FakeMapiNode *folder = new FakeMapiNode(FakeMapiNode::Folder, m_nextId++, parentId);
+
+    propertySet(folder->properties, PidTagFolderId, (qulonglong)folder->id);
+    propertySet(folder->properties, PidTagParentFolderId, (qulonglong)parentId);
+    propertySet(folder->properties, PidTagDisplayName, name);
+    if (!folderClass.isEmpty()) {
+        propertySet(folder->properties, PidTagContainerClass, folderClass);
+        for (unsigned i = 0; i < m_messages; i++) {
+            messageAdd(*folder, i);
+        }
+    }
+    propertySet(folder->properties, PidTagContentCount, (uint)folder->messages.size());
+    m_nodes.insert(folder->id, folder);
+    if (parentId) {
+        FakeMapiNode *parent = m_nodes.value(parentId);
+
+        parent->folders.append(folder->id);
+        propertySet(parent->properties, PidTagSubfolders, true);
+    }
+    return folder->id;
+}
+
+void FakeMapiStore::subfoldersAdd(mapi_id_t parentId, const QString &folderClass, unsigned depth)
+{
+    if (!depth) {
+        return;
+    }
+    for (unsigned i = 0; i < m_folders; i++) {
+        mapi_id_t id = folderAdd(parentId, QString::fromAscii("Folder %1").arg(i), folderClass);
+
+        subfoldersAdd(id, folderClass, depth - 1);
+    }
+}
+
+void FakeMapiStore::messageAdd(FakeMapiNode &folder, unsigned n)
+{
+    static QString lorem = QString::fromAscii(
+        "Lorem ipsum dolor sit amet, consectetur adipisicing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. ");
+    FakeMapiNode *message = new FakeMapiNode(FakeMapiNode::Message, m_nextId++, folder.id);
+    QString folderClass = folder.properties.value(propertyId(PidTagContainerClass)).toString();
+    QString folderName = folder.properties.value(propertyId(PidTagDisplayName)).toString();
+    QString subject = QString::fromAscii("Message %1 in %2").arg(n).arg(folderName);
+    QDateTime created(QDate(2013, 1, 1), QTime(0, 0), Qt::UTC);
+    created = created.addSecs(n * 3600);
+
+    propertySet(message->properties, PidTagMid, (qulonglong)message->id);
+    propertySet(message->properties, PidTagFolderId, (qulonglong)folder.id);
+    propertySet(message->properties, PidTagMessageClass, QString(folderClass).replace(QString::fromAscii("IPF."), QString::fromAscii("IPM.")));
+    propertySet(message->properties, PidTagSubject, subject);
+    propertySet(message->properties, PidTagNormalizedSubject, subject);
+    propertySet(message->properties, PidTagConversationTopic, subject);
+    propertySet(message->properties, PidTagCreationTime, created);
+    propertySet(message->properties, PidTagLastModificationTime, created);
+    propertySet(message->properties, PidTagClientSubmitTime, created);
+    propertySet(message->properties, PidTagMessageDeliveryTime, created);
+    propertySet(message->properties, PidTagMessageFlags, (uint)((n % 2) ? 0 : MSGFLAG_READ));
+    propertySet(message->properties, PidTagInternetMessageId, QString::fromAscii("<%1@example.com>").arg(message->id, 0, 16));
+
+    QString body;
+    body.reserve(m_bodySize);
+    while ((unsigned)body.size() < m_bodySize) {
+        body.append(lorem);
+    }
+    body.truncate(m_bodySize);
+    propertySet(message->properties, PidTagBody, body);
+
+    // The sender and recipients are drawn from the GAL. Only some of the
+    // recipients carry an SMTP address, so that the others need resolving.
+    QStringList to;
+    if (m_gal.size()) {
+        const FakeMapiProperties &sender = m_gal.at((n * 7) % m_gal.size());
+
+        propertySet(message->properties, PidTagSenderName, sender.value(propertyId(PidTagDisplayName)));
+        propertySet(message->properties, PidTagSenderEmailAddress, sender.value(propertyId(PidTagEmailAddress)));
+        propertySet(message->properties, PidTagSenderSmtpAddress, sender.value(propertyId(PidTagSmtpAddress)));
+        for (unsigned i = 0; i < m_recipients; i++) {
+            const FakeMapiProperties &entry = m_gal.at((n * 31 + i * 17) % m_gal.size());
+            QString name = entry.value(propertyId(PidTagDisplayName)).toString();
+            FakeMapiProperties recipient;
+
+            propertySet(recipient, PidTagDisplayName, name);
+            propertySet(recipient, PidTagRecipientDisplayName, name);
+            propertySet(recipient, PidTagRecipientType, (uint)(i ? MAPI_CC : MAPI_TO));
+            propertySet(recipient, PidTagRecipientOrder, i);
+            propertySet(recipient, PidTagObjectType, (uint)MAPI_MAILUSER);
+            propertySet(recipient, PidTagDisplayType, (uint)DT_MAILUSER);
+            if ((n + i) % 2) {
+                propertySet(recipient, PidTagSmtpAddress, entry.value(propertyId(PidTagSmtpAddress)));
+            }
+            message->recipients.append(recipient);
+            if (!i) {
+                to << name;
+            }
+        }
+    }
+    propertySet(message->properties, PidTagDisplayTo, to.join(QString::fromAscii("; ")));
+
+    for (unsigned i = 0; i < m_attachments; i++) {
+        FakeMapiProperties attachment;
+
+        propertySet(attachment, PidTagAttachNumber, i);
+        propertySet(attachment, PidTagAttachMethod, (uint)ATTACH_BY_VALUE);
+        propertySet(attachment, PidTagAttachLongFilename, QString::fromAscii("attachment-%1.bin").arg(i));
+        propertySet(attachment, PidTagAttachFilename, QString::fromAscii("ATTACH~%1.BIN").arg(i));
+        propertySet(attachment, PidTagAttachMimeTag, QString::fromAscii("application/octet-stream"));
+        propertySet(attachment, PidTagRenderingPosition, (uint)0xFFFFFFFF);
+        propertySet(attachment, PidTagAttachSize, m_attachmentSize);
+        propertySet(attachment, PidTagAttachDataBinary, QByteArray(m_attachmentSize, (char)('a' + (n + i) % 26)));
+        message->attachments.append(attachment);
+    }
+    propertySet(message->properties, PidTagHasAttachments, m_attachments != 0);
+    propertySet(message->properties, PidTagMessageSize, (uint)(m_bodySize + m_attachments * m_attachmentSize));
+
+    folder.messages.append(message->id);
+    m_nodes.insert(message->id, message);
+}
+
+void FakeMapiStore::rpc(const char *call, unsigned count)
+{
+    quint64 usecs = (quint64)m_latency * 1000 * count;
+    Timings::const_iterator recorded = m_recordedTimings.constFind(QByteArray(call));
+
+    // A replayed call takes as long as it did on average when recorded.
+    if ((recorded != m_recordedTimings.constEnd()) && recorded.value().first) {
+        usecs = recorded.value().second / recorded.value().first;
+    }
+    timing(call, usecs);
+    if (usecs) {
+        usleep(usecs);
+    }
+}
+
+void FakeMapiStore::timing(const char *call, quint64 usecs)
+{
+    QMutexLocker locker(&m_timingsLock);
+    QPair<quint64, quint64> &timing = m_timings[QByteArray(call)];
+
+    timing.first++;
+    timing.second += usecs;
+}
+
+mapi_id_t FakeMapiStore::defaultFolder(uint32_t folderType) const
+{
+    return m_defaultFolders.value(folderType);
+}
+
+bool FakeMapiStore::node(mapi_id_t id, FakeMapiNode::Kind kind, FakeMapiNode &result) const
+{
+    QReadLocker locker(&m_lock);
+    FakeMapiNode *node = m_nodes.value(id);
+
+    if (!node || (node->kind != kind)) {
+        return false;
+    }
+    result = *node;
+    return true;
+}
+
+QList<FakeMapiProperties> FakeMapiStore::folders(mapi_id_t parentId, bool deep) const
+{
+    QReadLocker locker(&m_lock);
+    QList<FakeMapiProperties> rows;
+    QList<mapi_id_t> pending;
+    FakeMapiNode *parent = m_nodes.value(parentId);
+
+    if (parent) {
+        pending = parent->folders;
+    }
+    while (!pending.isEmpty()) {
+        FakeMapiNode *folder = m_nodes.value(pending.takeFirst());
+
+        rows.append(folder->properties);
+        if (deep) {
+            pending << folder->folders;
+        }
+    }
+    return rows;
+}
+
+QList<FakeMapiProperties> FakeMapiStore::messages(mapi_id_t parentId) const
+{
+    QReadLocker locker(&m_lock);
+    QList<FakeMapiProperties> rows;
+    FakeMapiNode *parent = m_nodes.value(parentId);
+
+    if (parent) {
+        foreach (mapi_id_t id, parent->messages) {
+            rows.append(m_nodes.value(id)->properties);
+        }
+    }
+    return rows;
+}
+
+bool FakeMapiStore::propertiesSet(mapi_id_t id, const FakeMapiProperties &properties)
+{
+    QWriteLocker locker(&m_lock);
+    FakeMapiNode *node = m_nodes.value(id);
+
+    if (!node) {
+        return false;
+    }
+    for (FakeMapiProperties::const_iterator i = properties.constBegin(); i != properties.constEnd(); ++i) {
+        node->properties.insert(i.key(), i.value());
+    }
+    propertySet(node->properties, PidTagLastModificationTime, QDateTime::currentDateTimeUtc());
+    return true;
+}
+
+unsigned FakeMapiStore::galCount() const
+{
+    return m_gal.size();
+}
+
+const FakeMapiProperties &FakeMapiStore::galAt(unsigned i) const
+{
+    return m_gal.at(i);
+}
+
+int FakeMapiStore::galFind(const QString &name) const
+{
+    return m_galIndex.value(name.toLower(), -1);
+}
+
+unsigned FakeMapiStore::galSeek(const QString &displayName) const
+{
+    QString key = displayName.toLower();
+    unsigned i;
+
+    for (i = 0; i < (unsigned)m_gal.size(); i++) {
+        if (m_gal.at(i).value(propertyId(PidTagDisplayName)).toString().toLower() >= key) {
+            break;
+        }
+    }
+    return i;
+}
+
+bool FakeMapiStore::resolve(const QString &name, FakeMapiProperties &result) const
+{
+    QReadLocker locker(&m_lock);
+    QHash<QString, FakeMapiProperties>::const_iterator i = m_resolutions.constFind(name.toLower());
+
+    if (i != m_resolutions.constEnd()) {
+        result = i.value();
+        return true;
+    }
+    int entry = galFind(name);
+    if (entry < 0) {
+        return false;
+    }
+    result = m_gal.at(entry);
+    return true;
+}
+
+/**
+ * A named property is keyed by its GUID, kind and id or name.
+ */
+static QByteArray namedPropertyKey(const struct MAPINAMEID &name)
+{
+    QByteArray key((const char *)&name.lpguid, sizeof(name.lpguid));
+
+    key.append((char)name.ulKind);
+    if (MNID_ID == name.ulKind) {
+        key.append((const char *)&name.kind.lid, sizeof(name.kind.lid));
+    } else {
+        key.append(name.kind.lpwstr.Name);
+    }
+    return key;
+}
+
+uint16_t FakeMapiStore::namedPropertyId(const struct MAPINAMEID &name)
+{
+    QMutexLocker locker(&m_namesLock);
+    QByteArray key = namedPropertyKey(name);
+    QHash<QByteArray, uint16_t>::const_iterator i = m_namedIds.constFind(key);
+
+    if (i != m_namedIds.constEnd()) {
+        return i.value();
+    }
+    uint16_t id = m_nextNamedId++;
+    m_namedIds.insert(key, id);
+    m_names.insert(id, key);
+    return id;
+}
+
+void FakeMapiStore::namedPropertyIdSet(const struct MAPINAMEID &name, uint16_t id)
+{
+    QMutexLocker locker(&m_namesLock);
+    QByteArray key = namedPropertyKey(name);
+
+    m_namedIds.insert(key, id);
+    m_names.insert(id, key);
+    if (id >= m_nextNamedId) {
+        m_nextNamedId = id + 1;
+    }
+}
+
+QList<uint16_t> FakeMapiStore::namedPropertyIds() const
+{
+    QMutexLocker locker(&m_namesLock);
+
+    return m_names.keys();
+}
+
+bool FakeMapiStore::namedProperty(TALLOC_CTX *ctx, uint16_t id, struct MAPINAMEID &name) const
+{
+    QMutexLocker locker(&m_namesLock);
+    QHash<uint16_t, QByteArray>::const_iterator i = m_names.constFind(id);
+
+    if (i == m_names.constEnd()) {
+        return false;
+    }
+
+    // Unpick the key.
+    const QByteArray &key = i.value();
+    unsigned offset = sizeof(name.lpguid);
+    memcpy(&name.lpguid, key.constData(), offset);
+    if (MNID_ID == key.at(offset)) {
+        name.ulKind = MNID_ID;
+        memcpy(&name.kind.lid, key.constData() + offset + 1, sizeof(name.kind.lid));
+    } else {
+        QByteArray string = key.mid(offset + 1);
+
+        name.ulKind = MNID_STRING;
+        name.kind.lpwstr.Name = talloc_strdup(ctx, string.constData());
+        name.kind.lpwstr.NameSize = string.size();
+    }
+    return true;
+}
+
+static void propertyError(uint32_t tag, enum MAPISTATUS code, struct SPropValue &result)
+{
+    result.ulPropTag = (MAPITAGS)((tag & 0xFFFF0000) | PT_ERROR);
+    result.dwAlignPad = 0;
+    result.value.err = code;
+}
+
+bool FakeMapiStore::toSPropValue(TALLOC_CTX *ctx, const FakeMapiProperties &properties, uint32_t tag, struct SPropValue &result)
+{
+    FakeMapiProperties::const_iterator i = properties.constFind(propertyId(tag));
+    uint32_t type = tag & 0xFFFF;
+
+    if (i == properties.constEnd()) {
+        propertyError(tag, MAPI_E_NOT_FOUND, result);
+        return false;
+    }
+    tag &= 0xFFFF0000;
+    result.dwAlignPad = 0;
+
+    const QVariant &value = i.value();
+    switch (value.type()) {
+    case QVariant::String:
+    {
+        QByteArray utf8 = value.toString().toUtf8();
+
+        if (utf8.size() > STREAM_THRESHOLD) {
+            propertyError(tag, MAPI_E_NOT_ENOUGH_MEMORY, result);
+            return false;
+        }
+        tag |= (PT_STRING8 == type) ? PT_STRING8 : PT_UNICODE;
+        return set_SPropValue_proptag(&result, (MAPITAGS)tag, talloc_strdup(ctx, utf8.constData()));
+    }
+    case QVariant::ByteArray:
+    {
+        QByteArray bytes = value.toByteArray();
+        struct Binary_r bin;
+
+        if (bytes.size() > STREAM_THRESHOLD) {
+            propertyError(tag, MAPI_E_NOT_ENOUGH_MEMORY, result);
+            return false;
+        }
+        bin.cb = bytes.size();
+        bin.lpb = (uint8_t *)talloc_memdup(ctx, bytes.constData(), bytes.size());
+        return set_SPropValue_proptag(&result, (MAPITAGS)(tag | PT_BINARY), &bin);
+    }
+    case QVariant::DateTime:
+    {
+        // As per http://support.citrix.com/article/CTX109645.
+        NTTIME ntTime = ((NTTIME)value.toDateTime().toTime_t() + 11644473600LL) * 10000000;
+        struct FILETIME ft;
+
+        ft.dwHighDateTime = ntTime >> 32;
+        ft.dwLowDateTime = ntTime;
+        return set_SPropValue_proptag(&result, (MAPITAGS)(tag | PT_SYSTIME), &ft);
+    }
+    case QVariant::Bool:
+    {
+        uint8_t b = value.toBool();
+
+        return set_SPropValue_proptag(&result, (MAPITAGS)(tag | PT_BOOLEAN), &b);
+    }
+    case QVariant::ULongLong:
+    {
+        uint64_t d = value.toULongLong();
+
+        return set_SPropValue_proptag(&result, (MAPITAGS)(tag | PT_I8), &d);
+    }
+    default:
+    {
+        uint32_t l = value.toUInt();
+
+        return set_SPropValue_proptag(&result, (MAPITAGS)(tag | PT_LONG), &l);
+    }
+    }
+}
+
+QVariant FakeMapiStore::fromSPropValue(struct SPropValue &property)
+{
+    const void *data = get_SPropValue_data(&property);
+
+    if (!data) {
+        return QVariant();
+    }
+    switch (property.ulPropTag & 0xFFFF) {
+    case PT_UNICODE:
+    case PT_STRING8:
+        return QString::fromUtf8((const char *)data);
+    case PT_BINARY:
+    {
+        const struct Binary_r *bin = (const struct Binary_r *)data;
+
+        return QByteArray((const char *)bin->lpb, bin->cb);
+    }
+    case PT_SYSTIME:
+    {
+        const struct FILETIME *ft = (const struct FILETIME *)data;
+        NTTIME ntTime = ((NTTIME)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+        QDateTime result;
+
+        result.setTime_t(ntTime / 10000000 - 11644473600LL);
+        return result.toUTC();
+    }
+    case PT_BOOLEAN:
+        return (bool)*(const uint8_t *)data;
+    case PT_I8:
+        return (qulonglong)*(const uint64_t *)data;
+    case PT_LONG:
+        return (uint)*(const uint32_t *)data;
+    default:
+        return QVariant();
+    }
+}
+
+FakeMapiProperties FakeMapiStore::fromSPropValues(struct SPropValue *properties, unsigned count)
+{
+    FakeMapiProperties result;
+
+    // Errors, such as values which need a stream, are left out.
+    for (unsigned i = 0; i < count; i++) {
+        QVariant value = fromSPropValue(properties[i]);
+
+        if (value.isValid()) {
+            result.insert(propertyId(properties[i].ulPropTag), value);
+        }
+    }
+    return result;
+}
+
+QByteArray FakeMapiStore::toStream(const QVariant &value)
+{
+    if (value.type() == QVariant::String) {
+        // Strings are streamed as UTF-16LE.
+        QString string = value.toString();
+
+        return QByteArray((const char *)string.utf16(), string.size() * 2);
+    }
+    return value.toByteArray();
+}
+
+FakeMapiNode *FakeMapiStore::nodeMerge(FakeMapiNode::Kind kind, mapi_id_t id, mapi_id_t parentId, const FakeMapiProperties &properties)
+{
+    FakeMapiNode *node = m_nodes.value(id);
+
+    if (!node) {
+        node = new FakeMapiNode(kind, id, 0);
+        m_nodes.insert(id, node);
+    }
+    if (parentId && (parentId != node->parentId)) {
+        FakeMapiNode *parent = m_nodes.value(node->parentId);
+
+        if (parent) {
+            parent->folders.removeOne(id);
+            parent->messages.removeOne(id);
+        }
+
+        // The parent may not have been seen yet.
+        parent = m_nodes.value(parentId);
+        if (!parent) {
+            parent = new FakeMapiNode(FakeMapiNode::Folder, parentId, 0);
+            m_nodes.insert(parentId, parent);
+        }
+        if (FakeMapiNode::Folder == kind) {
+            parent->folders.append(id);
+        } else {
+            parent->messages.append(id);
+        }
+        node->parentId = parentId;
+    }
+    for (FakeMapiProperties::const_iterator i = properties.constBegin(); i != properties.constEnd(); ++i) {
+        node->properties.insert(i.key(), i.value());
+    }
+    return node;
+}
+
+void FakeMapiStore::defaultFolderSet(uint32_t folderType, mapi_id_t id)
+{
+    QWriteLocker locker(&m_lock);
+
+    m_defaultFolders.insert(folderType, id);
+    nodeMerge(FakeMapiNode::Folder, id, 0, FakeMapiProperties());
+}
+
+void FakeMapiStore::folderMerge(mapi_id_t id, mapi_id_t parentId, const FakeMapiProperties &properties)
+{
+    QWriteLocker locker(&m_lock);
+
+    nodeMerge(FakeMapiNode::Folder, id, parentId, properties);
+}
+
+void FakeMapiStore::messageMerge(mapi_id_t id, mapi_id_t folderId, const FakeMapiProperties &properties)
+{
+    QWriteLocker locker(&m_lock);
+
+    nodeMerge(FakeMapiNode::Message, id, folderId, properties);
+}
+
+void FakeMapiStore::recipientsSet(mapi_id_t messageId, const QList<FakeMapiProperties> &recipients)
+{
+    QWriteLocker locker(&m_lock);
+
+    nodeMerge(FakeMapiNode::Message, messageId, 0, FakeMapiProperties())->recipients = recipients;
+}
+
+void FakeMapiStore::galMerge(const FakeMapiProperties &entry)
+{
+    QWriteLocker locker(&m_lock);
+    FakeMapiProperties &merged = m_galSorted[galKey(entry)];
+
+    for (FakeMapiProperties::const_iterator i = entry.constBegin(); i != entry.constEnd(); ++i) {
+        merged.insert(i.key(), i.value());
+    }
+}
+
+void FakeMapiStore::resolutionAdd(const QString &name, const FakeMapiProperties &entry)
+{
+    QWriteLocker locker(&m_lock);
+
+    m_resolutions.insert(name.toLower(), entry);
+}
+
+/**
+ * QDataStream has no operators for mapi_id_t, which is an unsigned long on
+ * some platforms.
+ */
+static void idsWrite(QDataStream &out, const QList<mapi_id_t> &ids)
+{
+    out << (quint32)ids.size();
+    foreach (mapi_id_t id, ids) {
+        out << (quint64)id;
+    }
+}
+
+static void idsRead(QDataStream &in, QList<mapi_id_t> &ids)
+{
+    quint32 count;
+    quint64 id;
+
+    in >> count;
+    ids.clear();
+    for (quint32 i = 0; (i < count) && (in.status() == QDataStream::Ok); i++) {
+        in >> id;
+        ids.append(id);
+    }
+}
+
+bool FakeMapiStore::save(const QString &fileName) const
+{
+    QByteArray contents;
+    QDataStream out(&contents, QIODevice::WriteOnly);
+
+    out.setVersion(QDataStream::Qt_4_6);
+    {
+        QReadLocker locker(&m_lock);
+
+        out << (quint32)m_defaultFolders.size();
+        for (QHash<uint32_t, mapi_id_t>::const_iterator i = m_defaultFolders.constBegin(); i != m_defaultFolders.constEnd(); ++i) {
+            out << (quint32)i.key() << (quint64)i.value();
+        }
+        out << (quint32)m_nodes.size();
+        foreach (const FakeMapiNode *node, m_nodes) {
+            out << (quint8)node->kind << (quint64)node->id << (quint64)node->parentId;
+            out << node->properties << node->recipients << node->attachments;
+            idsWrite(out, node->folders);
+            idsWrite(out, node->messages);
+        }
+        out << m_galSorted.values() << m_resolutions;
+    }
+    {
+        QMutexLocker locker(&m_namesLock);
+
+        out << m_namedIds;
+    }
+    {
+        QMutexLocker locker(&m_timingsLock);
+
+        out << m_timings;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "FakeMapiStore: cannot write" << fileName << file.errorString();
+        return false;
+    }
+    QDataStream header(&file);
+    header.setVersion(QDataStream::Qt_4_6);
+    header.writeRawData(TRACE_MAGIC, strlen(TRACE_MAGIC));
+    header << (quint32)TRACE_VERSION << qCompress(contents);
+    if (header.status() != QDataStream::Ok) {
+        qWarning() << "FakeMapiStore: cannot write" << fileName;
+        return false;
+    }
+    qDebug() << "FakeMapiStore: saved" << m_nodes.size() << "folders and messages," << m_galSorted.size() << "GAL entries to" << fileName;
+    return true;
+}
+
+bool FakeMapiStore::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "FakeMapiStore: cannot read" << fileName << file.errorString();
+        return false;
+    }
+    QDataStream header(&file);
+    QByteArray magic(strlen(TRACE_MAGIC), 0);
+    quint32 version;
+    QByteArray compressed;
+
+    header.setVersion(QDataStream::Qt_4_6);
+    header.readRawData(magic.data(), magic.size());
+    header >> version >> compressed;
+    if ((magic != TRACE_MAGIC) || (version != TRACE_VERSION) || (header.status() != QDataStream::Ok)) {
+        qWarning() << "FakeMapiStore: not a trace" << fileName;
+        return false;
+    }
+    QByteArray contents = qUncompress(compressed);
+    QDataStream in(contents);
+    quint32 count;
+    QList<FakeMapiProperties> gal;
+
+    in.setVersion(QDataStream::Qt_4_6);
+    qDeleteAll(m_nodes);
+    m_nodes.clear();
+    m_defaultFolders.clear();
+    in >> count;
+    for (quint32 i = 0; (i < count) && (in.status() == QDataStream::Ok); i++) {
+        quint32 type;
+        quint64 id;
+
+        in >> type >> id;
+        m_defaultFolders.insert(type, id);
+    }
+    in >> count;
+    for (quint32 i = 0; (i < count) && (in.status() == QDataStream::Ok); i++) {
+        quint8 kind;
+        quint64 id;
+        quint64 parentId;
+
+        in >> kind >> id >> parentId;
+        FakeMapiNode *node = new FakeMapiNode((FakeMapiNode::Kind)kind, id, parentId);
+        in >> node->properties >> node->recipients >> node->attachments;
+        idsRead(in, node->folders);
+        idsRead(in, node->messages);
+        m_nodes.insert(node->id, node);
+    }
+    in >> gal >> m_resolutions >> m_namedIds >> m_recordedTimings;
+    if (in.status() != QDataStream::Ok) {
+        qWarning() << "FakeMapiStore: truncated trace" << fileName;
+        return false;
+    }
+    m_galSorted.clear();
+    foreach (const FakeMapiProperties &entry, gal) {
+        m_galSorted.insert(galKey(entry), entry);
+    }
+    galIndex();
+    m_names.clear();
+    for (QHash<QByteArray, uint16_t>::const_iterator i = m_namedIds.constBegin(); i != m_namedIds.constEnd(); ++i) {
+        m_names.insert(i.value(), i.key());
+        if (i.value() >= m_nextNamedId) {
+            m_nextNamedId = i.value() + 1;
+        }
+    }
+    qDebug() << "FakeMapiStore: replaying" << fileName;
+    return true;
+}
@@ -0,0 +1,257 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAKEMAPISTORE_H
+#define FAKEMAPISTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QPair>
+#include <QReadWriteLock>
+#include <QString>
+#include <QVariant>
+
+extern "C" {
+#include <libmapi/libmapi.h>
+}
+
+/**
+ * The properties of a folder, message, recipient, attachment or GAL entry,
+ * keyed by property id (the top 16 bits of the tag). The MAPI type is implied
+ * by the type of the value, see @ref FakeMapiStore::toSPropValue().
+ */
+typedef QMap<unsigned, QVariant> FakeMapiProperties;
+
+/**
+ * A folder or message in the store.
+ */
+class FakeMapiNode
+{
+public:
+    enum Kind {
+        Folder,
+        Message
+    };
+
+    FakeMapiNode(Kind kind, mapi_id_t id, mapi_id_t parentId);
+
+    Kind kind;
+    mapi_id_t id;
+    mapi_id_t parentId;
+    FakeMapiProperties properties;
+
+    /**
+     * For a folder, the ids of its subfolders and messages.
+     */
+    QList<mapi_id_t> folders;
+    QList<mapi_id_t> messages;
+
+    /**
+     * For a message, its recipients and attachments.
+     */
+    QList<FakeMapiProperties> recipients;
+    QList<FakeMapiProperties> attachments;
+};
+
+/**
+ * An in-process stand-in for an Exchange server, holding a synthetic mailbox
+ * and GAL. The contents are generated from a handful of parameters read from
+ * the file named by $FAKEMAPI_STORE (if any), in the [Store] group:
+ *
+ *  - Folders:          subfolders under each default folder (default 2).
+ *  - Depth:            levels of subfolders (default 1).
+ *  - Messages:         messages in each folder (default 50).
+ *  - Recipients:       recipients of each message (default 3).
+ *  - Attachments:      attachments on each message (default 0).
+ *  - AttachmentSize:   bytes in each attachment (default 4096).
+ *  - BodySize:         characters in each message body (default 2048).
+ *  - GalEntries:       entries in the GAL (default 1000).
+ *  - Latency:          milliseconds added to each RPC (default 0).
+ *
+ * $FAKEMAPI_LATENCY overrides the latency without needing a file.
+ *
+ * Alternatively, $FAKEMAPI_REPLAY names a trace saved by @ref save(), in which
+ * case the contents are whatever a real server returned when the trace was
+ * recorded, and each RPC takes as long as it did then (unless
+ * $FAKEMAPI_LATENCY is set). While $FAKEMAPI_RECORD names a file, the store
+ * starts empty, is filled in by librecordmapi from the results of real calls,
+ * and is saved to the file on exit.
+ *
+ * The contents are the same from run to run, so that timings can be
+ * compared. All methods are thread-safe.
+ */
+class FakeMapiStore
+{
+public:
+    static FakeMapiStore *self();
+
+    ~FakeMapiStore();
+
+    /**
+     * Account for a call which makes one or more round trips to the server.
+     */
+    void rpc(const char *call, unsigned count = 1);
+
+    /**
+     * Account for a call which took the given time on a real server.
+     */
+    void timing(const char *call, quint64 usecs);
+
+    /**
+     * The id of one of the well-known folders (olFolderInbox etc.), or 0.
+     */
+    mapi_id_t defaultFolder(uint32_t folderType) const;
+
+    /**
+     * Look up a folder or message. The result is a copy, so that the caller
+     * need not worry about concurrent @ref propertiesSet() calls.
+     */
+    bool node(mapi_id_t id, FakeMapiNode::Kind kind, FakeMapiNode &result) const;
+
+    /**
+     * The rows of a folder's hierarchy table.
+     */
+    QList<FakeMapiProperties> folders(mapi_id_t parentId, bool deep) const;
+
+    /**
+     * The rows of a folder's contents table.
+     */
+    QList<FakeMapiProperties> messages(mapi_id_t parentId) const;
+
+    /**
+     * Update some properties of a message.
+     */
+    bool propertiesSet(mapi_id_t id, const FakeMapiProperties &properties);
+
+    /**
+     * The GAL, sorted by display name.
+     */
+    unsigned galCount() const;
+    const FakeMapiProperties &galAt(unsigned i) const;
+
+    /**
+     * Find a GAL entry by display name, SMTP address or account.
+     *
+     * @return The index of the entry, or -1.
+     */
+    int galFind(const QString &name) const;
+
+    /**
+     * Find the first GAL entry whose display name sorts at or after the
+     * given one.
+     */
+    unsigned galSeek(const QString &displayName) const;
+
+    /**
+     * Resolve a name as ResolveNames would, preferring any result recorded
+     * from a real server.
+     */
+    bool resolve(const QString &name, FakeMapiProperties &result) const;
+
+    /**
+     * Map named properties to ids, as GetIDsFromNames does, allocating new
+     * ids as needed. Ids are shared by all objects, as with a real store.
+     */
+    uint16_t namedPropertyId(const struct MAPINAMEID &name);
+    bool namedProperty(TALLOC_CTX *ctx, uint16_t id, struct MAPINAMEID &name) const;
+    QList<uint16_t> namedPropertyIds() const;
+
+    /**
+     * Convert between our properties and the MAPI representation. Values
+     * larger than the stream threshold are not returned inline; as with a
+     * real server, the caller must use a stream to read them.
+     */
+    static bool toSPropValue(TALLOC_CTX *ctx, const FakeMapiProperties &properties, uint32_t tag, struct SPropValue &result);
+    static QVariant fromSPropValue(struct SPropValue &property);
+    static FakeMapiProperties fromSPropValues(struct SPropValue *properties, unsigned count);
+    static QByteArray toStream(const QVariant &value);
+
+    /**
+     * Fill in the store from the results of calls to a real server. Nodes
+     * are created as needed, a parentId of 0 leaves the parent unchanged, and
+     * new properties overwrite old ones.
+     */
+    void defaultFolderSet(uint32_t folderType, mapi_id_t id);
+    void folderMerge(mapi_id_t id, mapi_id_t parentId, const FakeMapiProperties &properties);
+    void messageMerge(mapi_id_t id, mapi_id_t folderId, const FakeMapiProperties &properties);
+    void recipientsSet(mapi_id_t messageId, const QList<FakeMapiProperties> &recipients);
+    void galMerge(const FakeMapiProperties &entry);
+    void resolutionAdd(const QString &name, const FakeMapiProperties &entry);
+    void namedPropertyIdSet(const struct MAPINAMEID &name, uint16_t id);
+
+    /**
+     * Save the contents and call timings as a trace, or replace them with
+     * those from a trace.
+     */
+    bool save(const QString &fileName) const;
+    bool load(const QString &fileName);
+
+private:
+    FakeMapiStore();
+
+    void generate();
+    void galIndex();
+    mapi_id_t folderAdd(mapi_id_t parentId, const QString &name, const QString &folderClass);
+    void messageAdd(FakeMapiNode &folder, unsigned n);
+    void subfoldersAdd(mapi_id_t parentId, const QString &folderClass, unsigned depth);
+    FakeMapiNode *nodeMerge(FakeMapiNode::Kind kind, mapi_id_t id, mapi_id_t parentId, const FakeMapiProperties &properties);
+
+    mutable QReadWriteLock m_lock;
+    QHash<mapi_id_t, FakeMapiNode *> m_nodes;
+    QHash<uint32_t, mapi_id_t> m_defaultFolders;
+    mapi_id_t m_nextId;
+
+    /**
+     * The GAL is kept sorted by display name (and DN, since names need not be
+     * unique), and indexed for resolving.
+     */
+    QMap<QString, FakeMapiProperties> m_galSorted;
+    QList<FakeMapiProperties> m_gal;
+    QHash<QString, int> m_galIndex;
+    QHash<QString, FakeMapiProperties> m_resolutions;
+
+    mutable QMutex m_namesLock;
+    QHash<QByteArray, uint16_t> m_namedIds;
+    QHash<uint16_t, QByteArray> m_names;
+    uint16_t m_nextNamedId;
+
+    /**
+     * The number of calls of each kind, and the total time they took, both
+     * for this run and (when replaying) as recorded.
+     */
+    typedef QHash<QByteArray, QPair<quint64, quint64> > Timings;
+    mutable QMutex m_timingsLock;
+    Timings m_timings;
+    Timings m_recordedTimings;
+    QString m_recordFile;
+
+    unsigned m_folders;
+    unsigned m_depth;
+    unsigned m_messages;
+    unsigned m_recipients;
+    unsigned m_attachments;
+    unsigned m_attachmentSize;
+    unsigned m_bodySize;
+    unsigned m_latency;
+};
+
+#endif
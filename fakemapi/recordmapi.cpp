@@ -0,0 +1,616 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Wrappers for the libmapi calls made by the connector which record what a
+ * real server returns. Preloading this library ahead of libmapi:
+ *
+ *  FAKEMAPI_RECORD=sync.trace LD_PRELOAD=librecordmapi.so akonadi_exmail_resource ...
+ *
+ * passes each call through to libmapi, timing it, and adds the folders,
+ * messages, recipients, stream contents, GAL entries and name resolutions
+ * it returns to a @ref FakeMapiStore. On exit, the store is saved as a trace
+ * which libfakemapi can replay with $FAKEMAPI_REPLAY.
+ *
+ * ICS is passed through too, and the folders and messages in the fast transfer
+ * stream are added to the store just as table rows are, so that a replay (in
+ * which ICS is unsupported, and the resource walks the tables) sees them.
+ */
+
+#include "fakemapistore.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <dlfcn.h>
+#include <errno.h>
+
+/**
+ * Call the real libmapi function, timing it, and leave the result in status.
+ */
+#define REAL_CALL(name, args) \
+    static __typeof__(&name) real_##name = (__typeof__(&name))dlsym(RTLD_NEXT, #name); \
+    QElapsedTimer timer; \
+    timer.start(); \
+    __typeof__(real_##name args) status = real_##name args; \
+    FakeMapiStore::self()->timing(#name, timer.nsecsElapsed() / 1000)
+
+/**
+ * What we know about a mapi_object_t.
+ */
+class RecordedObject
+{
+public:
+    enum Type {
+        Folder,
+        Message,
+        HierarchyTable,
+        ContentsTable,
+        Stream,
+        Synchronization
+    };
+
+    RecordedObject(Type type = Folder, mapi_id_t id = 0, mapi_id_t parentId = 0) :
+        type(type),
+        id(id),
+        parentId(parentId),
+        ownerType(type),
+        tag(0)
+    {
+    }
+
+    Type type;
+
+    /**
+     * The folder or message id. For a table or stream, that of its owner.
+     */
+    mapi_id_t id;
+
+    /**
+     * The folder of a message.
+     */
+    mapi_id_t parentId;
+
+    /**
+     * For a stream, the type of its owner, the property and what has been
+     * read so far. For a synchronization, the type of object it reports
+     * changes to, and the fast transfer stream so far.
+     */
+    Type ownerType;
+    uint32_t tag;
+    QByteArray data;
+};
+
+static QMutex objectsLock;
+static QHash<mapi_object_t *, RecordedObject> objects;
+
+static void objectSet(mapi_object_t *obj, const RecordedObject &object)
+{
+    QMutexLocker locker(&objectsLock);
+
+    objects.insert(obj, object);
+}
+
+static bool objectGet(mapi_object_t *obj, RecordedObject &object)
+{
+    QMutexLocker locker(&objectsLock);
+    QHash<mapi_object_t *, RecordedObject>::const_iterator i = objects.constFind(obj);
+
+    if (i == objects.constEnd()) {
+        return false;
+    }
+    object = i.value();
+    return true;
+}
+
+/**
+ * Add properties to the folder or message they were read from.
+ */
+static void propertiesMerge(RecordedObject::Type type, mapi_id_t id, mapi_id_t parentId, const FakeMapiProperties &properties)
+{
+    switch (type) {
+    case RecordedObject::Folder:
+        FakeMapiStore::self()->folderMerge(id, parentId, properties);
+        break;
+    case RecordedObject::Message:
+        FakeMapiStore::self()->messageMerge(id, parentId, properties);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * The folders or messages changed in a fast transfer stream, skipping the
+ * properties of anything nested inside them, as MapiSynchronizer does.
+ */
+class RecordedChanges
+{
+public:
+    RecordedChanges() :
+        inChange(false),
+        depth(0)
+    {
+    }
+
+    static enum MAPISTATUS marker(uint32_t marker, void *priv)
+    {
+        RecordedChanges *changes = static_cast<RecordedChanges *>(priv);
+
+        switch (marker) {
+        case FX_INCR_SYNC_CHG:
+            changes->changes.append(FakeMapiProperties());
+            changes->inChange = true;
+            changes->depth = 0;
+            break;
+        case FX_INCR_SYNC_DEL:
+        case FX_INCR_SYNC_STATE_BEGIN:
+        case FX_INCR_SYNC_STATE_END:
+        case FX_INCR_SYNC_END:
+            changes->inChange = false;
+            break;
+        case FX_START_RECIP:
+        case FX_NEW_ATTACH:
+        case FX_START_EMBED:
+            changes->depth++;
+            break;
+        case FX_END_TO_RECIP:
+        case FX_END_ATTACH:
+        case FX_END_EMBED:
+            changes->depth--;
+            break;
+        default:
+            break;
+        }
+        return MAPI_E_SUCCESS;
+    }
+
+    static enum MAPISTATUS property(struct SPropValue value, void *priv)
+    {
+        RecordedChanges *changes = static_cast<RecordedChanges *>(priv);
+
+        if (changes->inChange && !changes->depth) {
+            changes->changes.last().insert(value.ulPropTag >> 16, FakeMapiStore::fromSPropValue(value));
+        }
+        return MAPI_E_SUCCESS;
+    }
+
+    QList<FakeMapiProperties> changes;
+    bool inChange;
+    int depth;
+};
+
+/**
+ * Add the folders or messages in a complete fast transfer stream.
+ */
+static void synchronizationMerge(const RecordedObject &object)
+{
+    TALLOC_CTX *ctx = talloc_named_const(NULL, 0, "synchronizationMerge");
+    RecordedChanges changes;
+    struct fx_parser_context *parser = fxparser_init(ctx, &changes);
+    DATA_BLOB buffer;
+
+    buffer.data = (uint8_t *)object.data.data();
+    buffer.length = object.data.size();
+    fxparser_set_marker_callback(parser, RecordedChanges::marker);
+    fxparser_set_property_callback(parser, RecordedChanges::property);
+    fxparser_parse(parser, &buffer);
+    talloc_free(ctx);
+
+    FakeMapiStore *store = FakeMapiStore::self();
+    foreach (const FakeMapiProperties &change, changes.changes) {
+        if (RecordedObject::Folder == object.ownerType) {
+            mapi_id_t id = change.value(PidTagFolderId >> 16).toULongLong();
+            mapi_id_t parentId = change.value(PidTagParentFolderId >> 16, (qulonglong)object.id).toULongLong();
+
+            if (id) {
+                store->folderMerge(id, parentId, change);
+            }
+        } else {
+            mapi_id_t id = change.value(PidTagMid >> 16).toULongLong();
+
+            if (id) {
+                store->messageMerge(id, object.id, change);
+            }
+        }
+    }
+}
+
+/**
+ * Once an object is finished with, anything read from a stream is complete.
+ */
+static void objectForget(mapi_object_t *obj)
+{
+    RecordedObject object;
+    {
+        QMutexLocker locker(&objectsLock);
+
+        object = objects.take(obj);
+    }
+    if (object.data.isEmpty()) {
+        return;
+    }
+    if (RecordedObject::Synchronization == object.type) {
+        synchronizationMerge(object);
+        return;
+    }
+    if (RecordedObject::Stream != object.type) {
+        return;
+    }
+
+    FakeMapiProperties properties;
+    switch (object.tag & 0xFFFF) {
+    case PT_UNICODE:
+        properties.insert(object.tag >> 16, QString::fromUtf16((const ushort *)object.data.constData(), object.data.size() / 2));
+        break;
+    case PT_STRING8:
+        properties.insert(object.tag >> 16, QString::fromUtf8(object.data));
+        break;
+    default:
+        properties.insert(object.tag >> 16, object.data);
+        break;
+    }
+    propertiesMerge(object.ownerType, object.id, 0, properties);
+}
+
+static QList<FakeMapiProperties> rows(struct SRowSet *rowSet)
+{
+    QList<FakeMapiProperties> result;
+
+    if (rowSet) {
+        for (unsigned i = 0; i < rowSet->cRows; i++) {
+            result.append(FakeMapiStore::fromSPropValues(rowSet->aRow[i].lpProps, rowSet->aRow[i].cValues));
+        }
+    }
+    return result;
+}
+
+extern "C" {
+
+enum MAPISTATUS mapi_object_init(mapi_object_t *obj)
+{
+    static __typeof__(&mapi_object_init) real_mapi_object_init = (__typeof__(&mapi_object_init))dlsym(RTLD_NEXT, "mapi_object_init");
+
+    objectForget(obj);
+    return real_mapi_object_init(obj);
+}
+
+void mapi_object_release(mapi_object_t *obj)
+{
+    static __typeof__(&mapi_object_release) real_mapi_object_release = (__typeof__(&mapi_object_release))dlsym(RTLD_NEXT, "mapi_object_release");
+    QElapsedTimer timer;
+
+    objectForget(obj);
+    timer.start();
+    real_mapi_object_release(obj);
+    FakeMapiStore::self()->timing("Release", timer.nsecsElapsed() / 1000);
+}
+
+enum MAPISTATUS MapiLogonEx(struct mapi_context *mapi_ctx, struct mapi_session **session, const char *profname, const char *password)
+{
+    REAL_CALL(MapiLogonEx, (mapi_ctx, session, profname, password));
+    return status;
+}
+
+enum MAPISTATUS Logoff(mapi_object_t *obj_store)
+{
+    REAL_CALL(Logoff, (obj_store));
+    return status;
+}
+
+NTSTATUS emsmdb_transaction_null(struct emsmdb_context *emsmdb_ctx, struct mapi_response **res)
+{
+    REAL_CALL(emsmdb_transaction_null, (emsmdb_ctx, res));
+    return status;
+}
+
+enum MAPISTATUS OpenMsgStore(struct mapi_session *session, mapi_object_t *obj_store)
+{
+    REAL_CALL(OpenMsgStore, (session, obj_store));
+    return status;
+}
+
+enum MAPISTATUS GetDefaultFolder(mapi_object_t *obj_store, uint64_t *folder, const uint32_t id)
+{
+    REAL_CALL(GetDefaultFolder, (obj_store, folder, id));
+    if (MAPI_E_SUCCESS == status) {
+        FakeMapiStore::self()->defaultFolderSet(id, *folder);
+    }
+    return status;
+}
+
+enum MAPISTATUS OpenFolder(mapi_object_t *obj_store, mapi_id_t id_folder, mapi_object_t *obj_folder)
+{
+    REAL_CALL(OpenFolder, (obj_store, id_folder, obj_folder));
+    if (MAPI_E_SUCCESS == status) {
+        FakeMapiStore::self()->folderMerge(id_folder, 0, FakeMapiProperties());
+        objectSet(obj_folder, RecordedObject(RecordedObject::Folder, id_folder));
+    }
+    return status;
+}
+
+enum MAPISTATUS GetHierarchyTable(mapi_object_t *obj_container, mapi_object_t *obj_table, uint8_t TableFlags, uint32_t *RowCount)
+{
+    REAL_CALL(GetHierarchyTable, (obj_container, obj_table, TableFlags, RowCount));
+    RecordedObject folder;
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj_container, folder)) {
+        objectSet(obj_table, RecordedObject(RecordedObject::HierarchyTable, folder.id));
+    }
+    return status;
+}
+
+enum MAPISTATUS GetContentsTable(mapi_object_t *obj_container, mapi_object_t *obj_table, uint8_t TableFlags, uint32_t *RowCount)
+{
+    REAL_CALL(GetContentsTable, (obj_container, obj_table, TableFlags, RowCount));
+    RecordedObject folder;
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj_container, folder)) {
+        objectSet(obj_table, RecordedObject(RecordedObject::ContentsTable, folder.id));
+    }
+    return status;
+}
+
+enum MAPISTATUS SetColumns(mapi_object_t *obj_table, struct SPropTagArray *properties)
+{
+    REAL_CALL(SetColumns, (obj_table, properties));
+    return status;
+}
+
+enum MAPISTATUS QueryPosition(mapi_object_t *obj_table, uint32_t *Numerator, uint32_t *Denominator)
+{
+    REAL_CALL(QueryPosition, (obj_table, Numerator, Denominator));
+    return status;
+}
+
+enum MAPISTATUS QueryRows(mapi_object_t *obj_table, uint16_t row_count, enum QueryRowsFlags flags, struct SRowSet *rowSet)
+{
+    REAL_CALL(QueryRows, (obj_table, row_count, flags, rowSet));
+    RecordedObject table;
+    if ((MAPI_E_SUCCESS != status) || !objectGet(obj_table, table)) {
+        return status;
+    }
+
+    FakeMapiStore *store = FakeMapiStore::self();
+    foreach (const FakeMapiProperties &row, rows(rowSet)) {
+        if (RecordedObject::HierarchyTable == table.type) {
+            mapi_id_t id = row.value(PidTagFolderId >> 16).toULongLong();
+
+            // Shallow tables do not ask for the parent.
+            mapi_id_t parentId = row.value(PidTagParentFolderId >> 16, (qulonglong)table.id).toULongLong();
+            if (id) {
+                store->folderMerge(id, parentId, row);
+            }
+        } else if (RecordedObject::ContentsTable == table.type) {
+            mapi_id_t id = row.value(PidTagMid >> 16).toULongLong();
+
+            if (id) {
+                store->messageMerge(id, table.id, row);
+            }
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS OpenMessage(mapi_object_t *obj_store, mapi_id_t id_folder, mapi_id_t id_message, mapi_object_t *obj_message, uint8_t ulFlags)
+{
+    REAL_CALL(OpenMessage, (obj_store, id_folder, id_message, obj_message, ulFlags));
+    if (MAPI_E_SUCCESS == status) {
+        FakeMapiStore::self()->messageMerge(id_message, id_folder, FakeMapiProperties());
+        objectSet(obj_message, RecordedObject(RecordedObject::Message, id_message, id_folder));
+    }
+    return status;
+}
+
+enum MAPISTATUS GetRecipientTable(mapi_object_t *obj_message, struct SRowSet *SRowSet, struct SPropTagArray *SPropTagArray)
+{
+    REAL_CALL(GetRecipientTable, (obj_message, SRowSet, SPropTagArray));
+    RecordedObject message;
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj_message, message)) {
+        FakeMapiStore::self()->recipientsSet(message.id, rows(SRowSet));
+    }
+    return status;
+}
+
+enum MAPISTATUS GetProps(mapi_object_t *obj, uint32_t flags, struct SPropTagArray *SPropTagArray, struct SPropValue **lpProps, uint32_t *PropCount)
+{
+    REAL_CALL(GetProps, (obj, flags, SPropTagArray, lpProps, PropCount));
+    RecordedObject object;
+
+    // Named properties are recorded by id, as returned, so the mapping from
+    // names is recorded too; see GetIDsFromNames().
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj, object)) {
+        propertiesMerge(object.type, object.id, object.parentId, FakeMapiStore::fromSPropValues(*lpProps, *PropCount));
+    }
+    return status;
+}
+
+enum MAPISTATUS GetPropsAll(mapi_object_t *obj, uint32_t flags, struct mapi_SPropValue_array *properties)
+{
+    REAL_CALL(GetPropsAll, (obj, flags, properties));
+    RecordedObject object;
+    if ((MAPI_E_SUCCESS != status) || !objectGet(obj, object)) {
+        return status;
+    }
+
+    TALLOC_CTX *ctx = talloc_named_const(NULL, 0, "GetPropsAll");
+    struct SPropValue *values = talloc_array(ctx, struct SPropValue, properties->cValues);
+    for (unsigned i = 0; i < properties->cValues; i++) {
+        cast_SPropValue(ctx, &properties->lpProps[i], &values[i]);
+    }
+    propertiesMerge(object.type, object.id, object.parentId, FakeMapiStore::fromSPropValues(values, properties->cValues));
+    talloc_free(ctx);
+    return status;
+}
+
+enum MAPISTATUS OpenStream(mapi_object_t *obj_related, enum MAPITAGS PropertyTag, enum OpenStream_OpenModeFlags OpenModeFlag, mapi_object_t *obj_stream)
+{
+    REAL_CALL(OpenStream, (obj_related, PropertyTag, OpenModeFlag, obj_stream));
+    RecordedObject owner;
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj_related, owner)) {
+        RecordedObject stream(RecordedObject::Stream, owner.id, owner.parentId);
+
+        stream.ownerType = owner.type;
+        stream.tag = PropertyTag;
+        objectSet(obj_stream, stream);
+    }
+    return status;
+}
+
+enum MAPISTATUS GetStreamSize(mapi_object_t *obj_stream, uint32_t *StreamSize)
+{
+    REAL_CALL(GetStreamSize, (obj_stream, StreamSize));
+    return status;
+}
+
+enum MAPISTATUS ReadStream(mapi_object_t *obj_stream, unsigned char *buf_data, uint16_t ByteCount, uint16_t *ByteRead)
+{
+    REAL_CALL(ReadStream, (obj_stream, buf_data, ByteCount, ByteRead));
+    if (MAPI_E_SUCCESS == status) {
+        QMutexLocker locker(&objectsLock);
+        QHash<mapi_object_t *, RecordedObject>::iterator i = objects.find(obj_stream);
+
+        if (i != objects.end()) {
+            i.value().data.append((const char *)buf_data, *ByteRead);
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS GetIDsFromNames(mapi_object_t *obj, uint16_t count, struct MAPINAMEID *nameid, uint32_t ulFlags, struct SPropTagArray **proptags)
+{
+    REAL_CALL(GetIDsFromNames, (obj, count, nameid, ulFlags, proptags));
+    if (MAPI_E_SUCCESS == status) {
+        for (unsigned i = 0; (i < count) && (i < (*proptags)->cValues); i++) {
+            FakeMapiStore::self()->namedPropertyIdSet(nameid[i], (*proptags)->aulPropTag[i] >> 16);
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS GetNamesFromIDs(mapi_object_t *obj, enum MAPITAGS ulPropTag, uint16_t *count, struct MAPINAMEID **nameid)
+{
+    REAL_CALL(GetNamesFromIDs, (obj, ulPropTag, count, nameid));
+    if ((MAPI_E_SUCCESS == status) && (1 == *count)) {
+        FakeMapiStore::self()->namedPropertyIdSet(**nameid, ulPropTag >> 16);
+    }
+    return status;
+}
+
+enum MAPISTATUS QueryNamedProperties(mapi_object_t *obj, uint8_t queryFlags, struct GUID *guid, uint16_t *count, uint16_t **propID, struct MAPINAMEID **nameid)
+{
+    REAL_CALL(QueryNamedProperties, (obj, queryFlags, guid, count, propID, nameid));
+    if (MAPI_E_SUCCESS == status) {
+        for (unsigned i = 0; i < *count; i++) {
+            FakeMapiStore::self()->namedPropertyIdSet((*nameid)[i], (*propID)[i]);
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS Subscribe(mapi_object_t *obj, uint32_t *connection, uint16_t NotificationFlags, bool WholeStore, mapi_notify_callback_t notify_callback, void *private_data)
+{
+    REAL_CALL(Subscribe, (obj, connection, NotificationFlags, WholeStore, notify_callback, private_data));
+    return status;
+}
+
+enum MAPISTATUS ICSSyncConfigure(mapi_object_t *obj, enum SynchronizationType sync_type, uint8_t send_options, uint16_t sync_flags, DATA_BLOB restriction, uint32_t sync_extraflags, const struct SPropTagArray *property_tags, mapi_object_t *obj_sync_context)
+{
+    REAL_CALL(ICSSyncConfigure, (obj, sync_type, send_options, sync_flags, restriction, sync_extraflags, property_tags, obj_sync_context));
+    RecordedObject folder;
+    if ((MAPI_E_SUCCESS == status) && objectGet(obj, folder)) {
+        RecordedObject synchronization(RecordedObject::Synchronization, folder.id);
+
+        synchronization.ownerType = (SynchronizationType_Hierarchy == sync_type) ? RecordedObject::Folder : RecordedObject::Message;
+        objectSet(obj_sync_context, synchronization);
+    }
+    return status;
+}
+
+enum MAPISTATUS ICSSyncUploadStateBegin(mapi_object_t *obj_sync_context, enum StateProperty state_property, uint32_t length)
+{
+    REAL_CALL(ICSSyncUploadStateBegin, (obj_sync_context, state_property, length));
+    return status;
+}
+
+enum MAPISTATUS ICSSyncUploadStateContinue(mapi_object_t *obj_sync_context, DATA_BLOB state)
+{
+    REAL_CALL(ICSSyncUploadStateContinue, (obj_sync_context, state));
+    return status;
+}
+
+enum MAPISTATUS ICSSyncUploadStateEnd(mapi_object_t *obj_sync_context)
+{
+    REAL_CALL(ICSSyncUploadStateEnd, (obj_sync_context));
+    return status;
+}
+
+enum MAPISTATUS FXGetBuffer(mapi_object_t *obj_source_context, uint16_t maxSize, enum TransferStatus *transferStatus, uint16_t *progressStepCount, uint16_t *totalStepCount, DATA_BLOB *blob)
+{
+    REAL_CALL(FXGetBuffer, (obj_source_context, maxSize, transferStatus, progressStepCount, totalStepCount, blob));
+    if (MAPI_E_SUCCESS == status) {
+        QMutexLocker locker(&objectsLock);
+        QHash<mapi_object_t *, RecordedObject>::iterator i = objects.find(obj_source_context);
+
+        if (i != objects.end()) {
+            i.value().data.append((const char *)blob->data, blob->length);
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS ResolveNames(struct mapi_session *session, const char **usernames, struct SPropTagArray *props, struct PropertyRowSet_r **rowset, struct PropertyTagArray_r **flaglist, uint32_t flags)
+{
+    REAL_CALL(ResolveNames, (session, usernames, props, rowset, flaglist, flags));
+    if ((MAPI_E_SUCCESS != status) || !*flaglist) {
+        return status;
+    }
+
+    // There is a row for each resolved name, in order.
+    QList<FakeMapiProperties> resolved = rows((struct SRowSet *)*rowset);
+    int row = 0;
+    for (unsigned i = 0; i < (*flaglist)->cValues; i++) {
+        if ((MAPI_RESOLVED == (*flaglist)->aulPropTag[i]) && (row < resolved.size())) {
+            FakeMapiStore::self()->resolutionAdd(QString::fromUtf8(usernames[i]), resolved.at(row++));
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS GetGALTableCount(struct mapi_session *session, uint32_t *totalRecs)
+{
+    REAL_CALL(GetGALTableCount, (session, totalRecs));
+    return status;
+}
+
+enum MAPISTATUS GetGALTable(struct mapi_session *session, struct SPropTagArray *SPropTagArray, struct PropertyRowSet_r **RowSet, uint32_t count, uint8_t ulFlags)
+{
+    REAL_CALL(GetGALTable, (session, SPropTagArray, RowSet, count, ulFlags));
+    if (MAPI_E_SUCCESS == status) {
+        foreach (const FakeMapiProperties &entry, rows((struct SRowSet *)*RowSet)) {
+            FakeMapiStore::self()->galMerge(entry);
+        }
+    }
+    return status;
+}
+
+enum MAPISTATUS nspi_SeekEntries(struct nspi_context *nspi_ctx, TALLOC_CTX *mem_ctx, enum TableSortOrders SortType, struct PropertyValue_r *pTarget, struct SPropTagArray *pPropTags, struct PropertyTagArray_r *pMIds, struct PropertyRowSet_r **pRows)
+{
+    REAL_CALL(nspi_SeekEntries, (nspi_ctx, mem_ctx, SortType, pTarget, pPropTags, pMIds, pRows));
+    return status;
+}
+
+}
@@ -39,16 +39,9 @@
 #include <kpimutils/email.h>
 
 #include "mapiconnector2.h"
+#include "mapischema.h"
 #include "profiledialog.h"
 
-/**
- * Set this to 1 to pull all the properties, e.g. to see what a server has
- * available.
- */
-#ifndef DEBUG_NOTE_PROPERTIES
-#define DEBUG_NOTE_PROPERTIES 0
-#endif
-
 #define GET_SUBJECTS_FOR_EMBEDDED_MSGS 0
 
 using namespace Akonadi;
@@ -68,6 +61,11 @@ public:
 
     virtual ~MapiNote();
 
+    /**
+     * Release the attachment objects too.
+     */
+    virtual void close();
+
     /**
      * Fetch all email properties.
      */
@@ -150,41 +148,66 @@ const QString ExMailResource::profile()
 void ExMailResource::retrieveCollections()
 {
     Collection::List collections;
+    Collection::List deletedCollections;
 
     setName(i18n("Exchange Mail for %1", profile()));
-    fetchCollections(TopInformationStore, collections);
+    fetchCollections(TopInformationStore, collections, deletedCollections);
 
-    // Notify Akonadi about the new collections.
-    collectionsRetrieved(collections);
+    // Notify Akonadi about the changed collections.
+    collectionsRetrievedIncremental(collections, deletedCollections);
 }
 
 void ExMailResource::retrieveItems(const Akonadi::Collection &collection)
 {
-    Item::List items;
-    Item::List deletedItems;
-
-    fetchItems(collection, items, deletedItems);
-    kError() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
-#if (DEBUG_NOTE_PROPERTIES)
-    while (items.size() > 3) {
-        items.removeLast();
-    }
-#endif
+    fetchItems(collection);
+}
+
+void ExMailResource::itemsFetched(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+{
+    Q_UNUSED(collection);
+
+    MAPI_KDEBUG(Resource) << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
     itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
 }
 
 bool ExMailResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByteArray> &parts)
 {
     Q_UNUSED(parts);
 
-    MapiNote *message = fetchItem<MapiNote>(itemOrig);
-    if (!message) {
-        return false;
-    }
-    KMime::Message::Ptr ptr(message);
+    return fetchItemAsync<MapiNote>(itemOrig);
+}
 
+void ExMailResource::itemFetched(const Akonadi::Item &itemOrig, MapiMessage *message)
+{
     // Create a clone of the passed in const Item and fill it with the payload.
     Akonadi::Item item(itemOrig);
+    itemPayload(item, message);
+
+    // Notify Akonadi about the new data.
+    itemRetrieved(item);
+}
+
+unsigned ExMailResource::prefetchSessions()
+{
+    return Settings::self()->prefetchSessions();
+}
+
+MapiMessage *ExMailResource::createMessage(MapiConnector2 *connection, MapiId &id)
+{
+    return new MapiNote(connection, "ExMailResource::createMessage", id);
+}
+
+void ExMailResource::itemPayload(Akonadi::Item &item, MapiMessage *mapiMessage)
+{
+    MapiNote *message = static_cast<MapiNote *>(mapiMessage);
+
+    // The payload outlives the item fetch, so give it a copy of the content
+    // rather than the note.
+    KMime::Message::Ptr ptr(new KMime::Message);
+    ptr->setContent(message->encodedContent());
+    ptr->parse();
+    delete message;
 /*
     item.setMimeType(KMime::Message::mimeType());
     item.setPayload(KMime::Message::Ptr(message));
@@ -206,10 +229,6 @@ bool ExMailResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByt
     //item.setModificationTime(message->modified);
 */
     item.setPayload<KMime::Message::Ptr>(ptr);
-
-    // Notify Akonadi about the new data.
-    itemRetrieved(item);
-    return true;
 }
 
 void ExMailResource::aboutToQuit()
@@ -257,7 +276,7 @@ void ExMailResource::itemChanged(const Akonadi::Item &item, const QSet<QByteArra
     Q_UNUSED(parts);
 
     // Get the payload for the item.
-    kWarning() << "fetch cached item: {" <<
+    MAPI_KDEBUG(Resource) << "fetch cached item: {" <<
         item.parentCollection().name() << "," << item.id() << "} = {" <<
         item.parentCollection().remoteId() << "," << item.remoteId() << "}";
     Akonadi::ItemFetchJob *job = new Akonadi::ItemFetchJob(item);
@@ -336,7 +355,7 @@ void ExMailResource::itemChangedContinue(KJob* job)
     // TODO add further data
 
     // Update exchange with the new message.
-    kWarning() << "updating item: {" << 
+    MAPI_KDEBUG(Resource) << "updating item: {" <<
         currentCollection().name() << "," << item.id() << "} = {" << 
         folderId << "," << messageId << "}";
     emit status(Running, i18n("Updating item: { %1, %2 }", currentCollection().name(), messageId));
@@ -409,15 +428,9 @@ bool MapiEmbeddedNote::propertiesPull(QVector<int> &tags, const bool tagsAppende
 
 bool MapiEmbeddedNote::propertiesPull()
 {
-    static bool tagsAppended = false;
-    static QVector<int> tags;
+    QVector<int> tags;
 
-    if (!propertiesPull(tags, tagsAppended, (DEBUG_NOTE_PROPERTIES) != 0)) {
-        tagsAppended = true;
-        return false;
-    }
-    tagsAppended = true;
-    return true;
+    return propertiesPull(tags, false, MapiLog::enabled(MapiLog::Objects, MapiLog::Trace));
 }
 #endif
 
@@ -435,6 +448,15 @@ MapiNote::~MapiNote()
     mapi_object_release(&m_attachments);
 }
 
+void MapiNote::close()
+{
+    mapi_object_release(&m_attachment);
+    mapi_object_init(&m_attachment);
+    mapi_object_release(&m_attachments);
+    mapi_object_init(&m_attachments);
+    MapiMessage::close();
+}
+
 QDebug MapiNote::debug() const
 {
     static QString prefix = QString::fromAscii("MapiNote: %1:");
@@ -447,22 +469,221 @@ QDebug MapiNote::error() const
     return MapiObject::error(prefix.arg(m_id.toString()));
 }
 
+/**
+ * The state carried between the properties of a Note while they are decoded.
+ */
+class NoteDecoder
+{
+public:
+    NoteDecoder(MapiNote &note) :
+        note(note),
+        codepage(0),
+        hasAttachments(false),
+        textStream(false),
+        htmlStream(false)
+    {
+    }
+
+    MapiNote &note;
+    QString messageClass;
+    unsigned codepage;
+    QString textBody;
+    QString htmlBody;
+    bool hasAttachments;
+    bool textStream;
+    bool htmlStream;
+};
+
+template <QString NoteDecoder::*field>
+static bool noteString(NoteDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asString();
+    return true;
+}
+
+template <unsigned NoteDecoder::*field>
+static bool noteUnsigned(NoteDecoder &decoder, const MapiProperty &property)
+{
+    decoder.*field = property.asInteger();
+    return true;
+}
+
+static bool messageFlags(NoteDecoder &decoder, const MapiProperty &property)
+{
+    decoder.hasAttachments = (property.asInteger() & MSGFLAG_HASATTACH) != 0;
+    return true;
+}
+
+/**
+ * Anything else is either an oversize value, which must be read from a
+ * stream, or ignored.
+ */
+static bool noteProperty(NoteDecoder &decoder, const MapiProperty &property)
+{
+    switch (property.tag()) {
+#if (GET_SUBJECTS_FOR_EMBEDDED_MSGS)
+    // Only fetched for embedded notes, see MapiEmbeddedNote::propertiesPull().
+    case PidTagSubject:
+        decoder.note.subject()->fromUnicodeString(property.asString(), "utf-8");
+        return true;
+    case PidTagCreationTime:
+        decoder.note.date()->setDateTime(KDateTime(property.asDateTime()));
+        return true;
+#endif
+    default:
+        break;
+    }
+
+    // Handle oversize objects.
+    if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
+        switch (property.tag()) {
+        case PidTagBody_Error:
+            decoder.textStream = true;
+            break;
+        case PidTagHtml_Error:
+            decoder.htmlStream = true;
+            break;
+        default:
+            kError() << "missing oversize support:" << decoder.note.tagName(property.tag());
+            break;
+        }
+        return true;
+    }
+    MAPI_KTRACE(Objects) << "ignoring note property:" << decoder.note.tagName(property.tag()) << property.toString();
+    return true;
+}
+
+/**
+ * The properties used to fetch a Note, based on [MS-OXCMSG], and how each is
+ * decoded.
+ */
+static const MapiSchema<NoteDecoder>::Entry noteEntries[] = {
+    // 2.2.1.2
+    //PidTagHasAttachments,
+    // 2.2.1.3
+    { PidTagMessageClass, noteString<&NoteDecoder::messageClass> },
+    // 2.2.1.4
+    { PidTagMessageCodepage, noteUnsigned<&NoteDecoder::codepage> },
+    // 2.2.1.5
+    //PidTagMessageLocaleId,
+    // 2.2.1.6
+    { PidTagMessageFlags, messageFlags },
+    // 2.2.1.7
+    //PidTagMessageSize,
+    // 2.2.1.8
+    //PidTagMessageStatus,
+    // 2.2.1.9
+    //PidTagSubjectPrefix,
+    // 2.2.1.10
+    //PidTagNormalizedSubject,
+    // 2.2.1.11
+    //PidTagImportance,
+    // 2.2.1.12
+    //PidTagPriority,
+    // 2.2.1.13
+    //PidTagSensitivity,
+    // 2.2.1.14
+    //PidLidSmartNoAttach,
+    // 2.2.1.15
+    //PidLidPrivate,
+    // 2.2.1.16
+    //PidLidSideEffects,
+    // 2.2.1.17
+    //PidNameKeywords,
+    // 2.2.1.18
+    //PidLidCommonStart,
+    // 2.2.1.19
+    //PidLidCommonEnd,
+    // 2.2.1.20
+    //PidTagAutoForwarded,
+    // 2.2.1.21
+    //PidTagAutoForwardComment,
+    // 2.2.1.22
+    //PidLidCategories,
+    // 2.2.1.23
+    //PidLidClassification,
+    // 2.2.1.24
+    //PidLidClassificationDescription,
+    // 2.2.1.25
+    //PidLidClassified,
+    // 2.2.1.26
+    //PidTagInternetReferences,
+    // 2.2.1.27
+    //PidLidInfoPathFormName,
+    // 2.2.1.28
+    //PidTagMimeSkeleton,
+    // 2.2.1.29
+    //PidTagTnefCorrelationKey,
+    // 2.2.1.30
+    //PidTagAddressBookDisplayNamePrintable,
+    // 2.2.1.31
+    //PidTagCreatorEntryId,
+    // 2.2.1.32
+    //PidTagLastModifierEntryId,
+    // 2.2.1.33
+    //PidLidAgingDontAgeMe,
+    // 2.2.1.34
+    //PidLidCurrentVersion,
+    // 2.2.1.35
+    //PidLidCurrentVersionName,
+    // 2.2.1.36
+    //PidTagAlternateRecipientAllowed,
+    // 2.2.1.37
+    //PidTagResponsibility,
+    // 2.2.1.38
+    //PidTagRowid,
+    // 2.2.1.39
+    //PidTagHasNamedProperties,
+    // 2.2.1.40
+    //PidTagRecipientOrder,
+    // 2.2.1.41
+    //PidNameContentBase,
+    // 2.2.1.42
+    //PidNameAcceptLanguage,
+    // 2.2.1.43
+    //PidTagPurportedSenderDomain,
+    // 2.2.1.44
+    //PidTagStoreEntryId,
+    // 2.2.1.45
+    //PidTagTrustSender,
+    // 2.2.1.46
+    //PidTagSubject,
+    // 2.2.1.47
+    //PidTagMessageRecipients,
+    // 2.2.1.48.1
+    { PidTagBody, noteString<&NoteDecoder::textBody> },
+    // 2.2.1.48.2
+    //PidTagNativeBody,
+    // 2.2.1.48.3
+    //PidTagBodyHtml,
+    // 2.2.1.48.4
+    //PidTagRtfCompressed,
+    // 2.2.1.48.5
+    //PidTagRtfInSync,
+    // 2.2.1.48.6
+    //PidTagInternetCodepage,
+    // 2.2.1.48.7
+    //PidTagBodyContentId,
+    // 2.2.1.48.8
+    //PidTagBodyContentLocation,
+    // 2.2.1.48.9
+    { PidTagHtml, noteString<&NoteDecoder::htmlBody> },
+    // 2.2.2.3
+    //PidTagCreationTime,
+    // ???
+    { PidTagTransportMessageHeaders, 0 },
+    { 0, 0 } };
+static MapiSchema<NoteDecoder> noteSchema(noteEntries, MapiMessage::tagList());
+
 /**
  * Create the "raw source" as well as all the properties we need.
- * 
- * The switch statement at the heart of this routine must be kept synchronised
- * with @ref noteTagList.
  *
  * @return false on error.
  */
 bool MapiNote::preparePayload()
 {
+    MapiSpan span("preparePayload");
     unsigned index;
-    QString messageClass;
-    unsigned codepage = 0;
-    QString textBody;
-    QString htmlBody;
-    bool hasAttachments = false;
 
     // First set the header content, and parse what we can from it. Note
     // that the message headers we are given:
@@ -494,7 +715,7 @@ bool MapiNote::preparePayload()
     // instead of "multipart/alternative". For all these reasons, we need 
     // a fixed-up version to work with.
     if (UINT_MAX > (index = propertyFind(PidTagTransportMessageHeaders))) {
-        QString header = propertyAt(index).toString().prepend(QString::fromAscii("X-Parsed-By: "));
+        QString header = propertyRef(index).asString().prepend(QString::fromAscii("X-Parsed-By: "));
 
         // Fixup the header.
         bool lastChWasNl = false;
@@ -549,72 +770,22 @@ DONE:
         contentType()->from7BitString(tmp);
     }
 
-    // Walk through the properties and extract the values of interest. The
-    // properties here should be aligned with the list pulled above.
-    bool textStream = false;
-    bool htmlStream = false;
-    for (unsigned i = 0; i < m_propertyCount; i++) {
-        MapiProperty property(m_properties[i]);
-
-        switch (property.tag()) {
-        case PidTagMessageClass:
-            // Sanity check the message class.
-            messageClass = property.value().toString();
-            if (!messageClass.startsWith(QLatin1String("IPM.Note")) &&
-                !messageClass.startsWith(QLatin1String("Remote.IPM.Note")) &&
-                !messageClass.startsWith(QLatin1String("IPM.Schedule.Meeting"))) {
-                error() << "retrieved item is not an email or a header:" << messageClass;
-                return false;
-            }
-            break;
-        case PidTagMessageCodepage:
-            codepage = property.value().toUInt();
-            break;
-        case PidTagMessageFlags:
-            hasAttachments = (property.value().toUInt() & MSGFLAG_HASATTACH) != 0;
-            break;
-#if (GET_SUBJECTS_FOR_EMBEDDED_MSGS)
-        case PidTagSubject:
-            subject()->fromUnicodeString(property.value().toString(), "utf-8");
-            break;
-#endif
-        case PidTagBody:
-            textBody = property.value().toString();
-            break;
-        case PidTagHtml:
-            htmlBody = property.value().toString();
-            break;
-        case PidTagTransportMessageHeaders:
-            break;
-#if (GET_SUBJECTS_FOR_EMBEDDED_MSGS)
-        case PidTagCreationTime:
-            date()->setDateTime(KDateTime(property.value().toDateTime()));
-            break;
-#endif
-        default:
-            // Handle oversize objects.
-            if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
-                switch (property.tag()) {
-                case PidTagBody_Error:
-                    textStream = true;
-                    break;
-                case PidTagHtml_Error:
-                    htmlStream = true;
-                    break;
-                default:
-                    error() << "missing oversize support:" << tagName(property.tag());
-                    break;
-                }
+    // Walk through the properties and extract the values of interest.
+    NoteDecoder decoder(*this);
+    if (!noteSchema.decode(m_properties, m_propertyCount, decoder, noteProperty)) {
+        return false;
+    }
 
-                // Carry on with next property...
-                break;
-            }
-#if (DEBUG_NOTE_PROPERTIES)
-            debug() << "ignoring note property:" << tagName(property.tag()) << property.toString();
-#endif
-            break;
-        }
+    // Sanity check the message class.
+    if (!decoder.messageClass.startsWith(QLatin1String("IPM.Note")) &&
+        !decoder.messageClass.startsWith(QLatin1String("Remote.IPM.Note")) &&
+        !decoder.messageClass.startsWith(QLatin1String("IPM.Schedule.Meeting"))) {
+        error() << "retrieved item is not an email or a header:" << decoder.messageClass;
+        return false;
     }
+    QString &textBody = decoder.textBody;
+    QString &htmlBody = decoder.htmlBody;
+    bool hasAttachments = decoder.hasAttachments;
 
     foreach (MapiRecipient item, MapiMessage::recipients()) {
         switch (item.type()) {
@@ -638,13 +809,13 @@ DONE:
 
     // We get the PidTagBody as Unicode in any event, but we also now know
     // the codepage for PidTagHtml.
-    if (textStream && !streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, textBody)) {
+    if (decoder.textStream && !streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, textBody)) {
         return false;
     }
-    if (htmlStream && !streamRead(&m_object, PidTagHtml, codepage, htmlBody)) {
+    if (decoder.htmlStream && !streamRead(&m_object, PidTagHtml, decoder.codepage, htmlBody)) {
         return false;
     }
-    error() << "text size:" << textBody.size() << "html size:" << htmlBody.size() << "attachments:" << hasAttachments << "mimeType:" << contentType()->mimeType() << "isEmbedded:" << dynamic_cast<MapiEmbeddedNote*>(this);
+    MAPI_DEBUG(Objects) << "text size:" << textBody.size() << "html size:" << htmlBody.size() << "attachments:" << hasAttachments << "mimeType:" << contentType()->mimeType() << "isEmbedded:" << dynamic_cast<MapiEmbeddedNote*>(this);
 
     // If we don't have a Content-Type, then one will be automatically added.
     // Unfortunately, when that happens, we seem to get some bogus, empty
@@ -787,48 +958,47 @@ DONE:
                 // with those set above.
                 switch (property.tag()) {
                 case PidTagAttachNumber: 
-                    number = property.value().toUInt();
+                    number = property.asInteger();
                     break;
                 case PidTagAttachDataBinary: 
                 case PidTagAttachDataObject: 
                     break;
                 case PidTagAttachMethod: 
-                    method = property.value().toUInt();
+                    method = property.asInteger();
                     break;
                 case PidTagAttachLongFilename: 
-                    file = property.value().toString();
+                    file = property.asString();
                     break;
                 case PidTagAttachFilename:
                     if (file.isEmpty()) {
-                        file = property.value().toString();
+                        file = property.asString();
                     }
                     break;
                 case PidTagRenderingPosition: 
-                    renderingPosition = property.value().toUInt();
+                    renderingPosition = property.asInteger();
                     break;
                 case PidTagTextAttachmentCharset:
-                    charset = property.value().toString();
+                    charset = property.asString();
                     break;
                 case PidTagAttachMimeTag: 
-                    mimeTag = property.value().toString();
+                    mimeTag = property.asString();
                     break;
                 case PidTagAttachContentId:
-                    contentId = property.value().toString();
+                    contentId = property.asString();
                     break;
                 case PidTagAttachContentLocation:
-                    contentLocation = property.value().toString();
+                    contentLocation = property.asString();
                     break;
                 case PidTagAttachContentBase:
-                    contentBase = property.value().toString();
+                    contentBase = property.asString();
                     break;
                 default:
-#if (DEBUG_NOTE_PROPERTIES)
-                    debug() << "ignoring attachment property:" << tagName(property.tag()) << property.toString();
-#endif
+                    MAPI_TRACE(Objects) << "ignoring attachment property:" << tagName(property.tag()) << property.toString();
                     break;
                 }
             }
 
+            MapiSpan span("attachment", file);
             QByteArray bytes;
             KMime::Content *attachment;
             MapiEmbeddedNote *embeddedMsg;
@@ -836,7 +1006,10 @@ DONE:
             {
             case ATTACH_BY_VALUE:
                 if (UINT_MAX > (index = propertyFind(PidTagAttachDataBinary))) {
-                    bytes = propertyAt(index).toByteArray();
+                    unsigned size;
+                    const uint8_t *data = propertyRef(index).asBinary(size);
+
+                    bytes = QByteArray((const char *)data, size);
                 } else {
                     if (MAPI_E_SUCCESS != OpenAttach(&m_object, number, &m_attachment)) {
                         error() << "cannot open attachment" << mapiError();
@@ -919,137 +1092,8 @@ DONE:
 
 bool MapiNote::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
 {
-    /**
-     * The list of tags used to fetch a Note, based on [MS-OXCMSG].
-     */
-    static unsigned ourTagList[] = {
-        // 2.2.1.2
-        //PidTagHasAttachments,
-        // 2.2.1.3
-        PidTagMessageClass,
-        // 2.2.1.4
-        PidTagMessageCodepage,
-        // 2.2.1.5
-    //	PidTagMessageLocaleId,
-        // 2.2.1.6
-        PidTagMessageFlags,
-        // 2.2.1.7
-        //PidTagMessageSize,
-        // 2.2.1.8
-        //PidTagMessageStatus,
-        // 2.2.1.9
-        //PidTagSubjectPrefix,
-        // 2.2.1.10
-        //PidTagNormalizedSubject,
-        // 2.2.1.11
-        //PidTagImportance,
-        // 2.2.1.12
-        //PidTagPriority,
-        // 2.2.1.13
-        //PidTagSensitivity,
-        // 2.2.1.14
-        //PidLidSmartNoAttach,
-        // 2.2.1.15
-        //PidLidPrivate,
-        // 2.2.1.16
-        //PidLidSideEffects,
-        // 2.2.1.17
-        //PidNameKeywords,
-        // 2.2.1.18
-        //PidLidCommonStart,
-        // 2.2.1.19
-        //PidLidCommonEnd,
-        // 2.2.1.20
-        //PidTagAutoForwarded,
-        // 2.2.1.21
-        //PidTagAutoForwardComment,
-        // 2.2.1.22
-        //PidLidCategories,
-        // 2.2.1.23
-        //PidLidClassification,
-        // 2.2.1.24
-        //PidLidClassificationDescription,
-        // 2.2.1.25
-        //PidLidClassified,
-        // 2.2.1.26
-        //PidTagInternetReferences,
-        // 2.2.1.27
-        //PidLidInfoPathFormName,
-        // 2.2.1.28
-        //PidTagMimeSkeleton,
-        // 2.2.1.29
-        //PidTagTnefCorrelationKey,
-        // 2.2.1.30
-        //PidTagAddressBookDisplayNamePrintable,
-        // 2.2.1.31
-        //PidTagCreatorEntryId,
-        // 2.2.1.32
-        //PidTagLastModifierEntryId,
-        // 2.2.1.33
-        //PidLidAgingDontAgeMe,
-        // 2.2.1.34
-        //PidLidCurrentVersion,
-        // 2.2.1.35
-        //PidLidCurrentVersionName,
-        // 2.2.1.36
-        //PidTagAlternateRecipientAllowed,
-        // 2.2.1.37
-        //PidTagResponsibility,
-        // 2.2.1.38
-        //PidTagRowid,
-        // 2.2.1.39
-        //PidTagHasNamedProperties,
-        // 2.2.1.40
-        //PidTagRecipientOrder,
-        // 2.2.1.41
-        //PidNameContentBase,
-        // 2.2.1.42
-        //PidNameAcceptLanguage,
-        // 2.2.1.43
-        //PidTagPurportedSenderDomain,
-        // 2.2.1.44
-        //PidTagStoreEntryId,
-        // 2.2.1.45
-        //PidTagTrustSender,
-        // 2.2.1.46
-        //PidTagSubject,
-        // 2.2.1.47
-        //PidTagMessageRecipients,
-        // 2.2.1.48.1
-        PidTagBody,
-        // 2.2.1.48.2
-        //PidTagNativeBody,
-        // 2.2.1.48.3
-        //PidTagBodyHtml,
-        // 2.2.1.48.4
-        //PidTagRtfCompressed,
-        // 2.2.1.48.5
-        //PidTagRtfInSync,
-        // 2.2.1.48.6
-        //PidTagInternetCodepage,
-        // 2.2.1.48.7
-        //PidTagBodyContentId,
-        // 2.2.1.48.8
-        //PidTagBodyContentLocation,
-        // 2.2.1.48.9
-        PidTagHtml,
-        // 2.2.2.3
-        //PidTagCreationTime,
-        // ???
-        PidTagTransportMessageHeaders,
-        0 };
-    static SPropTagArray ourTags = {
-        (sizeof(ourTagList) / sizeof(ourTagList[0])) - 1,
-        (MAPITAGS *)ourTagList };
-
     if (!tagsAppended) {
-        for (unsigned i = 0; i < ourTags.cValues; i++) {
-            int newTag = ourTags.aulPropTag[i];
-            
-            if (!tags.contains(newTag)) {
-                tags.append(newTag);
-            }
-        }
+        noteSchema.tagsAppend(tags);
     }
     if (!MapiMessage::propertiesPull(tags, tagsAppended, pullAll)) {
         return false;
@@ -1062,15 +1106,11 @@ bool MapiNote::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool
 
 bool MapiNote::propertiesPull()
 {
-    static bool tagsAppended = false;
-    static QVector<int> tags;
+    // The tags come complete from the schema, so there is nothing shared to
+    // append to, whichever worker thread we are on.
+    QVector<int> tags(noteSchema.tagList());
 
-    if (!propertiesPull(tags, tagsAppended, (DEBUG_NOTE_PROPERTIES) != 0)) {
-        tagsAppended = true;
-        return false;
-    }
-    tagsAppended = true;
-    return true;
+    return propertiesPull(tags, true, MapiLog::enabled(MapiLog::Objects, MapiLog::Trace));
 }
 
 bool MapiNote::propertiesPush()
@@ -1089,25 +1129,25 @@ bool MapiNote::propertiesPush()
     if (!MapiMessage::propertiesPush()) {
         return false;
     }
-    debug() << "************  OpenFolder";
+    MAPI_DEBUG(Objects) << "************  OpenFolder";
     if (!OpenFolder(&m_store, folder.id(), folder.d())) {
         error() << "cannot open folder" << folderID
             << ", error:" << mapiError();
         return false;
         }
-    debug() << "************  SaveChangesMessage";
+    MAPI_DEBUG(Objects) << "************  SaveChangesMessage";
     if (!SaveChangesMessage(folder.d(), message.d(), KeepOpenReadWrite)) {
         error() << "cannot save message" << messageID << "in folder" << folderID
             << ", error:" << mapiError();
         return false;
     }
-    debug() << "************  SubmitMessage";
+    MAPI_DEBUG(Objects) << "************  SubmitMessage";
     if (MAPI_E_SUCCESS != SubmitMessage(&m_object)) {
         error() << "cannot submit message, error:" << mapiError();
         return false;
     }
     struct mapi_SPropValue_array replyProperties;
-    debug() << "************  TransportSend";
+    MAPI_DEBUG(Objects) << "************  TransportSend";
     if (MAPI_E_SUCCESS != TransportSend(&m_object, &replyProperties)) {
         error() << "cannot send message, error:" << mapiError();
         return false;
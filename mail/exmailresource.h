@@ -46,6 +46,11 @@ protected:
     virtual void itemAdded(const Akonadi::Item &item, const Akonadi::Collection &collection);
     virtual void itemChanged(const Akonadi::Item &item, const QSet<QByteArray> &parts);
     virtual void itemRemoved(const Akonadi::Item &item);
+    virtual void itemsFetched(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+    virtual void itemFetched(const Akonadi::Item &item, MapiMessage *message);
+    virtual unsigned prefetchSessions();
+    virtual MapiMessage *createMessage(MapiConnector2 *connection, MapiId &id);
+    virtual void itemPayload(Akonadi::Item &item, MapiMessage *message);
 
 private Q_SLOTS:
     /**